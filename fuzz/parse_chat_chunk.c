@@ -0,0 +1,69 @@
+/**
+ * @file parse_chat_chunk.c
+ * @brief Fuzz target for the in-place chat chunk scanner
+ * @note Built by make fuzz (libFuzzer) or make fuzz-replay (each corpus
+ *       file once, for toolchains without libFuzzer)
+ * @author Rouge Lin
+ * @date 2025-04-24
+ */
+
+#include "sse_parser.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every span handed back must lie inside the scanned bytes */
+static void
+check_span (const json_span_t *span, const char *data, size_t size)
+{
+    if (!span->start) return;
+    if (span->start < data || span->length > size ||
+        span->start + span->length > data + size) {
+        abort();
+    }
+}
+
+int LLVMFuzzerTestOneInput (const uint8_t *bytes, size_t size);
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *bytes, size_t size)
+{
+    /* An exact-size copy, so reading past the end is caught; strings are decoded in it */
+    char *data = malloc(size ? size : 1);
+    if (!data) return 0;
+    memcpy(data, bytes, size);
+
+    chat_chunk_t chunk;
+    if (parse_chat_chunk(data, size, &chunk) == 0) {
+        check_span(&chunk.content, data, size);
+        check_span(&chunk.reasoning_content, data, size);
+        check_span(&chunk.finish_reason, data, size);
+        check_span(&chunk.tool_calls, data, size);
+        check_span(&chunk.error_message, data, size);
+    }
+    free(data);
+    return 0;
+}
+
+#ifdef ADS_FUZZ_REPLAY
+
+int
+main (int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        FILE *input = fopen(argv[i], "rb");
+        if (!input) {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        static uint8_t buffer[1 << 20];
+        size_t size = fread(buffer, 1, sizeof(buffer), input);
+        fclose(input);
+        LLVMFuzzerTestOneInput(buffer, size);
+    }
+    printf("%d inputs replayed\n", argc - 1);
+    return EXIT_SUCCESS;
+}
+
+#endif /* ADS_FUZZ_REPLAY */
@@ -11,6 +11,9 @@
 
 #include "http_client.h"
 #include "config.h"
+#include "event_stream.h"
+
+struct tool_call_list;
 
 /**
  * @struct chat_response_t
@@ -19,27 +22,79 @@
  * @var input_token_count Input token count
  * @var output_token_count Output token count
  * @var total_token_count Total token count
+ * @var cache_hit_token_count Input tokens served from the server-side context cache
+ * @var cache_miss_token_count Input tokens that missed the context cache
  */
 typedef struct {
     char *content;           /**< Generated response content */
     int input_token_count;   /**< Input token count */
     int output_token_count;  /**< Output token count */
     int total_token_count;   /**< Total token count */
+    int cache_hit_token_count;  /**< Input tokens served from the server-side context cache */
+    int cache_miss_token_count; /**< Input tokens that missed the context cache */
 } chat_response_t;
 
+/**
+ * @struct chat_run_options_t
+ * @brief How a chat completion is run and printed
+ * @var stream Whether the request body asks for a streaming response
+ * @var show_tokens Whether to show token statistics
+ * @var use_cache Whether the response cache may answer or record the request
+ * @var reply_text Output parameter receiving the answer text (caller frees);
+ *                 NULL when it is not needed
+ * @var upload Streamed request body used instead of request_json (optional)
+ * @var async_output Whether streamed text is written by a separate thread
+ * @var format How the answer is written to standard output
+ * @var tool_calls Calls of a streamed answer, assembled as they arrive (optional)
+ */
+typedef struct {
+    int stream;                /**< Whether the request body asks for a streaming response */
+    int show_tokens;           /**< Whether to show token statistics */
+    int use_cache;             /**< Whether the response cache may answer or record the request */
+    char **reply_text;         /**< Output parameter receiving the answer text (caller frees) */
+    request_upload_t *upload;  /**< Streamed request body used instead of request_json (optional) */
+    int async_output;          /**< Whether streamed text is written by a separate thread */
+    output_format_t format;    /**< How the answer is written to standard output */
+    struct tool_call_list *tool_calls; /**< Calls of a streamed answer, assembled as they arrive (optional) */
+} chat_run_options_t;
+
 /**
  * @brief Execute a non-streaming chat request
+ * @param client Pointer to the reusable HTTP client
  * @param config Pointer to the API configuration structure
  * @param request_json JSON formatted request body string
+ * @param upload Streamed request body used instead of request_json (optional)
  * @return Pointer to the HTTP response data container
  */
-http_response_t * execute_chat_request (const api_config_t *config, const char *request_json);
+http_response_t * execute_chat_request (http_client_t *client, const api_config_t *config,
+                                        const char *request_json, request_upload_t *upload);
 
 /**
  * @brief Parse and return the chat response
- * @param http_res Pointer to the HTTP response data container
+ * @param http_res Pointer to the HTTP response data container; the payload is
+ *                 rewritten as its strings are decoded in place
+ * @param arena Arena holding the result (NULL for the heap)
  * @return Pointer to the parsed chat response structure
+ * @note The payload is scanned once without building a tree, and content
+ *       points into it, so it is valid only as long as the payload. A result
+ *       taken from an arena is released by resetting it; a heap result is a
+ *       single free().
+ */
+chat_response_t * parse_chat_response (http_response_t *http_res, arena_t *arena);
+
+/**
+ * @brief Send a chat request and print the answer to standard output
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param request_json JSON formatted request body string (NULL with an upload)
+ * @param options Pointer to the run options
+ * @return 0 on success, -1 on failure
+ * @note Shared by the one-shot CLI path and the resident daemon
+ * @note With CACHE_TTL set, a cached answer is replayed without contacting
+ *       the API, and fresh non-empty answers are stored. Streamed uploads
+ *       bypass the cache, since their body is not known in advance.
  */
-chat_response_t * parse_chat_response (const http_response_t *http_res);
+int run_chat_completion (http_client_t *client, const api_config_t *config,
+                         const char *request_json, const chat_run_options_t *options);
 
 #endif /* API_HANDLER_H */
\ No newline at end of file
@@ -0,0 +1,89 @@
+/**
+ * @file arena.h
+ * @brief Arena allocator module header
+ * @note Bump allocation for objects that all die with the request they
+ *       belong to, released in one reset
+ * @author Rouge Lin
+ * @date 2025-04-22
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * @def ARENA_BLOCK_SIZE
+ * @brief Default size of an arena block; larger allocations get a block of their own
+ */
+#define ARENA_BLOCK_SIZE (4 * 1024)
+
+/**
+ * @struct arena_block_t
+ * @brief One chunk of arena memory
+ * @var next Following block
+ * @var size Usable bytes in the block
+ * @var used Bytes handed out since the last reset
+ */
+typedef struct arena_block {
+    struct arena_block *next; /**< Following block */
+    size_t size;              /**< Usable bytes in the block */
+    size_t used;              /**< Bytes handed out since the last reset */
+} arena_block_t;
+
+/**
+ * @struct arena_t
+ * @brief Bump allocator whose blocks are kept across resets
+ * @var blocks First block, in allocation order
+ * @var current Block allocations are taken from
+ * @var block_size Size of regular blocks
+ */
+typedef struct {
+    arena_block_t *blocks;  /**< First block, in allocation order */
+    arena_block_t *current; /**< Block allocations are taken from */
+    size_t block_size;      /**< Size of regular blocks */
+} arena_t;
+
+/**
+ * @brief Initialize an empty arena
+ * @param arena Pointer to the arena
+ * @param block_size Size of regular blocks (0 for ARENA_BLOCK_SIZE)
+ * @return void
+ * @note No memory is taken until the first allocation
+ */
+void arena_init (arena_t *arena, size_t block_size);
+
+/**
+ * @brief Allocate from an arena
+ * @param arena Pointer to the arena
+ * @param size Number of bytes
+ * @return Memory aligned for any type, valid until the next reset; NULL on failure
+ */
+void *arena_alloc (arena_t *arena, size_t size);
+
+/**
+ * @brief Copy a string into an arena
+ * @param arena Pointer to the arena
+ * @param text Text to copy (need not be NUL-terminated)
+ * @param length Length of the text
+ * @return NUL-terminated copy, NULL on failure
+ */
+char *arena_strndup (arena_t *arena, const char *text, size_t length);
+
+/**
+ * @brief Release every allocation at once
+ * @param arena Pointer to the arena
+ * @return void
+ * @note The blocks are kept, so a request that needs no more memory than an
+ *       earlier one allocates nothing from the heap
+ */
+void arena_reset (arena_t *arena);
+
+/**
+ * @brief Return an arena's blocks to the heap
+ * @param arena Pointer to the arena (may be zero-initialized)
+ * @return void
+ */
+void arena_free (arena_t *arena);
+
+#endif /* ARENA_H */
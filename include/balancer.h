@@ -0,0 +1,156 @@
+/**
+ * @file balancer.h
+ * @brief Endpoint balancer module header
+ * @note Spreads requests over several API endpoints and steers around unhealthy ones
+ * @author Rouge Lin
+ * @date 2025-04-15
+ */
+
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include "config.h"
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * @def ENDPOINT_EJECT_BASE_MS
+ * @brief How long an endpoint is avoided after its first consecutive failure
+ * @note Doubled for each further consecutive failure
+ */
+#define ENDPOINT_EJECT_BASE_MS 1000
+
+/**
+ * @def ENDPOINT_EJECT_MAX_MS
+ * @brief Longest an endpoint is avoided after failures
+ */
+#define ENDPOINT_EJECT_MAX_MS 30000
+
+/**
+ * @def ENDPOINT_EWMA_WEIGHT
+ * @brief Weight of the newest latency sample in the moving average
+ */
+#define ENDPOINT_EWMA_WEIGHT 0.3
+
+/**
+ * @struct endpoint_state_t
+ * @brief What the balancer knows about one endpoint
+ * @var weight Relative capacity of the endpoint
+ * @var outstanding Requests currently in flight
+ * @var latency_ms Moving average of the time to first byte (0 before the first sample)
+ * @var failures Consecutive failed requests
+ * @var ejected_until_ms The endpoint is avoided until this monotonic time
+ */
+typedef struct {
+    double weight;           /**< Relative capacity of the endpoint */
+    int outstanding;         /**< Requests currently in flight */
+    double latency_ms;       /**< Moving average of the time to first byte (0 before the first sample) */
+    int failures;            /**< Consecutive failed requests */
+    double ejected_until_ms; /**< The endpoint is avoided until this monotonic time */
+} endpoint_state_t;
+
+/**
+ * @struct balancer
+ * @brief Load and health of every configured endpoint
+ * @var states One entry per endpoint, in configuration order
+ * @var count Number of endpoints
+ * @var policy How the endpoints are ranked
+ * @var cursor Rotates the starting point among equally ranked endpoints
+ * @var lock Serializes updates from concurrent requests
+ */
+typedef struct balancer {
+    endpoint_state_t *states; /**< One entry per endpoint, in configuration order */
+    size_t count;             /**< Number of endpoints */
+    balance_policy_t policy;  /**< How the endpoints are ranked */
+    size_t cursor;            /**< Rotates the starting point among equally ranked endpoints */
+    pthread_mutex_t lock;     /**< Serializes updates from concurrent requests */
+} balancer_t;
+
+/**
+ * @brief Create a balancer for a list of endpoints
+ * @param endpoints Endpoint list (only the weights are read)
+ * @param count Number of endpoints, at least 1
+ * @param policy How the endpoints are ranked
+ * @return Pointer to the balancer, NULL on allocation failure
+ */
+balancer_t *balancer_create (const api_endpoint_t *endpoints, size_t count,
+                             balance_policy_t policy);
+
+/**
+ * @brief Destroy a balancer
+ * @param balancer Pointer to the balancer
+ * @return void
+ * @note Does nothing if a NULL pointer is passed
+ */
+void balancer_destroy (balancer_t *balancer);
+
+/**
+ * @brief Order the endpoints from most to least preferred
+ * @param balancer Pointer to the balancer
+ * @param now_ms Current monotonic time in milliseconds
+ * @param order Output array of `count` endpoint indices
+ * @return void
+ * @note Healthy endpoints come first, ranked by the policy: under "ewma" the
+ *       score is latency * (outstanding + 1) / weight, so a slow endpoint or
+ *       a busy one is passed over and one without samples is tried at once;
+ *       under "least" it is (outstanding + 1) / weight. Ejected endpoints
+ *       follow, soonest recovered first, so a request is still sent somewhere
+ *       when every endpoint is failing.
+ */
+void balancer_rank (balancer_t *balancer, double now_ms, size_t *order);
+
+/**
+ * @brief Pick the preferred endpoint and count a request against it
+ * @param balancer Pointer to the balancer
+ * @param now_ms Current monotonic time in milliseconds
+ * @return Index of the endpoint in the configuration's list
+ * @note Pair every call with balancer_end
+ */
+size_t balancer_acquire (balancer_t *balancer, double now_ms);
+
+/**
+ * @brief Count a request against a chosen endpoint
+ * @param balancer Pointer to the balancer
+ * @param index Endpoint index returned by balancer_rank
+ * @return void
+ * @note Pair every call with balancer_end
+ */
+void balancer_begin (balancer_t *balancer, size_t index);
+
+/**
+ * @brief Record how a request to an endpoint went
+ * @param balancer Pointer to the balancer
+ * @param index Endpoint index the request was sent to
+ * @param transfer_result Result of the transfer
+ * @param status_code HTTP status of the response (0 if none arrived)
+ * @param first_byte_ms Time to the first response byte, or 0 if unknown
+ * @param now_ms Current monotonic time in milliseconds
+ * @return void
+ * @note Timeouts, refused connections, 408, 429 and 5xx responses count as
+ *       failures and eject the endpoint for ENDPOINT_EJECT_BASE_MS, doubled
+ *       per consecutive failure up to ENDPOINT_EJECT_MAX_MS. Any other
+ *       response restores it.
+ */
+void balancer_end (balancer_t *balancer, size_t index, CURLcode transfer_result,
+                   long status_code, double first_byte_ms, double now_ms);
+
+/**
+ * @brief Stop counting a request that was abandoned before it finished
+ * @param balancer Pointer to the balancer
+ * @param index Endpoint the request was sent to
+ * @return void
+ * @note Unlike balancer_end, says nothing about the endpoint's health
+ */
+void balancer_release (balancer_t *balancer, size_t index);
+
+/**
+ * @brief Whether a healthy endpoint other than `index` is available
+ * @param balancer Pointer to the balancer
+ * @param index Endpoint to leave out
+ * @param now_ms Current monotonic time in milliseconds
+ * @return Non-zero if a retry can fail over instead of backing off
+ */
+int balancer_has_alternative (balancer_t *balancer, size_t index, double now_ms);
+
+#endif /* BALANCER_H */
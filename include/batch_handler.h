@@ -0,0 +1,73 @@
+/**
+ * @file batch_handler.h
+ * @brief Batch request module header
+ * @note Runs many chat requests concurrently over one curl multi handle
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#ifndef BATCH_HANDLER_H
+#define BATCH_HANDLER_H
+
+#include "config.h"
+#include "http_client.h"
+#include "arena.h"
+#include <stddef.h>
+
+/**
+ * @def DEFAULT_BATCH_CONCURRENCY
+ * @brief Default number of requests kept in flight in batch mode
+ */
+#ifndef DEFAULT_BATCH_CONCURRENCY
+# define DEFAULT_BATCH_CONCURRENCY 4
+#endif
+
+/**
+ * @struct batch_job_t
+ * @brief A single request read from the batch input file
+ * @note The strings belong to the arena the job was built in
+ * @var id Request identifier used to tag the output
+ * @var query User input query content
+ * @var system_prompt Custom system prompt (optional)
+ */
+typedef struct {
+    char *id;            /**< Request identifier used to tag the output */
+    char *query;         /**< User input query content */
+    char *system_prompt; /**< Custom system prompt (optional) */
+} batch_job_t;
+
+/**
+ * @brief Load batch jobs from a JSONL file
+ * @param batch_path Path to the JSONL input file ("-" for standard input)
+ * @param arena Arena receiving the job array and its strings
+ * @param jobs Output parameter receiving the job array
+ * @param job_count Output parameter receiving the number of jobs
+ * @return 0 on success, -1 on failure
+ * @note Each non-empty line must be a JSON object with a "query" string and
+ *       optional "id" and "system" strings. Missing ids default to the line number.
+ * @note The jobs are released with the arena, all at once
+ */
+int load_batch_jobs (const char *batch_path, arena_t *arena,
+                     batch_job_t **jobs, size_t *job_count);
+
+/**
+ * @brief Execute all jobs with up to `concurrency` requests in flight
+ * @param client Pointer to the reusable HTTP client whose caches the jobs share
+ * @param config Pointer to the API configuration structure
+ * @param jobs Job array
+ * @param job_count Number of jobs
+ * @param concurrency Maximum number of concurrent transfers
+ * @param output_dir Directory receiving one "<id>.txt" per job, or NULL to
+ *                   write tagged JSONL results to standard output
+ * @param answers Array of job_count entries receiving each answer (caller
+ *                frees) instead of it being written out, or NULL; the entry
+ *                of a failed job stays NULL
+ * @return Number of failed jobs, -1 on setup failure
+ * @note Requests are sent in non-streaming mode; results are emitted in completion order.
+ *       Failures are reported on standard error unless JSONL is written.
+ */
+int run_batch_requests (http_client_t *client, const api_config_t *config,
+                        const batch_job_t *jobs, size_t job_count,
+                        int concurrency, const char *output_dir, char **answers);
+
+#endif /* BATCH_HANDLER_H */
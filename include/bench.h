@@ -0,0 +1,51 @@
+/**
+ * @file bench.h
+ * @brief Built-in benchmark module header
+ * @note Measures the client's own overhead against an in-process mock server
+ * @author Rouge Lin
+ * @date 2025-04-13
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * @def DEFAULT_BENCH_ITERATIONS
+ * @brief Default number of iterations per measured operation
+ */
+#ifndef DEFAULT_BENCH_ITERATIONS
+# define DEFAULT_BENCH_ITERATIONS 500
+#endif
+
+/**
+ * @def DEFAULT_BENCH_FIXTURES
+ * @brief Default fixture directory, relative to the source tree
+ */
+#ifndef DEFAULT_BENCH_FIXTURES
+# define DEFAULT_BENCH_FIXTURES "bench/fixtures"
+#endif
+
+/**
+ * @brief Run the `ads bench` subcommand
+ * @param argc Number of arguments, starting with "bench"
+ * @param argv List of arguments: bench [-n ITERATIONS] [FIXTURE_DIR]
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ * @note The fixture directory holds query.txt (the question), response.json
+ *       (a store-forward answer) and stream.sse (a recorded event stream)
+ */
+int run_bench_command (int argc, char **argv);
+
+/**
+ * @brief Number of heap allocations made so far by the process
+ * @return Allocation count, or 0 when allocation counting is compiled out
+ * @note Counting needs a build with ADS_BENCH_MALLOC_HOOKS (make bench)
+ */
+unsigned long bench_allocation_count (void);
+
+/**
+ * @brief Whether allocation counting is compiled in
+ * @return Non-zero when bench_allocation_count is meaningful
+ */
+int bench_allocations_tracked (void);
+
+#endif /* BENCH_H */
@@ -10,6 +10,7 @@
 #define CONFIG_H
 
 #include <cjson/cJSON.h>
+#include <stddef.h>
 
 /* Configuration constants */
 /**
@@ -39,6 +40,105 @@
 # define DEFAULT_SYSTEM_PROMPT "You are a helpful assistant." /* Default system prompt */
 #endif
 
+/**
+ * @def DEFAULT_SESSION_MAX_BYTES
+ * @brief Default history budget of a conversation session
+ * @note If the DEFAULT_SESSION_MAX_BYTES macro is not defined, set it to 256 KiB
+ */
+#ifndef DEFAULT_SESSION_MAX_BYTES
+# define DEFAULT_SESSION_MAX_BYTES (256 * 1024) /* Default session history budget */
+#endif
+
+/**
+ * @def DEFAULT_CACHE_MAX_BYTES
+ * @brief Default size cap of the response cache
+ * @note If the DEFAULT_CACHE_MAX_BYTES macro is not defined, set it to 64 MiB
+ */
+#ifndef DEFAULT_CACHE_MAX_BYTES
+# define DEFAULT_CACHE_MAX_BYTES (64L * 1024 * 1024) /* Default response cache size cap */
+#endif
+
+/**
+ * @def DEFAULT_MAX_RETRIES
+ * @brief Default number of retries after a 429, a 5xx or a failed connection
+ * @note If the DEFAULT_MAX_RETRIES macro is not defined, set it to 3
+ */
+#ifndef DEFAULT_MAX_RETRIES
+# define DEFAULT_MAX_RETRIES 3 /* Default retry count */
+#endif
+
+/**
+ * @def DEFAULT_RETRY_BASE_MS
+ * @brief Default backoff before the first retry
+ * @note If the DEFAULT_RETRY_BASE_MS macro is not defined, set it to 500 ms
+ */
+#ifndef DEFAULT_RETRY_BASE_MS
+# define DEFAULT_RETRY_BASE_MS 500 /* Default first backoff */
+#endif
+
+/**
+ * @def DEFAULT_RETRY_MAX_MS
+ * @brief Default longest wait before a retry
+ * @note If the DEFAULT_RETRY_MAX_MS macro is not defined, set it to 30 s
+ */
+#ifndef DEFAULT_RETRY_MAX_MS
+# define DEFAULT_RETRY_MAX_MS 30000 /* Default backoff ceiling */
+#endif
+
+/**
+ * @def DEFAULT_CONNECT_TIMEOUT_MS
+ * @brief Default longest wait for a connection to the API
+ * @note If the DEFAULT_CONNECT_TIMEOUT_MS macro is not defined, set it to 10 s
+ */
+#ifndef DEFAULT_CONNECT_TIMEOUT_MS
+# define DEFAULT_CONNECT_TIMEOUT_MS 10000 /* Default connect timeout */
+#endif
+
+/**
+ * @def DEFAULT_IDLE_TIMEOUT_MS
+ * @brief Default longest silence inside a streamed response
+ * @note If the DEFAULT_IDLE_TIMEOUT_MS macro is not defined, set it to 60 s
+ */
+#ifndef DEFAULT_IDLE_TIMEOUT_MS
+# define DEFAULT_IDLE_TIMEOUT_MS 60000 /* Default stall timeout */
+#endif
+
+/**
+ * @def DEFAULT_HEDGE_DELAY_MS
+ * @brief Default wait for a first byte before the hedged request is sent
+ * @note If the DEFAULT_HEDGE_DELAY_MS macro is not defined, set it to 2 s
+ */
+#ifndef DEFAULT_HEDGE_DELAY_MS
+# define DEFAULT_HEDGE_DELAY_MS 2000 /* Default hedge delay */
+#endif
+
+/**
+ * @enum balance_policy_t
+ * @brief How requests are spread over several endpoints
+ */
+typedef enum {
+    BALANCE_EWMA,              /**< Lowest smoothed first-byte latency, scaled by requests in flight */
+    BALANCE_LEAST_OUTSTANDING  /**< Fewest requests in flight */
+} balance_policy_t;
+
+/**
+ * @struct api_endpoint_t
+ * @brief One API endpoint requests can be sent to
+ * @var url Full URL of the chat completions endpoint
+ * @var api_key API access key for this endpoint
+ * @var weight Relative capacity of the endpoint (at least 1)
+ * @var headers Request headers built once from the key: [0] for a plain body, [1] for a gzip-encoded one
+ */
+typedef struct {
+    char *url;     /**< Full URL of the chat completions endpoint */
+    char *api_key; /**< API access key for this endpoint */
+    long weight;   /**< Relative capacity of the endpoint (at least 1) */
+    struct curl_slist *headers[2]; /**< Request headers built once from the key: [0] for a plain body, [1] for a gzip-encoded one */
+} api_endpoint_t;
+
+struct balancer;
+struct curl_slist;
+
 /**
  * @struct api_config_t
  * @brief Structure that stores API configuration parameters
@@ -46,12 +146,65 @@
  * @var base_url Base URL of the API endpoint
  * @var model_name Name of the model to use
  * @var system_prompt System-level prompt information
+ * @var session_max_bytes History budget of a conversation session (0 = unbounded)
+ * @var cache_ttl Lifetime of cached answers in seconds (0 = cache disabled)
+ * @var cache_max_bytes Size cap of the response cache (0 = unbounded)
+ * @var output_flush_ms Longest delay before streamed text reaches a terminal (0 = every network read)
+ * @var prewarm_connection Open the API connection while the request is still being prepared
+ * @var max_retries Retries after a 429, a 5xx or a failed connection (0 = never retry)
+ * @var retry_base_ms Backoff before the first retry; doubled for each further one
+ * @var retry_max_ms Longest wait before a retry, Retry-After included
+ * @var rate_limit_rpm Batch requests started per minute (0 = unlimited)
+ * @var rate_limit_tpm Batch tokens spent per minute (0 = unlimited)
+ * @var connect_timeout_ms Longest wait for a connection (0 = libcurl's default)
+ * @var first_byte_timeout_ms Longest wait for the first byte of the response body (0 = no limit)
+ * @var idle_timeout_ms Longest silence inside a streamed response (0 = no limit)
+ * @var hedge_url Alternate endpoint raced against a slow request (optional)
+ * @var hedge_delay_ms Wait for a first byte before the hedged request is sent
+ * @var hedge_api_key API access key sent to hedge_url (API_KEY when unset)
+ * @var hedge_headers Request headers of the hedged copy, built once from its key: [0] plain, [1] gzip-encoded body
+ * @var compress_request_min Smallest request body sent gzip-encoded (0 = never compress)
+ * @var endpoints Endpoints requests are balanced over (BASE_URL and API_KEY when none are listed)
+ * @var endpoint_count Number of endpoints
+ * @var balance_policy How requests are spread over the endpoints
+ * @var balancer Load and health of each endpoint, shared by every request made with this configuration
+ * @var api_key_env Environment variable API_KEY is read from (optional)
+ * @var api_key_command Credential helper whose output is API_KEY (optional)
+ * @var snapshot Mapped snapshot the strings point into (NULL when parsed from text)
+ * @var snapshot_size Size of the mapped snapshot
+ * @note Pointer members must also be translated in config_snapshot.c
  */
 typedef struct {
-    char *api_key;       /**< API access key */
-    char *base_url;      /**< Base URL of the API endpoint */
-    char *model_name;    /**< Name of the model to use */
-    char *system_prompt; /**< System-level prompt information */
+    char *api_key;          /**< API access key */
+    char *base_url;         /**< Base URL of the API endpoint */
+    char *model_name;       /**< Name of the model to use */
+    char *system_prompt;    /**< System-level prompt information */
+    long session_max_bytes; /**< History budget of a conversation session (0 = unbounded) */
+    long cache_ttl;         /**< Lifetime of cached answers in seconds (0 = cache disabled) */
+    long cache_max_bytes;   /**< Size cap of the response cache (0 = unbounded) */
+    long output_flush_ms;   /**< Longest delay before streamed text reaches a terminal (0 = every network read) */
+    long prewarm_connection; /**< Open the API connection while the request is still being prepared */
+    long max_retries;       /**< Retries after a 429, a 5xx or a failed connection (0 = never retry) */
+    long retry_base_ms;     /**< Backoff before the first retry; doubled for each further one */
+    long retry_max_ms;      /**< Longest wait before a retry, Retry-After included */
+    long rate_limit_rpm;    /**< Batch requests started per minute (0 = unlimited) */
+    long rate_limit_tpm;    /**< Batch tokens spent per minute (0 = unlimited) */
+    long connect_timeout_ms; /**< Longest wait for a connection (0 = libcurl's default) */
+    long first_byte_timeout_ms; /**< Longest wait for the first byte of the response body (0 = no limit) */
+    long idle_timeout_ms;   /**< Longest silence inside a streamed response (0 = no limit) */
+    char *hedge_url;        /**< Alternate endpoint raced against a slow request (optional) */
+    long hedge_delay_ms;    /**< Wait for a first byte before the hedged request is sent */
+    char *hedge_api_key;    /**< API access key sent to hedge_url (API_KEY when unset) */
+    struct curl_slist *hedge_headers[2]; /**< Request headers of the hedged copy, built once from its key: [0] plain, [1] gzip-encoded body */
+    long compress_request_min; /**< Smallest request body sent gzip-encoded (0 = never compress) */
+    api_endpoint_t *endpoints; /**< Endpoints requests are balanced over (BASE_URL and API_KEY when none are listed) */
+    size_t endpoint_count;  /**< Number of endpoints */
+    balance_policy_t balance_policy; /**< How requests are spread over the endpoints */
+    struct balancer *balancer; /**< Load and health of each endpoint, shared by every request made with this configuration */
+    char *api_key_env;      /**< Environment variable API_KEY is read from (optional) */
+    char *api_key_command;  /**< Credential helper whose output is API_KEY (optional) */
+    void *snapshot;         /**< Mapped snapshot the strings point into (NULL when parsed from text) */
+    size_t snapshot_size;   /**< Size of the mapped snapshot */
 } api_config_t;
 
 /**
@@ -63,10 +216,40 @@ typedef struct {
  *      - BASE_URL: Base URL of the DeepSeek API endpoint
  *      - MODEL: Name of the model to use
  *      - SYSTEM_PROMPT: System-level prompt information
+ *      - SESSION_MAX_BYTES: History kept per session, in bytes
+ *      - CACHE_TTL: Lifetime of cached answers, in seconds
+ *      - CACHE_MAX_BYTES: Size cap of the response cache, in bytes
+ *      - OUTPUT_FLUSH_MS: Terminal flush deadline for streamed text, in milliseconds
+ *      - PREWARM: 1 to connect to the API while input is read and the body is built
+ *      - MAX_RETRIES: Retries after a 429, a 5xx or a failed connection
+ *      - RETRY_BASE_MS, RETRY_MAX_MS: First and longest backoff, in milliseconds
+ *      - RATE_LIMIT_RPM, RATE_LIMIT_TPM: Batch request and token quotas per minute
+ *      - CONNECT_TIMEOUT_MS, FIRST_BYTE_TIMEOUT_MS, IDLE_TIMEOUT_MS: Transfer deadlines
+ *      - HEDGE_URL: Alternate endpoint sent the same request when the first is slow
+ *      - HEDGE_DELAY_MS: Wait for a first byte before the hedged request is sent
+ *      - HEDGE_API_KEY: Key sent to HEDGE_URL; defaults to API_KEY (never an
+ *        ENDPOINT's own key)
+ *      - COMPRESS_REQUEST_MIN: Smallest request body sent gzip-encoded, in bytes
+ *      - ENDPOINT: "url|api_key|weight", repeatable; the key defaults to API_KEY
+ *        and the weight to 1. BASE_URL and API_KEY default to the first one.
+ *      - BALANCE: "ewma" (default) or "least" (fewest requests in flight)
+ *      - API_KEY_ENV: Environment variable holding the API key
+ *      - API_KEY_CMD: Shell command printing the API key (e.g. a keyring lookup),
+ *        run once per load; either source overrides API_KEY
  * @note If the path is empty, attempts to locate the file from default locations
  */
 api_config_t *load_configuration(const char *config_path);
 
+/**
+ * @brief Load configuration through its compiled snapshot
+ * @param config_path Path to the configuration file
+ * @return Pointer to the configuration structure
+ * @note Maps the snapshot saved by an earlier run when the file's device,
+ *       inode, size and modification time still match; otherwise parses the
+ *       file with load_configuration and saves a new snapshot
+ */
+api_config_t *load_configuration_cached(const char *config_path);
+
 /**
  * @brief Free configuration structure
  * @param config Pointer to the configuration structure
@@ -75,11 +258,28 @@ api_config_t *load_configuration(const char *config_path);
  */
 void free_configuration(api_config_t *config);
 
+/**
+ * @brief Build the request header lists of every endpoint
+ * @param config Pointer to the configuration structure
+ * @return 0 on success, -1 on allocation failure
+ * @note Called by every loader once the endpoint keys are final, so requests
+ *       reuse the lists instead of formatting the Authorization header each time
+ */
+int prepare_endpoint_headers(api_config_t *config);
+
+/**
+ * @brief Free the request header lists of every endpoint
+ * @param config Pointer to the configuration structure
+ * @return void
+ */
+void release_endpoint_headers(api_config_t *config);
+
 /**
  * @brief Locate the configuration file
  * @param void
  * @return Path to the configuration file as a string
- * @note Attempts to locate the configuration file from the following paths:
+ * @note The ADS_CONFIG environment variable names the file and skips the search
+ * @note Otherwise attempts to locate the configuration file from the following paths:
  *      - .adsenv file in the current directory
  *      - .adsenv file in the user's home directory
  *      - .adsenv file in the user's .config directory
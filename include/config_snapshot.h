@@ -0,0 +1,56 @@
+/**
+ * @file config_snapshot.h
+ * @brief Compiled configuration snapshot module header
+ * @note A parsed configuration is saved as one binary blob that later runs
+ *       map into memory instead of parsing the text file again
+ * @author Rouge Lin
+ * @date 2025-04-16
+ */
+
+#ifndef CONFIG_SNAPSHOT_H
+#define CONFIG_SNAPSHOT_H
+
+#include "config.h"
+#include <sys/stat.h>
+
+/**
+ * @def CONFIG_SNAPSHOT_MAGIC
+ * @brief First bytes of a snapshot file; bumped whenever the layout changes
+ */
+#define CONFIG_SNAPSHOT_MAGIC "ADSCFG03"
+
+/**
+ * @brief Map the snapshot of a configuration file
+ * @param config_path Path to the configuration file
+ * @param source_stat Status of the configuration file
+ * @return Pointer to the configuration structure, NULL if there is no
+ *         snapshot or it is stale (other file, size or modification time)
+ * @note The strings of the returned configuration point into the read-only
+ *       mapping; only the structure and its endpoint list are allocated, in
+ *       one block. Release it with free_configuration.
+ */
+api_config_t *config_snapshot_load (const char *config_path, const struct stat *source_stat);
+
+/**
+ * @brief Save a parsed configuration as the snapshot of its file
+ * @param config Pointer to the configuration structure
+ * @param config_path Path to the configuration file
+ * @param source_stat Status of the configuration file when it was parsed
+ * @return 0 on success, -1 on failure
+ * @note The snapshot holds the API keys, so it is readable by its owner only
+ * @note Snapshots live in the config subdirectory of the cache directory, one
+ *       per resolved path; a new store replaces the previous one of that path
+ * @note A configuration with API_KEY_ENV or API_KEY_CMD is not saved: its key
+ *       must not reach the disk and is looked up again on every load
+ */
+int config_snapshot_store (const api_config_t *config, const char *config_path,
+                           const struct stat *source_stat);
+
+/**
+ * @brief Release a configuration returned by config_snapshot_load
+ * @param config Pointer to the configuration structure
+ * @return void
+ */
+void config_snapshot_release (api_config_t *config);
+
+#endif /* CONFIG_SNAPSHOT_H */
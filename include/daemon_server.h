@@ -0,0 +1,81 @@
+/**
+ * @file daemon_server.h
+ * @brief Resident daemon module header
+ * @note Keeps configuration and HTTP connections warm behind a Unix socket
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#ifndef DAEMON_SERVER_H
+#define DAEMON_SERVER_H
+
+#include "config.h"
+#include <stddef.h>
+
+/**
+ * @def DAEMON_SOCKET_ENV
+ * @brief Environment variable overriding the daemon socket path
+ */
+#define DAEMON_SOCKET_ENV "ADS_SOCKET"
+
+/**
+ * @struct daemon_request_t
+ * @brief A query forwarded from the command line to the daemon
+ * @var user_query User input query content
+ * @var stream Whether to use streaming mode
+ * @var show_tokens Whether to show token statistics
+ * @var no_cache Whether to bypass the response cache
+ * @var config_path Configuration file the caller resolved; the daemon only answers for the same file
+ */
+typedef struct {
+    const char *user_query;  /**< User input query content */
+    int stream;              /**< Whether to use streaming mode */
+    int show_tokens;         /**< Whether to show token statistics */
+    int no_cache;            /**< Whether to bypass the response cache */
+    const char *config_path; /**< Configuration file the caller resolved; the daemon only answers for the same file */
+} daemon_request_t;
+
+/**
+ * @brief Resolve the Unix socket path used by the daemon
+ * @param buffer Output buffer
+ * @param buffer_size Size of the output buffer
+ * @return 0 on success, -1 if the path does not fit
+ * @note Uses $ADS_SOCKET, then $XDG_RUNTIME_DIR/ads.sock, then /tmp/ads-<uid>/ads.sock
+ */
+int resolve_daemon_socket_path (char *buffer, size_t buffer_size);
+
+/**
+ * @brief Check whether a trusted daemon socket file exists
+ * @param socket_path Unix socket path of the daemon
+ * @return Non-zero when a socket is present (the daemon may still be gone)
+ * @note Lets the caller skip waiting for its whole input when no daemon can answer
+ * @note Only a socket owned by this user with no group or other access, in a
+ *       directory owned by this user that nobody else can write to, counts;
+ *       anything else could belong to another user waiting for our descriptors
+ */
+int daemon_socket_present (const char *socket_path);
+
+/**
+ * @brief Run the resident daemon until SIGINT or SIGTERM
+ * @param config_path Path to the configuration file (reloaded on SIGHUP)
+ * @param socket_path Unix socket path to listen on
+ * @return 0 on clean shutdown, -1 on failure
+ * @note Requests are served one at a time; the caller's stdout and stderr are
+ *       received over the socket so answers are written to them directly
+ * @note The socket's directory is created (mode 0700) when missing and must be
+ *       private to this user. A request for another configuration file is
+ *       declined; one for a newer version of config_path reloads it first.
+ */
+int run_daemon_server (const char *config_path, const char *socket_path);
+
+/**
+ * @brief Forward a query to a running daemon
+ * @param socket_path Unix socket path of the daemon
+ * @param request Pointer to the request to forward
+ * @return 0 or 1 with the daemon's exit status, -1 if no daemon is reachable,
+ *         it runs as another user, or it serves another configuration file
+ * @note On -1 nothing has been printed and the caller should run the request itself
+ */
+int forward_to_daemon (const char *socket_path, const daemon_request_t *request);
+
+#endif /* DAEMON_SERVER_H */
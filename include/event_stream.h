@@ -0,0 +1,129 @@
+/**
+ * @file event_stream.h
+ * @brief Event stream module header
+ * @note Writes an answer as newline-delimited JSON events (--format ndjson)
+ * @author Rouge Lin
+ * @date 2025-04-19
+ */
+
+#ifndef EVENT_STREAM_H
+#define EVENT_STREAM_H
+
+#include "output_sink.h"
+#include "json_writer.h"
+#include "stats.h"
+#include <stddef.h>
+
+/**
+ * @enum output_format_t
+ * @brief How an answer is written to standard output
+ */
+typedef enum {
+    OUTPUT_FORMAT_TEXT,  /**< The answer text itself */
+    OUTPUT_FORMAT_NDJSON /**< One compact JSON event per line */
+} output_format_t;
+
+/**
+ * @struct event_stream_t
+ * @brief Writer of NDJSON events
+ * @var sink Sink the events are written to
+ * @var line Event being composed, reused from one event to the next
+ * @note Events are objects with a "type" member:
+ *       {"type":"delta","content":...} and {"type":"reasoning","content":...}
+ *       per streamed fragment, {"type":"finish","reason":...},
+ *       {"type":"usage",...token counts...}, {"type":"timing",...} with
+ *       millisecond offsets from the request start, {"type":"error",...},
+ *       and {"type":"done"} once the answer is complete.
+ */
+typedef struct {
+    output_sink_t *sink; /**< Sink the events are written to */
+    json_writer_t line;  /**< Event being composed, reused from one event to the next */
+} event_stream_t;
+
+/**
+ * @brief Parse an output format name
+ * @param name "text" or "ndjson"
+ * @param format Output parameter receiving the format
+ * @return 0 on success, -1 for an unknown name
+ */
+int parse_output_format (const char *name, output_format_t *format);
+
+/**
+ * @brief Initialize an event writer
+ * @param events Pointer to the event writer
+ * @param sink Sink the events are written to (must outlive the writer)
+ * @return void
+ */
+void event_stream_init (event_stream_t *events, output_sink_t *sink);
+
+/**
+ * @brief Release an event writer
+ * @param events Pointer to the event writer
+ * @return void
+ * @note The sink is neither flushed nor closed
+ */
+void event_stream_free (event_stream_t *events);
+
+/**
+ * @brief Write a fragment of the answer
+ * @param events Pointer to the event writer
+ * @param type "delta" for content, "reasoning" for reasoning content
+ * @param text Fragment (not NUL-terminated)
+ * @param length Length of the fragment
+ * @return void
+ */
+void event_stream_text (event_stream_t *events, const char *type, const char *text, size_t length);
+
+/**
+ * @brief Write the finish reason of the answer
+ * @param events Pointer to the event writer
+ * @param reason Finish reason (not NUL-terminated)
+ * @param length Length of the reason
+ * @return void
+ */
+void event_stream_finish (event_stream_t *events, const char *reason, size_t length);
+
+/**
+ * @brief Write the token usage of the answer
+ * @param events Pointer to the event writer
+ * @param prompt_tokens Prompt token count
+ * @param completion_tokens Completion token count
+ * @param total_tokens Total token count
+ * @param cached_tokens Prompt tokens served from the server-side context cache
+ * @return void
+ */
+void event_stream_usage (event_stream_t *events, long prompt_tokens, long completion_tokens,
+                         long total_tokens, long cached_tokens);
+
+/**
+ * @brief Write the timing of a streamed answer
+ * @param events Pointer to the event writer
+ * @param request_start_ms When the request was sent
+ * @param first_token_ms When the first token arrived (0 if none did)
+ * @param last_token_ms When the latest token arrived
+ * @param token_gaps Intervals between consecutive tokens, in milliseconds
+ * @param end_ms When the transfer ended
+ * @return void
+ */
+void event_stream_timing (event_stream_t *events, double request_start_ms, double first_token_ms,
+                          double last_token_ms, sample_set_t *token_gaps, double end_ms);
+
+/**
+ * @brief Write a failure of the request
+ * @param events Pointer to the event writer
+ * @param status_code HTTP status of the response (0 when none arrived)
+ * @param message Error text (not NUL-terminated)
+ * @param length Length of the text
+ * @return void
+ */
+void event_stream_error (event_stream_t *events, long status_code, const char *message, size_t length);
+
+/**
+ * @brief Mark the answer as complete
+ * @param events Pointer to the event writer
+ * @param cached Whether the answer was replayed from the response cache
+ * @return void
+ */
+void event_stream_done (event_stream_t *events, int cached);
+
+#endif /* EVENT_STREAM_H */
@@ -0,0 +1,72 @@
+/**
+ * @file fanout.h
+ * @brief Fan-out module header
+ * @note Sends one question to several models (or several times) at once
+ * @author Rouge Lin
+ * @date 2025-04-18
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "config.h"
+#include "http_client.h"
+#include <stddef.h>
+
+/**
+ * @def FANOUT_MAX_VARIANTS
+ * @brief Most requests one fan-out sends (models times samples)
+ */
+#define FANOUT_MAX_VARIANTS 16
+
+/**
+ * @enum fanout_mode_t
+ * @brief Which answers of a fan-out are shown
+ */
+typedef enum {
+    FANOUT_ALL,   /**< Every answer, streamed line by line with a [label] prefix */
+    FANOUT_FIRST, /**< The first complete answer; the others are cancelled */
+    FANOUT_RACE   /**< The answer whose first token arrives first, streamed; the others are cancelled */
+} fanout_mode_t;
+
+/**
+ * @struct fanout_options_t
+ * @brief What a fan-out sends and how it reports
+ * @var models Model names, one request body each (NULL to use MODEL only)
+ * @var model_count Number of model names
+ * @var samples Requests sent per model (at least 1)
+ * @var mode Which answers are shown
+ * @var show_tokens Whether to report timing and token usage per request
+ */
+typedef struct {
+    char *const *models; /**< Model names, one request body each (NULL to use MODEL only) */
+    size_t model_count;  /**< Number of model names */
+    int samples;         /**< Requests sent per model (at least 1) */
+    fanout_mode_t mode;  /**< Which answers are shown */
+    int show_tokens;     /**< Whether to report timing and token usage per request */
+} fanout_options_t;
+
+/**
+ * @brief Parse a fan-out mode name
+ * @param name "all", "first" or "race"
+ * @param mode Output parameter receiving the mode
+ * @return 0 on success, -1 for an unknown name
+ */
+int parse_fanout_mode (const char *name, fanout_mode_t *mode);
+
+/**
+ * @brief Send every variant of a question concurrently and print the answers
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param params Request parameters shared by every variant (attachments still mapped)
+ * @param options Pointer to the fan-out options
+ * @return 0 if the answers that were to be shown arrived, -1 otherwise
+ * @note Every variant is a streamed request on the client's share handle, so
+ *       the wall-clock time is that of the slowest answer (FANOUT_ALL) or of
+ *       the winner. Fan-out requests are neither retried nor hedged, and the
+ *       response cache is not consulted.
+ */
+int run_fanout (http_client_t *client, const api_config_t *config,
+                const chat_request_params_t *params, const fanout_options_t *options);
+
+#endif /* FANOUT_H */
@@ -10,32 +10,205 @@
 #define HTTP_CLIENT_H
 
 #include "config.h"
+#include "input_file.h"
+#include "json_writer.h"
+#include "arena.h"
 #include <curl/curl.h>
+#include <pthread.h>
+#include <signal.h>
+
+/**
+ * @def HTTP_RESPONSE_INITIAL_SIZE
+ * @brief First allocation for a response body of unknown length
+ */
+#define HTTP_RESPONSE_INITIAL_SIZE (16 * 1024)
+
+/**
+ * @def HTTP_RESPONSE_RESERVE_LIMIT
+ * @brief Largest Content-Length honored as an up-front reservation
+ */
+#define HTTP_RESPONSE_RESERVE_LIMIT (256 * 1024 * 1024)
+
+/**
+ * @def HTTP_PREWARM_TIMEOUT
+ * @brief Longest a prewarm handshake may hold up the first request, in seconds
+ */
+#define HTTP_PREWARM_TIMEOUT 10L
 
 /**
  * @struct http_response_t
  * @brief HTTP response data container
  * @var payload Response body data
  * @var payload_size Response body size
+ * @var payload_capacity Allocated size of the payload buffer
  * @var status_code HTTP status code
+ * @var retry_after Seconds the server asked to wait before retrying (0 if none)
+ * @var first_byte_ms Time from sending the request to the first response byte
  */
 typedef struct {
-    char *payload;       /**< Response body data */
-    size_t payload_size; /**< Response body size */
-    long status_code;    /**< HTTP status code */
+    char *payload;           /**< Response body data */
+    size_t payload_size;     /**< Response body size */
+    size_t payload_capacity; /**< Allocated size of the payload buffer */
+    long status_code;        /**< HTTP status code */
+    long retry_after;        /**< Seconds the server asked to wait before retrying (0 if none) */
+    double first_byte_ms;    /**< Time from sending the request to the first response byte */
 } http_response_t;
 
+/**
+ * @struct http_client_t
+ * @brief Reusable HTTP client shared by every request of a process
+ * @var curl_handle Long-lived easy handle reused across requests
+ * @var share_handle Share handle holding the DNS, TLS session and connection caches
+ * @var prewarm_thread Thread opening the first connection in the background
+ * @var prewarm_url URL the prewarm thread connects to
+ * @var prewarm_running Whether prewarm_thread still has to be joined
+ * @var cancel_flag Set asynchronously (e.g. by a signal handler) to abort the transfer in flight (optional)
+ * @var response_arena Memory of the parsed response being handled, reset per response
+ */
+typedef struct {
+    CURL *curl_handle;        /**< Long-lived easy handle reused across requests */
+    CURLSH *share_handle;     /**< Share handle holding the DNS, TLS session and connection caches */
+    pthread_t prewarm_thread; /**< Thread opening the first connection in the background */
+    char *prewarm_url;        /**< URL the prewarm thread connects to */
+    int prewarm_running;      /**< Whether prewarm_thread still has to be joined */
+    const volatile sig_atomic_t *cancel_flag; /**< Set asynchronously (e.g. by a signal handler) to abort the transfer in flight (optional) */
+    arena_t response_arena;   /**< Memory of the parsed response being handled, reset per response */
+} http_client_t;
+
+/**
+ * @struct http_transfer_t
+ * @brief A request that may be raced against a hedged copy
+ * @var write_function Consumer of the response body
+ * @var write_data User data passed to write_function
+ * @var status_code HTTP status of the delivered response, set before its first byte is consumed
+ * @var retry_after Seconds the delivered response asked to wait before retrying (0 if none)
+ * @var first_byte_ms Time from sending the delivered request to its first response byte
+ * @var winner Request whose body is delivered: 0 the original, 1 the hedge, -1 none yet
+ * @var hedge_headers Header list of the hedged copy (config->hedge_headers); no hedge is sent without one
+ */
+typedef struct {
+    curl_write_callback write_function; /**< Consumer of the response body */
+    void *write_data;                   /**< User data passed to write_function */
+    long status_code;                   /**< HTTP status of the delivered response, set before its first byte is consumed */
+    long retry_after;                   /**< Seconds the delivered response asked to wait before retrying (0 if none) */
+    double first_byte_ms;               /**< Time from sending the delivered request to its first response byte */
+    int winner;                         /**< Request whose body is delivered: 0 the original, 1 the hedge, -1 none yet */
+    struct curl_slist *hedge_headers;   /**< Header list of the hedged copy (config->hedge_headers); no hedge is sent without one */
+} http_transfer_t;
+
 /**
  * @struct chat_request_params_t
  * @brief Structure for chat request parameters
  * @var user_query User input query content
  * @var custom_prompt Custom system prompt (optional)
+ * @var attachments Files appended to the user message (optional)
+ * @var attachment_count Number of attached files
+ * @var history Earlier messages as serialized JSON objects, each followed by a comma (optional)
+ * @var history_length Length of the history text
+ * @var stable_prefix Put the attachments, ordered by path, ahead of the question
+ * @var followup Messages after the user message as serialized JSON objects, each preceded by a comma (optional)
+ * @var followup_length Length of the follow-up text
+ * @var tools Serialized "tools" array offered to the model (optional)
  */
 typedef struct {
-    char *user_query;    /**< User input query content */
-    char *custom_prompt; /**< Custom system prompt (optional) */
+    char *user_query;                /**< User input query content */
+    char *custom_prompt;             /**< Custom system prompt (optional) */
+    const input_file_t *attachments; /**< Files appended to the user message (optional) */
+    size_t attachment_count;         /**< Number of attached files */
+    const char *history;             /**< Earlier messages as serialized JSON objects, each followed by a comma (optional) */
+    size_t history_length;           /**< Length of the history text */
+    int stable_prefix;               /**< Put the attachments, ordered by path, ahead of the question */
+    const char *followup;            /**< Messages after the user message as serialized JSON objects, each preceded by a comma (optional) */
+    size_t followup_length;          /**< Length of the follow-up text */
+    const char *tools;               /**< Serialized "tools" array offered to the model (optional) */
 } chat_request_params_t;
 
+/**
+ * @def REQUEST_UPLOAD_CHUNK_SIZE
+ * @brief Most input bytes read per upload callback
+ */
+#define REQUEST_UPLOAD_CHUNK_SIZE (16 * 1024)
+
+/**
+ * @def HTTP_UPLOAD_EXPECT_HEADER
+ * @brief Header suppressing "Expect: 100-continue" on streamed uploads
+ * @note Waiting for "100 Continue" would add a round trip before the first byte
+ */
+#define HTTP_UPLOAD_EXPECT_HEADER "Expect:"
+
+/**
+ * @struct request_upload_t
+ * @brief Request body streamed while the question is still being read
+ * @var body Serialized body with an empty question
+ * @var body_length Length of the serialized body
+ * @var question_offset Offset in `body` where the escaped question belongs
+ * @var position Bytes of `body` already sent
+ * @var input_fd Descriptor the question is read from
+ * @var input_open Whether input_fd has not reached end of file yet
+ * @var input_chunk Scratch buffer for raw input bytes
+ * @var pending_start Offset in input_chunk of escaped bytes still to be sent
+ * @var pending_length Number of escaped bytes still to be sent
+ * @var input_bytes Number of question bytes read so far
+ * @var failed Set when reading the input failed
+ * @note The body is framed as chunked transfer encoding over HTTP/1.1 or as
+ *       a stream of DATA frames over HTTP/2
+ */
+typedef struct {
+    char *body;             /**< Serialized body with an empty question */
+    size_t body_length;     /**< Length of the serialized body */
+    size_t question_offset; /**< Offset in `body` where the escaped question belongs */
+    size_t position;        /**< Bytes of `body` already sent */
+    int input_fd;           /**< Descriptor the question is read from */
+    int input_open;         /**< Whether input_fd has not reached end of file yet */
+    char *input_chunk;      /**< Scratch buffer for raw input bytes */
+    size_t pending_start;   /**< Offset in input_chunk of escaped bytes still to be sent */
+    size_t pending_length;  /**< Number of escaped bytes still to be sent */
+    size_t input_bytes;     /**< Number of question bytes read so far */
+    int failed;             /**< Set when reading the input failed */
+} request_upload_t;
+
+/**
+ * @def REQUEST_GZIP_LEVEL
+ * @brief zlib level used for compressed request bodies
+ * @note The fastest level: JSON text still shrinks severalfold, and a body of
+ *       several megabytes compresses in a few milliseconds
+ */
+#define REQUEST_GZIP_LEVEL 1
+
+/**
+ * @def HTTP_GZIP_ENCODING_HEADER
+ * @brief Header announcing a gzip-encoded request body
+ */
+#define HTTP_GZIP_ENCODING_HEADER "Content-Encoding: gzip"
+
+/**
+ * @struct request_body_t
+ * @brief Complete request body as sent on the wire
+ * @var data Bytes sent: the JSON payload itself, or its gzip encoding
+ * @var length Number of bytes sent
+ * @var compressed Whether data is a gzip encoding owned by the body
+ */
+typedef struct {
+    const char *data; /**< Bytes sent: the JSON payload itself, or its gzip encoding */
+    size_t length;    /**< Number of bytes sent */
+    int compressed;   /**< Whether data is a gzip encoding owned by the body */
+} request_body_t;
+
+/**
+ * @brief Ensure the payload buffer can hold at least `capacity` bytes
+ * @param response HTTP response data container
+ * @param capacity Required buffer size, including the terminating NUL
+ * @return 0 on success, -1 on allocation failure
+ */
+int http_response_reserve (http_response_t *response, size_t capacity);
+
+/**
+ * @brief Empty a response container while keeping its buffer for reuse
+ * @param response HTTP response data container
+ * @return void
+ */
+void http_response_reset (http_response_t *response);
+
 /**
  * @brief Write data to buffer
  * @param buffer Data buffer
@@ -44,29 +217,208 @@ typedef struct {
  * @param user_buffer User data buffer
  * @return Number of bytes written
  * @note Callback function for writing data in the CURL library
+ * @note The buffer grows geometrically, so appending is amortized O(1)
  */
 size_t curl_data_writer(char *buffer, size_t element_size,
                         size_t element_count, void *user_buffer);
 
 /**
- * @brief Perform an HTTP POST request
+ * @brief Inspect response headers
+ * @param buffer Header line
+ * @param element_size Size of each data element
+ * @param element_count Number of data elements
+ * @param user_buffer HTTP response data container
+ * @return Number of bytes processed
+ * @note Reserves the whole body up front when the server sends Content-Length
+ */
+size_t curl_header_reader(char *buffer, size_t element_size,
+                          size_t element_count, void *user_buffer);
+
+/**
+ * @brief Create a reusable HTTP client
+ * @param void
+ * @return Pointer to the client, NULL on failure
+ * @note Initializes libcurl globally; pair every call with http_client_destroy
+ */
+http_client_t *http_client_create(void);
+
+/**
+ * @brief Destroy an HTTP client and release its caches
+ * @param client Pointer to the client
+ * @return void
+ * @note Does nothing if a NULL pointer is passed
+ */
+void http_client_destroy(http_client_t *client);
+
+/**
+ * @brief Get the client's easy handle ready for a new transfer
+ * @param client Pointer to the client
+ * @return Easy handle with all options reset and the share handle attached
+ * @note Live connections and caches survive the reset, so consecutive requests
+ *       to the same host reuse the connection and the TLS session
+ * @note Waits for a pending prewarm, whose connection the request then reuses
+ * @note With a cancel flag set, a progress callback aborts the transfer with
+ *       CURLE_ABORTED_BY_CALLBACK once the flag becomes non-zero
+ */
+CURL *http_client_acquire(http_client_t *client);
+
+/**
+ * @brief Whether the client's cancel flag has been raised
+ * @param client Pointer to the client
+ * @return Non-zero if the transfer in flight should be aborted
+ * @note Progress callbacks installed over the client's own must check it too
+ */
+int http_client_cancelled(const http_client_t *client);
+
+/**
+ * @brief Wait for a pending prewarm to finish
+ * @param client Pointer to the client
+ * @return void
+ * @note Call before attaching other easy handles to the client's share handle
+ */
+void http_client_finish_prewarm(http_client_t *client);
+
+/**
+ * @brief Start connecting to a host before the first request is ready
+ * @param client Pointer to the client
+ * @param url URL of the endpoint the first request will be sent to
+ * @return 0 if the prewarm was started, -1 otherwise (requests still work)
+ * @note A background thread sends a HEAD request so DNS, TCP, TLS and HTTP/2
+ *       setup overlap with reading input and building the body; the connection
+ *       lands in the share's cache. The response status is ignored.
+ */
+int http_client_prewarm(http_client_t *client, const char *url);
+
+/**
+ * @brief Apply the transport options every request of the client uses
+ * @param curl_handle CURL easy handle to configure
+ * @return void
+ * @note HTTP/2 is negotiated over TLS (HTTP/1.1 otherwise), and a transfer
+ *       started while another connection handshake is pending waits to
+ *       multiplex on it instead of opening a second connection
+ * @note Responses may be compressed with any encoding libcurl was built with
+ *       (gzip, and br or zstd where available); they are decoded transparently
+ */
+void setup_http_transport (CURL *curl_handle);
+
+/**
+ * @brief Apply the common POST options to a CURL easy handle
+ * @param curl_handle CURL easy handle to configure
  * @param url Request URL
- * @param auth_header Authorization header
+ * @param header_list Request header list (owned by the caller)
+ * @param body Request body (must outlive the transfer)
+ * @param response HTTP response data container receiving the body
+ * @return void
+ * @note Shared by the blocking request path and the curl_multi batch engine
+ */
+void setup_http_post (CURL *curl_handle, const char *url, struct curl_slist *header_list,
+                      const request_body_t *body, http_response_t *response);
+
+/**
+ * @brief Send a complete request body
+ * @param curl_handle CURL easy handle to configure
+ * @param body Request body (must outlive the transfer)
+ * @return void
+ * @note Add HTTP_GZIP_ENCODING_HEADER to the request headers when body->compressed is set
+ */
+void setup_http_body (CURL *curl_handle, const request_body_t *body);
+
+/**
+ * @brief Apply the configured connect and stall deadlines
+ * @param curl_handle CURL easy handle to configure
+ * @param config Pointer to the API configuration structure
+ * @return void
+ * @note The stall deadline aborts a transfer that delivers less than a byte per
+ *       second for IDLE_TIMEOUT_MS. A non-streamed answer is silent until it is
+ *       complete, so with -s or --batch it bounds the wait for the whole answer.
+ */
+void setup_http_timeouts (CURL *curl_handle, const api_config_t *config);
+
+/**
+ * @brief Run a configured transfer, hedging it when it is slow to answer
+ * @param curl_handle CURL easy handle configured for the request
+ * @param config Pointer to the API configuration structure
+ * @param replayable Whether the body may be sent twice and its first byte
+ *                   timed (false for a pipelined upload still reading input)
+ * @param transfer Body consumer on input; status of the delivered response on output
+ * @return CURLcode of the delivered response, or of the original request if none was
+ * @note Installs its own write callback, which forwards to transfer->write_function.
+ * @note With HEDGE_URL set, a copy of the request goes to that endpoint when the
+ *       original has produced no body byte after HEDGE_DELAY_MS (or has failed).
+ *       The first request to produce a byte is delivered and the other is
+ *       cancelled. A request without a byte after FIRST_BYTE_TIMEOUT_MS is
+ *       abandoned with CURLE_OPERATION_TIMEDOUT.
+ */
+CURLcode http_client_perform (CURL *curl_handle, const api_config_t *config, int replayable,
+                              http_transfer_t *transfer);
+
+/**
+ * @brief Send the request body from an upload instead of a complete payload
+ * @param curl_handle CURL easy handle already configured for a POST
+ * @param upload Upload the body is read from
+ * @return void
+ * @note The body is sent as it is produced; add HTTP_UPLOAD_EXPECT_HEADER to
+ *       the request headers so it starts without waiting for "100 Continue"
+ */
+void setup_http_upload (CURL *curl_handle, request_upload_t *upload);
+
+/**
+ * @brief Build the header list of a request to the chat completions API
+ * @param api_key API access key sent as the bearer token (any length)
+ * @param compressed Whether the body is gzip-encoded
+ * @param upload Whether the body is streamed from an upload
+ * @return Header list (caller frees with curl_slist_free_all), or NULL on allocation failure
+ * @note Endpoints keep the lists of complete bodies prebuilt in api_endpoint_t.headers,
+ *       so this is only called per request for uploads
+ */
+struct curl_slist *build_request_headers (const char *api_key, int compressed, int upload);
+
+/**
+ * @brief Perform an HTTP POST request
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure (deadlines and compression)
+ * @param endpoint Endpoint the request is sent to (URL and prebuilt headers)
  * @param payload Request body data
+ * @param upload Streamed request body used instead of `payload` (optional)
  * @param response HTTP response data container
  * @return CURLcode type error code
  * @note Executes an HTTP POST request and writes the response data to the response
  * @note Uses the CURL library to perform the HTTP request
  */
-CURLcode perform_http_post(const char *url, const char *auth_header,
-                          const char *payload, http_response_t *response);
+CURLcode perform_http_post(http_client_t *client, const api_config_t *config,
+                          const api_endpoint_t *endpoint,
+                          const char *payload, request_upload_t *upload,
+                          http_response_t *response);
+
+/**
+ * @brief Upper bound on the serialized size of the user message
+ * @param params Pointer to the chat request parameters structure
+ * @return Number of bytes write_user_message_json may emit
+ */
+size_t user_message_json_size (const chat_request_params_t *params);
+
+/**
+ * @brief Serialize the user message, attachments included, as a JSON object
+ * @param writer Writer receiving the object
+ * @param params Pointer to the chat request parameters structure
+ * @return Offset in the writer where the question text starts
+ * @note Shared by the request body and the session log so both carry the same text
+ * @note By default the question comes first and the attachments follow in
+ *       command-line order. With stable_prefix the attachments come first,
+ *       sorted by path, and the question last, so calls about the same files
+ *       share a byte-identical prefix that the server-side context cache can
+ *       reuse whatever the question and the -f order.
+ */
+size_t write_user_message_json (json_writer_t *writer, const chat_request_params_t *params);
 
 /**
  * @brief Build the JSON payload for requests
  * @param config Pointer to the API configuration structure
  * @param params Pointer to the chat request parameters structure
  * @param stream Whether to enable streaming
- * @return JSON formatted request body string
+ * @param arena Arena holding the body (NULL for the heap)
+ * @return JSON formatted request body string; a heap body is freed by the
+ *         caller, an arena body goes with the arena's next reset
  * @note Constructs the JSON formatted request body for chat requests
  * @note The request body includes the model name, user input, system prompt, and streaming flag
  * @note The request body format is as follows:
@@ -74,14 +426,61 @@ CURLcode perform_http_post(const char *url, const char *auth_header,
  *        "model": "model name",
  *       "messages": [
  *          {"role": "system", "content": "system prompt"},
- *         {"role": "user", "content": "user input"}
+ *          ...earlier session messages...,
+ *         {"role": "user", "content": "user input"},
+ *          ...tool calls and results of earlier rounds...
  *      ],
- *     "stream": true|false
+ *     "stream": true|false,
+ *     "stream_options": {"include_usage": true},  (streaming only)
+ *     "tools": [...]                              (with --tools only)
  *    }
  * @note The streaming flag in the request body controls the API response mode
+ * @note Each attachment is appended to the user content as a fenced block
+ *       headed by "File: <path>"
+ * @note Strings are escaped straight into one buffer sized up front, so a large
+ *       query or attachment is copied exactly once; keys are always emitted in
+ *       this order
  */
 char * construct_request_json (const api_config_t *config,
                         const chat_request_params_t *params,
-                        int stream);
+                        int stream, arena_t *arena);
+
+/**
+ * @brief Prepare a request body whose question is read while it is sent
+ * @param upload Upload to initialize
+ * @param config Pointer to the API configuration structure
+ * @param params Chat request parameters; user_query is ignored
+ * @param stream Whether to enable streaming
+ * @param input_fd Descriptor the question is read from, up to end of file
+ * @return 0 on success, -1 on allocation failure
+ * @note The body matches construct_request_json with the input as the question
+ */
+int request_upload_init (request_upload_t *upload, const api_config_t *config,
+                         const chat_request_params_t *params, int stream, int input_fd);
+
+/**
+ * @brief Release an upload
+ * @param upload Upload to release
+ * @return void
+ */
+void request_upload_free (request_upload_t *upload);
+
+/**
+ * @brief Prepare a JSON payload for sending, gzip-encoding it when it is large
+ * @param body Body to initialize
+ * @param config Pointer to the API configuration structure
+ * @param payload NUL-terminated request JSON (must outlive the body)
+ * @return void
+ * @note Payloads of at least COMPRESS_REQUEST_MIN bytes are compressed; the
+ *       payload is sent as is when compression is off, fails or does not shrink it
+ */
+void request_body_init (request_body_t *body, const api_config_t *config, const char *payload);
+
+/**
+ * @brief Release a body prepared by request_body_init
+ * @param body Body to release
+ * @return void
+ */
+void request_body_free (request_body_t *body);
 
 #endif
\ No newline at end of file
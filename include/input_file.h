@@ -0,0 +1,68 @@
+/**
+ * @file input_file.h
+ * @brief Input file module header
+ * @note Maps attached files and reads the question from standard input
+ * @author Rouge Lin
+ * @date 2025-04-09
+ */
+
+#ifndef INPUT_FILE_H
+#define INPUT_FILE_H
+
+#include <stddef.h>
+
+/**
+ * @def MAX_ATTACHMENTS
+ * @brief Maximum number of -f attachments per question
+ */
+#define MAX_ATTACHMENTS 64
+
+/**
+ * @struct input_file_t
+ * @brief Read-only view of an attached file
+ * @var path Path given on the command line, used to label the contents
+ * @var data File contents (not NUL-terminated)
+ * @var length Length of the contents
+ */
+typedef struct {
+    const char *path; /**< Path given on the command line, used to label the contents */
+    const char *data; /**< File contents (not NUL-terminated) */
+    size_t length;    /**< Length of the contents */
+} input_file_t;
+
+/**
+ * @brief Map a file read-only
+ * @param file Output structure receiving the mapping
+ * @param path Path of the file
+ * @return 0 on success, -1 on failure (an error is printed)
+ * @note The pages are only touched while the request body is written, so
+ *       attaching a file costs no heap memory of its own
+ */
+int input_file_open (input_file_t *file, const char *path);
+
+/**
+ * @brief Unmap a file opened with input_file_open
+ * @param file Pointer to the file
+ * @return void
+ */
+void input_file_close (input_file_t *file);
+
+/**
+ * @brief Read all content from standard input
+ * @return Dynamically allocated string with stdin content, NULL on failure
+ * @note Regular files are read with a single allocation of their exact size;
+ *       pipes start from a small buffer that doubles as needed
+ */
+char *read_stdin (void);
+
+/**
+ * @brief Read a whole file into memory
+ * @param path Path of the file
+ * @param length Output parameter receiving the length of the contents (optional)
+ * @return Dynamically allocated NUL-terminated contents, NULL on failure (an error is printed)
+ * @note For small files read in full, such as definitions and fixtures;
+ *       attachments are mapped with input_file_open instead
+ */
+char *read_file (const char *path, size_t *length);
+
+#endif /* INPUT_FILE_H */
@@ -0,0 +1,134 @@
+/**
+ * @file json_scan.h
+ * @brief Allocation-free JSON scanner header
+ * @note Pull-style cursor for extracting a few fields without building a DOM
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stddef.h>
+
+/**
+ * @struct json_scanner_t
+ * @brief Cursor over a JSON text
+ * @var cursor Current read position
+ * @var end One past the last byte of the text
+ */
+typedef struct {
+    const char *cursor; /**< Current read position */
+    const char *end;    /**< One past the last byte of the text */
+} json_scanner_t;
+
+/**
+ * @struct json_span_t
+ * @brief Byte range inside the scanned text
+ * @var start First byte of the range
+ * @var length Number of bytes in the range
+ */
+typedef struct {
+    const char *start; /**< First byte of the range */
+    size_t length;     /**< Number of bytes in the range */
+} json_span_t;
+
+/**
+ * @enum json_scan_type_t
+ * @brief Type of the value at the cursor
+ */
+typedef enum {
+    JSON_SCAN_INVALID = 0, /**< End of input or malformed text */
+    JSON_SCAN_NULL,        /**< null */
+    JSON_SCAN_BOOL,        /**< true or false */
+    JSON_SCAN_NUMBER,      /**< Number */
+    JSON_SCAN_STRING,      /**< String */
+    JSON_SCAN_ARRAY,       /**< Array */
+    JSON_SCAN_OBJECT       /**< Object */
+} json_scan_type_t;
+
+/**
+ * @brief Initialize a scanner over a text
+ * @param scanner Pointer to the scanner
+ * @param text JSON text (need not be NUL-terminated)
+ * @param length Length of the text in bytes
+ * @return void
+ */
+void json_scan_init (json_scanner_t *scanner, const char *text, size_t length);
+
+/**
+ * @brief Peek at the type of the next value without consuming it
+ * @param scanner Pointer to the scanner
+ * @return Type of the value at the cursor
+ */
+json_scan_type_t json_scan_peek (json_scanner_t *scanner);
+
+/**
+ * @brief Consume the opening bracket of an object or array
+ * @param scanner Pointer to the scanner
+ * @param type JSON_SCAN_OBJECT or JSON_SCAN_ARRAY
+ * @return 0 on success, -1 if the next value has another type
+ */
+int json_scan_enter (json_scanner_t *scanner, json_scan_type_t type);
+
+/**
+ * @brief Advance to the next member of the object being iterated
+ * @param scanner Pointer to the scanner
+ * @param key Output span receiving the raw (still escaped) member name
+ * @return 1 with the cursor on the member value, 0 at the closing brace
+ *         (consumed), -1 on malformed input
+ */
+int json_scan_next_member (json_scanner_t *scanner, json_span_t *key);
+
+/**
+ * @brief Advance to the next element of the array being iterated
+ * @param scanner Pointer to the scanner
+ * @return 1 with the cursor on the element, 0 at the closing bracket
+ *         (consumed), -1 on malformed input
+ */
+int json_scan_next_element (json_scanner_t *scanner);
+
+/**
+ * @brief Skip the value at the cursor, including nested containers
+ * @param scanner Pointer to the scanner
+ * @return 0 on success, -1 on malformed input
+ */
+int json_scan_skip (json_scanner_t *scanner);
+
+/**
+ * @brief Consume a string value
+ * @param scanner Pointer to the scanner
+ * @param value Output span receiving the raw contents between the quotes
+ * @return 0 on success, -1 if the value is not a well-formed string
+ * @note Escapes are left in place; decode them with json_unescape
+ */
+int json_scan_string (json_scanner_t *scanner, json_span_t *value);
+
+/**
+ * @brief Consume a number value as an integer
+ * @param scanner Pointer to the scanner
+ * @param value Output parameter receiving the integer part, clamped to +/-LONG_MAX
+ * @return 0 on success, -1 if the value is not a number
+ */
+int json_scan_integer (json_scanner_t *scanner, long *value);
+
+/**
+ * @brief Compare a raw member name with a literal
+ * @param key Raw member name span
+ * @param literal NUL-terminated literal without escapes
+ * @return Non-zero when equal
+ */
+int json_span_equals (const json_span_t *key, const char *literal);
+
+/**
+ * @brief Decode JSON string escapes
+ * @param destination Output buffer of at least `length` bytes; may equal `source`
+ * @param source Raw string contents as returned by json_scan_string
+ * @param length Length of the raw contents
+ * @return Length of the decoded text, or (size_t)-1 on an invalid escape
+ * @note Decoding never grows the text, so it can run in place. The output is
+ *       not NUL-terminated.
+ */
+size_t json_unescape (char *destination, const char *source, size_t length);
+
+#endif /* JSON_SCAN_H */
@@ -0,0 +1,142 @@
+/**
+ * @file json_writer.h
+ * @brief Direct JSON writer header
+ * @note Serializes straight into one buffer without building a cJSON tree
+ * @author Rouge Lin
+ * @date 2025-04-09
+ */
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include "arena.h"
+#include <stddef.h>
+
+/**
+ * @struct json_writer_t
+ * @brief Output buffer of a JSON text under construction
+ * @var data Text written so far (NUL-terminated while not failed)
+ * @var length Length of the text
+ * @var capacity Allocated size of the buffer
+ * @var failed Set once an allocation fails; later writes are ignored
+ * @var arena Arena the buffer is taken from (NULL for the heap)
+ */
+typedef struct {
+    char *data;      /**< Text written so far (NUL-terminated while not failed) */
+    size_t length;   /**< Length of the text */
+    size_t capacity; /**< Allocated size of the buffer */
+    int failed;      /**< Set once an allocation fails; later writes are ignored */
+    arena_t *arena;  /**< Arena the buffer is taken from (NULL for the heap) */
+} json_writer_t;
+
+/**
+ * @brief Number of bytes a string occupies once escaped, quotes excluded
+ * @param text String contents
+ * @param length Length of the contents
+ * @return Escaped length
+ * @note Used to size the buffer exactly before writing large strings
+ */
+size_t json_escaped_length (const char *text, size_t length);
+
+/**
+ * @brief Escape string contents into a caller-provided buffer
+ * @param output Destination with room for json_escaped_length(text, length) bytes
+ *               (six per input byte always suffice)
+ * @param text String contents (UTF-8 is passed through unchanged)
+ * @param length Length of the contents
+ * @return Number of bytes written; the output is not NUL-terminated
+ * @note Bytes are escaped one at a time, so input may be split anywhere,
+ *       even inside a multi-byte character
+ */
+size_t json_escape_into (char *output, const char *text, size_t length);
+
+/**
+ * @brief Initialize a writer
+ * @param writer Pointer to the writer
+ * @param size_hint Expected final length; the buffer is allocated at exactly this
+ *                  size (plus the terminator) and only grows, geometrically, past it
+ * @return 0 on success, -1 on allocation failure
+ */
+int json_writer_init (json_writer_t *writer, size_t size_hint);
+
+/**
+ * @brief Initialize a writer whose buffer comes from an arena
+ * @param writer Pointer to the writer
+ * @param size_hint As for json_writer_init
+ * @param arena Arena receiving the buffer (NULL for the heap)
+ * @return 0 on success, -1 on allocation failure
+ * @note The finished text is released with the arena; a buffer outgrown
+ *       before then stays in the arena unused
+ */
+int json_writer_init_arena (json_writer_t *writer, size_t size_hint, arena_t *arena);
+
+/**
+ * @brief Append raw JSON text
+ * @param writer Pointer to the writer
+ * @param text Text copied verbatim
+ * @param length Length of the text
+ * @return void
+ */
+void json_writer_raw (json_writer_t *writer, const char *text, size_t length);
+
+/**
+ * @brief Append a quoted, escaped string
+ * @param writer Pointer to the writer
+ * @param text String contents (UTF-8 is passed through unchanged)
+ * @param length Length of the contents
+ * @return void
+ */
+void json_writer_string (json_writer_t *writer, const char *text, size_t length);
+
+/**
+ * @brief Append escaped string contents without the surrounding quotes
+ * @param writer Pointer to the writer
+ * @param text String contents (UTF-8 is passed through unchanged)
+ * @param length Length of the contents
+ * @return void
+ * @note Lets one JSON string be assembled from several pieces between
+ *       json_writer_raw(writer, "\"", 1) calls
+ */
+void json_writer_escaped (json_writer_t *writer, const char *text, size_t length);
+
+/**
+ * @brief Append an object member name and the following colon
+ * @param writer Pointer to the writer
+ * @param key NUL-terminated member name without characters needing escapes
+ * @return void
+ */
+void json_writer_key (json_writer_t *writer, const char *key);
+
+/**
+ * @brief Append an integer
+ * @param writer Pointer to the writer
+ * @param value Integer value
+ * @return void
+ */
+void json_writer_integer (json_writer_t *writer, long value);
+
+/**
+ * @brief Append true or false
+ * @param writer Pointer to the writer
+ * @param value Boolean value
+ * @return void
+ */
+void json_writer_bool (json_writer_t *writer, int value);
+
+/**
+ * @brief Discard the written text, keeping the buffer for the next one
+ * @param writer Pointer to the writer
+ * @return void
+ */
+void json_writer_reset (json_writer_t *writer);
+
+/**
+ * @brief Take ownership of the written text
+ * @param writer Pointer to the writer
+ * @return NUL-terminated text (caller frees unless it came from an arena),
+ *         or NULL if any write failed
+ * @note The writer is left empty
+ */
+char *json_writer_finish (json_writer_t *writer);
+
+#endif /* JSON_WRITER_H */
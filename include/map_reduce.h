@@ -0,0 +1,88 @@
+/**
+ * @file map_reduce.h
+ * @brief Map-reduce module header
+ * @note Answers a question about an input too long for one request
+ *       (--chunk-size): the input is split, every part is asked about
+ *       concurrently and the partial answers are combined
+ * @author Rouge Lin
+ * @date 2025-04-23
+ */
+
+#ifndef MAP_REDUCE_H
+#define MAP_REDUCE_H
+
+#include "config.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include <stddef.h>
+
+/**
+ * @def MAP_REDUCE_BYTES_PER_TOKEN
+ * @brief Bytes of input counted as one token when sizing the parts
+ */
+#define MAP_REDUCE_BYTES_PER_TOKEN 4
+
+/**
+ * @def MAP_REDUCE_MAX_CHUNK_TOKENS
+ * @brief Largest --chunk-size accepted
+ */
+#define MAP_REDUCE_MAX_CHUNK_TOKENS (1024 * 1024)
+
+/**
+ * @struct text_chunk_t
+ * @brief One part of a split input
+ * @var text Start of the part, inside the input
+ * @var length Length of the part
+ */
+typedef struct {
+    const char *text; /**< Start of the part, inside the input */
+    size_t length;    /**< Length of the part */
+} text_chunk_t;
+
+/**
+ * @struct map_reduce_options_t
+ * @brief How an input is split and its parts are sent
+ * @var chunk_tokens Most tokens of input, or of partial answers, one request carries
+ * @var concurrency Most requests in flight at once
+ */
+typedef struct {
+    size_t chunk_tokens; /**< Most tokens of input, or of partial answers, one request carries */
+    int concurrency;     /**< Most requests in flight at once */
+} map_reduce_options_t;
+
+/**
+ * @brief Split a text into parts of at most max_bytes
+ * @param text Text to split
+ * @param length Length of the text
+ * @param max_bytes Largest part
+ * @param chunks Output parameter receiving the dynamically allocated parts
+ * @param chunk_count Output parameter receiving the number of parts
+ * @return 0 on success, -1 on allocation failure
+ * @note A part ends after the last line break in its second half, else after
+ *       the last blank there, else at the last UTF-8 character boundary, so
+ *       lines and words are only cut when they are longer than half a part
+ */
+int split_text_chunks (const char *text, size_t length, size_t max_bytes,
+                       text_chunk_t **chunks, size_t *chunk_count);
+
+/**
+ * @brief Answer a question about an input of any length
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param question What is asked about the input
+ * @param input Input text
+ * @param input_length Length of the input
+ * @param options Pointer to the map-reduce options
+ * @param run_options Run options of the final request, whose answer is printed
+ * @return 0 on success, -1 on failure
+ * @note An input that fits in one part is sent as a single request. Otherwise
+ *       each part is asked about on its own through the batch engine (so
+ *       retries and rate limits apply), and consecutive partial answers are
+ *       combined in further rounds until one request can carry them all; that
+ *       last request is streamed. Each round takes about one request's time.
+ */
+int run_map_reduce (http_client_t *client, const api_config_t *config,
+                    const char *question, const char *input, size_t input_length,
+                    const map_reduce_options_t *options, const chat_run_options_t *run_options);
+
+#endif /* MAP_REDUCE_H */
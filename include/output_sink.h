@@ -0,0 +1,120 @@
+/**
+ * @file output_sink.h
+ * @brief Output sink module header
+ * @note Coalesces streamed text into few write syscalls
+ * @author Rouge Lin
+ * @date 2025-04-12
+ */
+
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * @def OUTPUT_SINK_BUFFER_SIZE
+ * @brief Size of the coalescing buffer
+ */
+#define OUTPUT_SINK_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @struct output_sink_t
+ * @brief Buffered writer on a file descriptor
+ * @var fd Destination file descriptor
+ * @var interactive Whether the destination is a terminal
+ * @var flush_interval_ms Longest time text may wait in the buffer on a terminal
+ * @var buffer Pending bytes (NULL when allocation failed: writes go straight out)
+ * @var length Number of pending bytes
+ * @var pending_newline Whether the pending bytes contain a newline
+ * @var pending_since When the oldest pending byte was written
+ * @var failed Set once a write fails; later output is discarded
+ * @var threaded Whether a writer thread performs the writes
+ * @var writer_thread Thread draining the buffer (when threaded)
+ * @var lock Protects the buffer and the flags below (when threaded)
+ * @var wake Signals the writer that output is due or the sink is closing
+ * @var drained Signals producers that the writer emptied the buffer
+ * @var spare Buffer the writer writes from while producers fill `buffer`
+ * @var flush_requested Whether pending output should be written now
+ * @var writing Whether the writer is writing `spare`
+ * @var stopping Whether the writer should exit once the buffer is empty
+ * @note On a terminal, pending text is flushed by output_sink_poll as soon as
+ *       it completes a line or has waited flush_interval_ms (0 = at every poll).
+ *       Otherwise output is block buffered and only leaves when the buffer fills
+ *       or the sink is flushed.
+ */
+typedef struct {
+    int fd;                       /**< Destination file descriptor */
+    int interactive;              /**< Whether the destination is a terminal */
+    long flush_interval_ms;       /**< Longest time text may wait in the buffer on a terminal */
+    char *buffer;                 /**< Pending bytes (NULL when allocation failed: writes go straight out) */
+    size_t length;                /**< Number of pending bytes */
+    int pending_newline;          /**< Whether the pending bytes contain a newline */
+    struct timespec pending_since; /**< When the oldest pending byte was written */
+    int failed;                   /**< Set once a write fails; later output is discarded */
+    int threaded;                 /**< Whether a writer thread performs the writes */
+    pthread_t writer_thread;      /**< Thread draining the buffer (when threaded) */
+    pthread_mutex_t lock;         /**< Protects the buffer and the flags below (when threaded) */
+    pthread_cond_t wake;          /**< Signals the writer that output is due or the sink is closing */
+    pthread_cond_t drained;       /**< Signals producers that the writer emptied the buffer */
+    char *spare;                  /**< Buffer the writer writes from while producers fill `buffer` */
+    int flush_requested;          /**< Whether pending output should be written now */
+    int writing;                  /**< Whether the writer is writing `spare` */
+    int stopping;                 /**< Whether the writer should exit once the buffer is empty */
+} output_sink_t;
+
+/**
+ * @brief Initialize a sink
+ * @param sink Pointer to the sink
+ * @param fd Destination file descriptor
+ * @param flush_interval_ms Terminal flush deadline in milliseconds
+ * @return void
+ */
+void output_sink_init (output_sink_t *sink, int fd, long flush_interval_ms);
+
+/**
+ * @brief Move the writes of a sink to a dedicated thread
+ * @param sink Pointer to an initialized sink
+ * @return 0 on success, -1 if the sink stays synchronous
+ * @note Writes then only copy into the buffer, and a full buffer is handed to
+ *       the writer while producers continue in a second one; the flush policy
+ *       is unchanged. output_sink_flush waits until the writer is idle.
+ */
+int output_sink_start_writer (output_sink_t *sink);
+
+/**
+ * @brief Queue bytes for output
+ * @param sink Pointer to the sink
+ * @param data Bytes to write
+ * @param length Number of bytes
+ * @return void
+ * @note When the bytes do not fit, the buffer and the new bytes leave
+ *       together in one writev call
+ */
+void output_sink_write (output_sink_t *sink, const char *data, size_t length);
+
+/**
+ * @brief Apply the terminal flush policy
+ * @param sink Pointer to the sink
+ * @return void
+ * @note Call after each batch of writes (e.g. each network read); does nothing
+ *       when the destination is not a terminal
+ */
+void output_sink_poll (output_sink_t *sink);
+
+/**
+ * @brief Write out every pending byte
+ * @param sink Pointer to the sink
+ * @return 0 on success, -1 if output failed
+ */
+int output_sink_flush (output_sink_t *sink);
+
+/**
+ * @brief Flush and release a sink
+ * @param sink Pointer to the sink
+ * @return 0 on success, -1 if output failed
+ */
+int output_sink_close (output_sink_t *sink);
+
+#endif /* OUTPUT_SINK_H */
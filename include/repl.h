@@ -0,0 +1,37 @@
+/**
+ * @file repl.h
+ * @brief Interactive mode module header
+ * @note Reads questions line by line and answers them over one warm client
+ * @author Rouge Lin
+ * @date 2025-04-17
+ */
+
+#ifndef REPL_H
+#define REPL_H
+
+#include "config.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include "session.h"
+
+/**
+ * @def REPL_QUIT_COMMAND
+ * @brief Input line that ends the interactive loop (as does end of input)
+ */
+#define REPL_QUIT_COMMAND "/quit"
+
+/**
+ * @brief Answer questions read from standard input until it ends
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param run_template How each answer is requested and printed (reply_text is ignored)
+ * @param session Conversation the turns are added to; its history is retained in memory
+ * @return 0 on success, -1 on failure
+ * @note Every line is one user message sent with the whole conversation so far.
+ *       SIGINT aborts the answer in flight (which is then not recorded) or
+ *       discards the line being typed; the process keeps running.
+ */
+int run_interactive_session (http_client_t *client, const api_config_t *config,
+                             const chat_run_options_t *run_template, session_t *session);
+
+#endif /* REPL_H */
@@ -0,0 +1,54 @@
+/**
+ * @file response_cache.h
+ * @brief Response cache module header
+ * @note Content-addressed on-disk cache of answers keyed by the request body
+ * @author Rouge Lin
+ * @date 2025-04-11
+ */
+
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include "config.h"
+#include <stddef.h>
+
+/**
+ * @def CACHE_SNAPSHOT_SUBDIRECTORY
+ * @brief Subdirectory of the cache directory holding the configuration snapshots
+ */
+#define CACHE_SNAPSHOT_SUBDIRECTORY "config"
+
+/**
+ * @brief Resolve the cache directory, or a subdirectory of it
+ * @param path Output buffer
+ * @param path_size Size of the output buffer
+ * @param subdirectory Name inside the cache directory, NULL for the directory itself
+ * @return 0 on success, -1 if HOME is not set either or the path does not fit
+ * @note $XDG_CACHE_HOME/ads, else ~/.cache/ads. Only the answers live directly
+ *       in it, since eviction treats every regular file there as an answer.
+ */
+int resolve_cache_directory (char *path, size_t path_size, const char *subdirectory);
+
+/**
+ * @brief Look up the cached answer to a request
+ * @param config Pointer to the API configuration structure
+ * @param request_json Exact request body that would be sent
+ * @return Dynamically allocated answer text, or NULL on a miss
+ * @note Entries older than CACHE_TTL seconds are discarded; a hit refreshes
+ *       the entry's access time, which drives LRU eviction
+ */
+char *response_cache_lookup (const api_config_t *config, const char *request_json);
+
+/**
+ * @brief Store the answer to a request
+ * @param config Pointer to the API configuration structure
+ * @param request_json Exact request body that was sent
+ * @param reply Answer text
+ * @return 0 on success, -1 on failure
+ * @note Least recently used entries are evicted while the cache exceeds
+ *       CACHE_MAX_BYTES
+ */
+int response_cache_store (const api_config_t *config, const char *request_json,
+                          const char *reply);
+
+#endif /* RESPONSE_CACHE_H */
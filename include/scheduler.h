@@ -0,0 +1,120 @@
+/**
+ * @file scheduler.h
+ * @brief Request scheduler module header
+ * @note Retry policy for transient failures and the batch rate limiter
+ * @author Rouge Lin
+ * @date 2025-04-14
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "config.h"
+#include <curl/curl.h>
+
+/**
+ * @struct rate_limiter_t
+ * @brief Token buckets for a requests-per-minute and a tokens-per-minute quota
+ * @var request_rate Requests added to the request bucket per millisecond (0 = unlimited)
+ * @var request_capacity Largest number of requests the bucket holds
+ * @var request_level Requests currently available
+ * @var token_rate Tokens added to the token bucket per millisecond (0 = unlimited)
+ * @var token_capacity Largest number of tokens the bucket holds
+ * @var token_level Tokens currently available (negative after an underestimate)
+ * @var refilled_ms When the buckets were last refilled
+ * @var paused_until_ms No request starts before this time (set by a 429)
+ * @note Buckets start full and hold one minute's quota, the window the API
+ *       enforces. Every in-flight request of a batch draws from the same limiter.
+ */
+typedef struct {
+    double request_rate;     /**< Requests added to the request bucket per millisecond (0 = unlimited) */
+    double request_capacity; /**< Largest number of requests the bucket holds */
+    double request_level;    /**< Requests currently available */
+    double token_rate;       /**< Tokens added to the token bucket per millisecond (0 = unlimited) */
+    double token_capacity;   /**< Largest number of tokens the bucket holds */
+    double token_level;      /**< Tokens currently available (negative after an underestimate) */
+    double refilled_ms;      /**< When the buckets were last refilled */
+    double paused_until_ms;  /**< No request starts before this time (set by a 429) */
+} rate_limiter_t;
+
+/**
+ * @brief Whether a failed attempt is worth repeating
+ * @param transfer_result Result of the transfer
+ * @param status_code HTTP status of the response (0 if none arrived)
+ * @return Non-zero for 408, 429 and 5xx statuses and for connections that
+ *         failed before the server could have processed the request
+ */
+int retry_is_transient (CURLcode transfer_result, long status_code);
+
+/**
+ * @brief How long to wait before the next attempt
+ * @param config Pointer to the API configuration structure
+ * @param attempt Number of retries already made
+ * @param retry_after_seconds Server's Retry-After value (0 if none)
+ * @return Delay in milliseconds, or -1 when no retry should be made
+ * @note Without Retry-After the delay is drawn from the upper half of
+ *       [0, min(RETRY_MAX_MS, RETRY_BASE_MS * 2^attempt)], so clients that
+ *       failed together do not retry together. Retry-After is honored with
+ *       the same jitter on top, unless it exceeds RETRY_MAX_MS.
+ */
+long retry_delay_ms (const api_config_t *config, int attempt, long retry_after_seconds);
+
+/**
+ * @brief Report a retry on standard error
+ * @param label Prefix for the message (e.g. the batch job id), or NULL
+ * @param transfer_result Result of the failed transfer
+ * @param status_code HTTP status of the response (0 if none arrived)
+ * @param attempt Number of the retry about to be made, starting at 1
+ * @param max_retries Configured retry count
+ * @param delay_ms Delay returned by retry_delay_ms
+ * @return void
+ */
+void retry_announce (const char *label, CURLcode transfer_result, long status_code,
+                     int attempt, long max_retries, long delay_ms);
+
+/**
+ * @brief Sleep for a number of milliseconds
+ * @param delay_ms Delay in milliseconds
+ * @return void
+ */
+void retry_sleep_ms (long delay_ms);
+
+/**
+ * @brief Initialize a limiter from the configured quotas
+ * @param limiter Pointer to the limiter
+ * @param config Pointer to the API configuration structure
+ * @param now_ms Current monotonic time in milliseconds
+ * @return void
+ */
+void rate_limiter_init (rate_limiter_t *limiter, const api_config_t *config, double now_ms);
+
+/**
+ * @brief Try to take one request and its estimated tokens from the buckets
+ * @param limiter Pointer to the limiter
+ * @param now_ms Current monotonic time in milliseconds
+ * @param estimated_tokens Tokens the request is expected to consume
+ * @return 0 if the request may start now (the quota is taken), otherwise the
+ *         number of milliseconds to wait before asking again
+ */
+long rate_limiter_acquire (rate_limiter_t *limiter, double now_ms, long estimated_tokens);
+
+/**
+ * @brief Correct the token bucket once a request's real usage is known
+ * @param limiter Pointer to the limiter
+ * @param estimated_tokens Estimate passed to rate_limiter_acquire
+ * @param used_tokens Tokens the response reported
+ * @return void
+ */
+void rate_limiter_settle (rate_limiter_t *limiter, long estimated_tokens, long used_tokens);
+
+/**
+ * @brief Hold every request back until a point in time
+ * @param limiter Pointer to the limiter
+ * @param until_ms Monotonic time in milliseconds before which nothing starts
+ * @return void
+ * @note Called on a 429 so the other in-flight slots back off with the one
+ *       that was refused, instead of each discovering the limit on its own
+ */
+void rate_limiter_pause (rate_limiter_t *limiter, double until_ms);
+
+#endif /* SCHEDULER_H */
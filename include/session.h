@@ -0,0 +1,94 @@
+/**
+ * @file session.h
+ * @brief Conversation session module header
+ * @note Keeps multi-turn history in an append-only log of serialized messages
+ * @author Rouge Lin
+ * @date 2025-04-10
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "config.h"
+#include "http_client.h"
+#include <stddef.h>
+
+/**
+ * @struct session_t
+ * @brief An open conversation session
+ * @var path Path of the session log
+ * @var mapping Read-only mapping of the log (NULL when empty)
+ * @var mapping_length Length of the mapping
+ * @var history Start of the retained history inside the mapping
+ * @var history_length Length of the retained history
+ * @var pending_user Serialized user message waiting for its reply
+ * @var retained Owned copy of the history that recorded turns are appended to (optional)
+ * @var retained_capacity Allocated size of the retained copy
+ * @var max_bytes History budget applied to the retained copy (0 = unbounded)
+ * @note A session whose path is empty has no log and lives in memory only
+ * @note The log holds one JSON message object per line, each followed by a
+ *       comma, so it can be spliced into the messages array byte for byte
+ */
+typedef struct {
+    char path[PATH_MAX];   /**< Path of the session log */
+    char *mapping;         /**< Read-only mapping of the log (NULL when empty) */
+    size_t mapping_length; /**< Length of the mapping */
+    const char *history;   /**< Start of the retained history inside the mapping */
+    size_t history_length; /**< Length of the retained history */
+    char *pending_user;    /**< Serialized user message waiting for its reply */
+    char *retained;        /**< Owned copy of the history that recorded turns are appended to (optional) */
+    size_t retained_capacity; /**< Allocated size of the retained copy */
+    long max_bytes;        /**< History budget applied to the retained copy (0 = unbounded) */
+} session_t;
+
+/**
+ * @brief Open (or create) a named session
+ * @param session Output structure receiving the session
+ * @param name Session name ([A-Za-z0-9._-], not starting with '.')
+ * @param max_bytes History budget; older turns beyond it are dropped from the log
+ * @return 0 on success, -1 on failure (an error is printed)
+ * @note Logs live in $XDG_DATA_HOME/ads/sessions (default ~/.local/share/ads/sessions)
+ * @note Truncation always cuts at a user message, so the retained history
+ *       starts with a whole turn
+ */
+int session_open (session_t *session, const char *name, long max_bytes);
+
+/**
+ * @brief Keep recorded turns in memory so the next request includes them
+ * @param session Pointer to an open session, or a zeroed one with history ""
+ *                for a conversation without a log
+ * @param max_bytes History budget; the oldest turns beyond it are dropped
+ * @return 0 on success, -1 on allocation failure
+ * @note For a process that sends several turns: each turn then costs one
+ *       append instead of reopening the log
+ */
+int session_retain_history (session_t *session, long max_bytes);
+
+/**
+ * @brief Release a session
+ * @param session Pointer to the session
+ * @return void
+ */
+void session_close (session_t *session);
+
+/**
+ * @brief Serialize the user message of the turn about to be sent
+ * @param session Pointer to the session
+ * @param params Request parameters, attachments still mapped
+ * @return 0 on success, -1 on allocation failure
+ * @note Nothing is written until session_record_reply, so a failed request
+ *       leaves the log untouched
+ */
+int session_stage_user (session_t *session, const chat_request_params_t *params);
+
+/**
+ * @brief Append the staged user message and the assistant reply to the log
+ * @param session Pointer to the session
+ * @param reply Assistant reply text
+ * @return 0 on success, -1 on failure (an error is printed)
+ * @note Both records go out in a single O_APPEND write, and are also appended
+ *       to the retained history when session_retain_history was called
+ */
+int session_record_reply (session_t *session, const char *reply);
+
+#endif /* SESSION_H */
@@ -0,0 +1,124 @@
+/**
+ * @file sse_parser.h
+ * @brief Server-sent events parser header
+ * @note Splits an SSE stream into events and extracts chat completion chunks
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#ifndef SSE_PARSER_H
+#define SSE_PARSER_H
+
+#include "json_scan.h"
+#include <stddef.h>
+
+/**
+ * @struct sse_parser_t
+ * @brief State of the event currently being assembled
+ * @var data Data field of the pending event (not NUL-terminated)
+ * @var data_length Length of the data field
+ * @var owned_data Parser-owned storage used when the data cannot be borrowed
+ * @var owned_capacity Allocated size of the owned storage
+ * @var has_data Whether the pending event has received a data line
+ * @var event_ready Whether the previous line completed an event
+ * @var event_type Event field of the pending event (empty for "message")
+ * @note A single data line is borrowed from the caller's buffer and parsed
+ *       in place; it is copied into owned storage only for multi-line data or
+ *       when the caller announces it will reuse the buffer (sse_parser_detach)
+ */
+typedef struct {
+    char *data;            /**< Data field of the pending event (not NUL-terminated) */
+    size_t data_length;    /**< Length of the data field */
+    char *owned_data;      /**< Parser-owned storage used when the data cannot be borrowed */
+    size_t owned_capacity; /**< Allocated size of the owned storage */
+    int has_data;          /**< Whether the pending event has received a data line */
+    int event_ready;       /**< Whether the previous line completed an event */
+    char event_type[32];   /**< Event field of the pending event (empty for "message") */
+} sse_parser_t;
+
+/**
+ * @struct chat_chunk_t
+ * @brief Fields of one streamed chat completion chunk
+ * @var content Decoded choices[0].delta.content (not NUL-terminated)
+ * @var reasoning_content Decoded choices[0].delta.reasoning_content
+ * @var finish_reason Decoded choices[0].finish_reason
+ * @var tool_calls Raw choices[0].delta.tool_calls array, still escaped (see tool_calls_feed)
+ * @var has_usage Whether the chunk carries a usage object
+ * @var prompt_tokens Prompt token count from usage
+ * @var completion_tokens Completion token count from usage
+ * @var total_tokens Total token count from usage
+ * @var cached_tokens Prompt tokens served from the server-side context cache
+ * @var cache_miss_tokens Prompt tokens that missed the context cache (-1 when not reported)
+ * @var has_error Whether the text carries an error member
+ * @var error_message Decoded error.message, or error itself when it is a string
+ */
+typedef struct {
+    json_span_t content;           /**< Decoded choices[0].delta.content (not NUL-terminated) */
+    json_span_t reasoning_content; /**< Decoded choices[0].delta.reasoning_content */
+    json_span_t finish_reason;     /**< Decoded choices[0].finish_reason */
+    json_span_t tool_calls;        /**< Raw choices[0].delta.tool_calls array, still escaped (see tool_calls_feed) */
+    int has_usage;                 /**< Whether the chunk carries a usage object */
+    long prompt_tokens;            /**< Prompt token count from usage */
+    long completion_tokens;        /**< Completion token count from usage */
+    long total_tokens;             /**< Total token count from usage */
+    long cached_tokens;            /**< Prompt tokens served from the server-side context cache */
+    long cache_miss_tokens;        /**< Prompt tokens that missed the context cache (-1 when not reported) */
+    int has_error;                 /**< Whether the text carries an error member */
+    json_span_t error_message;     /**< Decoded error.message, or error itself when it is a string */
+} chat_chunk_t;
+
+/**
+ * @brief Initialize an SSE parser
+ * @param parser Pointer to the parser
+ * @return void
+ */
+void sse_parser_init (sse_parser_t *parser);
+
+/**
+ * @brief Release the parser's buffer
+ * @param parser Pointer to the parser
+ * @return void
+ */
+void sse_parser_free (sse_parser_t *parser);
+
+/**
+ * @brief Feed one line of the stream
+ * @param parser Pointer to the parser
+ * @param line Line contents without the line terminator; a data line may be
+ *             referenced (and decoded in place) until the event is consumed
+ * @param length Length of the line
+ * @return 1 when the line completed an event (read it from the parser before
+ *         the next call), 0 otherwise, -1 on allocation failure
+ * @note Comment lines (":...") are ignored; "id" and "retry" fields are accepted
+ *       and discarded; multiple data lines are joined with '\n'
+ */
+int sse_parser_feed_line (sse_parser_t *parser, char *line, size_t length);
+
+/**
+ * @brief Stop borrowing from the caller's buffer
+ * @param parser Pointer to the parser
+ * @return 0 on success, -1 on allocation failure
+ * @note Call before moving or overwriting bytes already fed to the parser
+ */
+int sse_parser_detach (sse_parser_t *parser);
+
+/**
+ * @brief Flush an event left pending when the stream ended without a blank line
+ * @param parser Pointer to the parser
+ * @return 1 if an event is ready, 0 otherwise
+ */
+int sse_parser_finish (sse_parser_t *parser);
+
+/**
+ * @brief Extract the interesting fields of a chat completion chunk
+ * @param data JSON text of the chunk; string fields are decoded in place
+ * @param length Length of the JSON text
+ * @param chunk Output structure receiving spans into `data`
+ * @return 0 on success, -1 on malformed JSON
+ * @note Scans the text once and allocates nothing. A whole chat.completion
+ *       body is read the same way, its choices[0].message standing in for
+ *       the delta.
+ */
+int parse_chat_chunk (char *data, size_t length, chat_chunk_t *chunk);
+
+#endif /* SSE_PARSER_H */
@@ -0,0 +1,66 @@
+/**
+ * @file stats.h
+ * @brief Timing statistics helper header
+ * @note Monotonic timestamps and percentile summaries of latency samples
+ * @author Rouge Lin
+ * @date 2025-04-12
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/**
+ * @struct sample_set_t
+ * @brief Growable set of measurements
+ * @var values Recorded samples
+ * @var count Number of samples
+ * @var capacity Allocated number of samples
+ * @var sorted Whether values are currently in ascending order
+ */
+typedef struct {
+    double *values;  /**< Recorded samples */
+    size_t count;    /**< Number of samples */
+    size_t capacity; /**< Allocated number of samples */
+    int sorted;      /**< Whether values are currently in ascending order */
+} sample_set_t;
+
+/**
+ * @brief Current monotonic time
+ * @return Milliseconds since an arbitrary fixed point
+ */
+double monotonic_ms (void);
+
+/**
+ * @brief Initialize an empty sample set
+ * @param set Pointer to the sample set
+ * @return void
+ */
+void sample_set_init (sample_set_t *set);
+
+/**
+ * @brief Record one sample
+ * @param set Pointer to the sample set
+ * @param value Sample value
+ * @return 0 on success, -1 on allocation failure
+ */
+int sample_set_add (sample_set_t *set, double value);
+
+/**
+ * @brief Nearest-rank percentile of the samples
+ * @param set Pointer to the sample set
+ * @param percentile Percentile in [0, 100]
+ * @return Percentile value, or 0 when the set is empty
+ * @note Sorts the samples on first use after an addition
+ */
+double sample_set_percentile (sample_set_t *set, double percentile);
+
+/**
+ * @brief Release a sample set
+ * @param set Pointer to the sample set
+ * @return void
+ */
+void sample_set_free (sample_set_t *set);
+
+#endif /* STATS_H */
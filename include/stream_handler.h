@@ -10,18 +10,85 @@
 #define STREAM_HANDLER_H
 
 #include "config.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include "sse_parser.h"
+#include "output_sink.h"
+#include "stats.h"
+
+/**
+ * @def STREAM_BUFFER_INITIAL_SIZE
+ * @brief Initial size of the streaming buffer
+ */
+#define STREAM_BUFFER_INITIAL_SIZE (16 * 1024)
+
+/**
+ * @def STREAM_BUFFER_MAX_SIZE
+ * @brief Upper bound on a single unterminated SSE line
+ */
+#define STREAM_BUFFER_MAX_SIZE (64 * 1024 * 1024)
 
 /**
  * @struct stream_context_t
  * @brief Context for handling streaming output
- * @var buffer Data buffer
- * @var buffer_len Current buffer length
+ * @var buffer Growable data buffer
+ * @var buffer_start Offset of the first unconsumed byte
+ * @var buffer_len Offset one past the last received byte
+ * @var buffer_capacity Allocated size of the buffer
  * @var show_tokens Whether to show token statistics
+ * @var sink Coalescing writer for the streamed answer
+ * @var parser SSE event parser
+ * @var done Whether the "[DONE]" sentinel has been received
+ * @var finish_reason Finish reason of the first choice
+ * @var has_usage Whether a usage object has been received
+ * @var prompt_tokens Prompt token count from usage
+ * @var completion_tokens Completion token count from usage
+ * @var total_tokens Total token count from usage
+ * @var cached_tokens Prompt tokens served from the server-side context cache
+ * @var request_start_ms When the request was sent
+ * @var first_token_ms When the first content delta arrived (0 before that)
+ * @var last_token_ms When the latest content delta arrived
+ * @var token_gaps Intervals between consecutive content deltas, in milliseconds
+ * @var capture_reply Whether streamed content is also kept in `reply`
+ * @var reply Streamed content received so far (when captured)
+ * @var reply_length Length of the captured content
+ * @var reply_capacity Allocated size of the reply buffer
+ * @var transfer Transfer the data arrives on (NULL when fed directly)
+ * @var status_code HTTP status of the response (0 until known)
+ * @var client Client whose cancel flag aborts the transfer (NULL when fed directly)
+ * @var muted Whether content is only captured, not written to the sink
+ * @var events Writer the answer goes through as NDJSON events (NULL for plain text)
+ * @var tool_calls Calls being assembled from delta.tool_calls (NULL to ignore them)
  */
 typedef struct {
-    char buffer[4096];   /**< Data buffer */
-    size_t buffer_len;   /**< Current buffer length */
-    int show_tokens;     /**< Whether to show token statistics */
+    char *buffer;           /**< Growable data buffer */
+    size_t buffer_start;    /**< Offset of the first unconsumed byte */
+    size_t buffer_len;      /**< Offset one past the last received byte */
+    size_t buffer_capacity; /**< Allocated size of the buffer */
+    int show_tokens;        /**< Whether to show token statistics */
+    output_sink_t sink;     /**< Coalescing writer for the streamed answer */
+    sse_parser_t parser;    /**< SSE event parser */
+    int done;               /**< Whether the "[DONE]" sentinel has been received */
+    char finish_reason[32]; /**< Finish reason of the first choice */
+    int has_usage;          /**< Whether a usage object has been received */
+    long prompt_tokens;     /**< Prompt token count from usage */
+    long completion_tokens; /**< Completion token count from usage */
+    long total_tokens;      /**< Total token count from usage */
+    long cached_tokens;     /**< Prompt tokens served from the server-side context cache */
+    double request_start_ms; /**< When the request was sent */
+    double first_token_ms;  /**< When the first content delta arrived (0 before that) */
+    double last_token_ms;   /**< When the latest content delta arrived */
+    sample_set_t token_gaps; /**< Intervals between consecutive content deltas, in milliseconds */
+    int capture_reply;      /**< Whether streamed content is also kept in `reply` */
+    char *reply;            /**< Streamed content received so far (when captured) */
+    size_t reply_length;    /**< Length of the captured content */
+    size_t reply_capacity;  /**< Allocated size of the reply buffer */
+    const http_transfer_t *transfer; /**< Transfer the data arrives on (NULL when fed directly) */
+    long status_code;       /**< HTTP status of the response (0 until known) */
+    const http_client_t *client; /**< Client whose cancel flag aborts the transfer (NULL when fed directly) */
+    int muted;              /**< Whether content is only captured, not written to the sink */
+    event_stream_t *events; /**< Writer the answer goes through as NDJSON events (NULL for plain text) */
+    struct tool_call_list *tool_calls; /**< Calls being assembled from delta.tool_calls (NULL to ignore them) */
 } stream_context_t;
 
 /**
@@ -39,17 +106,31 @@ size_t stream_data_callback (char *ptr, size_t size, size_t nmemb, void *userdat
  * @brief Process streamed data chunks
  * @param ctx Pointer to the streaming context
  * @return void
+ * @note Consumes every complete line in the buffer in place and leaves the
+ *       partial tail where it is; nothing is copied per callback
  */
 void process_stream_data (stream_context_t *ctx);
 
+/**
+ * @brief Consume what is left once the transfer has ended
+ * @param ctx Pointer to the streaming context
+ * @return void
+ * @note A final line or event may arrive without its terminator
+ */
+void finish_stream_data (stream_context_t *ctx);
+
 /**
  * @brief Execute a streaming chat request
+ * @param client Pointer to the reusable HTTP client
  * @param config Pointer to the API configuration structure
- * @param request_json JSON formatted request body string
- * @param show_tokens Whether to show token statistics
+ * @param request_json JSON formatted request body string (NULL with an upload)
+ * @param options Pointer to the run options (show_tokens, upload, async_output)
+ * @param reply_text Output parameter receiving the whole streamed answer
+ *                   (caller frees); NULL when it is not needed
  * @return 0 on success, -1 on failure
  */
-int execute_streaming_request (const api_config_t *config, const char *request_json,
-                           int show_tokens);
+int execute_streaming_request (http_client_t *client, const api_config_t *config,
+                               const char *request_json, const chat_run_options_t *options,
+                               char **reply_text);
 
 #endif /* STREAM_HANDLER_H */
\ No newline at end of file
@@ -0,0 +1,178 @@
+/**
+ * @file tools.h
+ * @brief Tool calling module header
+ * @note Offers local commands to the model as functions (--tools) and runs
+ *       the calls it makes until it answers
+ * @author Rouge Lin
+ * @date 2025-04-21
+ */
+
+#ifndef TOOLS_H
+#define TOOLS_H
+
+#include "config.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include "json_writer.h"
+#include <stddef.h>
+
+/**
+ * @def TOOL_MAX_CALLS
+ * @brief Most tool calls one answer may make
+ */
+#define TOOL_MAX_CALLS 32
+
+/**
+ * @def TOOL_MAX_WORKERS
+ * @brief Most tool commands run at once
+ */
+#define TOOL_MAX_WORKERS 8
+
+/**
+ * @def TOOL_MAX_ROUNDS
+ * @brief Most requests one question sends before giving up on a final answer
+ */
+#define TOOL_MAX_ROUNDS 8
+
+/**
+ * @def TOOL_OUTPUT_MAX
+ * @brief Bytes of a command's output kept as the tool result
+ */
+#define TOOL_OUTPUT_MAX (1024 * 1024)
+
+/**
+ * @struct tool_t
+ * @brief A local command offered to the model
+ * @var name Function name the model calls it by
+ * @var command Shell command run per call, with the arguments JSON on standard input
+ */
+typedef struct {
+    char *name;    /**< Function name the model calls it by */
+    char *command; /**< Shell command run per call, with the arguments JSON on standard input */
+} tool_t;
+
+/**
+ * @struct tool_set_t
+ * @brief Tools loaded from a --tools file
+ * @var tools Loaded tools
+ * @var tool_count Number of tools
+ * @var definitions Serialized "tools" array sent with every request
+ */
+typedef struct {
+    tool_t *tools;     /**< Loaded tools */
+    size_t tool_count; /**< Number of tools */
+    char *definitions; /**< Serialized "tools" array sent with every request */
+} tool_set_t;
+
+/**
+ * @struct tool_call_t
+ * @brief One call of an answer, assembled from streamed fragments
+ * @var id Call identifier chosen by the server
+ * @var name Function called
+ * @var arguments Arguments JSON assembled so far (NUL-terminated)
+ * @var arguments_length Length of the arguments
+ * @var arguments_capacity Allocated size of the arguments buffer
+ * @var output What the command printed, the tool result
+ * @var output_length Length of the output
+ * @var exit_status Exit status of the command (-1 if it could not run or was killed)
+ * @var elapsed_ms How long the command ran
+ */
+typedef struct {
+    char *id;                  /**< Call identifier chosen by the server */
+    char *name;                /**< Function called */
+    char *arguments;           /**< Arguments JSON assembled so far (NUL-terminated) */
+    size_t arguments_length;   /**< Length of the arguments */
+    size_t arguments_capacity; /**< Allocated size of the arguments buffer */
+    char *output;              /**< What the command printed, the tool result */
+    size_t output_length;      /**< Length of the output */
+    int exit_status;           /**< Exit status of the command (-1 if it could not run or was killed) */
+    double elapsed_ms;         /**< How long the command ran */
+} tool_call_t;
+
+/**
+ * @struct tool_call_list
+ * @brief Calls of one answer, by their index in the stream
+ * @var calls Calls, indexed as the server numbers them
+ * @var count One past the highest index seen
+ * @var failed Set when a call could not be stored; the list is then unusable
+ */
+typedef struct tool_call_list {
+    tool_call_t calls[TOOL_MAX_CALLS]; /**< Calls, indexed as the server numbers them */
+    size_t count;                      /**< One past the highest index seen */
+    int failed;                        /**< Set when a call could not be stored; the list is then unusable */
+} tool_call_list_t;
+
+/**
+ * @brief Load tool definitions from a file
+ * @param set Tool set to fill
+ * @param path JSON file holding an array of OpenAI-style definitions,
+ *             {"type":"function","function":{"name":...,"description":...,
+ *             "parameters":{...}},"command":"..."}, the "command" member
+ *             being stripped before the definitions are sent
+ * @return 0 on success, -1 on failure (reported on standard error)
+ */
+int tool_set_load (tool_set_t *set, const char *path);
+
+/**
+ * @brief Release a tool set
+ * @param set Tool set to release (may be zero-initialized)
+ * @return void
+ */
+void tool_set_free (tool_set_t *set);
+
+/**
+ * @brief Add the fragments of one streamed delta.tool_calls array
+ * @param list Calls being assembled
+ * @param deltas Raw JSON array from chat_chunk_t.tool_calls; strings are decoded in place
+ * @param length Length of the array text
+ * @return 0 on success, -1 on malformed input or allocation failure
+ * @note Each fragment is appended to its call where it sits in the event, so
+ *       assembling an answer's arguments is linear in their size; nothing
+ *       accumulated is scanned again
+ */
+int tool_calls_feed (tool_call_list_t *list, char *deltas, size_t length);
+
+/**
+ * @brief Release the calls of a list and empty it
+ * @param list Calls to release
+ * @return void
+ */
+void tool_calls_free (tool_call_list_t *list);
+
+/**
+ * @brief Run every call of a list on a pool of worker threads
+ * @param list Calls to run; their output and exit status are filled in
+ * @param set Tools the calls refer to
+ * @return void
+ * @note Up to TOOL_MAX_WORKERS commands run concurrently, each through
+ *       /bin/sh -c with the call's arguments on standard input. A call of an
+ *       unknown tool gets an error text as its result without running anything.
+ */
+void tool_calls_execute (tool_call_list_t *list, const tool_set_t *set);
+
+/**
+ * @brief Append an answer's calls and their results as follow-up messages
+ * @param writer Writer receiving the messages, each preceded by a comma
+ * @param list Executed calls
+ * @param content Text the answer came with (NULL or empty for none)
+ * @return void
+ */
+void tool_calls_write_messages (json_writer_t *writer, const tool_call_list_t *list,
+                                const char *content);
+
+/**
+ * @brief Ask a question with tools and run the calls until the model answers
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param params Request parameters of the first request (attachments still mapped)
+ * @param set Tools offered with every request
+ * @param options Run options of each request (streamed; the cache is not used)
+ * @return 0 once an answer without calls arrived, -1 otherwise
+ * @note Each request carries the whole exchange so far: the question, then
+ *       per round the assistant's calls and one "tool" message per result
+ */
+int run_tool_conversation (http_client_t *client, const api_config_t *config,
+                           const chat_request_params_t *params, const tool_set_t *set,
+                           const chat_run_options_t *options);
+
+#endif /* TOOLS_H */
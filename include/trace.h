@@ -0,0 +1,105 @@
+/**
+ * @file trace.h
+ * @brief Tracing module header
+ * @note Spans around the hot paths, reported by --stats and --trace-file.
+ *       The TRACE_* hooks compile to nothing unless ADS_ENABLE_TRACING is
+ *       defined (make trace), so regular builds pay nothing for them.
+ * @author Rouge Lin
+ * @date 2025-04-20
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <curl/curl.h>
+
+/**
+ * @def TRACE_MAX_SPANS
+ * @brief Most spans one run records; later ones are counted as dropped
+ */
+#define TRACE_MAX_SPANS 16384
+
+/**
+ * @enum trace_format_t
+ * @brief How the --stats summary is written
+ */
+typedef enum {
+    TRACE_FORMAT_NONE, /**< No summary (a trace file may still be written) */
+    TRACE_FORMAT_TEXT, /**< A table per span name */
+    TRACE_FORMAT_JSON  /**< One compact JSON object */
+} trace_format_t;
+
+#ifdef ADS_ENABLE_TRACING
+
+/**
+ * @def TRACE_AVAILABLE
+ * @brief Whether this build records spans
+ */
+# define TRACE_AVAILABLE 1
+/** @brief Open a span named by the variable it declares */
+# define TRACE_BEGIN(span) double span = trace_clock()
+/** @brief Close a span opened with TRACE_BEGIN and record it under a static name */
+# define TRACE_END(span, name) trace_record((name), span)
+/** @brief Record the phases of a finished libcurl transfer */
+# define TRACE_TRANSFER(curl_handle) trace_record_transfer(curl_handle)
+
+#else
+
+# define TRACE_AVAILABLE 0
+# define TRACE_BEGIN(span) ((void)0)
+# define TRACE_END(span, name) ((void)0)
+# define TRACE_TRANSFER(curl_handle) ((void)0)
+
+#endif /* ADS_ENABLE_TRACING */
+
+/**
+ * @brief Start recording spans
+ * @param format Summary written by trace_report (TRACE_FORMAT_NONE for none)
+ * @param path Chrome trace-event file written by trace_report (NULL for none)
+ * @return void
+ */
+void trace_start (trace_format_t format, const char *path);
+
+/**
+ * @brief Parse a --stats format name
+ * @param name "text" or "json"
+ * @param format Output parameter receiving the format
+ * @return 0 on success, -1 for an unknown name
+ */
+int parse_trace_format (const char *name, trace_format_t *format);
+
+/**
+ * @brief Timestamp opening a span
+ * @return Current monotonic time in milliseconds, 0 while not recording
+ */
+double trace_clock (void);
+
+/**
+ * @brief Record a span that ends now
+ * @param name Span name (a string literal; it is kept, not copied)
+ * @param start_ms Value trace_clock returned when the span opened
+ * @return void
+ * @note Safe to call from any thread
+ */
+void trace_record (const char *name, double start_ms);
+
+/**
+ * @brief Record the phases of a finished transfer as spans
+ * @param curl_handle Easy handle of the transfer
+ * @return void
+ * @note The phases come from curl_easy_getinfo: "dns", "connect", "tls",
+ *       "send" (up to pretransfer), "wait" (to the first response byte) and
+ *       "receive", all nested in one "http" span. Phases a reused
+ *       connection skipped are left out.
+ */
+void trace_record_transfer (CURL *curl_handle);
+
+/**
+ * @brief Write the summary on standard error and the trace file, once
+ * @param void
+ * @return void
+ * @note Registered with atexit by trace_start
+ */
+void trace_report (void);
+
+#endif /* TRACE_H */
@@ -28,6 +28,8 @@
  * @brief Output text to stdout in a streaming fashion
  * @param text_buffer Text buffer
  * @return void
+ * @note The text and its trailing newline go through an output sink, so a
+ *       whole answer costs a handful of write calls instead of one per byte
  */
 void stream_output (const char *text_buffer);
 
@@ -38,5 +40,13 @@ void stream_output (const char *text_buffer);
  */
 void trim_whitespace (char *string_buffer);
 
+/**
+ * @brief Create every missing directory along a path
+ * @param path Absolute directory path; modified during the call and restored
+ * @return 0 on success, -1 on failure (errno is set)
+ * @note New directories are readable by their owner only (mode 0700)
+ */
+int make_directories (char *path);
+
 
 #endif /* UTILS_H */
\ No newline at end of file
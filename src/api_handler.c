@@ -8,14 +8,22 @@
 
 #include "utils.h"
 #include "api_handler.h"
+#include "stream_handler.h"
+#include "sse_parser.h"
+#include "response_cache.h"
+#include "scheduler.h"
+#include "balancer.h"
+#include "stats.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
-#include <cjson/cJSON.h>
+#include <unistd.h>
 
 /*------------------------ API request handling module implementation ------------------------*/
 
 http_response_t *
-execute_chat_request (const api_config_t *config, const char *request_json)
+execute_chat_request (http_client_t *client, const api_config_t *config,
+                      const char *request_json, request_upload_t *upload)
 {
     http_response_t *response = calloc(1, sizeof(http_response_t));
     if (!response) {
@@ -23,19 +31,33 @@ execute_chat_request (const api_config_t *config, const char *request_json)
         return NULL;
     }
 
-    char auth_header[256];
-    int header_length = snprintf(auth_header, sizeof(auth_header),
-                                "Authorization: Bearer %s", config->api_key);
-    if (header_length >= (int)sizeof(auth_header)) {
-        fprintf(stderr, "Authorization header truncated\n");
-        SAFE_FREE(response);
-        return NULL;
-    }
+    CURLcode curl_status;
+    for (int attempt = 0; ; ++attempt) {
+        size_t endpoint_index = balancer_acquire(config->balancer, monotonic_ms());
+        curl_status = perform_http_post(client, config, &config->endpoints[endpoint_index],
+                                        request_json, upload, response);
+        double now_ms = monotonic_ms();
+        balancer_end(config->balancer, endpoint_index, curl_status, response->status_code,
+                     response->first_byte_ms, now_ms);
+        /* A streamed upload has consumed its input and cannot be sent again */
+        if (upload || !retry_is_transient(curl_status, response->status_code)) break;
 
-    CURLcode curl_status = perform_http_post(config->base_url, auth_header, request_json, response);
+        long delay_ms = retry_delay_ms(config, attempt, response->retry_after);
+        if (delay_ms < 0) break;
+        /* Another healthy endpoint takes the retry at once; backing off is for a lone endpoint */
+        if (balancer_has_alternative(config->balancer, endpoint_index, now_ms)) delay_ms = 0;
+        retry_announce(NULL, curl_status, response->status_code,
+                       attempt + 1, config->max_retries, delay_ms);
+        if (delay_ms > 0) retry_sleep_ms(delay_ms);
+        http_response_reset(response);
+    }
 
     if (curl_status != CURLE_OK) {
-        fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(curl_status));
+        if (curl_status == CURLE_ABORTED_BY_CALLBACK) {
+            fprintf(stderr, "Request cancelled\n");
+        } else {
+            fprintf(stderr, "HTTP request failed: %s\n", curl_easy_strerror(curl_status));
+        }
         SAFE_FREE(response->payload);
         SAFE_FREE(response);
         return NULL;
@@ -54,70 +76,206 @@ execute_chat_request (const api_config_t *config, const char *request_json)
 }
 
 chat_response_t *
-parse_chat_response (const http_response_t *http_res)
+parse_chat_response (http_response_t *http_res, arena_t *arena)
 {
     if (!http_res || !http_res->payload) {
         fprintf(stderr, "Received empty response\n");
         return NULL;
     }
 
-    cJSON *root_object = cJSON_Parse(http_res->payload);
-    if (!root_object) {
+    /* One pass over the payload; the strings are decoded where they sit */
+    TRACE_BEGIN(parse_span);
+    chat_chunk_t fields;
+    int scanned = parse_chat_chunk(http_res->payload, http_res->payload_size, &fields);
+    /* The span ends with the scan, so rejected payloads are recorded too */
+    TRACE_END(parse_span, "parse response");
+    if (scanned != 0) {
         fprintf(stderr, "JSON parsing failed\n");
         return NULL;
     }
 
-    cJSON *error_object = cJSON_GetObjectItem(root_object, "error");
-    if (error_object) {
-        cJSON *error_message = cJSON_GetObjectItem(error_object, "message");
-        fprintf(stderr, "API error: %s\n", 
-               cJSON_IsString(error_message) ? error_message->valuestring : "Unknown error");
-        cJSON_Delete(root_object);
+    if (fields.has_error && fields.error_message.start) {
+        fprintf(stderr, "API error: %.*s\n",
+                (int)fields.error_message.length, fields.error_message.start);
+        return NULL;
+    } else if (fields.has_error) {
+        fprintf(stderr, "API error: Unknown error\n");
+        return NULL;
+    }
+    if (!fields.content.start) {
+        fprintf(stderr, "Invalid content format\n");
         return NULL;
     }
 
-    chat_response_t *parsed_response = calloc(1, sizeof(chat_response_t));
+    chat_response_t *parsed_response = arena
+        ? arena_alloc(arena, sizeof(chat_response_t))
+        : malloc(sizeof(chat_response_t));
     if (!parsed_response) {
         perror("Memory allocation failed");
-        cJSON_Delete(root_object);
         return NULL;
     }
+    memset(parsed_response, 0, sizeof(chat_response_t));
 
-    cJSON *choices_array = cJSON_GetObjectItem(root_object, "choices");
-    if (!cJSON_IsArray(choices_array) || cJSON_GetArraySize(choices_array) == 0) {
-        fprintf(stderr, "Invalid choices array\n");
-        goto error;
+    /* Decoding never grows a string, so its terminator fits inside the raw text */
+    char *content = (char *)fields.content.start;
+    content[fields.content.length] = '\0';
+    parsed_response->content = content;
+
+    if (fields.has_usage) {
+        parsed_response->input_token_count = (int)fields.prompt_tokens;
+        parsed_response->output_token_count = (int)fields.completion_tokens;
+        parsed_response->total_token_count = (int)fields.total_tokens;
+        parsed_response->cache_hit_token_count = (int)fields.cached_tokens;
+        parsed_response->cache_miss_token_count = fields.cache_miss_tokens >= 0
+            ? (int)fields.cache_miss_tokens
+            : parsed_response->input_token_count - parsed_response->cache_hit_token_count;
     }
 
-    cJSON *first_choice = cJSON_GetArrayItem(choices_array, 0);
-    cJSON *message_object = cJSON_GetObjectItem(first_choice, "message");
-    cJSON *content_object = cJSON_GetObjectItem(message_object, "content");
-    if (!cJSON_IsString(content_object)) {
-        fprintf(stderr, "Invalid content format\n");
-        goto error;
+    return parsed_response;
+}
+
+/**
+ * @brief Write a complete answer as NDJSON events
+ * @param reply Answer text
+ * @param response Parsed response carrying the token usage (NULL when there is none)
+ * @param cached Whether the answer was replayed from the response cache
+ * @return void
+ * @note The events are those a stream of the answer would have produced,
+ *       with the whole text in a single delta
+ */
+static void
+write_reply_events (const char *reply, const chat_response_t *response, int cached)
+{
+    output_sink_t sink;
+    event_stream_t events;
+    fflush(stdout);
+    output_sink_init(&sink, STDOUT_FILENO, 0);
+    event_stream_init(&events, &sink);
+
+    event_stream_text(&events, "delta", reply, strlen(reply));
+    if (response) {
+        event_stream_usage(&events, response->input_token_count, response->output_token_count,
+                           response->total_token_count, response->cache_hit_token_count);
+    }
+    event_stream_done(&events, cached);
+
+    event_stream_free(&events);
+    output_sink_close(&sink);
+}
+
+/**
+ * @brief Send a non-streaming request and print its answer
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param request_json JSON formatted request body string
+ * @param options Pointer to the run options
+ * @param reply_text Output parameter receiving the answer text, or NULL
+ * @return 0 on success, -1 on failure
+ */
+static int
+print_chat_completion (http_client_t *client, const api_config_t *config,
+                       const char *request_json, const chat_run_options_t *options,
+                       char **reply_text)
+{
+    http_response_t *http_response = execute_chat_request(client, config, request_json,
+                                                          options->upload);
+    if (!http_response) return -1;
+
+    int result = -1;
+    arena_reset(&client->response_arena);
+    chat_response_t *chat_response = parse_chat_response(http_response, &client->response_arena);
+    if (chat_response && chat_response->content && options->format == OUTPUT_FORMAT_NDJSON) {
+        write_reply_events(chat_response->content, chat_response, 0);
+        if (reply_text) *reply_text = strdup(chat_response->content);
+        result = 0;
+    } else if (chat_response && chat_response->content) {
+        printf("%s", chat_response->content);
+        printf("\n");
+
+        if (options->show_tokens) {
+            printf("\nToken usage:\n  Input: %d\n  Cached: %d\n  Uncached: %d\n  Output: %d\n  Total: %d\n",
+                  chat_response->input_token_count,
+                  chat_response->cache_hit_token_count,
+                  chat_response->cache_miss_token_count,
+                  chat_response->output_token_count,
+                  chat_response->total_token_count);
+            if (chat_response->input_token_count > 0) {
+                printf("  Cache hit rate: %.1f%%\n", chat_response->cache_hit_token_count * 100.0
+                                                      / chat_response->input_token_count);
+            }
+        }
+        if (reply_text) *reply_text = strdup(chat_response->content);
+        result = 0;
+    } else {
+        fprintf(stderr, "Failed to get valid response\n");
     }
 
-    parsed_response->content = strdup(content_object->valuestring);
-    if (!parsed_response->content) {
-        perror("String duplication failed");
-        goto error;
+    SAFE_FREE(http_response->payload);
+    SAFE_FREE(http_response);
+    return result;
+}
+
+/**
+ * @brief Print an answer taken from the response cache
+ * @param reply Cached answer text
+ * @param show_tokens Whether to show token statistics
+ * @return void
+ */
+static void
+replay_cached_reply (const char *reply, int show_tokens)
+{
+    stream_output(reply);
+    if (show_tokens) {
+        printf("\nToken usage:\n  Served from cache (no tokens used)\n");
     }
+    fflush(stdout);
+}
+
+int
+run_chat_completion (http_client_t *client, const api_config_t *config,
+                     const char *request_json, const chat_run_options_t *options)
+{
+    if (options->reply_text) *options->reply_text = NULL;
 
-    cJSON *usage_object = cJSON_GetObjectItem(root_object, "usage");
-    if (usage_object) {
-        cJSON *input_tokens = cJSON_GetObjectItem(usage_object, "prompt_tokens");
-        cJSON *output_tokens = cJSON_GetObjectItem(usage_object, "completion_tokens");
-        cJSON *total_tokens = cJSON_GetObjectItem(usage_object, "total_tokens");
-        parsed_response->input_token_count = input_tokens ? input_tokens->valueint : 0;
-        parsed_response->output_token_count = output_tokens ? output_tokens->valueint : 0;
-        parsed_response->total_token_count = total_tokens ? total_tokens->valueint : 0;
+    int use_cache = options->use_cache && config->cache_ttl > 0 && !options->upload;
+    if (use_cache) {
+        char *cached_reply = response_cache_lookup(config, request_json);
+        if (cached_reply) {
+            if (options->format == OUTPUT_FORMAT_NDJSON) {
+                write_reply_events(cached_reply, NULL, 1);
+            } else {
+                replay_cached_reply(cached_reply, options->show_tokens);
+            }
+            if (options->reply_text) {
+                *options->reply_text = cached_reply;
+            } else {
+                SAFE_FREE(cached_reply);
+            }
+            return 0;
+        }
     }
 
-    cJSON_Delete(root_object);
-    return parsed_response;
+    char *reply_text = NULL;
+    char **reply_target = (options->reply_text || use_cache) ? &reply_text : NULL;
+    int result;
+    if (options->stream) {
+        fflush(stdout);
+        result = execute_streaming_request(client, config, request_json,
+                                           options, reply_target);
+        /* Every event already ends its line */
+        if (options->format != OUTPUT_FORMAT_NDJSON) printf("\n");
+    } else {
+        result = print_chat_completion(client, config, request_json,
+                                       options, reply_target);
+    }
 
-error:
-    cJSON_Delete(root_object);
-    SAFE_FREE(parsed_response);
-    return NULL;
+    if (result == 0 && use_cache && reply_text && reply_text[0] != '\0') {
+        response_cache_store(config, request_json, reply_text);
+    }
+    if (options->reply_text) {
+        *options->reply_text = reply_text;
+    } else {
+        SAFE_FREE(reply_text);
+    }
+    return result;
 }
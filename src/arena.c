@@ -0,0 +1,94 @@
+/**
+ * @file arena.c
+ * @brief Arena allocator module implementation
+ * @author Rouge Lin
+ * @date 2025-04-22
+ */
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+
+/* Block headers are padded so the first allocation of a block is aligned */
+#define ARENA_ALIGNMENT alignof(max_align_t)
+#define ARENA_HEADER_SIZE ((sizeof(arena_block_t) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+static char *
+block_data (arena_block_t *block)
+{
+    return (char *)block + ARENA_HEADER_SIZE;
+}
+
+void
+arena_init (arena_t *arena, size_t block_size)
+{
+    arena->blocks = NULL;
+    arena->current = NULL;
+    arena->block_size = block_size > 0 ? block_size : ARENA_BLOCK_SIZE;
+}
+
+static arena_block_t *
+append_block (arena_t *arena, size_t size)
+{
+    size_t block_size = size > arena->block_size ? size : arena->block_size;
+    arena_block_t *block = malloc(ARENA_HEADER_SIZE + block_size);
+    if (!block) return NULL;
+
+    block->next = NULL;
+    block->size = block_size;
+    block->used = 0;
+    arena_block_t **link = &arena->blocks;
+    while (*link) link = &(*link)->next;
+    *link = block;
+    return block;
+}
+
+void *
+arena_alloc (arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (size == 0) size = ARENA_ALIGNMENT;
+
+    arena_block_t *block = arena->current ? arena->current : arena->blocks;
+    /* Blocks past the current one are empty since the last reset */
+    while (block && block->size - block->used < size) block = block->next;
+    if (!block && !(block = append_block(arena, size))) return NULL;
+
+    arena->current = block;
+    void *pointer = block_data(block) + block->used;
+    block->used += size;
+    return pointer;
+}
+
+char *
+arena_strndup (arena_t *arena, const char *text, size_t length)
+{
+    char *copy = arena_alloc(arena, length + 1);
+    if (!copy) return NULL;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+void
+arena_reset (arena_t *arena)
+{
+    for (arena_block_t *block = arena->blocks; block; block = block->next) {
+        block->used = 0;
+    }
+    arena->current = arena->blocks;
+}
+
+void
+arena_free (arena_t *arena)
+{
+    arena_block_t *block = arena->blocks;
+    while (block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->current = NULL;
+}
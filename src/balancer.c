@@ -0,0 +1,168 @@
+/**
+ * @file balancer.c
+ * @brief Endpoint balancer implementation
+ * @author Rouge Lin
+ * @date 2025-04-15
+ */
+
+#include "balancer.h"
+#include "scheduler.h"
+#include <stdlib.h>
+
+/*------------------------ Endpoint balancer ------------------------*/
+
+balancer_t *
+balancer_create (const api_endpoint_t *endpoints, size_t count, balance_policy_t policy)
+{
+    balancer_t *balancer = calloc(1, sizeof(balancer_t));
+    if (!balancer) return NULL;
+
+    balancer->states = calloc(count, sizeof(endpoint_state_t));
+    if (!balancer->states || pthread_mutex_init(&balancer->lock, NULL) != 0) {
+        free(balancer->states);
+        free(balancer);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        balancer->states[i].weight = (double)endpoints[i].weight;
+    }
+    balancer->count = count;
+    balancer->policy = policy;
+    return balancer;
+}
+
+void
+balancer_destroy (balancer_t *balancer)
+{
+    if (!balancer) return;
+    pthread_mutex_destroy(&balancer->lock);
+    free(balancer->states);
+    free(balancer);
+}
+
+static double
+endpoint_score (const balancer_t *balancer, const endpoint_state_t *state)
+{
+    double load = (state->outstanding + 1) / state->weight;
+    return balancer->policy == BALANCE_EWMA ? state->latency_ms * load : load;
+}
+
+/* Whether endpoint `a` should be tried before endpoint `b` */
+static int
+ranks_before (const balancer_t *balancer, size_t a, size_t b, double now_ms)
+{
+    const endpoint_state_t *first = &balancer->states[a];
+    const endpoint_state_t *second = &balancer->states[b];
+    int first_ejected = first->ejected_until_ms > now_ms;
+    int second_ejected = second->ejected_until_ms > now_ms;
+
+    if (first_ejected != second_ejected) return second_ejected;
+    if (first_ejected) return first->ejected_until_ms < second->ejected_until_ms;
+
+    double first_score = endpoint_score(balancer, first);
+    double second_score = endpoint_score(balancer, second);
+    if (first_score != second_score) return first_score < second_score;
+
+    /* Equal scores take turns, starting after the endpoint chosen last */
+    size_t first_turn = (a + balancer->count - balancer->cursor) % balancer->count;
+    size_t second_turn = (b + balancer->count - balancer->cursor) % balancer->count;
+    return first_turn < second_turn;
+}
+
+static void
+rank_locked (balancer_t *balancer, double now_ms, size_t *order)
+{
+    /* Endpoint lists are short, so an insertion sort is plenty */
+    for (size_t i = 0; i < balancer->count; ++i) {
+        size_t j = i;
+        while (j > 0 && ranks_before(balancer, i, order[j - 1], now_ms)) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+void
+balancer_rank (balancer_t *balancer, double now_ms, size_t *order)
+{
+    pthread_mutex_lock(&balancer->lock);
+    rank_locked(balancer, now_ms, order);
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+static void
+begin_locked (balancer_t *balancer, size_t index)
+{
+    balancer->states[index].outstanding++;
+    balancer->cursor = (index + 1) % balancer->count;
+}
+
+size_t
+balancer_acquire (balancer_t *balancer, double now_ms)
+{
+    size_t best = 0;
+    pthread_mutex_lock(&balancer->lock);
+    for (size_t i = 1; i < balancer->count; ++i) {
+        if (ranks_before(balancer, i, best, now_ms)) best = i;
+    }
+    begin_locked(balancer, best);
+    pthread_mutex_unlock(&balancer->lock);
+    return best;
+}
+
+void
+balancer_begin (balancer_t *balancer, size_t index)
+{
+    pthread_mutex_lock(&balancer->lock);
+    begin_locked(balancer, index);
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+void
+balancer_end (balancer_t *balancer, size_t index, CURLcode transfer_result,
+              long status_code, double first_byte_ms, double now_ms)
+{
+    int failed = retry_is_transient(transfer_result, status_code) ||
+                 transfer_result == CURLE_OPERATION_TIMEDOUT;
+
+    pthread_mutex_lock(&balancer->lock);
+    endpoint_state_t *state = &balancer->states[index];
+    if (state->outstanding > 0) state->outstanding--;
+
+    if (failed) {
+        long eject_ms = ENDPOINT_EJECT_BASE_MS;
+        for (int i = 0; i < state->failures && eject_ms < ENDPOINT_EJECT_MAX_MS; ++i) eject_ms *= 2;
+        if (eject_ms > ENDPOINT_EJECT_MAX_MS) eject_ms = ENDPOINT_EJECT_MAX_MS;
+        state->failures++;
+        state->ejected_until_ms = now_ms + eject_ms;
+    } else {
+        state->failures = 0;
+        state->ejected_until_ms = 0;
+        if (first_byte_ms > 0) {
+            state->latency_ms = state->latency_ms == 0 ? first_byte_ms
+                              : state->latency_ms + ENDPOINT_EWMA_WEIGHT * (first_byte_ms - state->latency_ms);
+        }
+    }
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+void
+balancer_release (balancer_t *balancer, size_t index)
+{
+    pthread_mutex_lock(&balancer->lock);
+    if (balancer->states[index].outstanding > 0) balancer->states[index].outstanding--;
+    pthread_mutex_unlock(&balancer->lock);
+}
+
+int
+balancer_has_alternative (balancer_t *balancer, size_t index, double now_ms)
+{
+    int found = 0;
+    pthread_mutex_lock(&balancer->lock);
+    for (size_t i = 0; i < balancer->count && !found; ++i) {
+        found = i != index && balancer->states[i].ejected_until_ms <= now_ms;
+    }
+    pthread_mutex_unlock(&balancer->lock);
+    return found;
+}
@@ -0,0 +1,619 @@
+/**
+ * @file batch_handler.c
+ * @brief Batch request implementation
+ * @note Drives concurrent non-streaming requests through curl_multi
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#include "batch_handler.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include "utils.h"
+#include "scheduler.h"
+#include "balancer.h"
+#include "stats.h"
+#include "trace.h"
+#include "json_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <cjson/cJSON.h>
+
+/**
+ * @enum batch_slot_state_t
+ * @brief What a batch slot is currently doing
+ */
+typedef enum {
+    BATCH_SLOT_IDLE,    /**< No job assigned */
+    BATCH_SLOT_WAITING, /**< Job prepared, waiting for its start time and the rate limiter */
+    BATCH_SLOT_ACTIVE   /**< Transfer added to the multi handle */
+} batch_slot_state_t;
+
+/**
+ * @struct batch_slot_t
+ * @brief One in-flight transfer of the batch engine
+ * @var easy_handle CURL easy handle reused for every job run in this slot
+ * @var response Response container for the current job
+ * @var request_json Request body of the current job
+ * @var body Request body as sent, possibly gzip-encoded
+ * @var job_index Index of the current job in the job array
+ * @var endpoint Endpoint the current attempt is sent to
+ * @var state What the slot is currently doing
+ * @var attempts Retries already made for the current job
+ * @var start_at_ms Monotonic time before which a waiting job is not started
+ * @var launched_ms Monotonic time the current attempt was added to the multi handle
+ * @var estimated_tokens Tokens the current job is expected to consume
+ * @var arena Memory of the current job (request body, parsed response, result
+ *            line), reset when the slot takes its next job
+ */
+typedef struct {
+    CURL *easy_handle;        /**< CURL easy handle reused for every job run in this slot */
+    http_response_t response; /**< Response container for the current job */
+    char *request_json;       /**< Request body of the current job */
+    request_body_t body;      /**< Request body as sent, possibly gzip-encoded */
+    size_t job_index;         /**< Index of the current job in the job array */
+    size_t endpoint;          /**< Endpoint the current attempt is sent to */
+    batch_slot_state_t state; /**< What the slot is currently doing */
+    int attempts;             /**< Retries already made for the current job */
+    double start_at_ms;       /**< Monotonic time before which a waiting job is not started */
+    double launched_ms;       /**< Monotonic time the current attempt was added to the multi handle */
+    long estimated_tokens;    /**< Tokens the current job is expected to consume */
+    arena_t arena;            /**< Memory of the current job, reset when the slot takes its next job */
+} batch_slot_t;
+
+/*------------------------ Batch input loading ------------------------*/
+
+static char *
+arena_strdup (arena_t *arena, const char *text)
+{
+    return arena_strndup(arena, text, strlen(text));
+}
+
+static char *
+dup_json_string (arena_t *arena, const cJSON *object, const char *key)
+{
+    cJSON *item = cJSON_GetObjectItemCaseSensitive(object, key);
+    return cJSON_IsString(item) ? arena_strdup(arena, item->valuestring) : NULL;
+}
+
+int
+load_batch_jobs (const char *batch_path, arena_t *arena,
+                 batch_job_t **job_array, size_t *job_count)
+{
+    int use_stdin = strcmp(batch_path, "-") == 0;
+    FILE *batch_file = use_stdin ? stdin : fopen(batch_path, "r");
+    if (!batch_file) {
+        perror("Failed to open batch file");
+        return -1;
+    }
+
+    batch_job_t *jobs = NULL;
+    size_t count = 0, capacity = 0, line_number = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int failed = 0;
+
+    while (getline(&line, &line_capacity, batch_file) != -1) {
+        line_number++;
+        trim_whitespace(line);
+        if (line[0] == '\0') continue;
+
+        cJSON *root = cJSON_Parse(line);
+        cJSON *query = cJSON_GetObjectItemCaseSensitive(root, "query");
+        if (!cJSON_IsString(query)) {
+            fprintf(stderr, "Batch line %zu: expected an object with a \"query\" string\n",
+                    line_number);
+            cJSON_Delete(root);
+            failed = 1;
+            break;
+        }
+
+        if (count == capacity) {
+            /* Outgrown arrays stay in the arena; together they are smaller than the last one */
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            batch_job_t *new_jobs = arena_alloc(arena, new_capacity * sizeof(batch_job_t));
+            if (!new_jobs) {
+                perror("Memory allocation failed");
+                cJSON_Delete(root);
+                failed = 1;
+                break;
+            }
+            if (count > 0) memcpy(new_jobs, jobs, count * sizeof(batch_job_t));
+            jobs = new_jobs;
+            capacity = new_capacity;
+        }
+
+        batch_job_t *job = &jobs[count++];
+        memset(job, 0, sizeof(*job));
+        job->query = arena_strdup(arena, query->valuestring);
+        job->system_prompt = dup_json_string(arena, root, "system");
+
+        cJSON *id = cJSON_GetObjectItemCaseSensitive(root, "id");
+        if (cJSON_IsString(id)) {
+            job->id = arena_strdup(arena, id->valuestring);
+        } else {
+            char id_buffer[32];
+            snprintf(id_buffer, sizeof(id_buffer), "%d",
+                     cJSON_IsNumber(id) ? id->valueint : (int)line_number);
+            job->id = arena_strdup(arena, id_buffer);
+        }
+        cJSON_Delete(root);
+
+        if (!job->query || !job->id) {
+            perror("Memory allocation failed");
+            failed = 1;
+            break;
+        }
+    }
+
+    if (!failed && ferror(batch_file)) {
+        perror("Error reading batch file");
+        failed = 1;
+    }
+
+    free(line);
+    if (!use_stdin) fclose(batch_file);
+    if (failed) return -1;
+
+    *job_array = jobs;
+    *job_count = count;
+    return 0;
+}
+
+/*------------------------ Batch result output ------------------------*/
+
+static int
+write_result_file (const char *output_dir, const char *id, const char *content)
+{
+    char file_path[PATH_MAX];
+    int path_length = snprintf(file_path, sizeof(file_path), "%s/%s.txt", output_dir, id);
+    if (path_length >= (int)sizeof(file_path)) {
+        fprintf(stderr, "[%s] Output path too long\n", id);
+        return -1;
+    }
+    /* Keep ids from escaping the output directory */
+    for (char *cursor = file_path + strlen(output_dir) + 1; *cursor; ++cursor) {
+        if (*cursor == '/') *cursor = '_';
+    }
+
+    FILE *output_file = fopen(file_path, "w");
+    if (!output_file) {
+        fprintf(stderr, "[%s] Failed to open %s: %s\n", id, file_path, strerror(errno));
+        return -1;
+    }
+    fputs(content, output_file);
+    fputc('\n', output_file);
+    return fclose(output_file) == 0 ? 0 : -1;
+}
+
+/* Braces, keys and numbers of a result line, on top of its escaped strings */
+#define RESULT_LINE_OVERHEAD 256
+
+static void
+write_usage_member (json_writer_t *writer, const char *key, long value)
+{
+    json_writer_raw(writer, ",", 1);
+    json_writer_key(writer, key);
+    json_writer_integer(writer, value);
+}
+
+/* One JSONL result line, written in the slot's arena */
+static void
+emit_result_json (arena_t *arena, const char *id, long status_code,
+                  const chat_response_t *chat_response, const char *error_message)
+{
+    const char *text = chat_response ? chat_response->content : error_message;
+    size_t id_length = strlen(id), text_length = strlen(text);
+    json_writer_t writer;
+    if (json_writer_init_arena(&writer, RESULT_LINE_OVERHEAD + json_escaped_length(id, id_length) +
+                               json_escaped_length(text, text_length), arena) != 0) {
+        return;
+    }
+
+    json_writer_raw(&writer, "{", 1);
+    json_writer_key(&writer, "id");
+    json_writer_string(&writer, id, id_length);
+    json_writer_raw(&writer, ",", 1);
+    json_writer_key(&writer, "status");
+    json_writer_integer(&writer, status_code);
+    json_writer_raw(&writer, ",", 1);
+    json_writer_key(&writer, chat_response ? "content" : "error");
+    json_writer_string(&writer, text, text_length);
+    if (chat_response) {
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "usage");
+        json_writer_raw(&writer, "{", 1);
+        json_writer_key(&writer, "prompt_tokens");
+        json_writer_integer(&writer, chat_response->input_token_count);
+        write_usage_member(&writer, "completion_tokens", chat_response->output_token_count);
+        write_usage_member(&writer, "total_tokens", chat_response->total_token_count);
+        write_usage_member(&writer, "prompt_cache_hit_tokens", chat_response->cache_hit_token_count);
+        write_usage_member(&writer, "prompt_cache_miss_tokens", chat_response->cache_miss_token_count);
+        json_writer_raw(&writer, "}", 1);
+    }
+    json_writer_raw(&writer, "}\n", 2);
+
+    char *json_output = json_writer_finish(&writer);
+    if (json_output) {
+        fputs(json_output, stdout);
+        fflush(stdout);
+    }
+}
+
+/*------------------------ Batch transfer engine ------------------------*/
+
+static int
+prepare_batch_job (const api_config_t *config, batch_slot_t *slot,
+                   const batch_job_t *job, size_t job_index, double now_ms)
+{
+    chat_request_params_t request_params = {
+        .user_query = job->query,
+        .custom_prompt = job->system_prompt
+    };
+
+    /* Everything the previous job left in the arena goes in one reset */
+    arena_reset(&slot->arena);
+    slot->request_json = construct_request_json(config, &request_params, 0, &slot->arena);
+    if (!slot->request_json) {
+        emit_result_json(&slot->arena, job->id, 0, NULL, "Failed to construct request JSON");
+        return -1;
+    }
+
+    /* Roughly four bytes of JSON per prompt token; settled once usage is known */
+    slot->estimated_tokens = (long)(strlen(slot->request_json) / 4) + 1;
+    request_body_init(&slot->body, config, slot->request_json);
+    slot->job_index = job_index;
+    slot->attempts = 0;
+    slot->start_at_ms = now_ms;
+    slot->state = BATCH_SLOT_WAITING;
+    return 0;
+}
+
+static int
+assign_next_job (const api_config_t *config, batch_slot_t *slot,
+                 const batch_job_t *jobs, size_t job_count, size_t *next_job,
+                 int *failures)
+{
+    slot->state = BATCH_SLOT_IDLE;
+    while (*next_job < job_count) {
+        size_t job_index = (*next_job)++;
+        if (prepare_batch_job(config, slot, &jobs[job_index], job_index, monotonic_ms()) == 0) {
+            return 1;
+        }
+        (*failures)++;
+    }
+    return 0;
+}
+
+/* Pick the best endpoint whose quota allows the job; returns 0 or the wait */
+static long
+choose_batch_endpoint (const api_config_t *config, rate_limiter_t *limiters,
+                       size_t *order, batch_slot_t *slot, double now_ms)
+{
+    long shortest_wait = -1;
+    balancer_rank(config->balancer, now_ms, order);
+    for (size_t i = 0; i < config->endpoint_count; ++i) {
+        long wait_ms = rate_limiter_acquire(&limiters[order[i]], now_ms, slot->estimated_tokens);
+        if (wait_ms == 0) {
+            slot->endpoint = order[i];
+            return 0;
+        }
+        if (shortest_wait < 0 || wait_ms < shortest_wait) shortest_wait = wait_ms;
+    }
+    return shortest_wait;
+}
+
+static int
+launch_batch_job (const api_config_t *config, CURLM *multi_handle,
+                  batch_slot_t *slot, const batch_job_t *job)
+{
+    /* The slot's response buffer is kept across jobs and only grows */
+    http_response_reset(&slot->response);
+
+    const api_endpoint_t *endpoint = &config->endpoints[slot->endpoint];
+    setup_http_post(slot->easy_handle, endpoint->url, endpoint->headers[slot->body.compressed],
+                    &slot->body, &slot->response);
+    setup_http_timeouts(slot->easy_handle, config);
+    if (curl_multi_add_handle(multi_handle, slot->easy_handle) != CURLM_OK) {
+        emit_result_json(&slot->arena, job->id, 0, NULL, "Failed to schedule transfer");
+        request_body_free(&slot->body);
+        slot->request_json = NULL;
+        return -1;
+    }
+    balancer_begin(config->balancer, slot->endpoint);
+    slot->launched_ms = monotonic_ms();
+    slot->state = BATCH_SLOT_ACTIVE;
+    return 0;
+}
+
+/* Take a transfer off the multi handle, recording its status and first-byte time */
+static batch_slot_t *
+detach_batch_slot (CURLM *multi_handle, CURL *easy_handle, curl_off_t *first_byte_us)
+{
+    batch_slot_t *slot = NULL;
+    curl_easy_getinfo(easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+    curl_easy_getinfo(easy_handle, CURLINFO_RESPONSE_CODE, &slot->response.status_code);
+    *first_byte_us = 0;
+    curl_easy_getinfo(easy_handle, CURLINFO_STARTTRANSFER_TIME_T, first_byte_us);
+    TRACE_TRANSFER(easy_handle);
+    curl_multi_remove_handle(multi_handle, easy_handle);
+    return slot;
+}
+
+/*
+ * When an active transfer runs out of time for its first body byte; 0 when no
+ * deadline applies. It counts from the request being sent, so time spent
+ * waiting for a connection another slot is opening (PIPEWAIT) is not charged.
+ */
+static double
+first_byte_deadline_ms (const api_config_t *config, const batch_slot_t *slot)
+{
+    if (config->first_byte_timeout_ms <= 0 || slot->state != BATCH_SLOT_ACTIVE ||
+        slot->response.payload_size > 0) {
+        return 0;
+    }
+    curl_off_t sent_us = 0;
+    curl_easy_getinfo(slot->easy_handle, CURLINFO_PRETRANSFER_TIME_T, &sent_us);
+    if (sent_us <= 0) return 0;
+    return slot->launched_ms + sent_us / 1000.0 + config->first_byte_timeout_ms;
+}
+
+/*
+ * The next transfer that ended, else the next one still without a body byte
+ * past FIRST_BYTE_TIMEOUT_MS (ended here as a timeout); NULL when there is none
+ */
+static batch_slot_t *
+next_finished_slot (const api_config_t *config, CURLM *multi_handle,
+                    batch_slot_t *slots, int concurrency,
+                    CURLcode *transfer_result, curl_off_t *first_byte_us)
+{
+    CURLMsg *message;
+    int messages_left;
+    while ((message = curl_multi_info_read(multi_handle, &messages_left)) != NULL) {
+        if (message->msg != CURLMSG_DONE) continue;
+        *transfer_result = message->data.result;
+        return detach_batch_slot(multi_handle, message->easy_handle, first_byte_us);
+    }
+
+    double now_ms = monotonic_ms();
+    for (int i = 0; i < concurrency; ++i) {
+        batch_slot_t *slot = &slots[i];
+        double deadline_ms = first_byte_deadline_ms(config, slot);
+        if (deadline_ms > 0 && deadline_ms <= now_ms) {
+            *transfer_result = CURLE_OPERATION_TIMEDOUT;
+            return detach_batch_slot(multi_handle, slot->easy_handle, first_byte_us);
+        }
+    }
+    return NULL;
+}
+
+static int
+finish_batch_job (batch_slot_t *slot, const batch_job_t *job,
+                  CURLcode transfer_result, const char *output_dir, char **answers,
+                  long *used_tokens)
+{
+    int result = -1;
+    char error_message[256];
+    chat_response_t *chat_response = NULL;
+
+    *used_tokens = 0;
+    if (transfer_result != CURLE_OK) {
+        snprintf(error_message, sizeof(error_message), "HTTP request failed: %s",
+                 curl_easy_strerror(transfer_result));
+    } else if (slot->response.status_code != 200) {
+        snprintf(error_message, sizeof(error_message), "HTTP error %ld: %s",
+                 slot->response.status_code,
+                 slot->response.payload ? slot->response.payload : "No response content");
+    } else if ((chat_response = parse_chat_response(&slot->response, &slot->arena)) == NULL) {
+        snprintf(error_message, sizeof(error_message), "Failed to get valid response");
+    } else {
+        *used_tokens = chat_response->total_token_count;
+        result = 0;
+    }
+
+    if (answers && result == 0) {
+        answers[slot->job_index] = strdup(chat_response->content);
+        if (!answers[slot->job_index]) {
+            fprintf(stderr, "[%s] Memory allocation failed\n", job->id);
+            result = -1;
+        }
+    } else if (output_dir || answers) {
+        if (result == 0) {
+            result = write_result_file(output_dir, job->id, chat_response->content);
+        } else {
+            fprintf(stderr, "[%s] %s\n", job->id, error_message);
+        }
+    } else {
+        emit_result_json(&slot->arena, job->id, slot->response.status_code,
+                         chat_response, error_message);
+    }
+
+    request_body_free(&slot->body);
+    slot->request_json = NULL;
+    return result;
+}
+
+/* Queue a failed transfer again if it is transient and retries remain */
+static int
+requeue_batch_job (const api_config_t *config, rate_limiter_t *limiter,
+                   batch_slot_t *slot, const batch_job_t *job,
+                   CURLcode transfer_result, double now_ms)
+{
+    /* A deadline that passed before any body byte arrived is retried like a lost connection */
+    int silent_timeout = transfer_result == CURLE_OPERATION_TIMEDOUT &&
+                         slot->response.payload_size == 0;
+    if (!silent_timeout && !retry_is_transient(transfer_result, slot->response.status_code)) {
+        return 0;
+    }
+
+    curl_off_t retry_after = 0;
+    if (transfer_result == CURLE_OK) {
+        curl_easy_getinfo(slot->easy_handle, CURLINFO_RETRY_AFTER, &retry_after);
+    }
+    long delay_ms = retry_delay_ms(config, slot->attempts, (long)retry_after);
+    if (delay_ms < 0) return 0;
+
+    /* A refused request spent no tokens; a 429 holds back every slot on that endpoint */
+    rate_limiter_settle(limiter, slot->estimated_tokens, 0);
+    if (slot->response.status_code == 429) rate_limiter_pause(limiter, now_ms + delay_ms);
+
+    /* Another healthy endpoint can take the retry straight away */
+    if (balancer_has_alternative(config->balancer, slot->endpoint, now_ms)) delay_ms = 0;
+
+    slot->attempts++;
+    retry_announce(job->id, transfer_result, slot->response.status_code,
+                   slot->attempts, config->max_retries, delay_ms);
+    slot->start_at_ms = now_ms + delay_ms;
+    slot->state = BATCH_SLOT_WAITING;
+    return 1;
+}
+
+int
+run_batch_requests (http_client_t *client, const api_config_t *config,
+                    const batch_job_t *jobs, size_t job_count,
+                    int concurrency, const char *output_dir, char **answers)
+{
+    if (concurrency < 1) concurrency = 1;
+    if (job_count > 0 && (size_t)concurrency > job_count) concurrency = (int)job_count;
+
+    if (output_dir && mkdir(output_dir, 0755) != 0 && errno != EEXIST) {
+        perror("Failed to create output directory");
+        return -1;
+    }
+
+    size_t endpoint_count = config->endpoint_count;
+    rate_limiter_t *limiters = calloc(endpoint_count, sizeof(rate_limiter_t));
+    size_t *endpoint_order = calloc(endpoint_count, sizeof(size_t));
+    CURLM *multi_handle = curl_multi_init();
+    batch_slot_t *slots = calloc((size_t)concurrency, sizeof(batch_slot_t));
+    int setup_failed = !limiters || !endpoint_order || !multi_handle || !slots;
+
+    for (size_t e = 0; !setup_failed && e < endpoint_count; ++e) {
+        /* Each endpoint enforces its own quota */
+        rate_limiter_init(&limiters[e], config, monotonic_ms());
+    }
+
+    if (setup_failed) {
+        fprintf(stderr, "Failed to initialize batch transfer engine\n");
+        free(limiters);
+        free(endpoint_order);
+        if (multi_handle) curl_multi_cleanup(multi_handle);
+        free(slots);
+        return -1;
+    }
+    /* Over HTTP/2 every slot shares one connection instead of opening its own */
+    curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    http_client_finish_prewarm(client);
+
+    int failures = 0, busy_slots = 0;
+    size_t next_job = 0;
+
+    for (int i = 0; i < concurrency; ++i) {
+        slots[i].easy_handle = curl_easy_init();
+        if (!slots[i].easy_handle) {
+            setup_failed = 1;
+            break;
+        }
+        arena_init(&slots[i].arena, 0);
+        curl_easy_setopt(slots[i].easy_handle, CURLOPT_PRIVATE, &slots[i]);
+        curl_easy_setopt(slots[i].easy_handle, CURLOPT_SHARE, client->share_handle);
+    }
+
+    for (int i = 0; !setup_failed && i < concurrency; ++i) {
+        busy_slots += assign_next_job(config, &slots[i], jobs, job_count, &next_job, &failures);
+    }
+
+    while (!setup_failed && busy_slots > 0) {
+        /* Start every waiting job whose backoff has passed and the quota allows */
+        double now_ms = monotonic_ms();
+        long poll_timeout_ms = 1000;
+        for (int i = 0; i < concurrency; ++i) {
+            batch_slot_t *slot = &slots[i];
+            double deadline_ms = first_byte_deadline_ms(config, slot);
+            if (deadline_ms > 0) {
+                /* Wake when the first-byte deadline passes even if the socket stays silent */
+                long remaining_ms = deadline_ms > now_ms ? (long)(deadline_ms - now_ms) + 1 : 0;
+                if (remaining_ms < poll_timeout_ms) poll_timeout_ms = remaining_ms;
+            }
+            if (slot->state != BATCH_SLOT_WAITING) continue;
+
+            long wait_ms = slot->start_at_ms > now_ms
+                         ? (long)(slot->start_at_ms - now_ms) + 1
+                         : choose_batch_endpoint(config, limiters, endpoint_order, slot, now_ms);
+            if (wait_ms == 0) {
+                if (launch_batch_job(config, multi_handle,
+                                     slot, &jobs[slot->job_index]) == 0) {
+                    continue;
+                }
+                failures++;
+                busy_slots--;
+                busy_slots += assign_next_job(config, slot, jobs, job_count, &next_job, &failures);
+                wait_ms = 1;
+            } else {
+                slot->start_at_ms = now_ms + wait_ms;
+            }
+            if (wait_ms < poll_timeout_ms) poll_timeout_ms = wait_ms;
+        }
+
+        int still_running = 0;
+        CURLMcode multi_status = curl_multi_perform(multi_handle, &still_running);
+        if (multi_status != CURLM_OK) {
+            fprintf(stderr, "Batch transfer failed: %s\n", curl_multi_strerror(multi_status));
+            setup_failed = 1;
+            break;
+        }
+
+        batch_slot_t *slot;
+        CURLcode transfer_result;
+        curl_off_t first_byte_us;
+        while ((slot = next_finished_slot(config, multi_handle, slots, concurrency,
+                                          &transfer_result, &first_byte_us)) != NULL) {
+            double finished_ms = monotonic_ms();
+            balancer_end(config->balancer, slot->endpoint, transfer_result,
+                         slot->response.status_code, first_byte_us / 1000.0, finished_ms);
+
+            const batch_job_t *job = &jobs[slot->job_index];
+            rate_limiter_t *limiter = &limiters[slot->endpoint];
+            if (requeue_batch_job(config, limiter, slot, job, transfer_result, finished_ms)) {
+                /* Wake in time for the retry even if nothing else happens */
+                poll_timeout_ms = 0;
+                continue;
+            }
+
+            long used_tokens = 0;
+            if (finish_batch_job(slot, job, transfer_result,
+                                 output_dir, answers, &used_tokens) != 0) {
+                failures++;
+            }
+            rate_limiter_settle(limiter, slot->estimated_tokens, used_tokens);
+
+            busy_slots--;
+            busy_slots += assign_next_job(config, slot, jobs, job_count, &next_job, &failures);
+            if (slot->state == BATCH_SLOT_WAITING) poll_timeout_ms = 0;
+        }
+
+        if (busy_slots > 0 && poll_timeout_ms > 0) {
+            curl_multi_poll(multi_handle, NULL, 0, (int)poll_timeout_ms, NULL);
+        }
+    }
+
+    for (int i = 0; i < concurrency; ++i) {
+        if (slots[i].easy_handle) {
+            curl_multi_remove_handle(multi_handle, slots[i].easy_handle);
+            curl_easy_cleanup(slots[i].easy_handle);
+        }
+        SAFE_FREE(slots[i].response.payload);
+        request_body_free(&slots[i].body);
+        arena_free(&slots[i].arena);
+    }
+    free(slots);
+    curl_multi_cleanup(multi_handle);
+    free(limiters);
+    free(endpoint_order);
+
+    return setup_failed ? -1 : failures;
+}
@@ -0,0 +1,535 @@
+/**
+ * @file bench.c
+ * @brief Built-in benchmark module implementation
+ * @note Replays recorded fixtures through a mock HTTP server running on a
+ *       thread of this process, so every measured microsecond is client time
+ * @author Rouge Lin
+ * @date 2025-04-13
+ */
+
+#define _GNU_SOURCE
+#include "bench.h"
+#include "config.h"
+#include "http_client.h"
+#include "api_handler.h"
+#include "stream_handler.h"
+#include "input_file.h"
+#include "stats.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define BENCH_REQUEST_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * @struct bench_fixtures_t
+ * @brief Recorded inputs and responses replayed by the benchmark
+ * @var query Question text
+ * @var response_json Store-forward response body
+ * @var response_length Length of the store-forward response body
+ * @var stream_events Recorded SSE stream
+ * @var stream_length Length of the recorded stream
+ */
+typedef struct {
+    char *query;           /**< Question text */
+    char *response_json;   /**< Store-forward response body */
+    size_t response_length; /**< Length of the store-forward response body */
+    char *stream_events;   /**< Recorded SSE stream */
+    size_t stream_length;  /**< Length of the recorded stream */
+} bench_fixtures_t;
+
+/**
+ * @struct bench_server_t
+ * @brief Mock chat completion server
+ * @var listen_fd Listening socket on 127.0.0.1
+ * @var port Port the socket is bound to
+ * @var fixtures Responses to serve
+ * @var request_buffer Buffer for one connection's pending request bytes
+ * @var thread Thread running the accept loop
+ */
+typedef struct {
+    int listen_fd;                    /**< Listening socket on 127.0.0.1 */
+    unsigned short port;              /**< Port the socket is bound to */
+    const bench_fixtures_t *fixtures; /**< Responses to serve */
+    char *request_buffer;             /**< Buffer for one connection's pending request bytes */
+    pthread_t thread;                 /**< Thread running the accept loop */
+} bench_server_t;
+
+/**
+ * @struct bench_result_t
+ * @brief Measurements of one operation
+ * @var name Operation label
+ * @var samples Duration of each iteration, in milliseconds
+ * @var allocations Heap allocations made by all iterations
+ */
+typedef struct {
+    const char *name;          /**< Operation label */
+    sample_set_t samples;      /**< Duration of each iteration, in milliseconds */
+    unsigned long allocations; /**< Heap allocations made by all iterations */
+} bench_result_t;
+
+/*------------------------ Fixtures ------------------------*/
+
+/* A file the directory lacks is taken from the default fixtures */
+static char *
+read_fixture (const char *directory, const char *name, size_t *length)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    if (access(path, F_OK) != 0 && errno == ENOENT) {
+        snprintf(path, sizeof(path), "%s/%s", DEFAULT_BENCH_FIXTURES, name);
+    }
+    return read_file(path, length);
+}
+
+static void
+free_fixtures (bench_fixtures_t *fixtures)
+{
+    SAFE_FREE(fixtures->query);
+    SAFE_FREE(fixtures->response_json);
+    SAFE_FREE(fixtures->stream_events);
+}
+
+static int
+load_fixtures (bench_fixtures_t *fixtures, const char *directory)
+{
+    memset(fixtures, 0, sizeof(*fixtures));
+    fixtures->query = read_fixture(directory, "query.txt", NULL);
+    fixtures->response_json = read_fixture(directory, "response.json", &fixtures->response_length);
+    fixtures->stream_events = read_fixture(directory, "stream.sse", &fixtures->stream_length);
+    if (!fixtures->query || !fixtures->response_json || !fixtures->stream_events) {
+        free_fixtures(fixtures);
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------ Mock server ------------------------*/
+
+static int
+send_fixture_response (int fd, const char *content_type, const char *body, size_t length)
+{
+    char header[256];
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                                 "Content-Length: %zu\r\n\r\n", content_type, length);
+    struct iovec vectors[2] = {
+        { .iov_base = header, .iov_len = (size_t)header_length },
+        { .iov_base = (void *)body, .iov_len = length }
+    };
+
+    struct iovec *next = vectors;
+    int vector_count = 2;
+    while (vector_count > 0) {
+        ssize_t written = writev(fd, next, vector_count);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        while (vector_count > 0 && (size_t)written >= next->iov_len) {
+            written -= (ssize_t)next->iov_len;
+            next++;
+            vector_count--;
+        }
+        if (vector_count > 0) {
+            next->iov_base = (char *)next->iov_base + written;
+            next->iov_len -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+/* Find a header value; the header block must be NUL-terminated */
+static const char *
+find_header (const char *headers, const char *name)
+{
+    const char *line = strcasestr(headers, name);
+    return line ? line + strlen(name) : NULL;
+}
+
+/**
+ * @brief Answer keep-alive requests on one connection until it closes
+ * @param server Pointer to the server
+ * @param fd Connection socket
+ * @return void
+ * @note Allocation-free, so the client's allocation counts stay exact
+ */
+static void
+serve_bench_connection (bench_server_t *server, int fd)
+{
+    char *buffer = server->request_buffer;
+    size_t used = 0;
+
+    while (1) {
+        char *header_end;
+        while (!(header_end = memmem(buffer, used, "\r\n\r\n", 4))) {
+            if (used == BENCH_REQUEST_BUFFER_SIZE) return;
+            ssize_t bytes_read = read(fd, buffer + used, BENCH_REQUEST_BUFFER_SIZE - used);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) return;
+            used += (size_t)bytes_read;
+        }
+        size_t header_length = (size_t)(header_end - buffer) + 4;
+
+        header_end[2] = '\0';
+        const char *length_value = find_header(buffer, "\r\nContent-Length:");
+        size_t body_length = length_value ? strtoul(length_value, NULL, 10) : 0;
+        int expects_continue = find_header(buffer, "\r\nExpect: 100-continue") != NULL;
+        header_end[2] = '\r';
+
+        if (header_length + body_length > BENCH_REQUEST_BUFFER_SIZE) return;
+        if (expects_continue && used < header_length + body_length) {
+            static const char continue_line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            if (write(fd, continue_line, sizeof(continue_line) - 1) < 0) return;
+        }
+        while (used < header_length + body_length) {
+            ssize_t bytes_read = read(fd, buffer + used, BENCH_REQUEST_BUFFER_SIZE - used);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) return;
+            used += (size_t)bytes_read;
+        }
+
+        const bench_fixtures_t *fixtures = server->fixtures;
+        int stream = memmem(buffer + header_length, body_length, "\"stream\":true", 13) != NULL;
+        int status = stream
+                   ? send_fixture_response(fd, "text/event-stream",
+                                           fixtures->stream_events, fixtures->stream_length)
+                   : send_fixture_response(fd, "application/json",
+                                           fixtures->response_json, fixtures->response_length);
+        if (status != 0) return;
+
+        size_t consumed = header_length + body_length;
+        memmove(buffer, buffer + consumed, used - consumed);
+        used -= consumed;
+    }
+}
+
+static void *
+bench_server_main (void *argument)
+{
+    bench_server_t *server = argument;
+    while (1) {
+        int connection_fd = accept(server->listen_fd, NULL, NULL);
+        if (connection_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return NULL;
+        }
+        serve_bench_connection(server, connection_fd);
+        close(connection_fd);
+    }
+}
+
+static int
+start_bench_server (bench_server_t *server, const bench_fixtures_t *fixtures)
+{
+    memset(server, 0, sizeof(*server));
+    server->fixtures = fixtures;
+    server->request_buffer = malloc(BENCH_REQUEST_BUFFER_SIZE);
+    if (!server->request_buffer) return -1;
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listen_fd < 0) {
+        perror("socket");
+        SAFE_FREE(server->request_buffer);
+        return -1;
+    }
+
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = 0 };
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_length = sizeof(address);
+    if (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(server->listen_fd, 16) != 0 ||
+        getsockname(server->listen_fd, (struct sockaddr *)&address, &address_length) != 0) {
+        perror("Mock server");
+        goto error;
+    }
+    server->port = ntohs(address.sin_port);
+
+    if (pthread_create(&server->thread, NULL, bench_server_main, server) != 0) {
+        fprintf(stderr, "Failed to start the mock server thread\n");
+        goto error;
+    }
+    return 0;
+
+error:
+    close(server->listen_fd);
+    SAFE_FREE(server->request_buffer);
+    return -1;
+}
+
+/**
+ * @brief Stop the mock server
+ * @param server Pointer to the server
+ * @return void
+ * @note Destroy the HTTP client first: the server thread leaves a keep-alive
+ *       connection only when the client closes it
+ */
+static void
+stop_bench_server (bench_server_t *server)
+{
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    SAFE_FREE(server->request_buffer);
+}
+
+/*------------------------ Measurements ------------------------*/
+
+static void
+begin_iteration (double *start_ms, unsigned long *start_allocations)
+{
+    *start_allocations = bench_allocation_count();
+    *start_ms = monotonic_ms();
+}
+
+static void
+end_iteration (bench_result_t *result, double start_ms, unsigned long start_allocations)
+{
+    double elapsed_ms = monotonic_ms() - start_ms;
+    result->allocations += bench_allocation_count() - start_allocations;
+    sample_set_add(&result->samples, elapsed_ms);
+}
+
+static void
+print_bench_result (bench_result_t *result, int iterations)
+{
+    printf("%-28s %10.1f %10.1f %10.1f", result->name,
+           sample_set_percentile(&result->samples, 50) * 1000.0,
+           sample_set_percentile(&result->samples, 90) * 1000.0,
+           sample_set_percentile(&result->samples, 99) * 1000.0);
+    if (bench_allocations_tracked()) {
+        printf(" %10.1f\n", (double)result->allocations / iterations);
+    } else {
+        printf(" %10s\n", "n/a");
+    }
+}
+
+static void
+bench_construct_request (bench_result_t *result, const api_config_t *config,
+                         const chat_request_params_t *params, int iterations)
+{
+    /* As in batch and daemon mode: one arena, reset per request */
+    arena_t arena;
+    arena_init(&arena, 0);
+
+    for (int i = 0; i < iterations; ++i) {
+        double start_ms;
+        unsigned long start_allocations;
+        begin_iteration(&start_ms, &start_allocations);
+        arena_reset(&arena);
+        construct_request_json(config, params, 1, &arena);
+        end_iteration(result, start_ms, start_allocations);
+    }
+    arena_free(&arena);
+}
+
+static void
+bench_parse_response (bench_result_t *result, const bench_fixtures_t *fixtures, int iterations)
+{
+    http_response_t response = { .status_code = 200 };
+    if (http_response_reserve(&response, fixtures->response_length + 1) != 0) return;
+
+    /* As in the client: one arena, reset per response */
+    arena_t arena;
+    arena_init(&arena, 0);
+
+    for (int i = 0; i < iterations; ++i) {
+        /* Restore the payload each time in case parsing rewrites it */
+        memcpy(response.payload, fixtures->response_json, fixtures->response_length + 1);
+        response.payload_size = fixtures->response_length;
+
+        double start_ms;
+        unsigned long start_allocations;
+        begin_iteration(&start_ms, &start_allocations);
+        arena_reset(&arena);
+        parse_chat_response(&response, &arena);
+        end_iteration(result, start_ms, start_allocations);
+    }
+    arena_free(&arena);
+    SAFE_FREE(response.payload);
+}
+
+static void
+bench_process_stream (bench_result_t *result, const bench_fixtures_t *fixtures,
+                      int null_fd, int iterations)
+{
+    stream_context_t ctx = { .buffer_capacity = fixtures->stream_length + 1 };
+    ctx.buffer = malloc(ctx.buffer_capacity);
+    if (!ctx.buffer) return;
+    output_sink_init(&ctx.sink, null_fd, 0);
+    sample_set_init(&ctx.token_gaps);
+
+    for (int i = 0; i < iterations; ++i) {
+        /* SSE data is decoded in place, so every pass starts from a fresh copy */
+        memcpy(ctx.buffer, fixtures->stream_events, fixtures->stream_length);
+        ctx.buffer_start = 0;
+        ctx.buffer_len = fixtures->stream_length;
+        ctx.first_token_ms = 0;
+        ctx.token_gaps.count = 0;
+        sse_parser_init(&ctx.parser);
+
+        double start_ms;
+        unsigned long start_allocations;
+        begin_iteration(&start_ms, &start_allocations);
+        process_stream_data(&ctx);
+        output_sink_flush(&ctx.sink);
+        end_iteration(result, start_ms, start_allocations);
+
+        sse_parser_free(&ctx.parser);
+    }
+
+    output_sink_close(&ctx.sink);
+    sample_set_free(&ctx.token_gaps);
+    SAFE_FREE(ctx.buffer);
+}
+
+static void
+bench_end_to_end (bench_result_t *result, http_client_t *client, const api_config_t *config,
+                  const chat_request_params_t *params, int stream, int iterations)
+{
+    chat_run_options_t run_options = { .stream = stream };
+    arena_t arena;
+    arena_init(&arena, 0);
+
+    /* One untimed request opens the keep-alive connection */
+    for (int i = -1; i < iterations; ++i) {
+        double start_ms;
+        unsigned long start_allocations;
+        begin_iteration(&start_ms, &start_allocations);
+        arena_reset(&arena);
+        char *request_json = construct_request_json(config, params, stream, &arena);
+        int status = request_json ? run_chat_completion(client, config, request_json, &run_options) : -1;
+        fflush(stdout);
+        if (i >= 0) end_iteration(result, start_ms, start_allocations);
+        if (status != 0) break;
+    }
+    arena_free(&arena);
+}
+
+/*------------------------ Command entry point ------------------------*/
+
+static api_config_t *
+load_bench_configuration (unsigned short port)
+{
+    char config_path[] = "/tmp/ads-bench-XXXXXX";
+    int fd = mkstemp(config_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return NULL;
+    }
+
+    FILE *config_file = fdopen(fd, "w");
+    if (!config_file) {
+        close(fd);
+        unlink(config_path);
+        return NULL;
+    }
+    fprintf(config_file, "API_KEY=bench\nBASE_URL=http://127.0.0.1:%u/v1/chat/completions\n"
+            "MODEL=deepseek-chat\n", port);
+    fclose(config_file);
+
+    api_config_t *config = load_configuration(config_path);
+    unlink(config_path);
+    return config;
+}
+
+int
+run_bench_command (int argc, char **argv)
+{
+    int iterations = DEFAULT_BENCH_ITERATIONS;
+    const char *fixture_dir = DEFAULT_BENCH_FIXTURES;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            fixture_dir = argv[i];
+        } else {
+            fprintf(stderr, "Usage: ads bench [-n ITERATIONS] [FIXTURE_DIR]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1) {
+        fprintf(stderr, "Invalid iteration count\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_fixtures_t fixtures;
+    if (load_fixtures(&fixtures, fixture_dir) != 0) return EXIT_FAILURE;
+
+    bench_server_t server;
+    if (start_bench_server(&server, &fixtures) != 0) {
+        free_fixtures(&fixtures);
+        return EXIT_FAILURE;
+    }
+
+    api_config_t *config = load_bench_configuration(server.port);
+    http_client_t *client = config ? http_client_create() : NULL;
+    int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (!client || null_fd < 0 || saved_stdout < 0) {
+        fprintf(stderr, "Failed to set up the benchmark\n");
+        http_client_destroy(client);
+        stop_bench_server(&server);
+        if (null_fd >= 0) close(null_fd);
+        if (saved_stdout >= 0) close(saved_stdout);
+        free_configuration(config);
+        free_fixtures(&fixtures);
+        return EXIT_FAILURE;
+    }
+
+    chat_request_params_t params = { .user_query = fixtures.query };
+    bench_result_t results[] = {
+        { .name = "construct_request_json" },
+        { .name = "parse_chat_response" },
+        { .name = "process_stream_data" },
+        { .name = "end-to-end store-forward" },
+        { .name = "end-to-end streaming" }
+    };
+    size_t result_count = sizeof(results) / sizeof(results[0]);
+    for (size_t i = 0; i < result_count; ++i) {
+        sample_set_init(&results[i].samples);
+    }
+
+    bench_construct_request(&results[0], config, &params, iterations);
+    bench_parse_response(&results[1], &fixtures, iterations);
+    bench_process_stream(&results[2], &fixtures, null_fd, iterations);
+
+    /* Answers are printed to stdout, which is parked on /dev/null meanwhile */
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    bench_end_to_end(&results[3], client, config, &params, 0, iterations);
+    bench_end_to_end(&results[4], client, config, &params, 1, iterations);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(null_fd);
+
+    printf("ads bench: %d iterations per operation, fixtures from %s\n", iterations, fixture_dir);
+    printf("%-28s %10s %10s %10s %10s\n", "operation", "p50 (us)", "p90 (us)", "p99 (us)", "allocs/op");
+    int result = EXIT_SUCCESS;
+    for (size_t i = 0; i < result_count; ++i) {
+        if (results[i].samples.count < (size_t)iterations) {
+            fprintf(stderr, "%s: only %zu of %d iterations completed\n",
+                    results[i].name, results[i].samples.count, iterations);
+            result = EXIT_FAILURE;
+        }
+        print_bench_result(&results[i], iterations);
+        sample_set_free(&results[i].samples);
+    }
+    if (!bench_allocations_tracked()) {
+        printf("(allocation counts need a build with ADS_BENCH_MALLOC_HOOKS: make bench)\n");
+    }
+
+    http_client_destroy(client);
+    stop_bench_server(&server);
+    free_configuration(config);
+    free_fixtures(&fixtures);
+    return result;
+}
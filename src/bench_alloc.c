@@ -0,0 +1,69 @@
+/**
+ * @file bench_alloc.c
+ * @brief Allocation counter for the benchmark build
+ * @note With ADS_BENCH_MALLOC_HOOKS defined, malloc, calloc and realloc are
+ *       interposed and forwarded to glibc's allocator after being counted.
+ *       Regular builds contain only the stubs.
+ * @author Rouge Lin
+ * @date 2025-04-13
+ */
+
+#include "bench.h"
+#include <stddef.h>
+
+#ifdef ADS_BENCH_MALLOC_HOOKS
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *pointer, size_t size);
+
+static unsigned long allocation_count;
+
+void *
+malloc (size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc (size_t count, size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *
+realloc (void *pointer, size_t size)
+{
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(pointer, size);
+}
+
+unsigned long
+bench_allocation_count (void)
+{
+    return __atomic_load_n(&allocation_count, __ATOMIC_RELAXED);
+}
+
+int
+bench_allocations_tracked (void)
+{
+    return 1;
+}
+
+#else
+
+unsigned long
+bench_allocation_count (void)
+{
+    return 0;
+}
+
+int
+bench_allocations_tracked (void)
+{
+    return 0;
+}
+
+#endif /* ADS_BENCH_MALLOC_HOOKS */
@@ -6,14 +6,209 @@
  */
 
 #include "config.h"
+#include "config_snapshot.h"
+#include "http_client.h"
+#include "balancer.h"
 #include "utils.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/**
+ * @def API_KEY_COMMAND_MAX_OUTPUT
+ * @brief Most output read from an API_KEY_CMD helper
+ */
+#define API_KEY_COMMAND_MAX_OUTPUT 8192
 
 /*------------------------ Configuration management module implementation ------------------------*/
 
+/* Parse "url|api_key|weight" and append it to the endpoint list */
+static int
+add_endpoint (api_config_t *config, char *value)
+{
+    char *key = strchr(value, '|');
+    char *weight = NULL;
+    if (key) {
+        *key++ = '\0';
+        weight = strchr(key, '|');
+        if (weight) *weight++ = '\0';
+        trim_whitespace(key);
+    }
+    trim_whitespace(value);
+    if (value[0] == '\0') {
+        fprintf(stderr, "Ignoring ENDPOINT without a URL\n");
+        return 0;
+    }
+
+    long weight_value = 1;
+    if (weight) {
+        char *weight_end = NULL;
+        trim_whitespace(weight);
+        weight_value = strtol(weight, &weight_end, 10);
+        if (weight_end == weight || *weight_end != '\0' || weight_value < 1) {
+            fprintf(stderr, "Ignoring invalid ENDPOINT weight: %s\n", weight);
+            weight_value = 1;
+        }
+    }
+
+    api_endpoint_t *endpoints = realloc(config->endpoints,
+                                        (config->endpoint_count + 1) * sizeof(api_endpoint_t));
+    if (!endpoints) return -1;
+    config->endpoints = endpoints;
+
+    api_endpoint_t *endpoint = &endpoints[config->endpoint_count];
+    endpoint->url = strdup(value);
+    endpoint->api_key = key && key[0] ? strdup(key) : NULL;
+    endpoint->weight = weight_value;
+    config->endpoint_count++;
+    if (!endpoint->url || (key && key[0] && !endpoint->api_key)) return -1;
+    return 0;
+}
+
+/* Run an API_KEY_CMD helper and return its trimmed output, or NULL if it failed */
+static char *
+run_key_command (const char *command)
+{
+    int output_pipe[2];
+    if (pipe(output_pipe) != 0) return NULL;
+
+    pid_t child = fork();
+    if (child < 0) {
+        close(output_pipe[0]);
+        close(output_pipe[1]);
+        return NULL;
+    }
+    if (child == 0) {
+        /* Standard input may carry the question ("-"): the helper must not consume it */
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        close(output_pipe[0]);
+        close(output_pipe[1]);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(output_pipe[1]);
+
+    char *output = malloc(API_KEY_COMMAND_MAX_OUTPUT + 1);
+    size_t length = 0;
+    ssize_t bytes;
+    while (output && length < API_KEY_COMMAND_MAX_OUTPUT &&
+           ((bytes = read(output_pipe[0], output + length, API_KEY_COMMAND_MAX_OUTPUT - length)) > 0 ||
+            (bytes < 0 && errno == EINTR))) {
+        if (bytes > 0) length += (size_t)bytes;
+    }
+    close(output_pipe[0]);
+
+    int status;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+    if (!output) return NULL;
+    output[length] = '\0';
+    trim_whitespace(output);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || output[0] == '\0') {
+        SAFE_FREE(output);
+    }
+    return output;
+}
+
+/* Take API_KEY from API_KEY_ENV, else from API_KEY_CMD; the file's API_KEY is the fallback */
+static int
+resolve_api_key (api_config_t *config)
+{
+    char *key = NULL;
+    if (config->api_key_env) {
+        const char *value = getenv(config->api_key_env);
+        if (value && value[0]) {
+            key = strdup(value);
+            if (!key) return -1;
+        } else {
+            fprintf(stderr, "API_KEY_ENV: %s is not set\n", config->api_key_env);
+        }
+    }
+    if (!key && config->api_key_command) {
+        key = run_key_command(config->api_key_command);
+        if (!key) fprintf(stderr, "API_KEY_CMD failed: %s\n", config->api_key_command);
+    }
+    if (key) {
+        free(config->api_key);
+        config->api_key = key;
+    }
+    return 0;
+}
+
+/* Fill in defaults between BASE_URL/API_KEY and the endpoint list, then build the balancer */
+static int
+finish_endpoints (api_config_t *config)
+{
+    if (config->endpoint_count == 0) {
+        if (!config->base_url || !config->api_key) return 0;
+        char *value = strdup(config->base_url);
+        int status = value ? add_endpoint(config, value) : -1;
+        free(value);
+        if (status != 0) return -1;
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < config->endpoint_count; ++i) {
+        api_endpoint_t *endpoint = &config->endpoints[i];
+        if (!endpoint->api_key && config->api_key) endpoint->api_key = strdup(config->api_key);
+        if (!endpoint->api_key) {
+            fprintf(stderr, "Ignoring ENDPOINT %s: no API key\n", endpoint->url);
+            SAFE_FREE(endpoint->url);
+            continue;
+        }
+        config->endpoints[kept++] = *endpoint;
+    }
+    config->endpoint_count = kept;
+    if (kept == 0) return 0;
+
+    if (!config->base_url) config->base_url = strdup(config->endpoints[0].url);
+    if (!config->api_key) config->api_key = strdup(config->endpoints[0].api_key);
+    config->balancer = balancer_create(config->endpoints, config->endpoint_count,
+                                       config->balance_policy);
+    if (!config->base_url || !config->api_key || !config->balancer) return -1;
+    return prepare_endpoint_headers(config);
+}
+
+int
+prepare_endpoint_headers (api_config_t *config)
+{
+    for (size_t i = 0; i < config->endpoint_count; ++i) {
+        api_endpoint_t *endpoint = &config->endpoints[i];
+        endpoint->headers[0] = build_request_headers(endpoint->api_key, 0, 0);
+        endpoint->headers[1] = build_request_headers(endpoint->api_key, 1, 0);
+        if (!endpoint->headers[0] || !endpoint->headers[1]) return -1;
+    }
+
+    /* The hedge goes to another host, so it never carries an endpoint's headers */
+    if (config->hedge_url && config->hedge_url[0]) {
+        const char *hedge_key = config->hedge_api_key ? config->hedge_api_key : config->api_key;
+        config->hedge_headers[0] = build_request_headers(hedge_key, 0, 0);
+        config->hedge_headers[1] = build_request_headers(hedge_key, 1, 0);
+        if (!config->hedge_headers[0] || !config->hedge_headers[1]) return -1;
+    }
+    return 0;
+}
+
+void
+release_endpoint_headers (api_config_t *config)
+{
+    for (size_t i = 0; i < config->endpoint_count; ++i) {
+        curl_slist_free_all(config->endpoints[i].headers[0]);
+        curl_slist_free_all(config->endpoints[i].headers[1]);
+        config->endpoints[i].headers[0] = config->endpoints[i].headers[1] = NULL;
+    }
+    curl_slist_free_all(config->hedge_headers[0]);
+    curl_slist_free_all(config->hedge_headers[1]);
+    config->hedge_headers[0] = config->hedge_headers[1] = NULL;
+}
+
 api_config_t *
 load_configuration (const char *config_path)
 {
@@ -31,6 +226,14 @@ load_configuration (const char *config_path)
 
     config->model_name = strdup(DEFAULT_MODEL);
     config->system_prompt = strdup(DEFAULT_SYSTEM_PROMPT);
+    config->session_max_bytes = DEFAULT_SESSION_MAX_BYTES;
+    config->cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+    config->max_retries = DEFAULT_MAX_RETRIES;
+    config->retry_base_ms = DEFAULT_RETRY_BASE_MS;
+    config->retry_max_ms = DEFAULT_RETRY_MAX_MS;
+    config->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    config->idle_timeout_ms = DEFAULT_IDLE_TIMEOUT_MS;
+    config->hedge_delay_ms = DEFAULT_HEDGE_DELAY_MS;
     if (!config->model_name || !config->system_prompt) {
         perror("Memory allocation failed");
         free_configuration(config);
@@ -38,8 +241,10 @@ load_configuration (const char *config_path)
         return NULL;
     }
 
-    char config_line[256];
-    while (fgets(config_line, sizeof(config_line), config_file)) {
+    /* Lines are read whole, so long keys and prompts are never split */
+    char *config_line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&config_line, &line_capacity, config_file) >= 0) {
         char *comment_start = strchr(config_line, '#');
         if (comment_start) *comment_start = '\0';
         trim_whitespace(config_line);
@@ -55,14 +260,79 @@ load_configuration (const char *config_path)
         trim_whitespace(value);
 
         char **target_field = NULL;
+        long *numeric_field = NULL;
         if (strcmp(key, "API_KEY") == 0) {
             target_field = &config->api_key;
+        } else if (strcmp(key, "API_KEY_ENV") == 0) {
+            target_field = &config->api_key_env;
+        } else if (strcmp(key, "API_KEY_CMD") == 0) {
+            target_field = &config->api_key_command;
         } else if (strcmp(key, "BASE_URL") == 0) {
             target_field = &config->base_url;
         } else if (strcmp(key, "MODEL") == 0) {
             target_field = &config->model_name;
         } else if (strcmp(key, "SYSTEM_PROMPT") == 0) {
             target_field = &config->system_prompt;
+        } else if (strcmp(key, "SESSION_MAX_BYTES") == 0) {
+            numeric_field = &config->session_max_bytes;
+        } else if (strcmp(key, "CACHE_TTL") == 0) {
+            numeric_field = &config->cache_ttl;
+        } else if (strcmp(key, "CACHE_MAX_BYTES") == 0) {
+            numeric_field = &config->cache_max_bytes;
+        } else if (strcmp(key, "OUTPUT_FLUSH_MS") == 0) {
+            numeric_field = &config->output_flush_ms;
+        } else if (strcmp(key, "PREWARM") == 0) {
+            numeric_field = &config->prewarm_connection;
+        } else if (strcmp(key, "MAX_RETRIES") == 0) {
+            numeric_field = &config->max_retries;
+        } else if (strcmp(key, "RETRY_BASE_MS") == 0) {
+            numeric_field = &config->retry_base_ms;
+        } else if (strcmp(key, "RETRY_MAX_MS") == 0) {
+            numeric_field = &config->retry_max_ms;
+        } else if (strcmp(key, "RATE_LIMIT_RPM") == 0) {
+            numeric_field = &config->rate_limit_rpm;
+        } else if (strcmp(key, "RATE_LIMIT_TPM") == 0) {
+            numeric_field = &config->rate_limit_tpm;
+        } else if (strcmp(key, "CONNECT_TIMEOUT_MS") == 0) {
+            numeric_field = &config->connect_timeout_ms;
+        } else if (strcmp(key, "FIRST_BYTE_TIMEOUT_MS") == 0) {
+            numeric_field = &config->first_byte_timeout_ms;
+        } else if (strcmp(key, "IDLE_TIMEOUT_MS") == 0) {
+            numeric_field = &config->idle_timeout_ms;
+        } else if (strcmp(key, "HEDGE_URL") == 0) {
+            target_field = &config->hedge_url;
+        } else if (strcmp(key, "HEDGE_API_KEY") == 0) {
+            target_field = &config->hedge_api_key;
+        } else if (strcmp(key, "HEDGE_DELAY_MS") == 0) {
+            numeric_field = &config->hedge_delay_ms;
+        } else if (strcmp(key, "COMPRESS_REQUEST_MIN") == 0) {
+            numeric_field = &config->compress_request_min;
+        } else if (strcmp(key, "ENDPOINT") == 0) {
+            if (add_endpoint(config, value) != 0) {
+                perror("Memory allocation failed");
+                free_configuration(config);
+                SAFE_FREE(config_line);
+                fclose(config_file);
+                return NULL;
+            }
+        } else if (strcmp(key, "BALANCE") == 0) {
+            if (strcmp(value, "ewma") == 0) {
+                config->balance_policy = BALANCE_EWMA;
+            } else if (strcmp(value, "least") == 0) {
+                config->balance_policy = BALANCE_LEAST_OUTSTANDING;
+            } else {
+                fprintf(stderr, "Ignoring invalid value for %s: %s\n", key, value);
+            }
+        }
+
+        if (numeric_field) {
+            char *value_end = NULL;
+            long number = strtol(value, &value_end, 10);
+            if (value_end == value || *value_end != '\0' || number < 0) {
+                fprintf(stderr, "Ignoring invalid value for %s: %s\n", key, value);
+            } else {
+                *numeric_field = number;
+            }
         }
 
         if (target_field) {
@@ -70,6 +340,7 @@ load_configuration (const char *config_path)
             if (!new_value) {
                 perror("Memory allocation failed");
                 free_configuration(config);
+                SAFE_FREE(config_line);
                 fclose(config_file);
                 return NULL;
             }
@@ -78,6 +349,7 @@ load_configuration (const char *config_path)
         }
     }
 
+    SAFE_FREE(config_line);
     if (ferror(config_file)) {
         perror("Error reading configuration file");
         free_configuration(config);
@@ -86,17 +358,54 @@ load_configuration (const char *config_path)
     }
 
     fclose(config_file);
+    if (resolve_api_key(config) != 0 || finish_endpoints(config) != 0) {
+        perror("Memory allocation failed");
+        free_configuration(config);
+        return NULL;
+    }
+    return config;
+}
+
+api_config_t *
+load_configuration_cached (const char *config_path)
+{
+    TRACE_BEGIN(load_span);
+    struct stat source_stat;
+    int have_stat = stat(config_path, &source_stat) == 0;
+    api_config_t *config = have_stat ? config_snapshot_load(config_path, &source_stat) : NULL;
+    if (config) {
+        TRACE_END(load_span, "config snapshot");
+        return config;
+    }
+
+    config = load_configuration(config_path);
+    TRACE_END(load_span, "config parse");
+    /* A failed store only means the next run parses the file again */
+    if (config && have_stat) config_snapshot_store(config, config_path, &source_stat);
     return config;
 }
 
 void
 free_configuration (api_config_t *config)
 {
-    if (config) {
+    if (config && config->snapshot) {
+        config_snapshot_release(config);
+    } else if (config) {
         SAFE_FREE(config->api_key);
         SAFE_FREE(config->base_url);
         SAFE_FREE(config->model_name);
         SAFE_FREE(config->system_prompt);
+        SAFE_FREE(config->hedge_url);
+        SAFE_FREE(config->hedge_api_key);
+        SAFE_FREE(config->api_key_env);
+        SAFE_FREE(config->api_key_command);
+        release_endpoint_headers(config);
+        for (size_t i = 0; i < config->endpoint_count; ++i) {
+            SAFE_FREE(config->endpoints[i].url);
+            SAFE_FREE(config->endpoints[i].api_key);
+        }
+        SAFE_FREE(config->endpoints);
+        balancer_destroy(config->balancer);
         SAFE_FREE(config);
     }
 }
@@ -104,6 +413,9 @@ free_configuration (api_config_t *config)
 const char *
 locate_config_file (void)
 {
+    const char *override_path = getenv("ADS_CONFIG");
+    if (override_path && override_path[0]) return override_path;
+
     static const char *config_search_paths[] = {
         "./.adsenv",
         NULL,
@@ -138,15 +450,51 @@ dump_configuration_json (const api_config_t *config)
     
     cJSON_AddStringToObject(config_section, "api_key", 
                            config->api_key ? config->api_key : "");
+    cJSON_AddStringToObject(config_section, "api_key_env",
+                           config->api_key_env ? config->api_key_env : "");
+    cJSON_AddStringToObject(config_section, "api_key_cmd",
+                           config->api_key_command ? config->api_key_command : "");
     cJSON_AddStringToObject(config_section, "base_url", 
                            config->base_url ? config->base_url : "");
     cJSON_AddStringToObject(config_section, "model", config->model_name);
     cJSON_AddStringToObject(config_section, "system_prompt", config->system_prompt);
+    cJSON_AddNumberToObject(config_section, "session_max_bytes", config->session_max_bytes);
+    cJSON_AddNumberToObject(config_section, "cache_ttl", config->cache_ttl);
+    cJSON_AddNumberToObject(config_section, "cache_max_bytes", config->cache_max_bytes);
+    cJSON_AddNumberToObject(config_section, "output_flush_ms", config->output_flush_ms);
+    cJSON_AddBoolToObject(config_section, "prewarm", config->prewarm_connection != 0);
+    cJSON_AddNumberToObject(config_section, "max_retries", config->max_retries);
+    cJSON_AddNumberToObject(config_section, "retry_base_ms", config->retry_base_ms);
+    cJSON_AddNumberToObject(config_section, "retry_max_ms", config->retry_max_ms);
+    cJSON_AddNumberToObject(config_section, "rate_limit_rpm", config->rate_limit_rpm);
+    cJSON_AddNumberToObject(config_section, "rate_limit_tpm", config->rate_limit_tpm);
+    cJSON_AddNumberToObject(config_section, "connect_timeout_ms", config->connect_timeout_ms);
+    cJSON_AddNumberToObject(config_section, "first_byte_timeout_ms", config->first_byte_timeout_ms);
+    cJSON_AddNumberToObject(config_section, "idle_timeout_ms", config->idle_timeout_ms);
+    cJSON_AddStringToObject(config_section, "hedge_url",
+                           config->hedge_url ? config->hedge_url : "");
+    cJSON_AddStringToObject(config_section, "hedge_api_key",
+                           config->hedge_api_key ? config->hedge_api_key : "");
+    cJSON_AddNumberToObject(config_section, "hedge_delay_ms", config->hedge_delay_ms);
+    cJSON_AddNumberToObject(config_section, "compress_request_min", config->compress_request_min);
+    cJSON_AddStringToObject(config_section, "balance",
+                           config->balance_policy == BALANCE_EWMA ? "ewma" : "least");
+    cJSON *endpoints_array = cJSON_AddArrayToObject(config_section, "endpoints");
+    for (size_t i = 0; i < config->endpoint_count; ++i) {
+        cJSON *endpoint_object = cJSON_CreateObject();
+        cJSON_AddStringToObject(endpoint_object, "url", config->endpoints[i].url);
+        cJSON_AddStringToObject(endpoint_object, "api_key", config->endpoints[i].api_key);
+        cJSON_AddNumberToObject(endpoint_object, "weight", config->endpoints[i].weight);
+        cJSON_AddItemToArray(endpoints_array, endpoint_object);
+    }
     
     cJSON *constants_section = cJSON_AddObjectToObject(root_object, "constants");
     cJSON_AddStringToObject(constants_section, "DEFAULT_MODEL", DEFAULT_MODEL);
     cJSON_AddStringToObject(constants_section, "DEFAULT_SYSTEM_PROMPT", DEFAULT_SYSTEM_PROMPT);
     cJSON_AddNumberToObject(constants_section, "PATH_MAX", PATH_MAX);
+    cJSON_AddNumberToObject(constants_section, "DEFAULT_SESSION_MAX_BYTES", DEFAULT_SESSION_MAX_BYTES);
+    cJSON_AddNumberToObject(constants_section, "DEFAULT_CACHE_MAX_BYTES", DEFAULT_CACHE_MAX_BYTES);
+    cJSON_AddNumberToObject(constants_section, "DEFAULT_MAX_RETRIES", DEFAULT_MAX_RETRIES);
     
     char *json_output = cJSON_Print(root_object);
     if (json_output) {
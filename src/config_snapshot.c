@@ -0,0 +1,328 @@
+/**
+ * @file config_snapshot.c
+ * @brief Compiled configuration snapshot implementation
+ * @note Layout: a header holding the identity of the source file and an image
+ *       of api_config_t, the endpoint images, then every string. Pointers in
+ *       the images are stored as offsets from the start of the file (0 = NULL).
+ * @author Rouge Lin
+ * @date 2025-04-16
+ */
+
+#include "config_snapshot.h"
+#include "balancer.h"
+#include "response_cache.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * @struct snapshot_header_t
+ * @brief Start of a snapshot file
+ * @var magic CONFIG_SNAPSHOT_MAGIC
+ * @var config_size sizeof(api_config_t) of the writer
+ * @var endpoint_size sizeof(api_endpoint_t) of the writer
+ * @var source_device Device of the configuration file
+ * @var source_inode Inode of the configuration file
+ * @var source_size Size of the configuration file
+ * @var source_mtime_sec Modification time of the configuration file, seconds
+ * @var source_mtime_nsec Modification time of the configuration file, nanoseconds
+ * @var total_size Size of the whole snapshot file
+ * @var config Configuration image with pointers stored as offsets
+ */
+typedef struct {
+    char magic[8];              /**< CONFIG_SNAPSHOT_MAGIC */
+    uint32_t config_size;       /**< sizeof(api_config_t) of the writer */
+    uint32_t endpoint_size;     /**< sizeof(api_endpoint_t) of the writer */
+    uint64_t source_device;     /**< Device of the configuration file */
+    uint64_t source_inode;      /**< Inode of the configuration file */
+    int64_t source_size;        /**< Size of the configuration file */
+    int64_t source_mtime_sec;   /**< Modification time of the configuration file, seconds */
+    int64_t source_mtime_nsec;  /**< Modification time of the configuration file, nanoseconds */
+    uint64_t total_size;        /**< Size of the whole snapshot file */
+    api_config_t config;        /**< Configuration image with pointers stored as offsets */
+} snapshot_header_t;
+
+/*------------------------ Paths ------------------------*/
+
+/*
+ * Snapshots get their own subdirectory of the cache, out of reach of answer
+ * eviction. The resolved path names the snapshot (./.adsenv differs per
+ * directory), so rewriting the file replaces its snapshot instead of adding one.
+ */
+static int
+resolve_snapshot_path (char *path, size_t path_size, char *directory, size_t directory_size,
+                       const char *config_path)
+{
+    char source_path[PATH_MAX];
+    if (!realpath(config_path, source_path) ||
+        resolve_cache_directory(directory, directory_size, CACHE_SNAPSHOT_SUBDIRECTORY) != 0) {
+        return -1;
+    }
+
+    unsigned long long path_hash = 0xcbf29ce484222325ULL;
+    for (const char *cursor = source_path; *cursor; ++cursor) {
+        path_hash = (path_hash ^ (unsigned char)*cursor) * 0x100000001b3ULL;
+    }
+    int length = snprintf(path, path_size, "%s/%016llx", directory, path_hash);
+    return length < 0 || (size_t)length >= path_size ? -1 : 0;
+}
+
+static void
+describe_source (snapshot_header_t *header, const struct stat *source_stat)
+{
+    memcpy(header->magic, CONFIG_SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->config_size = sizeof(api_config_t);
+    header->endpoint_size = sizeof(api_endpoint_t);
+    header->source_device = (uint64_t)source_stat->st_dev;
+    header->source_inode = (uint64_t)source_stat->st_ino;
+    header->source_size = (int64_t)source_stat->st_size;
+    header->source_mtime_sec = (int64_t)source_stat->st_mtim.tv_sec;
+    header->source_mtime_nsec = (int64_t)source_stat->st_mtim.tv_nsec;
+}
+
+/*------------------------ Loading ------------------------*/
+
+/* Turn a stored offset back into a string inside the mapping */
+static int
+resolve_string (char **field, const char *base, size_t size)
+{
+    uintptr_t offset = (uintptr_t)*field;
+    if (offset == 0) return 0;
+    if (offset < sizeof(snapshot_header_t) || offset >= size) return -1;
+    *field = (char *)base + offset;
+    return 0;
+}
+
+api_config_t *
+config_snapshot_load (const char *config_path, const struct stat *source_stat)
+{
+    char path[PATH_MAX];
+    char directory[PATH_MAX];
+    if (resolve_snapshot_path(path, sizeof(path), directory, sizeof(directory), config_path) != 0) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat snapshot_stat;
+    if (fstat(fd, &snapshot_stat) != 0 || !S_ISREG(snapshot_stat.st_mode) ||
+        snapshot_stat.st_uid != getuid() ||
+        (size_t)snapshot_stat.st_size < sizeof(snapshot_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)snapshot_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+
+    const char *base = mapping;
+    const snapshot_header_t *header = mapping;
+    snapshot_header_t expected;
+    describe_source(&expected, source_stat);
+    /* Every string ends before the final byte, which is a terminator */
+    if (memcmp(header, &expected, offsetof(snapshot_header_t, total_size)) != 0 ||
+        header->total_size != size || base[size - 1] != '\0') {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    size_t endpoint_count = header->config.endpoint_count;
+    uintptr_t endpoint_offset = (uintptr_t)header->config.endpoints;
+    if (endpoint_count == 0 || endpoint_offset < sizeof(snapshot_header_t) ||
+        endpoint_offset > size || endpoint_offset % sizeof(void *) != 0 ||
+        endpoint_count > (size - endpoint_offset) / sizeof(api_endpoint_t)) {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    /* The structure and its endpoint list share one allocation */
+    api_config_t *config = malloc(sizeof(api_config_t) + endpoint_count * sizeof(api_endpoint_t));
+    if (!config) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    *config = header->config;
+    config->endpoints = (api_endpoint_t *)(config + 1);
+    memcpy(config->endpoints, base + endpoint_offset, endpoint_count * sizeof(api_endpoint_t));
+    for (size_t i = 0; i < endpoint_count; ++i) {
+        config->endpoints[i].headers[0] = config->endpoints[i].headers[1] = NULL;
+    }
+    config->balancer = NULL;
+    config->hedge_headers[0] = config->hedge_headers[1] = NULL;
+    config->api_key_env = config->api_key_command = NULL;
+    config->snapshot = mapping;
+    config->snapshot_size = size;
+
+    int invalid = resolve_string(&config->api_key, base, size) ||
+                  resolve_string(&config->base_url, base, size) ||
+                  resolve_string(&config->model_name, base, size) ||
+                  resolve_string(&config->system_prompt, base, size) ||
+                  resolve_string(&config->hedge_url, base, size) ||
+                  resolve_string(&config->hedge_api_key, base, size);
+    for (size_t i = 0; !invalid && i < endpoint_count; ++i) {
+        invalid = resolve_string(&config->endpoints[i].url, base, size) ||
+                  resolve_string(&config->endpoints[i].api_key, base, size);
+    }
+    if (!invalid) {
+        config->balancer = balancer_create(config->endpoints, endpoint_count,
+                                           config->balance_policy);
+    }
+    if (invalid || !config->balancer || prepare_endpoint_headers(config) != 0) {
+        config_snapshot_release(config);
+        return NULL;
+    }
+    return config;
+}
+
+void
+config_snapshot_release (api_config_t *config)
+{
+    release_endpoint_headers(config);
+    balancer_destroy(config->balancer);
+    munmap(config->snapshot, config->snapshot_size);
+    free(config);
+}
+
+/*------------------------ Storing ------------------------*/
+
+/**
+ * @struct snapshot_writer_t
+ * @brief Snapshot file being assembled in memory
+ * @var data Bytes written so far
+ * @var length Number of bytes written
+ * @var capacity Allocated size of data
+ */
+typedef struct {
+    char *data;      /**< Bytes written so far */
+    size_t length;   /**< Number of bytes written */
+    size_t capacity; /**< Allocated size of data */
+} snapshot_writer_t;
+
+static int
+append_bytes (snapshot_writer_t *writer, const void *bytes, size_t length)
+{
+    if (writer->length + length > writer->capacity) {
+        size_t new_capacity = writer->capacity ? writer->capacity : 1024;
+        while (new_capacity < writer->length + length) new_capacity *= 2;
+        char *new_data = realloc(writer->data, new_capacity);
+        if (!new_data) return -1;
+        writer->data = new_data;
+        writer->capacity = new_capacity;
+    }
+    memcpy(writer->data + writer->length, bytes, length);
+    writer->length += length;
+    return 0;
+}
+
+/* Append a string and return its offset disguised as a pointer */
+static char *
+append_string (snapshot_writer_t *writer, const char *text, int *failed)
+{
+    if (!text) return NULL;
+    uintptr_t offset = writer->length;
+    if (append_bytes(writer, text, strlen(text) + 1) != 0) *failed = 1;
+    return (char *)offset;
+}
+
+int
+config_snapshot_store (const api_config_t *config, const char *config_path,
+                       const struct stat *source_stat)
+{
+    char path[PATH_MAX];
+    char directory[PATH_MAX];
+    char temporary_path[PATH_MAX];
+    if (config->endpoint_count == 0 || config->api_key_env || config->api_key_command ||
+        resolve_snapshot_path(path, sizeof(path), directory, sizeof(directory), config_path) != 0) {
+        return -1;
+    }
+    int length = snprintf(temporary_path, sizeof(temporary_path), "%s/.config.%ld",
+                          directory, (long)getpid());
+    if (length < 0 || (size_t)length >= sizeof(temporary_path)) return -1;
+
+    snapshot_header_t header;
+    memset(&header, 0, sizeof(header));
+    describe_source(&header, source_stat);
+    header.config = *config;
+    header.config.balancer = NULL;
+    header.config.hedge_headers[0] = header.config.hedge_headers[1] = NULL;
+    header.config.snapshot = NULL;
+    header.config.snapshot_size = 0;
+
+    snapshot_writer_t writer = { .data = NULL };
+    int failed = append_bytes(&writer, &header, sizeof(header)) != 0;
+
+    /* Endpoint images are copied into the loader's allocation, but are kept aligned anyway */
+    static const char padding[sizeof(void *)];
+    size_t misalignment = writer.length % sizeof(void *);
+    if (!failed && misalignment) {
+        failed = append_bytes(&writer, padding, sizeof(void *) - misalignment) != 0;
+    }
+    uintptr_t endpoint_offset = writer.length;
+    for (size_t i = 0; !failed && i < config->endpoint_count; ++i) {
+        /* Header lists are rebuilt by every loader */
+        api_endpoint_t endpoint = config->endpoints[i];
+        endpoint.headers[0] = endpoint.headers[1] = NULL;
+        failed = append_bytes(&writer, &endpoint, sizeof(endpoint)) != 0;
+    }
+
+    if (!failed) {
+        /* The writer may move while strings are appended, so offsets go into a local copy */
+        api_config_t stored = header.config;
+        stored.endpoints = (api_endpoint_t *)endpoint_offset;
+        stored.api_key = append_string(&writer, config->api_key, &failed);
+        stored.base_url = append_string(&writer, config->base_url, &failed);
+        stored.model_name = append_string(&writer, config->model_name, &failed);
+        stored.system_prompt = append_string(&writer, config->system_prompt, &failed);
+        stored.hedge_url = append_string(&writer, config->hedge_url, &failed);
+        stored.hedge_api_key = append_string(&writer, config->hedge_api_key, &failed);
+        for (size_t i = 0; !failed && i < config->endpoint_count; ++i) {
+            api_endpoint_t endpoint = config->endpoints[i];
+            endpoint.url = append_string(&writer, config->endpoints[i].url, &failed);
+            endpoint.api_key = append_string(&writer, config->endpoints[i].api_key, &failed);
+            endpoint.headers[0] = endpoint.headers[1] = NULL;
+            memcpy(writer.data + endpoint_offset + i * sizeof(api_endpoint_t),
+                   &endpoint, sizeof(endpoint));
+        }
+        snapshot_header_t *image = (snapshot_header_t *)writer.data;
+        image->config = stored;
+        image->total_size = writer.length;
+    }
+    if (failed) {
+        free(writer.data);
+        return -1;
+    }
+
+    /* The cache directory and its parent (~/.cache) may not exist yet either */
+    if (make_directories(directory) != 0) {
+        free(writer.data);
+        return -1;
+    }
+
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(writer.data);
+        return -1;
+    }
+    size_t written = 0;
+    while (written < writer.length) {
+        ssize_t bytes = write(fd, writer.data + written, writer.length - written);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        written += (size_t)bytes;
+    }
+    free(writer.data);
+    if (close(fd) != 0 || written < writer.length || rename(temporary_path, path) != 0) {
+        unlink(temporary_path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,572 @@
+/**
+ * @file daemon_server.c
+ * @brief Resident daemon implementation
+ * @note Serves forwarded queries over a Unix domain socket
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#define _GNU_SOURCE
+#include "daemon_server.h"
+#include "http_client.h"
+#include "json_writer.h"
+#include "api_handler.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <cjson/cJSON.h>
+
+/* Status bytes the daemon answers with; DECLINED means nothing was written */
+#define DAEMON_STATUS_OK 0
+#define DAEMON_STATUS_FAILED 1
+#define DAEMON_STATUS_DECLINED 2
+
+/* Room for "<dev>:<ino>:<size>:<sec>.<nsec>" */
+#define CONFIG_IDENTITY_SIZE 96
+
+static volatile sig_atomic_t daemon_stop_requested = 0;
+static volatile sig_atomic_t daemon_reload_requested = 0;
+
+/*------------------------ Socket helpers ------------------------*/
+
+int
+resolve_daemon_socket_path (char *buffer, size_t buffer_size)
+{
+    const char *socket_override = getenv(DAEMON_SOCKET_ENV);
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    int path_length;
+
+    if (socket_override && socket_override[0]) {
+        path_length = snprintf(buffer, buffer_size, "%s", socket_override);
+    } else if (runtime_dir && runtime_dir[0]) {
+        path_length = snprintf(buffer, buffer_size, "%s/ads.sock", runtime_dir);
+    } else {
+        path_length = snprintf(buffer, buffer_size, "/tmp/ads-%ld/ads.sock", (long)getuid());
+    }
+    return (path_length < 0 || (size_t)path_length >= buffer_size) ? -1 : 0;
+}
+
+/* Copy the directory part of a path; "." when it has none */
+static int
+socket_directory (const char *socket_path, char *buffer, size_t buffer_size)
+{
+    const char *slash = strrchr(socket_path, '/');
+    size_t length = slash ? (size_t)(slash - socket_path) : 1;
+    if (slash && length == 0) length = 1;
+    if (length >= buffer_size) return -1;
+    memcpy(buffer, slash ? socket_path : ".", length);
+    buffer[length] = '\0';
+    return 0;
+}
+
+/* Only the owner may replace entries of the directory, so a socket in it cannot be swapped */
+static int
+directory_private (const char *directory)
+{
+    struct stat directory_stat;
+    return stat(directory, &directory_stat) == 0 && S_ISDIR(directory_stat.st_mode) &&
+           directory_stat.st_uid == getuid() &&
+           (directory_stat.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+int
+daemon_socket_present (const char *socket_path)
+{
+    struct stat socket_stat;
+    char directory[PATH_MAX];
+    if (lstat(socket_path, &socket_stat) != 0 || !S_ISSOCK(socket_stat.st_mode)) return 0;
+    if (socket_stat.st_uid != getuid() || (socket_stat.st_mode & (S_IRWXG | S_IRWXO)) != 0) return 0;
+    return socket_directory(socket_path, directory, sizeof(directory)) == 0 &&
+           directory_private(directory);
+}
+
+/* Whether the process at the other end of a connection runs as this user */
+static int
+peer_is_current_user (int socket_fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t credentials_length = sizeof(credentials);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) != 0) {
+        return 0;
+    }
+    return credentials.uid == getuid();
+#else
+    /* Without peer credentials the owner and mode checks on the socket file have to do */
+    (void)socket_fd;
+    return 1;
+#endif
+}
+
+/* Identify a configuration file by device, inode, size and modification time */
+static int
+format_config_identity (const char *config_path, char *buffer, size_t buffer_size)
+{
+    struct stat config_stat;
+    if (!config_path || stat(config_path, &config_stat) != 0) return -1;
+    int length = snprintf(buffer, buffer_size, "%llu:%llu:%lld:%lld.%09ld",
+                          (unsigned long long)config_stat.st_dev,
+                          (unsigned long long)config_stat.st_ino,
+                          (long long)config_stat.st_size,
+                          (long long)config_stat.st_mtim.tv_sec, (long)config_stat.st_mtim.tv_nsec);
+    return (length < 0 || (size_t)length >= buffer_size) ? -1 : 0;
+}
+
+static int
+fill_socket_address (struct sockaddr_un *address, const char *socket_path)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) return -1;
+    strcpy(address->sun_path, socket_path);
+    return 0;
+}
+
+static int
+connect_to_socket (const char *socket_path)
+{
+    struct sockaddr_un address;
+    if (fill_socket_address(&address, socket_path) != 0) return -1;
+
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_fd < 0) return -1;
+    if (connect(socket_fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+static int
+write_all (int fd, const char *data, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+/*------------------------ Daemon side ------------------------*/
+
+static void
+handle_stop_signal (int signal_number)
+{
+    (void)signal_number;
+    daemon_stop_requested = 1;
+}
+
+static void
+handle_reload_signal (int signal_number)
+{
+    (void)signal_number;
+    daemon_reload_requested = 1;
+}
+
+static api_config_t *
+load_daemon_configuration (const char *config_path, char *identity)
+{
+    /* Taken before the load, so an edit racing with it shows as a mismatch later */
+    if (format_config_identity(config_path, identity, CONFIG_IDENTITY_SIZE) != 0) {
+        identity[0] = '\0';
+    }
+    api_config_t *config = load_configuration_cached(config_path);
+    if (!config || !config->api_key || !config->base_url) {
+        fprintf(stderr, "Invalid configuration parameters\n");
+        free_configuration(config);
+        return NULL;
+    }
+    return config;
+}
+
+/* Replace the configuration with a fresh load of config_path; kept as is on failure */
+static void
+reload_daemon_configuration (api_config_t **config, const char *config_path, char *identity)
+{
+    char new_identity[CONFIG_IDENTITY_SIZE];
+    api_config_t *new_config = load_daemon_configuration(config_path, new_identity);
+    if (!new_config) return;
+    free_configuration(*config);
+    *config = new_config;
+    memcpy(identity, new_identity, CONFIG_IDENTITY_SIZE);
+    fprintf(stderr, "ads daemon reloaded %s\n", config_path);
+}
+
+/*
+ * Whether the caller resolved the same configuration file the daemon serves.
+ * A caller seeing a newer version of that file makes the daemon reload it.
+ */
+static int
+configuration_matches (const char *requested, api_config_t **config,
+                       const char *config_path, char *identity)
+{
+    if (identity[0] && strcmp(requested, identity) == 0) return 1;
+
+    char current[CONFIG_IDENTITY_SIZE];
+    if (format_config_identity(config_path, current, sizeof(current)) != 0 ||
+        strcmp(requested, current) != 0) {
+        return 0;
+    }
+    reload_daemon_configuration(config, config_path, identity);
+    return strcmp(requested, identity) == 0;
+}
+
+/**
+ * @brief Receive the caller's descriptors and the JSON request body
+ * @param connection_fd Accepted connection
+ * @param client_fds Output array receiving the caller's stdout and stderr
+ * @param payload Output parameter receiving the NUL-terminated request body
+ * @return 0 on success, -1 on failure
+ */
+static int
+receive_request (int connection_fd, int client_fds[2], char **payload)
+{
+    size_t capacity = 4096, size = 0;
+    char *buffer = malloc(capacity);
+    if (!buffer) return -1;
+
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec io_vector = { .iov_base = buffer, .iov_len = capacity - 1 };
+    struct msghdr message = {
+        .msg_iov = &io_vector,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space)
+    };
+
+    ssize_t received;
+    do {
+        received = recvmsg(connection_fd, &message, 0);
+    } while (received < 0 && errno == EINTR);
+
+    struct cmsghdr *control_header = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (!control_header || control_header->cmsg_level != SOL_SOCKET ||
+        control_header->cmsg_type != SCM_RIGHTS ||
+        control_header->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        fprintf(stderr, "Daemon: malformed request\n");
+        free(buffer);
+        return -1;
+    }
+    memcpy(client_fds, CMSG_DATA(control_header), 2 * sizeof(int));
+    size = (size_t)received;
+
+    for (;;) {
+        if (size + 1 >= capacity) {
+            char *new_buffer = realloc(buffer, capacity * 2);
+            if (!new_buffer) goto error;
+            buffer = new_buffer;
+            capacity *= 2;
+        }
+        ssize_t bytes_read = read(connection_fd, buffer + size, capacity - size - 1);
+        if (bytes_read == 0) break;
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            goto error;
+        }
+        size += (size_t)bytes_read;
+    }
+
+    buffer[size] = '\0';
+    *payload = buffer;
+    return 0;
+
+error:
+    close(client_fds[0]);
+    close(client_fds[1]);
+    free(buffer);
+    return -1;
+}
+
+static void
+serve_connection (int connection_fd, http_client_t *client, arena_t *request_arena,
+                  api_config_t **config, const char *config_path, char *config_identity)
+{
+    int client_fds[2];
+    char *payload = NULL;
+    if (receive_request(connection_fd, client_fds, &payload) != 0) return;
+
+    int result = -1;
+    char status = DAEMON_STATUS_FAILED;
+    cJSON *root_object = cJSON_Parse(payload);
+    cJSON *query = cJSON_GetObjectItemCaseSensitive(root_object, "query");
+    cJSON *requested_config = cJSON_GetObjectItemCaseSensitive(root_object, "config");
+    if (cJSON_IsString(query) &&
+        (!cJSON_IsString(requested_config) ||
+         !configuration_matches(requested_config->valuestring, config, config_path, config_identity))) {
+        /* Another configuration file: the caller answers the question itself */
+        status = DAEMON_STATUS_DECLINED;
+    } else if (cJSON_IsString(query)) {
+        int stream = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(root_object, "stream"));
+        int show_tokens = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(root_object, "show_tokens"));
+        int no_cache = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(root_object, "no_cache"));
+
+        /* Answer straight into the caller's terminal or pipe */
+        fflush(stdout);
+        fflush(stderr);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int saved_stderr = dup(STDERR_FILENO);
+        dup2(client_fds[0], STDOUT_FILENO);
+        dup2(client_fds[1], STDERR_FILENO);
+
+        chat_request_params_t request_params = {
+            .user_query = query->valuestring,
+            .custom_prompt = NULL
+        };
+        /* One reset per connection releases the previous request's body */
+        arena_reset(request_arena);
+        char *request_json = construct_request_json(*config, &request_params, stream, request_arena);
+        if (request_json) {
+            chat_run_options_t run_options = {
+                .stream = stream,
+                .show_tokens = show_tokens,
+                .use_cache = !no_cache
+            };
+            result = run_chat_completion(client, *config, request_json, &run_options);
+        } else {
+            fprintf(stderr, "Failed to construct request JSON\n");
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+        status = result == 0 ? DAEMON_STATUS_OK : DAEMON_STATUS_FAILED;
+    } else {
+        fprintf(stderr, "Daemon: request without a query\n");
+    }
+
+    write_all(connection_fd, &status, 1);
+
+    cJSON_Delete(root_object);
+    close(client_fds[0]);
+    close(client_fds[1]);
+    SAFE_FREE(payload);
+}
+
+int
+run_daemon_server (const char *config_path, const char *socket_path)
+{
+    struct sockaddr_un address;
+    if (fill_socket_address(&address, socket_path) != 0) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+
+    int probe_fd = connect_to_socket(socket_path);
+    if (probe_fd >= 0) {
+        close(probe_fd);
+        fprintf(stderr, "A daemon is already listening on %s\n", socket_path);
+        return -1;
+    }
+
+    char socket_dir[PATH_MAX];
+    if (socket_directory(socket_path, socket_dir, sizeof(socket_dir)) != 0) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    /* The default directory under /tmp is created here, private to this user */
+    if (mkdir(socket_dir, 0700) != 0 && errno != EEXIST) {
+        perror("Failed to create socket directory");
+        return -1;
+    }
+    if (!directory_private(socket_dir)) {
+        fprintf(stderr, "Refusing to listen in %s: it is not owned by this user "
+                "or others can write to it\n", socket_dir);
+        return -1;
+    }
+
+    char config_identity[CONFIG_IDENTITY_SIZE];
+    api_config_t *config = load_daemon_configuration(config_path, config_identity);
+    if (!config) return -1;
+
+    http_client_t *client = http_client_create();
+    if (!client) {
+        fprintf(stderr, "Failed to initialize HTTP client\n");
+        free_configuration(config);
+        return -1;
+    }
+    /* The first query then finds the connection open instead of paying for the handshake */
+    if (config->prewarm_connection) {
+        http_client_prewarm(client, config->base_url);
+    }
+    arena_t request_arena;
+    arena_init(&request_arena, 0);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("Failed to create socket");
+        goto error;
+    }
+
+    /* Stale socket files are left behind by daemons that were killed */
+    unlink(socket_path);
+    mode_t previous_umask = umask(077);
+    int bind_result = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(previous_umask);
+    if (bind_result != 0 || listen(listen_fd, 16) != 0) {
+        perror("Failed to listen on socket");
+        close(listen_fd);
+        goto error;
+    }
+
+    struct sigaction stop_action = { .sa_handler = handle_stop_signal };
+    struct sigaction reload_action = { .sa_handler = handle_reload_signal };
+    sigemptyset(&stop_action.sa_mask);
+    sigemptyset(&reload_action.sa_mask);
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGHUP, &reload_action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    fprintf(stderr, "ads daemon listening on %s\n", socket_path);
+
+    while (!daemon_stop_requested) {
+        int connection_fd = accept(listen_fd, NULL, NULL);
+
+        if (daemon_reload_requested) {
+            daemon_reload_requested = 0;
+            reload_daemon_configuration(&config, config_path, config_identity);
+        }
+
+        if (connection_fd < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to accept connection");
+            break;
+        }
+
+        /* The socket is private already; a peer of another user is dropped unread */
+        if (peer_is_current_user(connection_fd)) {
+            serve_connection(connection_fd, client, &request_arena, &config, config_path, config_identity);
+        }
+        close(connection_fd);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    arena_free(&request_arena);
+    http_client_destroy(client);
+    free_configuration(config);
+    return 0;
+
+error:
+    arena_free(&request_arena);
+    http_client_destroy(client);
+    free_configuration(config);
+    return -1;
+}
+
+/*------------------------ Client side ------------------------*/
+
+int
+forward_to_daemon (const char *socket_path, const daemon_request_t *request)
+{
+    char config_identity[CONFIG_IDENTITY_SIZE];
+    if (format_config_identity(request->config_path, config_identity, sizeof(config_identity)) != 0) {
+        return -1;
+    }
+
+    /* Our descriptors and query only go to a daemon run by this user */
+    int socket_fd = connect_to_socket(socket_path);
+    if (socket_fd < 0) return -1;
+    if (!peer_is_current_user(socket_fd)) {
+        close(socket_fd);
+        return -1;
+    }
+
+    size_t query_length = strlen(request->user_query);
+    json_writer_t writer;
+    char *payload = NULL;
+    if (json_writer_init(&writer, json_escaped_length(request->user_query, query_length) +
+                         64 + CONFIG_IDENTITY_SIZE) == 0) {
+        json_writer_raw(&writer, "{", 1);
+        json_writer_key(&writer, "query");
+        json_writer_string(&writer, request->user_query, query_length);
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "stream");
+        json_writer_bool(&writer, request->stream);
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "show_tokens");
+        json_writer_bool(&writer, request->show_tokens);
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "no_cache");
+        json_writer_bool(&writer, request->no_cache);
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "config");
+        json_writer_string(&writer, config_identity, strlen(config_identity));
+        json_writer_raw(&writer, "}", 1);
+        payload = json_writer_finish(&writer);
+    }
+    if (!payload) {
+        close(socket_fd);
+        return -1;
+    }
+
+    /* Anything already buffered must reach the terminal before the daemon writes */
+    fflush(stdout);
+    fflush(stderr);
+
+    int client_fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    size_t payload_size = strlen(payload);
+    struct iovec io_vector = { .iov_base = payload, .iov_len = payload_size };
+    struct msghdr message = {
+        .msg_iov = &io_vector,
+        .msg_iovlen = 1,
+        .msg_control = control.space,
+        .msg_controllen = sizeof(control.space)
+    };
+    struct cmsghdr *control_header = CMSG_FIRSTHDR(&message);
+    control_header->cmsg_level = SOL_SOCKET;
+    control_header->cmsg_type = SCM_RIGHTS;
+    control_header->cmsg_len = CMSG_LEN(sizeof(client_fds));
+    memcpy(CMSG_DATA(control_header), client_fds, sizeof(client_fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket_fd, &message, 0);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0 || write_all(socket_fd, payload + sent, payload_size - (size_t)sent) != 0) {
+        SAFE_FREE(payload);
+        close(socket_fd);
+        return -1;
+    }
+    SAFE_FREE(payload);
+    shutdown(socket_fd, SHUT_WR);
+
+    char status = 1;
+    ssize_t status_read;
+    do {
+        status_read = read(socket_fd, &status, 1);
+    } while (status_read < 0 && errno == EINTR);
+    close(socket_fd);
+
+    if (status_read != 1) {
+        fprintf(stderr, "Daemon closed the connection unexpectedly\n");
+        return 1;
+    }
+    if (status == DAEMON_STATUS_DECLINED) return -1;
+    return status == DAEMON_STATUS_OK ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/**
+ * @file event_stream.c
+ * @brief Event stream implementation
+ * @author Rouge Lin
+ * @date 2025-04-19
+ */
+
+#include "event_stream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int
+parse_output_format (const char *name, output_format_t *format)
+{
+    if (strcmp(name, "text") == 0) {
+        *format = OUTPUT_FORMAT_TEXT;
+    } else if (strcmp(name, "ndjson") == 0) {
+        *format = OUTPUT_FORMAT_NDJSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void
+event_stream_init (event_stream_t *events, output_sink_t *sink)
+{
+    events->sink = sink;
+    /* A failed allocation only means the first event grows the buffer */
+    json_writer_init(&events->line, 256);
+}
+
+void
+event_stream_free (event_stream_t *events)
+{
+    free(json_writer_finish(&events->line));
+}
+
+/*------------------------ Event composition ------------------------*/
+
+static json_writer_t *
+begin_event (event_stream_t *events, const char *type)
+{
+    json_writer_t *line = &events->line;
+    json_writer_reset(line);
+    json_writer_raw(line, "{\"type\":\"", 9);
+    json_writer_raw(line, type, strlen(type));
+    json_writer_raw(line, "\"", 1);
+    return line;
+}
+
+static void
+add_member (json_writer_t *line, const char *key)
+{
+    json_writer_raw(line, ",", 1);
+    json_writer_key(line, key);
+}
+
+static void
+add_milliseconds (json_writer_t *line, const char *key, double value)
+{
+    char digits[32];
+    int digit_count = snprintf(digits, sizeof(digits), "%.1f", value);
+    add_member(line, key);
+    json_writer_raw(line, digits, (size_t)digit_count);
+}
+
+static void
+end_event (event_stream_t *events)
+{
+    json_writer_t *line = &events->line;
+    json_writer_raw(line, "}\n", 2);
+    /* An event that could not be composed is dropped whole, never written in part */
+    if (!line->failed) output_sink_write(events->sink, line->data, line->length);
+}
+
+/*------------------------ Events ------------------------*/
+
+void
+event_stream_text (event_stream_t *events, const char *type, const char *text, size_t length)
+{
+    json_writer_t *line = begin_event(events, type);
+    add_member(line, "content");
+    json_writer_string(line, text, length);
+    end_event(events);
+}
+
+void
+event_stream_finish (event_stream_t *events, const char *reason, size_t length)
+{
+    json_writer_t *line = begin_event(events, "finish");
+    add_member(line, "reason");
+    json_writer_string(line, reason, length);
+    end_event(events);
+}
+
+void
+event_stream_usage (event_stream_t *events, long prompt_tokens, long completion_tokens,
+                    long total_tokens, long cached_tokens)
+{
+    json_writer_t *line = begin_event(events, "usage");
+    add_member(line, "prompt_tokens");
+    json_writer_integer(line, prompt_tokens);
+    add_member(line, "completion_tokens");
+    json_writer_integer(line, completion_tokens);
+    add_member(line, "total_tokens");
+    json_writer_integer(line, total_tokens);
+    add_member(line, "cached_tokens");
+    json_writer_integer(line, cached_tokens);
+    end_event(events);
+}
+
+void
+event_stream_timing (event_stream_t *events, double request_start_ms, double first_token_ms,
+                     double last_token_ms, sample_set_t *token_gaps, double end_ms)
+{
+    json_writer_t *line = begin_event(events, "timing");
+    if (first_token_ms > 0) {
+        add_milliseconds(line, "first_token_ms", first_token_ms - request_start_ms);
+        add_milliseconds(line, "last_token_ms", last_token_ms - request_start_ms);
+        add_milliseconds(line, "token_gap_p50_ms", sample_set_percentile(token_gaps, 50));
+        add_milliseconds(line, "token_gap_p90_ms", sample_set_percentile(token_gaps, 90));
+        add_milliseconds(line, "token_gap_p99_ms", sample_set_percentile(token_gaps, 99));
+    }
+    add_milliseconds(line, "total_ms", end_ms - request_start_ms);
+    end_event(events);
+}
+
+void
+event_stream_error (event_stream_t *events, long status_code, const char *message, size_t length)
+{
+    json_writer_t *line = begin_event(events, "error");
+    if (status_code > 0) {
+        add_member(line, "status");
+        json_writer_integer(line, status_code);
+    }
+    add_member(line, "message");
+    json_writer_string(line, message, length);
+    end_event(events);
+}
+
+void
+event_stream_done (event_stream_t *events, int cached)
+{
+    json_writer_t *line = begin_event(events, "done");
+    if (cached) {
+        add_member(line, "cached");
+        json_writer_bool(line, 1);
+    }
+    end_event(events);
+}
@@ -0,0 +1,379 @@
+/**
+ * @file fanout.c
+ * @brief Fan-out implementation
+ * @note Drives one streamed request per variant through curl_multi
+ * @author Rouge Lin
+ * @date 2025-04-18
+ */
+
+#include "fanout.h"
+#include "stream_handler.h"
+#include "balancer.h"
+#include "stats.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+/**
+ * @struct fanout_variant_t
+ * @brief One request of a fan-out
+ * @var label Name the answer is reported under (model and sample number)
+ * @var request_json Request body of the variant
+ * @var body Request body as sent, possibly gzip-encoded
+ * @var easy_handle CURL easy handle of the request
+ * @var endpoint Endpoint the request is sent to
+ * @var stream Parser of the streamed answer; content is captured, and printed only when unmuted
+ * @var error_response Body of a non-200 response
+ * @var status_code HTTP status of the response (0 until known)
+ * @var active Whether the handle is attached to the multi handle
+ * @var cancelled Whether the request was abandoned for another variant
+ * @var result How the transfer ended
+ * @var printed Captured bytes already written with FANOUT_ALL
+ * @var started_ms When the request was sent
+ * @var finished_ms When the transfer ended
+ */
+typedef struct {
+    char label[96];               /**< Name the answer is reported under (model and sample number) */
+    char *request_json;           /**< Request body of the variant */
+    request_body_t body;          /**< Request body as sent, possibly gzip-encoded */
+    CURL *easy_handle;            /**< CURL easy handle of the request */
+    size_t endpoint;              /**< Endpoint the request is sent to */
+    stream_context_t stream;      /**< Parser of the streamed answer; content is captured, and printed only when unmuted */
+    http_response_t error_response; /**< Body of a non-200 response */
+    long status_code;             /**< HTTP status of the response (0 until known) */
+    int active;                   /**< Whether the handle is attached to the multi handle */
+    int cancelled;                /**< Whether the request was abandoned for another variant */
+    CURLcode result;              /**< How the transfer ended */
+    size_t printed;               /**< Captured bytes already written with FANOUT_ALL */
+    double started_ms;            /**< When the request was sent */
+    double finished_ms;           /**< When the transfer ended */
+} fanout_variant_t;
+
+int
+parse_fanout_mode (const char *name, fanout_mode_t *mode)
+{
+    if (strcmp(name, "all") == 0) {
+        *mode = FANOUT_ALL;
+    } else if (strcmp(name, "first") == 0) {
+        *mode = FANOUT_FIRST;
+    } else if (strcmp(name, "race") == 0) {
+        *mode = FANOUT_RACE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*------------------------ Variants ------------------------*/
+
+static size_t
+fanout_write (char *data, size_t size, size_t count, void *userdata)
+{
+    fanout_variant_t *variant = userdata;
+    if (variant->status_code == 0) {
+        curl_easy_getinfo(variant->easy_handle, CURLINFO_RESPONSE_CODE, &variant->status_code);
+    }
+    /* An error response is a JSON document, not an event stream: keep it for the report */
+    if (variant->status_code != 200) {
+        return curl_data_writer(data, size, count, &variant->error_response);
+    }
+    return stream_data_callback(data, size, count, &variant->stream);
+}
+
+static int
+prepare_variant (const api_config_t *config, const chat_request_params_t *params,
+                 fanout_variant_t *variant, const char *model, int sample, int samples)
+{
+    /* Only the model differs between variants; every other setting is shared */
+    api_config_t variant_config = *config;
+    if (model) variant_config.model_name = (char *)model;
+
+    if (samples > 1) {
+        snprintf(variant->label, sizeof(variant->label), "%s#%d", variant_config.model_name, sample + 1);
+    } else {
+        snprintf(variant->label, sizeof(variant->label), "%s", variant_config.model_name);
+    }
+
+    variant->request_json = construct_request_json(&variant_config, params, 1, NULL);
+    variant->easy_handle = curl_easy_init();
+    if (!variant->request_json || !variant->easy_handle) return -1;
+    request_body_init(&variant->body, config, variant->request_json);
+
+    sse_parser_init(&variant->stream.parser);
+    sample_set_init(&variant->stream.token_gaps);
+    output_sink_init(&variant->stream.sink, STDOUT_FILENO, config->output_flush_ms);
+    variant->stream.capture_reply = 1;
+    variant->stream.muted = 1;
+    return 0;
+}
+
+static int
+launch_variant (http_client_t *client, const api_config_t *config, CURLM *multi_handle,
+                fanout_variant_t *variant)
+{
+    variant->started_ms = monotonic_ms();
+    variant->endpoint = balancer_acquire(config->balancer, variant->started_ms);
+    const api_endpoint_t *endpoint = &config->endpoints[variant->endpoint];
+
+    CURL *curl = variant->easy_handle;
+    curl_easy_setopt(curl, CURLOPT_SHARE, client->share_handle);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, variant);
+    curl_easy_setopt(curl, CURLOPT_URL, endpoint->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, endpoint->headers[variant->body.compressed]);
+    setup_http_body(curl, &variant->body);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fanout_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, variant);
+    setup_http_transport(curl);
+    setup_http_timeouts(curl, config);
+
+    if (curl_multi_add_handle(multi_handle, curl) != CURLM_OK) {
+        balancer_release(config->balancer, variant->endpoint);
+        return -1;
+    }
+    variant->active = 1;
+    return 0;
+}
+
+static void
+cancel_variant (const api_config_t *config, CURLM *multi_handle, fanout_variant_t *variant)
+{
+    if (!variant->active) return;
+    curl_multi_remove_handle(multi_handle, variant->easy_handle);
+    balancer_release(config->balancer, variant->endpoint);
+    variant->active = 0;
+    variant->cancelled = 1;
+    variant->finished_ms = monotonic_ms();
+}
+
+static int
+variant_succeeded (const fanout_variant_t *variant)
+{
+    return !variant->active && !variant->cancelled &&
+           variant->result == CURLE_OK && variant->status_code == 200;
+}
+
+static void
+release_variant (fanout_variant_t *variant)
+{
+    if (variant->easy_handle) curl_easy_cleanup(variant->easy_handle);
+    request_body_free(&variant->body);
+    SAFE_FREE(variant->request_json);
+    output_sink_close(&variant->stream.sink);
+    sse_parser_free(&variant->stream.parser);
+    sample_set_free(&variant->stream.token_gaps);
+    SAFE_FREE(variant->stream.buffer);
+    SAFE_FREE(variant->stream.reply);
+    SAFE_FREE(variant->error_response.payload);
+}
+
+/*------------------------ Output ------------------------*/
+
+/* FANOUT_ALL: write every complete captured line (every line when `final`) under the label */
+static void
+emit_labeled_lines (output_sink_t *sink, fanout_variant_t *variant, int final)
+{
+    const char *text = variant->stream.reply;
+    size_t length = variant->stream.reply_length;
+    size_t label_length = strlen(variant->label);
+
+    while (variant->printed < length) {
+        const char *line = text + variant->printed;
+        const char *newline = memchr(line, '\n', length - variant->printed);
+        if (!newline && !final) break;
+
+        size_t line_length = newline ? (size_t)(newline - line) : length - variant->printed;
+        output_sink_write(sink, "[", 1);
+        output_sink_write(sink, variant->label, label_length);
+        output_sink_write(sink, "] ", 2);
+        output_sink_write(sink, line, line_length);
+        output_sink_write(sink, "\n", 1);
+        variant->printed += line_length + (newline ? 1 : 0);
+    }
+}
+
+static void
+report_variant_error (const fanout_variant_t *variant)
+{
+    if (variant->result != CURLE_OK) {
+        fprintf(stderr, "[%s] Request failed: %s\n", variant->label,
+                curl_easy_strerror(variant->result));
+    } else if (variant->status_code != 200) {
+        fprintf(stderr, "[%s] HTTP error %ld: %s\n", variant->label, variant->status_code,
+                variant->error_response.payload ? variant->error_response.payload
+                                                : "No response content");
+    }
+}
+
+static void
+print_variant_statistics (const fanout_variant_t *variant)
+{
+    const stream_context_t *stream = &variant->stream;
+    printf("\n[%s] ", variant->label);
+    if (variant->cancelled) {
+        printf("cancelled after %.1f ms", variant->finished_ms - variant->started_ms);
+        return;
+    }
+    if (stream->first_token_ms > 0) {
+        printf("first token %.1f ms, ", stream->first_token_ms - variant->started_ms);
+    }
+    printf("total %.1f ms", variant->finished_ms - variant->started_ms);
+    if (stream->has_usage) {
+        printf(", tokens %ld in / %ld out", stream->prompt_tokens, stream->completion_tokens);
+    }
+}
+
+/*------------------------ Fan-out engine ------------------------*/
+
+int
+run_fanout (http_client_t *client, const api_config_t *config,
+            const chat_request_params_t *params, const fanout_options_t *options)
+{
+    size_t model_count = options->model_count > 0 ? options->model_count : 1;
+    int samples = options->samples > 0 ? options->samples : 1;
+    if (model_count * (size_t)samples > FANOUT_MAX_VARIANTS) {
+        fprintf(stderr, "At most %d requests can be fanned out\n", FANOUT_MAX_VARIANTS);
+        return -1;
+    }
+    size_t variant_count = model_count * (size_t)samples;
+
+    fanout_variant_t *variants = calloc(variant_count, sizeof(fanout_variant_t));
+    CURLM *multi_handle = curl_multi_init();
+    if (!variants || !multi_handle) {
+        fprintf(stderr, "Failed to initialize fan-out\n");
+        free(variants);
+        if (multi_handle) curl_multi_cleanup(multi_handle);
+        return -1;
+    }
+    /* Over HTTP/2 every variant shares one connection */
+    curl_multi_setopt(multi_handle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    http_client_finish_prewarm(client);
+
+    output_sink_t sink;
+    output_sink_init(&sink, STDOUT_FILENO, config->output_flush_ms);
+
+    int failed = 0;
+    for (size_t i = 0; !failed && i < variant_count; ++i) {
+        const char *model = options->models ? options->models[i / (size_t)samples] : NULL;
+        failed = prepare_variant(config, params, &variants[i], model,
+                                 (int)(i % (size_t)samples), samples) != 0;
+    }
+    for (size_t i = 0; !failed && i < variant_count; ++i) {
+        failed = launch_variant(client, config, multi_handle, &variants[i]) != 0;
+    }
+    if (failed) fprintf(stderr, "Failed to start fan-out requests\n");
+
+    fanout_variant_t *winner = NULL;
+    size_t active_count = 0;
+    for (size_t i = 0; i < variant_count; ++i) active_count += variants[i].active;
+
+    while (!failed && active_count > 0) {
+        int still_running = 0;
+        CURLMcode multi_status = curl_multi_perform(multi_handle, &still_running);
+        if (multi_status != CURLM_OK) {
+            fprintf(stderr, "Fan-out failed: %s\n", curl_multi_strerror(multi_status));
+            failed = 1;
+            break;
+        }
+
+        CURLMsg *message;
+        int messages_left;
+        while ((message = curl_multi_info_read(multi_handle, &messages_left)) != NULL) {
+            if (message->msg != CURLMSG_DONE) continue;
+
+            fanout_variant_t *variant = NULL;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&variant);
+            variant->result = message->data.result;
+            if (variant->status_code == 0) {
+                curl_easy_getinfo(variant->easy_handle, CURLINFO_RESPONSE_CODE, &variant->status_code);
+            }
+            curl_multi_remove_handle(multi_handle, variant->easy_handle);
+            variant->active = 0;
+            variant->finished_ms = monotonic_ms();
+            if (variant->status_code == 200) finish_stream_data(&variant->stream);
+
+            curl_off_t first_byte_us = 0;
+            curl_easy_getinfo(variant->easy_handle, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+            TRACE_TRANSFER(variant->easy_handle);
+            balancer_end(config->balancer, variant->endpoint, variant->result,
+                         variant->status_code, first_byte_us / 1000.0, variant->finished_ms);
+
+            if (!variant_succeeded(variant)) {
+                report_variant_error(variant);
+            } else if (options->mode == FANOUT_FIRST && !winner) {
+                winner = variant;
+            } else if (options->mode == FANOUT_ALL) {
+                emit_labeled_lines(&sink, variant, 1);
+            }
+        }
+
+        /* The race is decided by the first content or reasoning token */
+        if (options->mode == FANOUT_RACE && !winner) {
+            for (size_t i = 0; i < variant_count; ++i) {
+                fanout_variant_t *variant = &variants[i];
+                if (variant->stream.first_token_ms > 0 && variant->status_code == 200 &&
+                    (!winner || variant->stream.first_token_ms < winner->stream.first_token_ms)) {
+                    winner = variant;
+                }
+            }
+            if (winner) {
+                /* What arrived before the decision is written first, then the rest streams */
+                output_sink_write(&winner->stream.sink, winner->stream.reply ? winner->stream.reply : "",
+                                  winner->stream.reply_length);
+                output_sink_poll(&winner->stream.sink);
+                winner->stream.muted = 0;
+            }
+        }
+        if (winner) {
+            for (size_t i = 0; i < variant_count; ++i) {
+                if (&variants[i] != winner) cancel_variant(config, multi_handle, &variants[i]);
+            }
+        }
+        if (options->mode == FANOUT_ALL) {
+            for (size_t i = 0; i < variant_count; ++i) {
+                if (variants[i].active) emit_labeled_lines(&sink, &variants[i], 0);
+            }
+            output_sink_poll(&sink);
+        }
+
+        active_count = 0;
+        for (size_t i = 0; i < variant_count; ++i) active_count += variants[i].active;
+        if (active_count > 0) curl_multi_poll(multi_handle, NULL, 0, 1000, NULL);
+    }
+
+    if (!failed && winner) {
+        fprintf(stderr, "[%s] answered first\n", winner->label);
+        if (options->mode == FANOUT_FIRST) {
+            output_sink_write(&sink, winner->stream.reply ? winner->stream.reply : "",
+                              winner->stream.reply_length);
+        }
+        output_sink_flush(&winner->stream.sink);
+        output_sink_write(&sink, "\n", 1);
+        failed = !variant_succeeded(winner);
+    } else if (!failed && options->mode == FANOUT_ALL) {
+        for (size_t i = 0; i < variant_count; ++i) {
+            if (!variant_succeeded(&variants[i])) failed = 1;
+        }
+    } else {
+        failed = 1;
+    }
+    output_sink_close(&sink);
+
+    if (options->show_tokens) {
+        for (size_t i = 0; i < variant_count; ++i) {
+            if (variants[i].request_json) print_variant_statistics(&variants[i]);
+        }
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < variant_count; ++i) {
+        if (variants[i].active) cancel_variant(config, multi_handle, &variants[i]);
+        release_variant(&variants[i]);
+    }
+    free(variants);
+    curl_multi_cleanup(multi_handle);
+    return failed ? -1 : 0;
+}
@@ -7,11 +7,42 @@
 
 #include "http_client.h"
 #include "config.h"
+#include "json_writer.h"
+#include "stats.h"
+#include "trace.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
 
 /*------------------------ HTTP communication module implementation ------------------------*/
 
+int
+http_response_reserve (http_response_t *response, size_t capacity)
+{
+    if (capacity <= response->payload_capacity) return 0;
+
+    char *new_buffer = realloc(response->payload, capacity);
+    if (!new_buffer) return -1;
+
+    response->payload = new_buffer;
+    response->payload_capacity = capacity;
+    return 0;
+}
+
+void
+http_response_reset (http_response_t *response)
+{
+    response->payload_size = 0;
+    response->status_code = 0;
+    response->retry_after = 0;
+    response->first_byte_ms = 0;
+    if (response->payload) response->payload[0] = '\0';
+}
+
 size_t
 curl_data_writer(char *buffer, size_t element_size,
                  size_t element_count, void *user_buffer)
@@ -19,11 +50,15 @@ curl_data_writer(char *buffer, size_t element_size,
     size_t data_size = element_size * element_count;
     http_response_t *response_buffer = (http_response_t *)user_buffer;
 
-    char *new_buffer = realloc(response_buffer->payload, 
-                              response_buffer->payload_size + data_size + 1);
-    if (!new_buffer) return 0;
+    size_t required = response_buffer->payload_size + data_size + 1;
+    if (required > response_buffer->payload_capacity) {
+        size_t new_capacity = response_buffer->payload_capacity
+                            ? response_buffer->payload_capacity * 2
+                            : HTTP_RESPONSE_INITIAL_SIZE;
+        while (new_capacity < required) new_capacity *= 2;
+        if (http_response_reserve(response_buffer, new_capacity) != 0) return 0;
+    }
 
-    response_buffer->payload = new_buffer;
     memcpy(&response_buffer->payload[response_buffer->payload_size], 
           buffer, data_size);
     response_buffer->payload_size += data_size;
@@ -31,78 +66,772 @@ curl_data_writer(char *buffer, size_t element_size,
     return data_size;
 }
 
-CURLcode
-perform_http_post (const char *url, const char *auth_header,
-                   const char *payload, http_response_t *response)
+http_client_t *
+http_client_create (void)
+{
+    if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) return NULL;
+
+    http_client_t *client = calloc(1, sizeof(http_client_t));
+    if (!client) {
+        curl_global_cleanup();
+        return NULL;
+    }
+    arena_init(&client->response_arena, 0);
+
+    client->share_handle = curl_share_init();
+    client->curl_handle = curl_easy_init();
+    if (!client->share_handle || !client->curl_handle) {
+        http_client_destroy(client);
+        return NULL;
+    }
+
+    curl_share_setopt(client->share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(client->share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(client->share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    return client;
+}
+
+void
+http_client_destroy (http_client_t *client)
+{
+    if (!client) return;
+
+    http_client_finish_prewarm(client);
+    free(client->prewarm_url);
+    arena_free(&client->response_arena);
+
+    /* Easy handles must let go of the share before it can be cleaned up */
+    if (client->curl_handle) curl_easy_cleanup(client->curl_handle);
+    if (client->share_handle) curl_share_cleanup(client->share_handle);
+    free(client);
+    curl_global_cleanup();
+}
+
+void
+http_client_finish_prewarm (http_client_t *client)
+{
+    if (!client->prewarm_running) return;
+    pthread_join(client->prewarm_thread, NULL);
+    client->prewarm_running = 0;
+}
+
+int
+http_client_cancelled (const http_client_t *client)
+{
+    return client->cancel_flag && *client->cancel_flag;
+}
+
+static int
+cancel_progress (void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                 curl_off_t ultotal, curl_off_t ulnow)
+{
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    return http_client_cancelled(clientp);
+}
+
+CURL *
+http_client_acquire (http_client_t *client)
 {
+    http_client_finish_prewarm(client);
+    curl_easy_reset(client->curl_handle);
+    curl_easy_setopt(client->curl_handle, CURLOPT_SHARE, client->share_handle);
+    if (client->cancel_flag) {
+        curl_easy_setopt(client->curl_handle, CURLOPT_XFERINFOFUNCTION, cancel_progress);
+        curl_easy_setopt(client->curl_handle, CURLOPT_XFERINFODATA, client);
+        curl_easy_setopt(client->curl_handle, CURLOPT_NOPROGRESS, 0L);
+    }
+    return client->curl_handle;
+}
+
+static size_t
+discard_body (char *buffer, size_t element_size, size_t element_count, void *user_data)
+{
+    (void)buffer;
+    (void)user_data;
+    return element_size * element_count;
+}
+
+static void *
+prewarm_connection (void *argument)
+{
+    http_client_t *client = argument;
     CURL *curl_handle = curl_easy_init();
-    if (!curl_handle) return CURLE_FAILED_INIT;
+    if (!curl_handle) return NULL;
+
+    /* The main thread stays off the share until it joins this thread */
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, client->share_handle);
+    setup_http_transport(curl_handle);
+    curl_easy_setopt(curl_handle, CURLOPT_URL, client->prewarm_url);
+    curl_easy_setopt(curl_handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, discard_body);
+    curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, HTTP_PREWARM_TIMEOUT);
+    curl_easy_perform(curl_handle);
+    curl_easy_cleanup(curl_handle);
+    return NULL;
+}
+
+int
+http_client_prewarm (http_client_t *client, const char *url)
+{
+    if (client->prewarm_running || !url) return -1;
+
+    free(client->prewarm_url);
+    client->prewarm_url = strdup(url);
+    if (!client->prewarm_url) return -1;
+
+    if (pthread_create(&client->prewarm_thread, NULL, prewarm_connection, client) != 0) {
+        return -1;
+    }
+    client->prewarm_running = 1;
+    return 0;
+}
+
+size_t
+curl_header_reader(char *buffer, size_t element_size,
+                   size_t element_count, void *user_buffer)
+{
+    static const char length_header[] = "content-length:";
+    size_t header_size = element_size * element_count;
+    http_response_t *response_buffer = (http_response_t *)user_buffer;
 
-    struct curl_slist *header_list = NULL;
-    header_list = curl_slist_append(header_list, "Content-Type: application/json");
-    header_list = curl_slist_append(header_list, auth_header);
+    if (header_size > sizeof(length_header) - 1 &&
+        strncasecmp(buffer, length_header, sizeof(length_header) - 1) == 0) {
+        char *value_end = NULL;
+        unsigned long long content_length =
+            strtoull(buffer + sizeof(length_header) - 1, &value_end, 10);
+        /* Only a hint: failing to reserve just falls back to growing */
+        if (value_end != buffer + sizeof(length_header) - 1 &&
+            content_length < HTTP_RESPONSE_RESERVE_LIMIT) {
+            http_response_reserve(response_buffer,
+                                  response_buffer->payload_size + (size_t)content_length + 1);
+        }
+    }
+    return header_size;
+}
 
+void
+setup_http_transport (CURL *curl_handle)
+{
+    curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "deepseek-cli/1.0");
+    /* An empty string offers every encoding this libcurl can decode */
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+void
+setup_http_body (CURL *curl_handle, const request_body_t *body)
+{
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body->length);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, body->data);
+}
+
+void
+setup_http_post (CURL *curl_handle, const char *url, struct curl_slist *header_list,
+                 const request_body_t *body, http_response_t *response)
+{
     curl_easy_setopt(curl_handle, CURLOPT_URL, url);
     curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, header_list);
-    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, payload);
+    setup_http_body(curl_handle, body);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, curl_data_writer);
     curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, response);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "deepseek-cli/1.0");
-    curl_easy_setopt(curl_handle, CURLOPT_TIMEOUT, 30L);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, curl_header_reader);
+    curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, response);
+    setup_http_transport(curl_handle);
+}
+
+/*------------------------ Deadlines and hedging ------------------------*/
+
+/**
+ * @struct transfer_leg_t
+ * @brief One of the requests raced by http_client_perform
+ * @var curl_handle Easy handle of the request
+ * @var transfer Race the request belongs to
+ * @var index 0 for the original request, 1 for the hedge
+ * @var active Whether the handle is attached to the race's multi handle
+ * @var started_ms When the request was sent
+ * @var result How the request ended
+ */
+typedef struct {
+    CURL *curl_handle;          /**< Easy handle of the request */
+    http_transfer_t *transfer;  /**< Race the request belongs to */
+    int index;                  /**< 0 for the original request, 1 for the hedge */
+    int active;                 /**< Whether the handle is attached to the race's multi handle */
+    double started_ms;          /**< When the request was sent */
+    CURLcode result;            /**< How the request ended */
+} transfer_leg_t;
+
+void
+setup_http_timeouts (CURL *curl_handle, const api_config_t *config)
+{
+    curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS, config->connect_timeout_ms);
+    if (config->idle_timeout_ms > 0) {
+        curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME,
+                         (config->idle_timeout_ms + 999) / 1000);
+    }
+}
+
+static size_t
+transfer_leg_writer (char *buffer, size_t element_size, size_t element_count, void *user_data)
+{
+    transfer_leg_t *leg = (transfer_leg_t *)user_data;
+    http_transfer_t *transfer = leg->transfer;
+
+    /* The first request to produce a byte owns the output from then on */
+    if (transfer->winner < 0) {
+        transfer->winner = leg->index;
+        curl_easy_getinfo(leg->curl_handle, CURLINFO_RESPONSE_CODE, &transfer->status_code);
+    }
+    if (transfer->winner != leg->index) return 0;
+    return transfer->write_function(buffer, element_size, element_count, transfer->write_data);
+}
+
+static void
+record_transfer_status (http_transfer_t *transfer, CURL *curl_handle)
+{
+    curl_off_t retry_after = 0, first_byte_us = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &transfer->status_code);
+    curl_easy_getinfo(curl_handle, CURLINFO_RETRY_AFTER, &retry_after);
+    curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+    transfer->retry_after = (long)retry_after;
+    transfer->first_byte_ms = first_byte_us / 1000.0;
+    TRACE_TRANSFER(curl_handle);
+}
+
+static void
+start_leg (CURLM *multi_handle, transfer_leg_t *leg)
+{
+    leg->started_ms = monotonic_ms();
+    if (curl_multi_add_handle(multi_handle, leg->curl_handle) == CURLM_OK) {
+        leg->active = 1;
+    } else {
+        leg->result = CURLE_FAILED_INIT;
+    }
+}
+
+static void
+stop_leg (CURLM *multi_handle, transfer_leg_t *leg, CURLcode result)
+{
+    /* Detaching a transfer still in progress closes its connection or stream */
+    curl_multi_remove_handle(multi_handle, leg->curl_handle);
+    leg->active = 0;
+    leg->result = result;
+}
+
+static void
+send_hedge (CURLM *multi_handle, const api_config_t *config, transfer_leg_t *legs)
+{
+    /* The copy keeps every option and callback of the original, but not its key */
+    legs[1].curl_handle = curl_easy_duphandle(legs[0].curl_handle);
+    if (!legs[1].curl_handle) {
+        legs[1].result = CURLE_OUT_OF_MEMORY;
+        return;
+    }
+    curl_easy_setopt(legs[1].curl_handle, CURLOPT_URL, config->hedge_url);
+    curl_easy_setopt(legs[1].curl_handle, CURLOPT_HTTPHEADER, legs[0].transfer->hedge_headers);
+    curl_easy_setopt(legs[1].curl_handle, CURLOPT_WRITEDATA, &legs[1]);
+    start_leg(multi_handle, &legs[1]);
+}
+
+static CURLcode
+race_transfer (const api_config_t *config, int hedged, transfer_leg_t *legs)
+{
+    http_transfer_t *transfer = legs[0].transfer;
+    CURLM *multi_handle = curl_multi_init();
+    if (!multi_handle) return CURLE_OUT_OF_MEMORY;
+
+    int hedge_pending = hedged;
+    start_leg(multi_handle, &legs[0]);
+
+    while (legs[0].active || legs[1].active) {
+        int still_running = 0;
+        if (curl_multi_perform(multi_handle, &still_running) != CURLM_OK) {
+            for (int i = 0; i < 2; ++i) {
+                if (legs[i].active) stop_leg(multi_handle, &legs[i], CURLE_FAILED_INIT);
+            }
+            break;
+        }
+
+        CURLMsg *message;
+        int messages_left;
+        while ((message = curl_multi_info_read(multi_handle, &messages_left)) != NULL) {
+            if (message->msg != CURLMSG_DONE) continue;
+            transfer_leg_t *leg = message->easy_handle == legs[0].curl_handle ? &legs[0] : &legs[1];
+            stop_leg(multi_handle, leg, message->data.result);
+            /* A response that ends without a body byte wins as well */
+            if (transfer->winner < 0 && leg->result == CURLE_OK) transfer->winner = leg->index;
+        }
+
+        double now_ms = monotonic_ms();
+        long wait_ms = 1000;
+        if (transfer->winner >= 0) {
+            transfer_leg_t *loser = &legs[1 - transfer->winner];
+            if (loser->active) stop_leg(multi_handle, loser, CURLE_ABORTED_BY_CALLBACK);
+        } else {
+            for (int i = 0; i < 2 && config->first_byte_timeout_ms > 0; ++i) {
+                if (!legs[i].active) continue;
+                double remaining_ms = legs[i].started_ms + config->first_byte_timeout_ms - now_ms;
+                if (remaining_ms <= 0) {
+                    stop_leg(multi_handle, &legs[i], CURLE_OPERATION_TIMEDOUT);
+                } else if (remaining_ms < wait_ms) {
+                    wait_ms = (long)remaining_ms + 1;
+                }
+            }
+            if (hedge_pending) {
+                /* A failed original is hedged at once rather than after the delay */
+                double remaining_ms = legs[0].started_ms + config->hedge_delay_ms - now_ms;
+                if (remaining_ms <= 0 || !legs[0].active) {
+                    hedge_pending = 0;
+                    send_hedge(multi_handle, config, legs);
+                    wait_ms = 0;
+                } else if (remaining_ms < wait_ms) {
+                    wait_ms = (long)remaining_ms + 1;
+                }
+            }
+        }
+
+        if ((legs[0].active || legs[1].active) && wait_ms > 0) {
+            curl_multi_poll(multi_handle, NULL, 0, (int)wait_ms, NULL);
+        }
+    }
+
+    curl_multi_cleanup(multi_handle);
+
+    transfer_leg_t *delivered = transfer->winner >= 0 ? &legs[transfer->winner] : &legs[0];
+    record_transfer_status(transfer, delivered->curl_handle);
+    CURLcode result = delivered->result;
+    if (legs[1].curl_handle) curl_easy_cleanup(legs[1].curl_handle);
+    return result;
+}
+
+CURLcode
+http_client_perform (CURL *curl_handle, const api_config_t *config, int replayable,
+                     http_transfer_t *transfer)
+{
+    transfer->status_code = 0;
+    transfer->retry_after = 0;
+    transfer->first_byte_ms = 0;
+    transfer->winner = -1;
+
+    transfer_leg_t legs[2] = {
+        { .curl_handle = curl_handle, .transfer = transfer, .index = 0 },
+        { .curl_handle = NULL, .transfer = transfer, .index = 1 }
+    };
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, transfer_leg_writer);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &legs[0]);
+
+    int hedged = replayable && config->hedge_url && config->hedge_url[0] != '\0' &&
+                 transfer->hedge_headers;
+    if (hedged || (replayable && config->first_byte_timeout_ms > 0)) {
+        return race_transfer(config, hedged, legs);
+    }
 
     CURLcode result = curl_easy_perform(curl_handle);
+    record_transfer_status(transfer, curl_handle);
+    return result;
+}
+
+/*------------------------ Request execution ------------------------*/
+
+#define AUTHORIZATION_PREFIX "Authorization: Bearer "
+
+struct curl_slist *
+build_request_headers (const char *api_key, int compressed, int upload)
+{
+    /* Sized to the key: long tokens are sent whole, never cut to a fixed buffer */
+    size_t key_length = strlen(api_key);
+    char *auth_header = malloc(sizeof(AUTHORIZATION_PREFIX) + key_length);
+    if (!auth_header) return NULL;
+    memcpy(auth_header, AUTHORIZATION_PREFIX, sizeof(AUTHORIZATION_PREFIX) - 1);
+    memcpy(auth_header + sizeof(AUTHORIZATION_PREFIX) - 1, api_key, key_length + 1);
+
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+    struct curl_slist *tail = headers ? curl_slist_append(headers, auth_header) : NULL;
+    if (tail && upload) tail = curl_slist_append(headers, HTTP_UPLOAD_EXPECT_HEADER);
+    if (tail && compressed) tail = curl_slist_append(headers, HTTP_GZIP_ENCODING_HEADER);
+    free(auth_header);
+    if (!tail) {
+        curl_slist_free_all(headers);
+        return NULL;
+    }
+    return headers;
+}
+
+CURLcode
+perform_http_post (http_client_t *client, const api_config_t *config,
+                   const api_endpoint_t *endpoint,
+                   const char *payload, request_upload_t *upload,
+                   http_response_t *response)
+{
+    CURL *curl_handle = http_client_acquire(client);
+
+    request_body_t body = { .data = "", .length = 0 };
+    if (!upload) request_body_init(&body, config, payload);
+
+    /* Complete bodies use the endpoint's prebuilt list; only uploads need their own */
+    struct curl_slist *upload_headers = NULL;
+    struct curl_slist *header_list = endpoint->headers[body.compressed];
+    if (upload) {
+        upload_headers = build_request_headers(endpoint->api_key, 0, 1);
+        if (!upload_headers) return CURLE_OUT_OF_MEMORY;
+        header_list = upload_headers;
+    }
+
+    setup_http_post(curl_handle, endpoint->url, header_list, &body, response);
+    setup_http_timeouts(curl_handle, config);
+    if (upload) setup_http_upload(curl_handle, upload);
+
+    http_transfer_t transfer = {
+        .write_function = curl_data_writer,
+        .write_data = response,
+        .hedge_headers = config->hedge_headers[body.compressed]
+    };
+    CURLcode result = http_client_perform(curl_handle, config, upload == NULL, &transfer);
     if (result == CURLE_OK) {
-        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, 
-                         &response->status_code);
+        response->status_code = transfer.status_code;
+        response->retry_after = transfer.retry_after;
+        response->first_byte_ms = transfer.first_byte_ms;
     }
     
-    curl_slist_free_all(header_list);
-    curl_easy_cleanup(curl_handle);
+    curl_slist_free_all(upload_headers);
+    request_body_free(&body);
     return result;
 }
 
+/*------------------------ Request bodies ------------------------*/
+
+#define SYSTEM_MESSAGE_PREFIX "[{\"role\":\"system\",\"content\":"
+#define USER_MESSAGE_PREFIX "{\"role\":\"user\",\"content\":\""
+/* Attachment framing inside the user content, already JSON-escaped */
+#define ATTACHMENT_HEADER "\\n\\nFile: "
+#define ATTACHMENT_OPEN "\\n```\\n"
+#define ATTACHMENT_LINE_BREAK "\\n"
+#define ATTACHMENT_CLOSE "```"
+/* Stable-prefix framing: every file block first, then the question */
+#define STABLE_ATTACHMENT_HEADER "File: "
+#define STABLE_ATTACHMENT_CLOSE "```\\n\\n"
+#define STREAM_OPTIONS "{\"include_usage\":true}"
+/* Punctuation and keys making up the rest of a request body, as build_request_json writes them */
+#define BODY_OPEN "{\"model\":\"\",\"messages\":"
+#define SYSTEM_MESSAGE_CLOSE "\"\"},"
+#define BODY_CLOSE "],\"stream\":false}"
+#define STREAM_OPTIONS_MEMBER ",\"stream_options\":" STREAM_OPTIONS
+#define TOOLS_MEMBER ",\"tools\":"
+
+size_t
+user_message_json_size (const chat_request_params_t *params)
+{
+    size_t message_size = sizeof(USER_MESSAGE_PREFIX) + 2
+                        + json_escaped_length(params->user_query, strlen(params->user_query));
+    for (size_t i = 0; i < params->attachment_count; ++i) {
+        const input_file_t *file = &params->attachments[i];
+        message_size += sizeof(ATTACHMENT_HEADER) + sizeof(ATTACHMENT_OPEN)
+                      + sizeof(ATTACHMENT_LINE_BREAK) + sizeof(STABLE_ATTACHMENT_CLOSE)
+                      + json_escaped_length(file->path, strlen(file->path))
+                      + json_escaped_length(file->data, file->length);
+    }
+    return message_size;
+}
+
+/* A file's contents, ended with a line break unless it already has one, then the closing fence */
+static void
+write_attachment_body (json_writer_t *writer, const input_file_t *file,
+                       const char *close, size_t close_length)
+{
+    json_writer_escaped(writer, file->data, file->length);
+    if (file->length > 0 && file->data[file->length - 1] != '\n') {
+        json_writer_raw(writer, ATTACHMENT_LINE_BREAK, sizeof(ATTACHMENT_LINE_BREAK) - 1);
+    }
+    json_writer_raw(writer, close, close_length);
+}
+
+/* Attachment indices ordered by path, so the prefix does not depend on the -f order */
+static void
+sort_attachments_by_path (const chat_request_params_t *params, size_t *order)
+{
+    /* At most MAX_ATTACHMENTS files, so an insertion sort is plenty */
+    for (size_t i = 0; i < params->attachment_count; ++i) {
+        size_t j = i;
+        while (j > 0 && strcmp(params->attachments[i].path,
+                               params->attachments[order[j - 1]].path) < 0) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+static size_t
+write_stable_user_message (json_writer_t *writer, const chat_request_params_t *params)
+{
+    size_t order[MAX_ATTACHMENTS];
+    sort_attachments_by_path(params, order);
+
+    json_writer_raw(writer, USER_MESSAGE_PREFIX, sizeof(USER_MESSAGE_PREFIX) - 1);
+    for (size_t i = 0; i < params->attachment_count; ++i) {
+        const input_file_t *file = &params->attachments[order[i]];
+        json_writer_raw(writer, STABLE_ATTACHMENT_HEADER, sizeof(STABLE_ATTACHMENT_HEADER) - 1);
+        json_writer_escaped(writer, file->path, strlen(file->path));
+        json_writer_raw(writer, ATTACHMENT_OPEN, sizeof(ATTACHMENT_OPEN) - 1);
+        write_attachment_body(writer, file, STABLE_ATTACHMENT_CLOSE, sizeof(STABLE_ATTACHMENT_CLOSE) - 1);
+    }
+    size_t question_offset = writer->length;
+    json_writer_escaped(writer, params->user_query, strlen(params->user_query));
+    json_writer_raw(writer, "\"}", 2);
+    return question_offset;
+}
+
+size_t
+write_user_message_json (json_writer_t *writer, const chat_request_params_t *params)
+{
+    if (params->stable_prefix) return write_stable_user_message(writer, params);
+
+    json_writer_raw(writer, USER_MESSAGE_PREFIX, sizeof(USER_MESSAGE_PREFIX) - 1);
+    size_t question_offset = writer->length;
+    json_writer_escaped(writer, params->user_query, strlen(params->user_query));
+    for (size_t i = 0; i < params->attachment_count; ++i) {
+        const input_file_t *file = &params->attachments[i];
+        json_writer_raw(writer, ATTACHMENT_HEADER, sizeof(ATTACHMENT_HEADER) - 1);
+        json_writer_escaped(writer, file->path, strlen(file->path));
+        json_writer_raw(writer, ATTACHMENT_OPEN, sizeof(ATTACHMENT_OPEN) - 1);
+        write_attachment_body(writer, file, ATTACHMENT_CLOSE, sizeof(ATTACHMENT_CLOSE) - 1);
+    }
+    json_writer_raw(writer, "\"}", 2);
+    return question_offset;
+}
+
+/* Serialize the body; `question_offset` receives where the question text starts */
+static char *
+build_request_json (const api_config_t *config, const chat_request_params_t *params,
+                    int stream, arena_t *arena, size_t *question_offset)
+{
+    const char *system_prompt = params->custom_prompt ? params->custom_prompt : config->system_prompt;
+    size_t model_length = strlen(config->model_name);
+    size_t prompt_length = strlen(system_prompt);
+    size_t tools_length = params->tools ? strlen(params->tools) : 0;
+
+    /* Size the body up front so the query is escaped once, into its final place */
+    json_writer_t writer;
+    size_t body_size = sizeof(BODY_OPEN) - 1 + sizeof(SYSTEM_MESSAGE_PREFIX) - 1
+                     + sizeof(SYSTEM_MESSAGE_CLOSE) - 1 + sizeof(BODY_CLOSE) - 1
+                     + (stream ? sizeof(STREAM_OPTIONS_MEMBER) - 1 : 0)
+                     + (tools_length > 0 ? sizeof(TOOLS_MEMBER) - 1 + tools_length : 0)
+                     + json_escaped_length(config->model_name, model_length)
+                     + json_escaped_length(system_prompt, prompt_length)
+                     + params->history_length + user_message_json_size(params)
+                     + params->followup_length;
+    if (json_writer_init_arena(&writer, body_size, arena) != 0) return NULL;
+
+    json_writer_raw(&writer, "{", 1);
+    json_writer_key(&writer, "model");
+    json_writer_string(&writer, config->model_name, model_length);
+    json_writer_raw(&writer, ",", 1);
+    json_writer_key(&writer, "messages");
+    json_writer_raw(&writer, SYSTEM_MESSAGE_PREFIX, sizeof(SYSTEM_MESSAGE_PREFIX) - 1);
+    json_writer_string(&writer, system_prompt, prompt_length);
+    json_writer_raw(&writer, "},", 2);
+    /* Earlier turns are already serialized messages, each followed by a comma */
+    if (params->history_length > 0) {
+        json_writer_raw(&writer, params->history, params->history_length);
+    }
+    *question_offset = write_user_message_json(&writer, params);
+    if (params->followup_length > 0) {
+        json_writer_raw(&writer, params->followup, params->followup_length);
+    }
+    json_writer_raw(&writer, "],", 2);
+    json_writer_key(&writer, "stream");
+    json_writer_bool(&writer, stream);
+    if (stream) {
+        /* Ask for a final usage chunk so streaming can report token counts */
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "stream_options");
+        json_writer_raw(&writer, STREAM_OPTIONS, sizeof(STREAM_OPTIONS) - 1);
+    }
+    if (tools_length > 0) {
+        json_writer_raw(&writer, ",", 1);
+        json_writer_key(&writer, "tools");
+        json_writer_raw(&writer, params->tools, tools_length);
+    }
+    json_writer_raw(&writer, "}", 1);
+    return json_writer_finish(&writer);
+}
 
 char *
 construct_request_json (const api_config_t *config,
                         const chat_request_params_t *params,
-                        int stream)
+                        int stream, arena_t *arena)
 {
-    cJSON *root_object = cJSON_CreateObject();
-    if (!root_object) return NULL;
+    size_t question_offset;
+    TRACE_BEGIN(build_span);
+    char *request_json = build_request_json(config, params, stream, arena, &question_offset);
+    TRACE_END(build_span, "request json");
+    return request_json;
+}
 
-    if (!cJSON_AddStringToObject(root_object, "model", config->model_name)) goto error;
+/*------------------------ Streamed request bodies ------------------------*/
 
-    cJSON *message_array = cJSON_AddArrayToObject(root_object, "messages");
-    if (!message_array) goto error;
+int
+request_upload_init (request_upload_t *upload, const api_config_t *config,
+                     const chat_request_params_t *params, int stream, int input_fd)
+{
+    memset(upload, 0, sizeof(*upload));
+    upload->input_fd = input_fd;
+    upload->input_open = 1;
 
-    cJSON *system_message = cJSON_CreateObject();
-    if (!cJSON_AddStringToObject(system_message, "role", "system") ||
-        !cJSON_AddStringToObject(system_message, "content", 
-             params->custom_prompt ? params->custom_prompt : config->system_prompt)) {
-        cJSON_Delete(system_message);
-        goto error;
+    chat_request_params_t empty_question = *params;
+    empty_question.user_query = "";
+    TRACE_BEGIN(build_span);
+    upload->body = build_request_json(config, &empty_question, stream, NULL, &upload->question_offset);
+    TRACE_END(build_span, "request json");
+    upload->input_chunk = malloc(REQUEST_UPLOAD_CHUNK_SIZE);
+    if (!upload->body || !upload->input_chunk) {
+        request_upload_free(upload);
+        return -1;
     }
-    cJSON_AddItemToArray(message_array, system_message);
+    upload->body_length = strlen(upload->body);
+    return 0;
+}
+
+void
+request_upload_free (request_upload_t *upload)
+{
+    free(upload->body);
+    free(upload->input_chunk);
+    memset(upload, 0, sizeof(*upload));
+}
+
+static size_t
+read_upload_body (char *buffer, size_t element_size, size_t element_count, void *user_data)
+{
+    request_upload_t *upload = (request_upload_t *)user_data;
+    size_t capacity = element_size * element_count;
 
-    cJSON *user_message = cJSON_CreateObject();
-    if (!cJSON_AddStringToObject(user_message, "role", "user") ||
-        !cJSON_AddStringToObject(user_message, "content", params->user_query)) {
-        cJSON_Delete(user_message);
-        goto error;
+    /* The body up to the question, then the escaped input, then the rest */
+    size_t limit = upload->input_open ? upload->question_offset : upload->body_length;
+    if (upload->position < limit) {
+        size_t length = limit - upload->position;
+        if (length > capacity) length = capacity;
+        memcpy(buffer, upload->body + upload->position, length);
+        upload->position += length;
+        return length;
     }
-    cJSON_AddItemToArray(message_array, user_message);
 
-    if (stream) {
-        if (!cJSON_AddTrueToObject(root_object, "stream")) goto error;
-    } else {
-        if (!cJSON_AddFalseToObject(root_object, "stream")) goto error;
+    /* Escaped input that did not fit into the previous buffer goes first */
+    if (upload->pending_length > 0) {
+        size_t length = upload->pending_length < capacity ? upload->pending_length : capacity;
+        memcpy(buffer, upload->input_chunk + upload->pending_start, length);
+        upload->pending_start += length;
+        upload->pending_length -= length;
+        return length;
     }
+    if (!upload->input_open) return 0;
 
-    char *json_output = cJSON_PrintUnformatted(root_object);
-    cJSON_Delete(root_object);
-    return json_output;
+    /*
+     * Six output bytes per input byte cover the worst case, "\u00XX". A buffer
+     * too small for even one gets a single byte escaped behind it in
+     * input_chunk, since a zero-byte read would look like end of input.
+     */
+    size_t read_limit = capacity / 6;
+    int staged = read_limit == 0;
+    if (staged) read_limit = 1;
+    if (read_limit > REQUEST_UPLOAD_CHUNK_SIZE) read_limit = REQUEST_UPLOAD_CHUNK_SIZE;
+    while (1) {
+        ssize_t bytes_read = read(upload->input_fd, upload->input_chunk, read_limit);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read < 0) {
+            perror("Failed to read from standard input");
+            upload->failed = 1;
+            return CURL_READFUNC_ABORT;
+        }
+        if (bytes_read == 0) {
+            upload->input_open = 0;
+            return read_upload_body(buffer, element_size, element_count, user_data);
+        }
+        upload->input_bytes += (size_t)bytes_read;
+        if (!staged) return json_escape_into(buffer, upload->input_chunk, (size_t)bytes_read);
 
-error:
-    cJSON_Delete(root_object);
-    return NULL;
-}
\ No newline at end of file
+        upload->pending_start = 1;
+        upload->pending_length = json_escape_into(upload->input_chunk + 1, upload->input_chunk, 1);
+        return read_upload_body(buffer, element_size, element_count, user_data);
+    }
+}
+
+void
+setup_http_upload (CURL *curl_handle, request_upload_t *upload)
+{
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, NULL);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)-1);
+    curl_easy_setopt(curl_handle, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, read_upload_body);
+    curl_easy_setopt(curl_handle, CURLOPT_READDATA, upload);
+}
+
+/*------------------------ Compressed request bodies ------------------------*/
+
+/* gzip-encode a buffer; NULL when zlib fails */
+static char *
+gzip_buffer (const char *data, size_t length, size_t *compressed_length)
+{
+    if (length > UINT_MAX) return NULL;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    /* 16 added to the window bits selects the gzip wrapper */
+    if (deflateInit2(&stream, REQUEST_GZIP_LEVEL, Z_DEFLATED, MAX_WBITS + 16,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    uLong capacity = deflateBound(&stream, (uLong)length);
+    char *output = malloc(capacity);
+    if (!output) {
+        deflateEnd(&stream);
+        return NULL;
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = (Bytef *)output;
+    stream.avail_out = (uInt)capacity;
+
+    int status = deflate(&stream, Z_FINISH);
+    *compressed_length = stream.total_out;
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+void
+request_body_init (request_body_t *body, const api_config_t *config, const char *payload)
+{
+    body->data = payload;
+    body->length = strlen(payload);
+    body->compressed = 0;
+    if (config->compress_request_min <= 0 ||
+        body->length < (size_t)config->compress_request_min) {
+        return;
+    }
+
+    size_t compressed_length = 0;
+    char *compressed = gzip_buffer(payload, body->length, &compressed_length);
+    if (!compressed || compressed_length >= body->length) {
+        free(compressed);
+        return;
+    }
+    body->data = compressed;
+    body->length = compressed_length;
+    body->compressed = 1;
+}
+
+void
+request_body_free (request_body_t *body)
+{
+    if (body->compressed) free((char *)body->data);
+    body->data = NULL;
+    body->length = 0;
+    body->compressed = 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * @file input_file.c
+ * @brief Input file module implementation
+ * @author Rouge Lin
+ * @date 2025-04-09
+ */
+
+#include "input_file.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*------------------------ Attached files ------------------------*/
+
+int
+input_file_open (input_file_t *file, const char *path)
+{
+    memset(file, 0, sizeof(*file));
+    file->path = path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "%s: Not a regular file\n", path);
+        close(fd);
+        return -1;
+    }
+
+    /* An empty file cannot be mapped, but it is a valid attachment */
+    file->data = "";
+    if (file_stat.st_size > 0) {
+        void *mapping = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        madvise(mapping, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+        file->data = mapping;
+        file->length = (size_t)file_stat.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+void
+input_file_close (input_file_t *file)
+{
+    if (file->length > 0) munmap((void *)file->data, file->length);
+    memset(file, 0, sizeof(*file));
+}
+
+/*------------------------ Whole-stream reads ------------------------*/
+
+#define STDIN_INITIAL_SIZE 4096
+
+/* Read a stream to its end into one NUL-terminated buffer; NULL on failure */
+static char *
+read_stream (FILE *stream, size_t *length)
+{
+    /* A regular file tells us its size; one extra byte detects growth and holds the NUL */
+    struct stat input_stat;
+    size_t capacity = STDIN_INITIAL_SIZE;
+    if (fstat(fileno(stream), &input_stat) == 0 && S_ISREG(input_stat.st_mode) &&
+        input_stat.st_size > 0) {
+        capacity = (size_t)input_stat.st_size + 1;
+    }
+
+    size_t size = 0;
+    char *buffer = malloc(capacity);
+    if (!buffer) return NULL;
+
+    while (1) {
+        size += fread(buffer + size, 1, capacity - 1 - size, stream);
+        if (ferror(stream)) {
+            free(buffer);
+            return NULL;
+        }
+        if (size < capacity - 1) break;
+
+        /* Full: a successful probe read means the input really is longer */
+        int next_char = fgetc(stream);
+        if (next_char == EOF) {
+            if (ferror(stream)) {
+                free(buffer);
+                return NULL;
+            }
+            break;
+        }
+
+        capacity *= 2;
+        char *temp = realloc(buffer, capacity);
+        if (!temp) {
+            free(buffer);
+            return NULL;
+        }
+        buffer = temp;
+        buffer[size++] = (char)next_char;
+    }
+
+    buffer[size] = '\0';
+    if (length) *length = size;
+    return buffer;
+}
+
+char *
+read_stdin (void)
+{
+    return read_stream(stdin, NULL);
+}
+
+char *
+read_file (const char *path, size_t *length)
+{
+    FILE *input = fopen(path, "rb");
+    if (!input) {
+        perror(path);
+        return NULL;
+    }
+    char *data = read_stream(input, length);
+    if (!data) perror(path);
+    fclose(input);
+    return data;
+}
@@ -0,0 +1,296 @@
+/**
+ * @file json_scan.c
+ * @brief Allocation-free JSON scanner implementation
+ * @note Bounds-checked against the end pointer; never writes to the input
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#include "json_scan.h"
+#include <limits.h>
+#include <string.h>
+
+/*------------------------ Scanner primitives ------------------------*/
+
+static void
+skip_whitespace (json_scanner_t *scanner)
+{
+    while (scanner->cursor < scanner->end &&
+           (*scanner->cursor == ' ' || *scanner->cursor == '\t' ||
+            *scanner->cursor == '\n' || *scanner->cursor == '\r')) {
+        scanner->cursor++;
+    }
+}
+
+/* Move past a string whose opening quote is at the cursor */
+static int
+skip_string (json_scanner_t *scanner)
+{
+    const char *cursor = scanner->cursor + 1;
+    while (cursor < scanner->end) {
+        const char *quote = memchr(cursor, '"', (size_t)(scanner->end - cursor));
+        if (!quote) return -1;
+
+        /* The quote is escaped when preceded by an odd number of backslashes */
+        size_t backslashes = 0;
+        for (const char *back = quote - 1; back >= cursor && *back == '\\'; --back) {
+            backslashes++;
+        }
+        cursor = quote + 1;
+        if (backslashes % 2 == 0) {
+            scanner->cursor = cursor;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void
+json_scan_init (json_scanner_t *scanner, const char *text, size_t length)
+{
+    scanner->cursor = text;
+    scanner->end = text + length;
+}
+
+json_scan_type_t
+json_scan_peek (json_scanner_t *scanner)
+{
+    skip_whitespace(scanner);
+    if (scanner->cursor >= scanner->end) return JSON_SCAN_INVALID;
+
+    switch (*scanner->cursor) {
+    case '{': return JSON_SCAN_OBJECT;
+    case '[': return JSON_SCAN_ARRAY;
+    case '"': return JSON_SCAN_STRING;
+    case 'n': return JSON_SCAN_NULL;
+    case 't':
+    case 'f': return JSON_SCAN_BOOL;
+    default:
+        if (*scanner->cursor == '-' || (*scanner->cursor >= '0' && *scanner->cursor <= '9')) {
+            return JSON_SCAN_NUMBER;
+        }
+        return JSON_SCAN_INVALID;
+    }
+}
+
+int
+json_scan_enter (json_scanner_t *scanner, json_scan_type_t type)
+{
+    if (json_scan_peek(scanner) != type ||
+        (type != JSON_SCAN_OBJECT && type != JSON_SCAN_ARRAY)) {
+        return -1;
+    }
+    scanner->cursor++;
+    return 0;
+}
+
+int
+json_scan_next_member (json_scanner_t *scanner, json_span_t *key)
+{
+    skip_whitespace(scanner);
+    if (scanner->cursor < scanner->end && *scanner->cursor == ',') {
+        scanner->cursor++;
+        skip_whitespace(scanner);
+    }
+    if (scanner->cursor >= scanner->end) return -1;
+    if (*scanner->cursor == '}') {
+        scanner->cursor++;
+        return 0;
+    }
+
+    if (json_scan_string(scanner, key) != 0) return -1;
+    skip_whitespace(scanner);
+    if (scanner->cursor >= scanner->end || *scanner->cursor != ':') return -1;
+    scanner->cursor++;
+    return 1;
+}
+
+int
+json_scan_next_element (json_scanner_t *scanner)
+{
+    skip_whitespace(scanner);
+    if (scanner->cursor < scanner->end && *scanner->cursor == ',') {
+        scanner->cursor++;
+        skip_whitespace(scanner);
+    }
+    if (scanner->cursor >= scanner->end) return -1;
+    if (*scanner->cursor == ']') {
+        scanner->cursor++;
+        return 0;
+    }
+    return 1;
+}
+
+int
+json_scan_skip (json_scanner_t *scanner)
+{
+    json_scan_type_t type = json_scan_peek(scanner);
+    if (type == JSON_SCAN_INVALID) return -1;
+    if (type == JSON_SCAN_STRING) return skip_string(scanner);
+
+    if (type != JSON_SCAN_OBJECT && type != JSON_SCAN_ARRAY) {
+        /* Scalars run until the next structural character */
+        while (scanner->cursor < scanner->end &&
+               !strchr(",}] \t\r\n", *scanner->cursor)) {
+            scanner->cursor++;
+        }
+        return 0;
+    }
+
+    /* Containers are skipped iteratively so deep nesting cannot exhaust the stack */
+    size_t depth = 0;
+    while (scanner->cursor < scanner->end) {
+        char current = *scanner->cursor;
+        if (current == '"') {
+            if (skip_string(scanner) != 0) return -1;
+            continue;
+        }
+        scanner->cursor++;
+        if (current == '{' || current == '[') {
+            depth++;
+        } else if (current == '}' || current == ']') {
+            if (--depth == 0) return 0;
+        }
+    }
+    return -1;
+}
+
+int
+json_scan_string (json_scanner_t *scanner, json_span_t *value)
+{
+    if (json_scan_peek(scanner) != JSON_SCAN_STRING) return -1;
+
+    const char *start = scanner->cursor + 1;
+    if (skip_string(scanner) != 0) return -1;
+    value->start = start;
+    value->length = (size_t)(scanner->cursor - 1 - start);
+    return 0;
+}
+
+int
+json_scan_integer (json_scanner_t *scanner, long *value)
+{
+    if (json_scan_peek(scanner) != JSON_SCAN_NUMBER) return -1;
+
+    int negative = 0;
+    if (*scanner->cursor == '-') {
+        negative = 1;
+        scanner->cursor++;
+    }
+
+    /* Digits beyond what a long holds saturate rather than overflow */
+    long result = 0;
+    while (scanner->cursor < scanner->end &&
+           *scanner->cursor >= '0' && *scanner->cursor <= '9') {
+        int digit = *scanner->cursor - '0';
+        result = result > (LONG_MAX - digit) / 10 ? LONG_MAX : result * 10 + digit;
+        scanner->cursor++;
+    }
+    /* Fraction and exponent parts are not needed by any caller */
+    while (scanner->cursor < scanner->end && strchr(".eE+-0123456789", *scanner->cursor)) {
+        scanner->cursor++;
+    }
+
+    *value = negative ? -result : result;
+    return 0;
+}
+
+int
+json_span_equals (const json_span_t *key, const char *literal)
+{
+    size_t literal_length = strlen(literal);
+    return key->length == literal_length && memcmp(key->start, literal, literal_length) == 0;
+}
+
+/*------------------------ String decoding ------------------------*/
+
+static int
+parse_hex4 (const char *text, unsigned int *code_point)
+{
+    unsigned int value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char digit = text[i];
+        value <<= 4;
+        if (digit >= '0' && digit <= '9') value |= (unsigned int)(digit - '0');
+        else if (digit >= 'a' && digit <= 'f') value |= (unsigned int)(digit - 'a' + 10);
+        else if (digit >= 'A' && digit <= 'F') value |= (unsigned int)(digit - 'A' + 10);
+        else return -1;
+    }
+    *code_point = value;
+    return 0;
+}
+
+static size_t
+encode_utf8 (char *destination, unsigned int code_point)
+{
+    if (code_point < 0x80) {
+        destination[0] = (char)code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        destination[0] = (char)(0xC0 | (code_point >> 6));
+        destination[1] = (char)(0x80 | (code_point & 0x3F));
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        destination[0] = (char)(0xE0 | (code_point >> 12));
+        destination[1] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+        destination[2] = (char)(0x80 | (code_point & 0x3F));
+        return 3;
+    }
+    destination[0] = (char)(0xF0 | (code_point >> 18));
+    destination[1] = (char)(0x80 | ((code_point >> 12) & 0x3F));
+    destination[2] = (char)(0x80 | ((code_point >> 6) & 0x3F));
+    destination[3] = (char)(0x80 | (code_point & 0x3F));
+    return 4;
+}
+
+size_t
+json_unescape (char *destination, const char *source, size_t length)
+{
+    const char *end = source + length;
+    char *output = destination;
+
+    while (source < end) {
+        const char *backslash = memchr(source, '\\', (size_t)(end - source));
+        size_t literal_length = backslash ? (size_t)(backslash - source) : (size_t)(end - source);
+        if (output != source) memmove(output, source, literal_length);
+        output += literal_length;
+        source += literal_length;
+        if (!backslash) break;
+
+        if (end - source < 2) return (size_t)-1;
+        char escape = source[1];
+        source += 2;
+        switch (escape) {
+        case '"':  *output++ = '"';  break;
+        case '\\': *output++ = '\\'; break;
+        case '/':  *output++ = '/';  break;
+        case 'b':  *output++ = '\b'; break;
+        case 'f':  *output++ = '\f'; break;
+        case 'n':  *output++ = '\n'; break;
+        case 'r':  *output++ = '\r'; break;
+        case 't':  *output++ = '\t'; break;
+        case 'u': {
+            unsigned int code_point;
+            if (end - source < 4 || parse_hex4(source, &code_point) != 0) return (size_t)-1;
+            source += 4;
+            if (code_point >= 0xD800 && code_point <= 0xDBFF) {
+                unsigned int low_surrogate;
+                if (end - source < 6 || source[0] != '\\' || source[1] != 'u' ||
+                    parse_hex4(source + 2, &low_surrogate) != 0 ||
+                    low_surrogate < 0xDC00 || low_surrogate > 0xDFFF) {
+                    return (size_t)-1;
+                }
+                source += 6;
+                code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low_surrogate - 0xDC00);
+            }
+            output += encode_utf8(output, code_point);
+            break;
+        }
+        default:
+            return (size_t)-1;
+        }
+    }
+    return (size_t)(output - destination);
+}
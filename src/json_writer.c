@@ -0,0 +1,200 @@
+/**
+ * @file json_writer.c
+ * @brief Direct JSON writer implementation
+ * @author Rouge Lin
+ * @date 2025-04-09
+ */
+
+#include "json_writer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*------------------------ Buffer management ------------------------*/
+
+static int
+reserve_output (json_writer_t *writer, size_t additional)
+{
+    if (writer->failed) return -1;
+
+    size_t required = writer->length + additional + 1;
+    if (required <= writer->capacity) return 0;
+
+    size_t new_capacity = writer->capacity * 2 > 256 ? writer->capacity * 2 : 256;
+    while (new_capacity < required) new_capacity *= 2;
+    char *new_data = writer->arena ? arena_alloc(writer->arena, new_capacity)
+                                   : realloc(writer->data, new_capacity);
+    if (!new_data) {
+        writer->failed = 1;
+        return -1;
+    }
+    if (writer->arena) memcpy(new_data, writer->data, writer->length + 1);
+    writer->data = new_data;
+    writer->capacity = new_capacity;
+    return 0;
+}
+
+int
+json_writer_init (json_writer_t *writer, size_t size_hint)
+{
+    return json_writer_init_arena(writer, size_hint, NULL);
+}
+
+int
+json_writer_init_arena (json_writer_t *writer, size_t size_hint, arena_t *arena)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->arena = arena;
+
+    /* Exactly the hint: a body sized in advance neither grows nor carries slack */
+    writer->data = arena ? arena_alloc(arena, size_hint + 1) : malloc(size_hint + 1);
+    if (!writer->data) {
+        writer->failed = 1;
+        return -1;
+    }
+    writer->data[0] = '\0';
+    writer->capacity = size_hint + 1;
+    return 0;
+}
+
+void
+json_writer_reset (json_writer_t *writer)
+{
+    writer->length = 0;
+    writer->failed = 0;
+    if (writer->data) writer->data[0] = '\0';
+}
+
+char *
+json_writer_finish (json_writer_t *writer)
+{
+    char *text = writer->failed ? NULL : writer->data;
+    if (!text && !writer->arena) free(writer->data);
+    memset(writer, 0, sizeof(*writer));
+    return text;
+}
+
+/*------------------------ Value output ------------------------*/
+
+/* Bytes that cannot appear literally inside a JSON string */
+static int
+needs_escape (unsigned char character)
+{
+    return character < 0x20 || character == '"' || character == '\\';
+}
+
+size_t
+json_escaped_length (const char *text, size_t length)
+{
+    size_t escaped_length = length;
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char character = (unsigned char)text[i];
+        if (!needs_escape(character)) continue;
+
+        switch (character) {
+        case '"': case '\\': case '\b': case '\f':
+        case '\n': case '\r': case '\t':
+            escaped_length += 1;
+            break;
+        default:
+            escaped_length += 5;
+            break;
+        }
+    }
+    return escaped_length;
+}
+
+void
+json_writer_raw (json_writer_t *writer, const char *text, size_t length)
+{
+    if (reserve_output(writer, length) != 0) return;
+
+    memcpy(writer->data + writer->length, text, length);
+    writer->length += length;
+    writer->data[writer->length] = '\0';
+}
+
+size_t
+json_escape_into (char *output, const char *text, size_t length)
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    char *start = output;
+    const char *end = text + length;
+    while (text < end) {
+        /* Copy runs of plain bytes in one go; escapes are rare in prose and code */
+        const char *run = text;
+        while (text < end && !needs_escape((unsigned char)*text)) text++;
+        memcpy(output, run, (size_t)(text - run));
+        output += text - run;
+        if (text == end) break;
+
+        unsigned char character = (unsigned char)*text++;
+        *output++ = '\\';
+        switch (character) {
+        case '"':  *output++ = '"';  break;
+        case '\\': *output++ = '\\'; break;
+        case '\b': *output++ = 'b';  break;
+        case '\f': *output++ = 'f';  break;
+        case '\n': *output++ = 'n';  break;
+        case '\r': *output++ = 'r';  break;
+        case '\t': *output++ = 't';  break;
+        default:
+            /* Written by hand: sprintf's terminator could overrun an exact-size buffer */
+            *output++ = 'u';
+            *output++ = '0';
+            *output++ = '0';
+            *output++ = hex_digits[character >> 4];
+            *output++ = hex_digits[character & 0x0F];
+            break;
+        }
+    }
+    return (size_t)(output - start);
+}
+
+void
+json_writer_escaped (json_writer_t *writer, const char *text, size_t length)
+{
+    if (reserve_output(writer, json_escaped_length(text, length)) != 0) return;
+
+    writer->length += json_escape_into(writer->data + writer->length, text, length);
+    writer->data[writer->length] = '\0';
+}
+
+void
+json_writer_string (json_writer_t *writer, const char *text, size_t length)
+{
+    json_writer_raw(writer, "\"", 1);
+    json_writer_escaped(writer, text, length);
+    json_writer_raw(writer, "\"", 1);
+}
+
+void
+json_writer_key (json_writer_t *writer, const char *key)
+{
+    size_t key_length = strlen(key);
+    if (reserve_output(writer, key_length + 3) != 0) return;
+
+    char *output = writer->data + writer->length;
+    *output++ = '"';
+    memcpy(output, key, key_length);
+    output += key_length;
+    *output++ = '"';
+    *output++ = ':';
+    *output = '\0';
+    writer->length = (size_t)(output - writer->data);
+}
+
+void
+json_writer_integer (json_writer_t *writer, long value)
+{
+    char digits[24];
+    int digit_count = snprintf(digits, sizeof(digits), "%ld", value);
+    json_writer_raw(writer, digits, (size_t)digit_count);
+}
+
+void
+json_writer_bool (json_writer_t *writer, int value)
+{
+    if (value) json_writer_raw(writer, "true", 4);
+    else json_writer_raw(writer, "false", 5);
+}
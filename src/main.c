@@ -10,14 +10,137 @@
 #include "http_client.h"
 #include "api_handler.h"
 #include "stream_handler.h"
+#include "batch_handler.h"
+#include "bench.h"
+#include "daemon_server.h"
+#include "input_file.h"
+#include "session.h"
+#include "repl.h"
+#include "fanout.h"
+#include "tools.h"
+#include "map_reduce.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 #include <getopt.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
 
 
-#define MAX_INPUT_SIZE 1024*1024 // 1MB
+/**
+ * @struct cli_options_t
+ * @brief Options collected from the command line
+ * @var print_config Print configuration flag
+ * @var show_tokens Show token statistics flag
+ * @var echo_input Echo input flag
+ * @var dry_run Dry run flag
+ * @var store_forward Non-streaming mode flag
+ * @var batch_path JSONL batch input file (optional)
+ * @var output_dir Batch output directory (optional)
+ * @var concurrency Maximum concurrent requests in batch mode
+ * @var run_daemon Run as the resident daemon flag
+ * @var no_daemon Never forward to a running daemon flag
+ * @var no_cache Bypass the response cache flag
+ * @var attachment_paths Files attached with -f, in command-line order
+ * @var attachment_count Number of attached files
+ * @var session_name Conversation session to continue (optional)
+ * @var pipeline Send standard input while it is still being read flag
+ * @var trace_startup Report where the startup time went flag
+ * @var interactive Read questions from standard input until it ends flag
+ * @var fanout Send the question as several concurrent requests flag
+ * @var fanout_models Models named with --models
+ * @var fanout_model_count Number of models named with --models
+ * @var samples Requests sent per model with --samples
+ * @var fanout_mode Which fan-out answers are shown
+ * @var format How the answer is written to standard output
+ * @var stable_prefix Lay attachments out ahead of the question for context caching flag
+ * @var stats_format Summary of the recorded spans written on exit (--stats)
+ * @var trace_path Chrome trace-event file written on exit (optional)
+ * @var tools_path File of tool definitions offered to the model (optional)
+ * @var chunk_tokens Split standard input into parts of this many tokens (0 for no splitting)
+ * @var user_query User question string
+ */
+typedef struct {
+    int print_config;       /**< Print configuration flag */
+    int show_tokens;        /**< Show token statistics flag */
+    int echo_input;         /**< Echo input flag */
+    int dry_run;            /**< Dry run flag */
+    int store_forward;      /**< Non-streaming mode flag */
+    const char *batch_path; /**< JSONL batch input file (optional) */
+    const char *output_dir; /**< Batch output directory (optional) */
+    int concurrency;        /**< Maximum concurrent requests in batch mode */
+    int run_daemon;         /**< Run as the resident daemon flag */
+    int no_daemon;          /**< Never forward to a running daemon flag */
+    int no_cache;           /**< Bypass the response cache flag */
+    const char *attachment_paths[MAX_ATTACHMENTS]; /**< Files attached with -f, in command-line order */
+    size_t attachment_count;                       /**< Number of attached files */
+    const char *session_name; /**< Conversation session to continue (optional) */
+    int pipeline;           /**< Send standard input while it is still being read flag */
+    int trace_startup;      /**< Report where the startup time went flag */
+    int interactive;        /**< Read questions from standard input until it ends flag */
+    int fanout;             /**< Send the question as several concurrent requests flag */
+    char *fanout_models[FANOUT_MAX_VARIANTS]; /**< Models named with --models */
+    size_t fanout_model_count;                /**< Number of models named with --models */
+    int samples;            /**< Requests sent per model with --samples */
+    fanout_mode_t fanout_mode; /**< Which fan-out answers are shown */
+    output_format_t format; /**< How the answer is written to standard output */
+    int stable_prefix;      /**< Lay attachments out ahead of the question for context caching flag */
+    trace_format_t stats_format; /**< Summary of the recorded spans written on exit (--stats) */
+    const char *trace_path; /**< Chrome trace-event file written on exit (optional) */
+    const char *tools_path; /**< File of tool definitions offered to the model (optional) */
+    size_t chunk_tokens;    /**< Split standard input into parts of this many tokens (0 for no splitting) */
+    char *user_query;       /**< User question string */
+} cli_options_t;
+
+/**
+ * @brief Identifiers of options that have no short form
+ */
+enum {
+    OPTION_DAEMON = 256,  /**< --daemon */
+    OPTION_NO_DAEMON,     /**< --no-daemon */
+    OPTION_SESSION,       /**< --session */
+    OPTION_NO_CACHE,      /**< --no-cache */
+    OPTION_PIPELINE,      /**< --pipeline */
+    OPTION_TRACE_STARTUP, /**< --trace-startup */
+    OPTION_MODELS,        /**< --models */
+    OPTION_SAMPLES,       /**< --samples */
+    OPTION_FANOUT,        /**< --fanout */
+    OPTION_FORMAT,        /**< --format */
+    OPTION_STABLE_PREFIX, /**< --stable-prefix */
+    OPTION_STATS,         /**< --stats */
+    OPTION_TRACE_FILE,    /**< --trace-file */
+    OPTION_TOOLS,         /**< --tools */
+    OPTION_CHUNK_SIZE     /**< --chunk-size */
+};
+
+/**
+ * @def MAX_STARTUP_PHASES
+ * @brief Most phases a startup trace records
+ */
+#define MAX_STARTUP_PHASES 8
+
+/**
+ * @struct startup_trace_t
+ * @brief Time spent in each phase before the request is sent
+ * @var enabled Whether --trace-startup was given
+ * @var phases Phase names, in order
+ * @var durations_ms Time spent in each phase
+ * @var count Number of recorded phases
+ * @var started_ms When main was entered
+ * @var last_ms When the previous phase ended
+ */
+typedef struct {
+    int enabled;                                /**< Whether --trace-startup was given */
+    const char *phases[MAX_STARTUP_PHASES];     /**< Phase names, in order */
+    double durations_ms[MAX_STARTUP_PHASES];    /**< Time spent in each phase */
+    size_t count;                               /**< Number of recorded phases */
+    double started_ms;                          /**< When main was entered */
+    double last_ms;                             /**< When the previous phase ended */
+} startup_trace_t;
+
+static startup_trace_t startup_trace;
 
 /**
  * @brief Print usage instructions
@@ -32,23 +155,53 @@ static void show_usage (const char *program_name, FILE *output_stream, int exit_
  * @brief Parse command-line arguments
  * @param argc Number of arguments
  * @param argv List of arguments
- * @param print_config Print configuration flag
- * @param show_tokens Show token statistics flag
- * @param echo_input Echo input flag
- * @param dry_run Dry run flag
- * @param store_forward Non-streaming mode flag
- * @param user_query User question string
+ * @param options Output parameter receiving the parsed options
  * @return 0 on success, -1 on failure
  */
-static int parse_cli_arguments (int argc, char **argv,
-                                int *print_config, int *show_tokens, int *echo_input,
-                                int *dry_run, int *store_forward, char **user_query);
+static int parse_cli_arguments (int argc, char **argv, cli_options_t *options);
 
 /**
- * @brief Read all content from standard input
- * @return Dynamically allocated string with stdin content, NULL on failure
+ * @brief Run batch mode with the loaded configuration
+ * @param config Pointer to the API configuration structure
+ * @param options Pointer to the parsed command-line options
+ * @return EXIT_SUCCESS if every job succeeded, EXIT_FAILURE otherwise
  */
-static char *read_stdin(void);
+static int run_batch_mode (const api_config_t *config, const cli_options_t *options);
+
+/**
+ * @brief Run interactive mode with the loaded configuration and client
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param options Pointer to the parsed command-line options
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int run_interactive_mode (http_client_t *client, const api_config_t *config,
+                                 const cli_options_t *options);
+
+/**
+ * @brief Answer the question about standard input, split into parts
+ * @param client Pointer to the reusable HTTP client
+ * @param config Pointer to the API configuration structure
+ * @param options Pointer to the parsed command-line options
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int run_chunked_mode (http_client_t *client, const api_config_t *config,
+                             const cli_options_t *options);
+
+/**
+ * @brief Close the current startup phase
+ * @param phase Name of the phase that just ended
+ * @return void
+ */
+static void mark_startup_phase (const char *phase);
+
+/**
+ * @brief Print the startup trace on standard error, once
+ * @param void
+ * @return void
+ * @note Does nothing unless --trace-startup was given
+ */
+static void report_startup_trace (void);
 
 /*------------------------ Main program entry point ------------------------*/
 
@@ -61,134 +214,270 @@ static char *read_stdin(void);
 int
 main (int argc, char **argv)
 {
+    startup_trace.started_ms = startup_trace.last_ms = monotonic_ms();
     srand(time(NULL));
 
-    int print_config = 0, show_tokens = 0, echo_input = 0;
-    int dry_run = 0, store_forward = 0;
-    char *user_question = NULL;
-    char *stdin_input = NULL;
+    cli_options_t options = { .concurrency = DEFAULT_BATCH_CONCURRENCY, .samples = 1 };
 
-    if (parse_cli_arguments(argc, argv, &print_config, 
-                           &show_tokens, &echo_input, &dry_run, 
-                           &store_forward, &user_question) != 0) {
-        return EXIT_FAILURE;
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return run_bench_command(argc - 1, argv + 1);
     }
 
-    // if use - , read from stdin
-    if (strcmp(user_question, "-") == 0) {
-        stdin_input = read_stdin();
-        if (!stdin_input) {
-            fprintf(stderr, "Failed to read from standard input\n");
-            return EXIT_FAILURE;
-        }
-        user_question = stdin_input;
+    if (parse_cli_arguments(argc, argv, &options) != 0) {
+        return EXIT_FAILURE;
     }
 
-    if (print_config) {
-        const char *config_path = locate_config_file();
-        if (!config_path) {
-            fprintf(stderr, "Configuration file not found\n");
-            SAFE_FREE(stdin_input);
-            return EXIT_FAILURE;
-        }
+    /* Everything below is released once, at done */
+    int exit_status = EXIT_FAILURE;
+    char *stdin_input = NULL;
+    api_config_t *config = NULL;
+    http_client_t *http_client = NULL;
+    input_file_t attachments[MAX_ATTACHMENTS];
+    size_t opened_count = 0;
+    session_t session = { .history = "" };
+    tool_set_t tool_set = { .tools = NULL };
+    request_upload_t upload = { .body = NULL };
+    char *reply_text = NULL;
+    /* The request body lives here rather than on the heap */
+    arena_t request_arena;
+    arena_init(&request_arena, 0);
+
+    char *user_question = options.user_query;
+    int question_from_stdin = user_question && strcmp(user_question, "-") == 0;
+    startup_trace.enabled = options.trace_startup;
+    mark_startup_phase("arguments");
+    if (options.stats_format != TRACE_FORMAT_NONE || options.trace_path) {
+        trace_start(options.stats_format, options.trace_path);
+    }
 
-        api_config_t *config = load_configuration(config_path);
-        if (!config) {
-            fprintf(stderr, "Failed to load configuration\n");
-            SAFE_FREE(stdin_input);
-            return EXIT_FAILURE;
+    int stream_enabled = !options.store_forward;
+    /* The daemon only receives the question text and prints plain text, so everything else stays local */
+    if (!options.run_daemon && !options.no_daemon && !options.batch_path && !options.dry_run &&
+        !options.print_config && !options.interactive && options.attachment_count == 0 &&
+        !options.session_name && !options.pipeline && !options.fanout &&
+        options.format == OUTPUT_FORMAT_TEXT && options.stats_format == TRACE_FORMAT_NONE &&
+        !options.trace_path && !options.tools_path && options.chunk_tokens == 0) {
+        char socket_path[PATH_MAX];
+        /* The daemon answers only for the configuration file this run would load */
+        const char *daemon_config_path = locate_config_file();
+        if (daemon_config_path &&
+            resolve_daemon_socket_path(socket_path, sizeof(socket_path)) == 0 &&
+            daemon_socket_present(socket_path)) {
+            // if use - , read from stdin
+            if (question_from_stdin) {
+                stdin_input = read_stdin();
+                if (!stdin_input) {
+                    fprintf(stderr, "Failed to read from standard input\n");
+                    goto done;
+                }
+                user_question = stdin_input;
+            }
+            if (options.echo_input) {
+                printf("\nInput: %s\n", user_question);
+            }
+            daemon_request_t daemon_request = {
+                .user_query = user_question,
+                .stream = stream_enabled,
+                .show_tokens = options.show_tokens,
+                .no_cache = options.no_cache,
+                .config_path = daemon_config_path
+            };
+            mark_startup_phase("daemon probe");
+            report_startup_trace();
+            int daemon_result = forward_to_daemon(socket_path, &daemon_request);
+            if (daemon_result >= 0) {
+                exit_status = daemon_result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                goto done;
+            }
+            /* No daemon running, or not ours: answer the question in this process */
+            options.echo_input = 0;
         }
-
-        dump_configuration_json(config);
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
-        return EXIT_SUCCESS;
     }
 
     const char *config_path = locate_config_file();
     if (!config_path) {
         fprintf(stderr, "Configuration file not found\n");
-        SAFE_FREE(stdin_input);
-        return EXIT_FAILURE;
+        goto done;
     }
+    mark_startup_phase("config lookup");
 
-    api_config_t *config = load_configuration(config_path);
+    if (options.run_daemon) {
+        char socket_path[PATH_MAX];
+        if (resolve_daemon_socket_path(socket_path, sizeof(socket_path)) != 0) {
+            fprintf(stderr, "Daemon socket path too long\n");
+            goto done;
+        }
+        if (run_daemon_server(config_path, socket_path) == 0) exit_status = EXIT_SUCCESS;
+        goto done;
+    }
+
+    config = load_configuration_cached(config_path);
+    if (options.print_config && config) {
+        dump_configuration_json(config);
+        exit_status = EXIT_SUCCESS;
+        goto done;
+    }
     if (!config || !config->api_key || !config->base_url) {
         fprintf(stderr, "Invalid configuration parameters\n");
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
-        return EXIT_FAILURE;
+        goto done;
+    }
+    mark_startup_phase(config->snapshot ? "config (snapshot)" : "config (parsed)");
+
+    if (options.batch_path) {
+        report_startup_trace();
+        exit_status = run_batch_mode(config, &options);
+        goto done;
+    }
+
+    if (!options.dry_run) {
+        http_client = http_client_create();
+        if (!http_client) {
+            fprintf(stderr, "Failed to initialize HTTP client\n");
+            goto done;
+        }
+        /* The handshake overlaps with reading stdin, mapping files and building the body */
+        if (config->prewarm_connection) {
+            http_client_prewarm(http_client, config->base_url);
+        }
+        mark_startup_phase("http client");
+    }
+
+    if (options.interactive) {
+        exit_status = run_interactive_mode(http_client, config, &options);
+        goto done;
+    }
+
+    if (options.chunk_tokens > 0) {
+        exit_status = run_chunked_mode(http_client, config, &options);
+        goto done;
     }
 
-    if (echo_input) {
+    // if use - , read from stdin (a pipelined request reads it while sending)
+    if (question_from_stdin && !stdin_input && !options.pipeline) {
+        stdin_input = read_stdin();
+        if (!stdin_input) {
+            fprintf(stderr, "Failed to read from standard input\n");
+            goto done;
+        }
+        user_question = stdin_input;
+        mark_startup_phase("stdin");
+    }
+
+    if (options.echo_input) {
         printf("\nInput: %s\n", user_question);
     }
 
+    while (opened_count < options.attachment_count &&
+           input_file_open(&attachments[opened_count], options.attachment_paths[opened_count]) == 0) {
+        opened_count++;
+    }
+    if (opened_count < options.attachment_count) goto done;
+
+    if (options.session_name &&
+        session_open(&session, options.session_name, config->session_max_bytes) != 0) {
+        goto done;
+    }
+
     chat_request_params_t request_params = {
         .user_query = user_question,
-        .custom_prompt = NULL
+        .custom_prompt = NULL,
+        .attachments = attachments,
+        .attachment_count = opened_count,
+        .history = session.history,
+        .history_length = session.history_length,
+        .stable_prefix = options.stable_prefix
     };
 
-    int stream_enabled = !store_forward;
-    char *request_json = construct_request_json(config, &request_params, stream_enabled);
-    if (!request_json) {
-        fprintf(stderr, "Failed to construct request JSON\n");
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
-        return EXIT_FAILURE;
+    if (options.tools_path && tool_set_load(&tool_set, options.tools_path) != 0) goto done;
+    request_params.tools = tool_set.definitions;
+
+    if (options.tools_path && !options.dry_run) {
+        chat_run_options_t run_options = {
+            .stream = 1,
+            .show_tokens = options.show_tokens
+        };
+        report_startup_trace();
+        if (run_tool_conversation(http_client, config, &request_params, &tool_set, &run_options) == 0) {
+            exit_status = EXIT_SUCCESS;
+        }
+        goto done;
     }
 
-    if (dry_run) {
-        printf("%s\n", request_json);
-        SAFE_FREE(request_json);
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
-        return EXIT_SUCCESS;
-    }
-
-    if (stream_enabled) {
-        fflush(stdout);
-        int result = execute_streaming_request(config, request_json, show_tokens);
-        printf("\n");
-        SAFE_FREE(request_json);
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
-        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
-    } else {
-        http_response_t *http_response = execute_chat_request(config, request_json);
-        SAFE_FREE(request_json);
-        if (!http_response) {
-            free_configuration(config);
-            SAFE_FREE(stdin_input);
-            return EXIT_FAILURE;
+    if (options.fanout) {
+        fanout_options_t fanout_options = {
+            .models = options.fanout_model_count > 0 ? options.fanout_models : NULL,
+            .model_count = options.fanout_model_count,
+            .samples = options.samples,
+            .mode = options.fanout_mode,
+            .show_tokens = options.show_tokens
+        };
+        report_startup_trace();
+        if (run_fanout(http_client, config, &request_params, &fanout_options) == 0) {
+            exit_status = EXIT_SUCCESS;
         }
+        goto done;
+    }
 
-        chat_response_t *chat_response = parse_chat_response(http_response);
-        if (chat_response && chat_response->content) {
-            printf("%s", chat_response->content);
-            printf("\n");
-            
-            if (show_tokens) {
-                printf("\nToken usage:\n  Input: %d\n  Output: %d\n  Total: %d\n",
-                      chat_response->input_token_count, 
-                      chat_response->output_token_count, 
-                      chat_response->total_token_count);
-            }
-        } else {
-            fprintf(stderr, "Failed to get valid response\n");
-        }
+    /* The mappings are only needed until their contents are copied into the body */
+    char *request_json = NULL;
+    int body_ready;
+    if (options.pipeline) {
+        body_ready = request_upload_init(&upload, config, &request_params,
+                                         stream_enabled, STDIN_FILENO) == 0;
+    } else {
+        request_json = construct_request_json(config, &request_params, stream_enabled,
+                                              &request_arena);
+        body_ready = request_json != NULL &&
+                     (!options.session_name || options.dry_run ||
+                      session_stage_user(&session, &request_params) == 0);
+    }
+    for (size_t i = 0; i < opened_count; ++i) {
+        input_file_close(&attachments[i]);
+    }
+    opened_count = 0;
+    tool_set_free(&tool_set);
+    mark_startup_phase("request body");
+    report_startup_trace();
+    if (!body_ready) {
+        fprintf(stderr, "Failed to construct request JSON\n");
+        goto done;
+    }
+
+    if (options.dry_run) {
+        printf("%s\n", request_json);
+        exit_status = EXIT_SUCCESS;
+        goto done;
+    }
 
-        SAFE_FREE(http_response->payload);
-        SAFE_FREE(http_response);
-        if (chat_response) {
-            SAFE_FREE(chat_response->content);
-            SAFE_FREE(chat_response);
+    chat_run_options_t run_options = {
+        .stream = stream_enabled,
+        .show_tokens = options.show_tokens,
+        .use_cache = !options.no_cache,
+        .reply_text = options.session_name ? &reply_text : NULL,
+        .upload = options.pipeline ? &upload : NULL,
+        .async_output = options.pipeline,
+        .format = options.format
+    };
+    if (run_chat_completion(http_client, config, request_json, &run_options) == 0) {
+        exit_status = EXIT_SUCCESS;
+        if (reply_text && session_record_reply(&session, reply_text) != 0) {
+            fprintf(stderr, "Failed to update session '%s'\n", options.session_name);
         }
-        free_configuration(config);
-        SAFE_FREE(stdin_input);
     }
 
-    return EXIT_SUCCESS;
+done:
+    SAFE_FREE(reply_text);
+    request_upload_free(&upload);
+    tool_set_free(&tool_set);
+    for (size_t i = 0; i < opened_count; ++i) {
+        input_file_close(&attachments[i]);
+    }
+    http_client_destroy(http_client);
+    session_close(&session);
+    free_configuration(config);
+    arena_free(&request_arena);
+    SAFE_FREE(stdin_input);
+    return exit_status;
 }
 
 /*------------------------ Command line help info ------------------------*/
@@ -197,6 +486,7 @@ static void
 show_usage (const char *program_name, FILE *output_stream, int exit_code)
 {
     fprintf(output_stream, "Usage: %s [options]... \"<question>\"\n", program_name);
+    fprintf(output_stream, "       %s bench [-n ITERATIONS] [FIXTURE_DIR]\n", program_name);
     fprintf(output_stream, "DeepSeek model command line interface\n\n");
     fprintf(output_stream, "Options:\n");
     fprintf(output_stream, "  -p, --print-config        Print current configuration and exit\n");
@@ -204,49 +494,191 @@ show_usage (const char *program_name, FILE *output_stream, int exit_code)
     fprintf(output_stream, "  -t, --show-tokens         Show token usage statistics\n");
     fprintf(output_stream, "  -e, --echo                Echo the user's input question\n");
     fprintf(output_stream, "  -s, --store-forward       Use non-streaming mode\n");
+    fprintf(output_stream, "  -b, --batch FILE          Run every request in a JSONL file (\"-\" for stdin)\n");
+    fprintf(output_stream, "  -n, --concurrency N       Requests kept in flight in batch and --chunk-size mode (default %d)\n",
+            DEFAULT_BATCH_CONCURRENCY);
+    fprintf(output_stream, "  -o, --output-dir DIR      Write batch answers to DIR/<id>.txt instead of JSONL\n");
+    fprintf(output_stream, "  -f, --file PATH           Attach a file to the question (repeatable)\n");
+    fprintf(output_stream, "  -i, --interactive         Answer one question per input line, keeping the conversation\n");
+    fprintf(output_stream, "      --models A,B,...      Ask every listed model at once\n");
+    fprintf(output_stream, "      --samples N           Send the question N times per model at once\n");
+    fprintf(output_stream, "      --fanout MODE         Show all answers, the first complete one, or race\n");
+    fprintf(output_stream, "                            to the first token (all|first|race, default all)\n");
+    fprintf(output_stream, "      --format FORMAT       Print the answer as text or as NDJSON events (text|ndjson)\n");
+    fprintf(output_stream, "      --stable-prefix       Put attached files, sorted by path, before the question\n");
+    fprintf(output_stream, "      --tools FILE          Offer the commands defined in FILE to the model as tools\n");
+    fprintf(output_stream, "      --chunk-size TOKENS   Ask about stdin in parts of TOKENS concurrently, then\n");
+    fprintf(output_stream, "                            combine the partial answers\n");
+    fprintf(output_stream, "      --session NAME        Continue the named conversation and record this turn\n");
+    fprintf(output_stream, "      --no-cache            Always ask the API, even when CACHE_TTL is set\n");
+    fprintf(output_stream, "      --pipeline            Stream stdin to the API while it is read (with \"-\")\n");
+    fprintf(output_stream, "      --daemon              Stay resident and answer queries over a Unix socket\n");
+    fprintf(output_stream, "      --no-daemon           Do not forward the query to a running daemon\n");
+    fprintf(output_stream, "      --trace-startup       Report the time spent before the request is sent\n");
+    fprintf(output_stream, "      --stats[=FORMAT]      Report where the run spent its time (text|json;\n");
+    fprintf(output_stream, "                            needs a build made with: make trace)\n");
+    fprintf(output_stream, "      --trace-file PATH     Write the spans as a Chrome trace (make trace builds)\n");
     fprintf(output_stream, "  -h, --help                Show this help message\n");
     fprintf(output_stream, "\nExamples:\n");
     fprintf(output_stream, "  %s -p                     # Show current configuration\n", program_name);
     fprintf(output_stream, "  %s -j -e \"Your question\"  # Generate request JSON and echo input\n", program_name);
     fprintf(output_stream, "  %s - < input.txt          # Read question from standard input\n", program_name);
+    fprintf(output_stream, "  %s -b jobs.jsonl -n 8     # Run a batch with 8 requests in flight\n", program_name);
+    fprintf(output_stream, "  %s -f a.c -f b.c \"Diff?\"  # Ask about attached files\n", program_name);
+    fprintf(output_stream, "  %s --chunk-size 8000 \"Errors?\" < big.log  # Ask about a long input\n", program_name);
     exit(exit_code);
 }
 
 /*------------------------ Command line argument parsing ------------------------*/
 
 static int
-parse_cli_arguments (int argc, char **argv,
-                     int *print_config, int *show_tokens, int *echo_input,
-                     int *dry_run, int *store_forward, char **user_query)
+parse_cli_arguments (int argc, char **argv, cli_options_t *options)
 {
     static struct option long_options[] = {
-        {"print-config",  no_argument, NULL, 'p'},
-        {"dry-run",       no_argument, NULL, 'j'},
-        {"show-tokens",   no_argument, NULL, 't'},
-        {"echo",          no_argument, NULL, 'e'},
-        {"store-forward", no_argument, NULL, 's'},
-        {"help",          no_argument, NULL, 'h'},
+        {"print-config",  no_argument,       NULL, 'p'},
+        {"dry-run",       no_argument,       NULL, 'j'},
+        {"show-tokens",   no_argument,       NULL, 't'},
+        {"echo",          no_argument,       NULL, 'e'},
+        {"store-forward", no_argument,       NULL, 's'},
+        {"batch",         required_argument, NULL, 'b'},
+        {"concurrency",   required_argument, NULL, 'n'},
+        {"output-dir",    required_argument, NULL, 'o'},
+        {"file",          required_argument, NULL, 'f'},
+        {"interactive",   no_argument,       NULL, 'i'},
+        {"daemon",        no_argument,       NULL, OPTION_DAEMON},
+        {"no-daemon",     no_argument,       NULL, OPTION_NO_DAEMON},
+        {"session",       required_argument, NULL, OPTION_SESSION},
+        {"no-cache",      no_argument,       NULL, OPTION_NO_CACHE},
+        {"pipeline",      no_argument,       NULL, OPTION_PIPELINE},
+        {"trace-startup", no_argument,       NULL, OPTION_TRACE_STARTUP},
+        {"models",        required_argument, NULL, OPTION_MODELS},
+        {"samples",       required_argument, NULL, OPTION_SAMPLES},
+        {"fanout",        required_argument, NULL, OPTION_FANOUT},
+        {"format",        required_argument, NULL, OPTION_FORMAT},
+        {"stable-prefix", no_argument,       NULL, OPTION_STABLE_PREFIX},
+        {"stats",         optional_argument, NULL, OPTION_STATS},
+        {"trace-file",    required_argument, NULL, OPTION_TRACE_FILE},
+        {"tools",         required_argument, NULL, OPTION_TOOLS},
+        {"chunk-size",    required_argument, NULL, OPTION_CHUNK_SIZE},
+        {"help",          no_argument,       NULL, 'h'},
         {NULL, 0, NULL, 0}
     };
 
     int option;
-    while ((option = getopt_long(argc, argv, "pjtehsh", long_options, NULL)) != -1) {
+    while ((option = getopt_long(argc, argv, "pjtehsib:n:o:f:", long_options, NULL)) != -1) {
         switch (option) {
         case 'p':
-            *print_config = 1;
+            options->print_config = 1;
             break;
         case 'j':
-            *dry_run = 1;
+            options->dry_run = 1;
             break;
         case 't':
-            *show_tokens = 1;
+            options->show_tokens = 1;
             break;
         case 'e':
-            *echo_input = 1;
+            options->echo_input = 1;
             break;
         case 's':
-            *store_forward = 1;
+            options->store_forward = 1;
+            break;
+        case 'b':
+            options->batch_path = optarg;
+            break;
+        case 'n':
+            options->concurrency = atoi(optarg);
+            if (options->concurrency < 1) {
+                fprintf(stderr, "%s: Invalid concurrency '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            options->output_dir = optarg;
             break;
+        case 'i':
+            options->interactive = 1;
+            break;
+        case 'f':
+            if (options->attachment_count == MAX_ATTACHMENTS) {
+                fprintf(stderr, "%s: At most %d files can be attached\n", argv[0], MAX_ATTACHMENTS);
+                return -1;
+            }
+            options->attachment_paths[options->attachment_count++] = optarg;
+            break;
+        case OPTION_DAEMON:
+            options->run_daemon = 1;
+            break;
+        case OPTION_NO_DAEMON:
+            options->no_daemon = 1;
+            break;
+        case OPTION_SESSION:
+            options->session_name = optarg;
+            break;
+        case OPTION_NO_CACHE:
+            options->no_cache = 1;
+            break;
+        case OPTION_PIPELINE:
+            options->pipeline = 1;
+            break;
+        case OPTION_TRACE_STARTUP:
+            options->trace_startup = 1;
+            break;
+        case OPTION_MODELS:
+            options->fanout = 1;
+            for (char *model = strtok(optarg, ","); model; model = strtok(NULL, ",")) {
+                if (options->fanout_model_count == FANOUT_MAX_VARIANTS) {
+                    fprintf(stderr, "%s: At most %d models can be named\n", argv[0], FANOUT_MAX_VARIANTS);
+                    return -1;
+                }
+                options->fanout_models[options->fanout_model_count++] = model;
+            }
+            break;
+        case OPTION_SAMPLES:
+            options->fanout = 1;
+            options->samples = atoi(optarg);
+            if (options->samples < 1) {
+                fprintf(stderr, "%s: Invalid sample count '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            break;
+        case OPTION_FANOUT:
+            options->fanout = 1;
+            if (parse_fanout_mode(optarg, &options->fanout_mode) != 0) {
+                fprintf(stderr, "%s: Invalid fan-out mode '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            break;
+        case OPTION_FORMAT:
+            if (parse_output_format(optarg, &options->format) != 0) {
+                fprintf(stderr, "%s: Invalid output format '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            break;
+        case OPTION_STABLE_PREFIX:
+            options->stable_prefix = 1;
+            break;
+        case OPTION_STATS:
+            options->stats_format = TRACE_FORMAT_TEXT;
+            if (optarg && parse_trace_format(optarg, &options->stats_format) != 0) {
+                fprintf(stderr, "%s: Invalid stats format '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            break;
+        case OPTION_TRACE_FILE:
+            options->trace_path = optarg;
+            break;
+        case OPTION_TOOLS:
+            options->tools_path = optarg;
+            break;
+        case OPTION_CHUNK_SIZE: {
+            long chunk_tokens = atol(optarg);
+            if (chunk_tokens < 1 || chunk_tokens > MAP_REDUCE_MAX_CHUNK_TOKENS) {
+                fprintf(stderr, "%s: Invalid chunk size '%s'\n", argv[0], optarg);
+                show_usage(argv[0], stderr, EXIT_FAILURE);
+            }
+            options->chunk_tokens = (size_t)chunk_tokens;
+            break;
+        }
         case 'h':
             show_usage(argv[0], stdout, EXIT_SUCCESS);
             break;
@@ -255,48 +687,220 @@ parse_cli_arguments (int argc, char **argv,
         }
     }
 
+    if ((options->attachment_count > 0 || options->session_name) &&
+        (options->batch_path || options->run_daemon)) {
+        fprintf(stderr, "%s: --file and --session cannot be combined with --batch or --daemon\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->pipeline &&
+        (options->batch_path || options->run_daemon || options->session_name ||
+         options->dry_run || options->echo_input)) {
+        fprintf(stderr, "%s: --pipeline cannot be combined with --batch, --daemon, --session, -j or -e\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->interactive &&
+        (options->batch_path || options->run_daemon || options->pipeline ||
+         options->dry_run || options->attachment_count > 0)) {
+        fprintf(stderr, "%s: -i cannot be combined with --batch, --daemon, --pipeline, -j or --file\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->fanout &&
+        (options->batch_path || options->run_daemon || options->pipeline || options->interactive ||
+         options->session_name || options->dry_run || options->store_forward)) {
+        fprintf(stderr, "%s: Fan-out cannot be combined with --batch, --daemon, --pipeline, -i, --session, -j or -s\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->format == OUTPUT_FORMAT_NDJSON &&
+        (options->batch_path || options->run_daemon || options->interactive || options->fanout ||
+         options->echo_input)) {
+        fprintf(stderr, "%s: --format ndjson cannot be combined with --batch, --daemon, -i, fan-out or -e\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->tools_path &&
+        (options->batch_path || options->run_daemon || options->interactive || options->fanout ||
+         options->pipeline || options->session_name || options->store_forward ||
+         options->format == OUTPUT_FORMAT_NDJSON)) {
+        fprintf(stderr, "%s: --tools cannot be combined with --batch, --daemon, -i, fan-out, --pipeline, --session, -s or --format ndjson\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->chunk_tokens > 0 &&
+        (options->batch_path || options->run_daemon || options->interactive || options->fanout ||
+         options->pipeline || options->session_name || options->tools_path || options->dry_run ||
+         options->attachment_count > 0)) {
+        fprintf(stderr, "%s: --chunk-size cannot be combined with --batch, --daemon, -i, fan-out, --pipeline, --session, --tools, -j or --file\n",
+                argv[0]);
+        return -1;
+    }
+
+    if (options->stats_format != TRACE_FORMAT_NONE || options->trace_path) {
+        if (!TRACE_AVAILABLE) {
+            fprintf(stderr, "%s: --stats and --trace-file need a build with tracing (make trace)\n",
+                    argv[0]);
+            return -1;
+        }
+        if (options->run_daemon) {
+            fprintf(stderr, "%s: --stats and --trace-file cannot be combined with --daemon\n", argv[0]);
+            return -1;
+        }
+    }
+
+    if (options->interactive && optind < argc) {
+        fprintf(stderr, "%s: -i reads the questions from standard input\n", argv[0]);
+        return -1;
+    }
+
+    if (options->print_config || options->batch_path || options->run_daemon ||
+        options->interactive) {
+        options->user_query = optind < argc ? argv[optind] : NULL;
+        return 0;
+    }
+
     if (optind >= argc) {
         fprintf(stderr, "%s: Missing required question parameter\n", argv[0]);
         show_usage(argv[0], stderr, EXIT_FAILURE);
     }
-    *user_query = argv[optind];
+    options->user_query = argv[optind];
+    if (options->pipeline && strcmp(options->user_query, "-") != 0) {
+        fprintf(stderr, "%s: --pipeline reads the question from standard input (\"-\")\n", argv[0]);
+        return -1;
+    }
+    if (options->chunk_tokens > 0 && strcmp(options->user_query, "-") == 0) {
+        fprintf(stderr, "%s: --chunk-size reads the input from standard input, so the question is given as an argument\n",
+                argv[0]);
+        return -1;
+    }
     return 0;
 }
 
-/*------------------------ Read from standard input ------------------------*/
+/*------------------------ Batch mode ------------------------*/
 
-static char *
-read_stdin (void)
+static int
+run_batch_mode (const api_config_t *config, const cli_options_t *options)
 {
-    size_t capacity = MAX_INPUT_SIZE;
-    size_t size = 0;
-    char *buffer = malloc(capacity);
-    if (!buffer) return NULL;
-
-    while (1) {
-        size_t bytes_read = fread(buffer + size, 1, capacity - size, stdin);
-        size += bytes_read;
-
-        if (bytes_read < capacity - size) {
-            if (feof(stdin)) {
-                break;
-            } else {
-                free(buffer);
-                return NULL;
-            }
-        }
+    http_client_t *client = http_client_create();
+    if (!client) {
+        fprintf(stderr, "Failed to initialize HTTP client\n");
+        return EXIT_FAILURE;
+    }
+    if (config->prewarm_connection) {
+        http_client_prewarm(client, config->base_url);
+    }
 
-        if (size == capacity) {
-            capacity *= 2;
-            char *temp = realloc(buffer, capacity);
-            if (!temp) {
-                free(buffer);
-                return NULL;
-            }
-            buffer = temp;
-        }
+    batch_job_t *jobs = NULL;
+    size_t job_count = 0;
+    /* The jobs and their strings go together once the batch is done */
+    arena_t job_arena;
+    arena_init(&job_arena, 0);
+    if (load_batch_jobs(options->batch_path, &job_arena, &jobs, &job_count) != 0) {
+        arena_free(&job_arena);
+        http_client_destroy(client);
+        return EXIT_FAILURE;
+    }
+
+    int failures = run_batch_requests(client, config, jobs, job_count,
+                                      options->concurrency, options->output_dir, NULL);
+    http_client_destroy(client);
+    arena_free(&job_arena);
+
+    if (failures != 0) {
+        fprintf(stderr, "%d of %zu batch requests failed\n",
+                failures < 0 ? (int)job_count : failures, job_count);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*------------------------ Interactive mode ------------------------*/
+
+static int
+run_interactive_mode (http_client_t *client, const api_config_t *config,
+                      const cli_options_t *options)
+{
+    session_t session = { .history = "" };
+    if (options->session_name &&
+        session_open(&session, options->session_name, config->session_max_bytes) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    chat_run_options_t run_template = {
+        .stream = !options->store_forward,
+        .show_tokens = options->show_tokens,
+        .use_cache = !options->no_cache
+    };
+    report_startup_trace();
+    int result = run_interactive_session(client, config, &run_template, &session);
+    session_close(&session);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*------------------------ Chunked input ------------------------*/
+
+static int
+run_chunked_mode (http_client_t *client, const api_config_t *config,
+                  const cli_options_t *options)
+{
+    char *input = read_stdin();
+    if (!input) {
+        fprintf(stderr, "Failed to read from standard input\n");
+        return EXIT_FAILURE;
+    }
+    mark_startup_phase("stdin");
+    if (options->echo_input) {
+        printf("\nInput: %s\n", options->user_query);
     }
 
-    buffer[size] = '\0';
-    return buffer;
+    map_reduce_options_t map_reduce_options = {
+        .chunk_tokens = options->chunk_tokens,
+        .concurrency = options->concurrency
+    };
+    chat_run_options_t run_options = {
+        .stream = !options->store_forward,
+        .show_tokens = options->show_tokens,
+        .use_cache = !options->no_cache,
+        .format = options->format
+    };
+    report_startup_trace();
+    int result = run_map_reduce(client, config, options->user_query, input, strlen(input),
+                                &map_reduce_options, &run_options);
+    SAFE_FREE(input);
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*------------------------ Startup trace ------------------------*/
+
+static void
+mark_startup_phase (const char *phase)
+{
+    if (!startup_trace.enabled || startup_trace.count == MAX_STARTUP_PHASES) return;
+
+    double now_ms = monotonic_ms();
+    startup_trace.phases[startup_trace.count] = phase;
+    startup_trace.durations_ms[startup_trace.count] = now_ms - startup_trace.last_ms;
+    startup_trace.count++;
+    startup_trace.last_ms = now_ms;
+}
+
+static void
+report_startup_trace (void)
+{
+    if (!startup_trace.enabled) return;
+    startup_trace.enabled = 0;
+
+    fprintf(stderr, "startup:");
+    for (size_t i = 0; i < startup_trace.count; ++i) {
+        fprintf(stderr, " %s %.3f ms,", startup_trace.phases[i], startup_trace.durations_ms[i]);
+    }
+    fprintf(stderr, " total %.3f ms\n", startup_trace.last_ms - startup_trace.started_ms);
 }
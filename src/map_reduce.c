@@ -0,0 +1,283 @@
+/**
+ * @file map_reduce.c
+ * @brief Map-reduce module implementation
+ * @author Rouge Lin
+ * @date 2025-04-23
+ */
+
+#include "map_reduce.h"
+#include "batch_handler.h"
+#include "stats.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+/* Follow the question in each request, so it is read before the material */
+#define MAP_INSTRUCTIONS \
+    "The input is too long for one request, so it was split into %zu parts. " \
+    "Answer the request above for part %zu only; the answers to all parts are combined afterwards."
+#define REDUCE_INSTRUCTIONS \
+    "The answers below were each given for consecutive parts of one long input. " \
+    "Combine them into a single answer to the request above, as if it had been answered " \
+    "for the whole input at once."
+
+/*------------------------ Input splitting ------------------------*/
+
+/* Where a part starting at text ends: a line break, else a blank, else a character boundary */
+static size_t
+chunk_end (const char *text, size_t length, size_t max_bytes)
+{
+    if (length <= max_bytes) return length;
+
+    size_t shortest = max_bytes / 2;
+    for (size_t end = max_bytes; end > shortest; --end) {
+        if (text[end - 1] == '\n') return end;
+    }
+    for (size_t end = max_bytes; end > shortest; --end) {
+        if (text[end - 1] == ' ' || text[end - 1] == '\t') return end;
+    }
+    size_t end = max_bytes;
+    while (end > shortest && ((unsigned char)text[end] & 0xC0) == 0x80) end--;
+    return end > shortest ? end : max_bytes;
+}
+
+int
+split_text_chunks (const char *text, size_t length, size_t max_bytes,
+                   text_chunk_t **chunks, size_t *chunk_count)
+{
+    text_chunk_t *parts = NULL;
+    size_t count = 0, capacity = 0;
+    if (max_bytes == 0) max_bytes = 1;
+
+    while (length > 0) {
+        if (count == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 16;
+            text_chunk_t *new_parts = realloc(parts, new_capacity * sizeof(text_chunk_t));
+            if (!new_parts) {
+                perror("Memory allocation failed");
+                free(parts);
+                return -1;
+            }
+            parts = new_parts;
+            capacity = new_capacity;
+        }
+
+        size_t part_length = chunk_end(text, length, max_bytes);
+        parts[count].text = text;
+        parts[count].length = part_length;
+        count++;
+        text += part_length;
+        length -= part_length;
+    }
+
+    *chunks = parts;
+    *chunk_count = count;
+    return 0;
+}
+
+/*------------------------ Request text ------------------------*/
+
+static char *
+format_text (arena_t *arena, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (length < 0) return NULL;
+
+    char *text = arena_alloc(arena, (size_t)length + 1);
+    if (!text) return NULL;
+    va_start(args, format);
+    vsnprintf(text, (size_t)length + 1, format, args);
+    va_end(args);
+    return text;
+}
+
+/* The question, the reduce instructions, then answers[0..count) each under a heading */
+static char *
+format_reduce_query (arena_t *arena, const char *question, char *const *answers, size_t count)
+{
+    static const char heading[] = "\n\n----- Answer %zu of %zu -----\n";
+    size_t size = strlen(question) + sizeof(REDUCE_INSTRUCTIONS) + 2;
+    for (size_t i = 0; i < count; ++i) {
+        size += sizeof(heading) + 2 * 20 + strlen(answers[i]);
+    }
+
+    char *query = arena_alloc(arena, size);
+    if (!query) return NULL;
+    size_t used = (size_t)snprintf(query, size, "%s\n\n" REDUCE_INSTRUCTIONS, question);
+    for (size_t i = 0; i < count; ++i) {
+        used += (size_t)snprintf(query + used, size - used, heading, i + 1, count);
+        size_t answer_length = strlen(answers[i]);
+        memcpy(query + used, answers[i], answer_length + 1);
+        used += answer_length;
+    }
+    return query;
+}
+
+/*------------------------ Rounds ------------------------*/
+
+static void
+free_answers (char **answers, size_t count)
+{
+    if (!answers) return;
+    for (size_t i = 0; i < count; ++i) {
+        SAFE_FREE(answers[i]);
+    }
+    free(answers);
+}
+
+/* Send every job at once and collect the answers; NULL unless all of them arrived */
+static char **
+run_round (http_client_t *client, const api_config_t *config, const batch_job_t *jobs,
+           size_t job_count, int concurrency, size_t round)
+{
+    char **answers = calloc(job_count, sizeof(char *));
+    if (!answers) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    double started_ms = monotonic_ms();
+    int failures = run_batch_requests(client, config, jobs, job_count, concurrency, NULL, answers);
+    fprintf(stderr, "[map-reduce round %zu: %zu requests, %.0f ms]\n",
+            round, job_count, monotonic_ms() - started_ms);
+    if (failures != 0) {
+        fprintf(stderr, "%d of %zu requests of round %zu failed\n",
+                failures < 0 ? (int)job_count : failures, job_count, round);
+        free_answers(answers, job_count);
+        return NULL;
+    }
+    return answers;
+}
+
+/* Group consecutive answers into reduce jobs that fit max_bytes, at least two per job */
+static batch_job_t *
+group_answers (arena_t *arena, const char *question, char *const *answers, size_t answer_count,
+               size_t max_bytes, size_t round, size_t *job_count)
+{
+    batch_job_t *jobs = arena_alloc(arena, answer_count * sizeof(batch_job_t));
+    if (!jobs) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    memset(jobs, 0, answer_count * sizeof(batch_job_t));
+
+    size_t count = 0, first = 0;
+    while (first < answer_count) {
+        size_t last = first, group_bytes = strlen(answers[first]);
+        while (last + 1 < answer_count) {
+            size_t next_bytes = strlen(answers[last + 1]);
+            /* Taking a second answer regardless guarantees every round halves the count */
+            if (last > first && group_bytes + next_bytes > max_bytes) break;
+            group_bytes += next_bytes;
+            last++;
+        }
+
+        batch_job_t *job = &jobs[count++];
+        job->id = format_text(arena, "round %zu group %zu", round, count);
+        job->query = format_reduce_query(arena, question, answers + first, last - first + 1);
+        if (!job->id || !job->query) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        first = last + 1;
+    }
+
+    *job_count = count;
+    return jobs;
+}
+
+static batch_job_t *
+map_jobs (arena_t *arena, const char *question, const text_chunk_t *chunks, size_t chunk_count)
+{
+    batch_job_t *jobs = arena_alloc(arena, chunk_count * sizeof(batch_job_t));
+    if (!jobs) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < chunk_count; ++i) {
+        jobs[i].system_prompt = NULL;
+        jobs[i].id = format_text(arena, "part %zu", i + 1);
+        jobs[i].query = format_text(arena, "%s\n\n" MAP_INSTRUCTIONS "\n\n----- Part %zu of %zu -----\n%.*s",
+                                    question, chunk_count, i + 1, i + 1, chunk_count,
+                                    (int)chunks[i].length, chunks[i].text);
+        if (!jobs[i].id || !jobs[i].query) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+    }
+    return jobs;
+}
+
+/* Send the request whose answer is printed; its body joins the query in the arena */
+static int
+run_final_request (http_client_t *client, const api_config_t *config, arena_t *arena,
+                   char *query, const chat_run_options_t *run_options)
+{
+    chat_request_params_t request_params = { .user_query = query };
+    char *request_json = construct_request_json(config, &request_params, run_options->stream, arena);
+    if (!request_json) {
+        fprintf(stderr, "Failed to construct request JSON\n");
+        return -1;
+    }
+    return run_chat_completion(client, config, request_json, run_options);
+}
+
+int
+run_map_reduce (http_client_t *client, const api_config_t *config,
+                const char *question, const char *input, size_t input_length,
+                const map_reduce_options_t *options, const chat_run_options_t *run_options)
+{
+    size_t max_bytes = options->chunk_tokens * MAP_REDUCE_BYTES_PER_TOKEN;
+    /* Holds one round's jobs at a time; the answers outlive their round on the heap */
+    arena_t job_arena;
+    arena_init(&job_arena, 0);
+    int result = -1;
+
+    if (input_length <= max_bytes) {
+        char *query = format_text(&job_arena, "%s\n\n%.*s", question, (int)input_length, input);
+        if (query) {
+            result = run_final_request(client, config, &job_arena, query, run_options);
+        } else {
+            perror("Memory allocation failed");
+        }
+        arena_free(&job_arena);
+        return result;
+    }
+
+    text_chunk_t *chunks = NULL;
+    size_t chunk_count = 0;
+    if (split_text_chunks(input, input_length, max_bytes, &chunks, &chunk_count) != 0) return -1;
+
+    batch_job_t *jobs = map_jobs(&job_arena, question, chunks, chunk_count);
+    free(chunks);
+    size_t job_count = chunk_count, round = 1;
+    char **answers = jobs ? run_round(client, config, jobs, job_count, options->concurrency, round)
+                          : NULL;
+
+    /* There were at least two parts, so every round leaves at least two answers */
+    size_t answer_count = job_count;
+    while (answers) {
+        arena_reset(&job_arena);
+        jobs = group_answers(&job_arena, question, answers, answer_count, max_bytes, ++round, &job_count);
+        if (!jobs) break;
+
+        if (job_count == 1) {
+            result = run_final_request(client, config, &job_arena, jobs[0].query, run_options);
+            break;
+        }
+
+        char **next_answers = run_round(client, config, jobs, job_count, options->concurrency, round);
+        free_answers(answers, answer_count);
+        answers = next_answers;
+        answer_count = job_count;
+    }
+    free_answers(answers, answer_count);
+    arena_free(&job_arena);
+    return result;
+}
@@ -0,0 +1,253 @@
+/**
+ * @file output_sink.c
+ * @brief Output sink module implementation
+ * @author Rouge Lin
+ * @date 2025-04-12
+ */
+
+#include "output_sink.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/*------------------------ Low-level output ------------------------*/
+
+/* Write every byte of the vectors, resuming after partial writes */
+static int
+write_vectors (int fd, struct iovec *vectors, int vector_count)
+{
+    TRACE_BEGIN(write_span);
+    while (vector_count > 0) {
+        ssize_t written = writev(fd, vectors, vector_count);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        size_t remaining = (size_t)written;
+        while (vector_count > 0 && remaining >= vectors->iov_len) {
+            remaining -= vectors->iov_len;
+            vectors++;
+            vector_count--;
+        }
+        if (vector_count > 0) {
+            vectors->iov_base = (char *)vectors->iov_base + remaining;
+            vectors->iov_len -= remaining;
+        }
+    }
+    TRACE_END(write_span, "output");
+    return 0;
+}
+
+static long
+elapsed_ms (const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000L + (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+/*------------------------ Writer thread ------------------------*/
+
+static void *
+run_sink_writer (void *argument)
+{
+    output_sink_t *sink = argument;
+
+    pthread_mutex_lock(&sink->lock);
+    while (1) {
+        if (sink->flush_requested && sink->length > 0) {
+            /* Hand the producers the spare buffer and write the full one unlocked */
+            char *pending = sink->buffer;
+            struct iovec vector = { .iov_base = pending, .iov_len = sink->length };
+            int discard = sink->failed;
+            sink->buffer = sink->spare;
+            sink->spare = pending;
+            sink->length = 0;
+            sink->pending_newline = 0;
+            sink->flush_requested = 0;
+            sink->writing = 1;
+            pthread_mutex_unlock(&sink->lock);
+
+            int status = discard ? 0 : write_vectors(sink->fd, &vector, 1);
+
+            pthread_mutex_lock(&sink->lock);
+            if (status != 0) sink->failed = 1;
+            sink->writing = 0;
+            pthread_cond_broadcast(&sink->drained);
+            continue;
+        }
+        sink->flush_requested = 0;
+        if (sink->stopping) break;
+        pthread_cond_wait(&sink->wake, &sink->lock);
+    }
+    pthread_mutex_unlock(&sink->lock);
+    return NULL;
+}
+
+/* Ask the writer for output; the caller holds the lock */
+static void
+request_flush (output_sink_t *sink)
+{
+    sink->flush_requested = 1;
+    pthread_cond_signal(&sink->wake);
+}
+
+static void
+threaded_write (output_sink_t *sink, const char *data, size_t length)
+{
+    pthread_mutex_lock(&sink->lock);
+    while (length > 0 && !sink->failed) {
+        if (sink->length == OUTPUT_SINK_BUFFER_SIZE) {
+            request_flush(sink);
+            pthread_cond_wait(&sink->drained, &sink->lock);
+            continue;
+        }
+
+        size_t copy_length = OUTPUT_SINK_BUFFER_SIZE - sink->length;
+        if (copy_length > length) copy_length = length;
+        if (sink->length == 0) clock_gettime(CLOCK_MONOTONIC, &sink->pending_since);
+        memcpy(sink->buffer + sink->length, data, copy_length);
+        sink->length += copy_length;
+        if (sink->interactive && memchr(data, '\n', copy_length)) sink->pending_newline = 1;
+        data += copy_length;
+        length -= copy_length;
+    }
+    pthread_mutex_unlock(&sink->lock);
+}
+
+static int
+threaded_flush (output_sink_t *sink)
+{
+    pthread_mutex_lock(&sink->lock);
+    if (sink->length > 0) request_flush(sink);
+    while (sink->length > 0 || sink->writing) {
+        pthread_cond_wait(&sink->drained, &sink->lock);
+    }
+    int result = sink->failed ? -1 : 0;
+    pthread_mutex_unlock(&sink->lock);
+    return result;
+}
+
+/*------------------------ Sink interface ------------------------*/
+
+void
+output_sink_init (output_sink_t *sink, int fd, long flush_interval_ms)
+{
+    memset(sink, 0, sizeof(*sink));
+    sink->fd = fd;
+    sink->interactive = isatty(fd);
+    sink->flush_interval_ms = flush_interval_ms;
+    sink->buffer = malloc(OUTPUT_SINK_BUFFER_SIZE);
+}
+
+int
+output_sink_start_writer (output_sink_t *sink)
+{
+    if (sink->threaded || !sink->buffer) return -1;
+
+    sink->spare = malloc(OUTPUT_SINK_BUFFER_SIZE);
+    if (!sink->spare) return -1;
+    pthread_mutex_init(&sink->lock, NULL);
+    pthread_cond_init(&sink->wake, NULL);
+    pthread_cond_init(&sink->drained, NULL);
+
+    if (pthread_create(&sink->writer_thread, NULL, run_sink_writer, sink) != 0) {
+        pthread_cond_destroy(&sink->drained);
+        pthread_cond_destroy(&sink->wake);
+        pthread_mutex_destroy(&sink->lock);
+        free(sink->spare);
+        sink->spare = NULL;
+        return -1;
+    }
+    sink->threaded = 1;
+    return 0;
+}
+
+void
+output_sink_write (output_sink_t *sink, const char *data, size_t length)
+{
+    if (sink->threaded) {
+        threaded_write(sink, data, length);
+        return;
+    }
+    if (sink->failed || length == 0) return;
+
+    if (sink->buffer && sink->length + length <= OUTPUT_SINK_BUFFER_SIZE) {
+        if (sink->length == 0) clock_gettime(CLOCK_MONOTONIC, &sink->pending_since);
+        memcpy(sink->buffer + sink->length, data, length);
+        sink->length += length;
+        if (sink->interactive && memchr(data, '\n', length)) sink->pending_newline = 1;
+        return;
+    }
+
+    struct iovec vectors[2] = {
+        { .iov_base = sink->buffer, .iov_len = sink->length },
+        { .iov_base = (void *)data, .iov_len = length }
+    };
+    int first_vector = sink->length > 0 ? 0 : 1;
+    if (write_vectors(sink->fd, vectors + first_vector, 2 - first_vector) != 0) {
+        sink->failed = 1;
+    }
+    sink->length = 0;
+    sink->pending_newline = 0;
+}
+
+void
+output_sink_poll (output_sink_t *sink)
+{
+    if (!sink->interactive) return;
+    if (sink->threaded) pthread_mutex_lock(&sink->lock);
+
+    if (sink->length > 0 &&
+        (sink->pending_newline || sink->flush_interval_ms <= 0 ||
+         elapsed_ms(&sink->pending_since) >= sink->flush_interval_ms)) {
+        if (sink->threaded) {
+            request_flush(sink);
+        } else {
+            output_sink_flush(sink);
+        }
+    }
+
+    if (sink->threaded) pthread_mutex_unlock(&sink->lock);
+}
+
+int
+output_sink_flush (output_sink_t *sink)
+{
+    if (sink->threaded) return threaded_flush(sink);
+
+    if (sink->length > 0 && !sink->failed) {
+        struct iovec vector = { .iov_base = sink->buffer, .iov_len = sink->length };
+        if (write_vectors(sink->fd, &vector, 1) != 0) sink->failed = 1;
+    }
+    sink->length = 0;
+    sink->pending_newline = 0;
+    return sink->failed ? -1 : 0;
+}
+
+int
+output_sink_close (output_sink_t *sink)
+{
+    int result = output_sink_flush(sink);
+    if (sink->threaded) {
+        pthread_mutex_lock(&sink->lock);
+        sink->stopping = 1;
+        pthread_cond_signal(&sink->wake);
+        pthread_mutex_unlock(&sink->lock);
+        pthread_join(sink->writer_thread, NULL);
+
+        pthread_cond_destroy(&sink->drained);
+        pthread_cond_destroy(&sink->wake);
+        pthread_mutex_destroy(&sink->lock);
+        sink->threaded = 0;
+        free(sink->spare);
+        sink->spare = NULL;
+    }
+    free(sink->buffer);
+    sink->buffer = NULL;
+    return result;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file repl.c
+ * @brief Interactive mode implementation
+ * @author Rouge Lin
+ * @date 2025-04-17
+ */
+
+#include "repl.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t repl_cancel_requested = 0;
+
+static void
+handle_cancel_signal (int signal_number)
+{
+    (void)signal_number;
+    repl_cancel_requested = 1;
+}
+
+/*------------------------ Turns ------------------------*/
+
+/* Send one question with the conversation so far; returns 0 when the turn was recorded */
+static int
+answer_question (http_client_t *client, const api_config_t *config,
+                 const chat_run_options_t *run_template, session_t *session,
+                 arena_t *turn_arena, char *question)
+{
+    chat_request_params_t request_params = {
+        .user_query = question,
+        .history = session->history,
+        .history_length = session->history_length
+    };
+
+    /* The body lives until the next turn resets the arena */
+    arena_reset(turn_arena);
+    char *request_json = construct_request_json(config, &request_params, run_template->stream,
+                                                turn_arena);
+    if (!request_json || session_stage_user(session, &request_params) != 0) {
+        fprintf(stderr, "Failed to construct request JSON\n");
+        return -1;
+    }
+
+    char *reply_text = NULL;
+    chat_run_options_t run_options = *run_template;
+    run_options.reply_text = &reply_text;
+    int result = run_chat_completion(client, config, request_json, &run_options);
+
+    /* A cancelled answer is left out of the conversation */
+    if (result == 0 && !repl_cancel_requested && reply_text) {
+        result = session_record_reply(session, reply_text);
+    } else {
+        result = -1;
+    }
+    SAFE_FREE(reply_text);
+    return result;
+}
+
+/*------------------------ Interactive loop ------------------------*/
+
+int
+run_interactive_session (http_client_t *client, const api_config_t *config,
+                         const chat_run_options_t *run_template, session_t *session)
+{
+    if (!session->retained && session_retain_history(session, config->session_max_bytes) != 0) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    /* No SA_RESTART: the signal must interrupt a blocking read or poll */
+    struct sigaction cancel_action = { .sa_handler = handle_cancel_signal };
+    struct sigaction previous_action;
+    sigemptyset(&cancel_action.sa_mask);
+    sigaction(SIGINT, &cancel_action, &previous_action);
+    client->cancel_flag = &repl_cancel_requested;
+
+    int show_prompt = isatty(STDIN_FILENO);
+    arena_t turn_arena;
+    arena_init(&turn_arena, 0);
+    char *line = NULL;
+    size_t line_capacity = 0;
+    for (;;) {
+        repl_cancel_requested = 0;
+        if (show_prompt) {
+            fputs("> ", stdout);
+            fflush(stdout);
+        }
+
+        errno = 0;
+        ssize_t line_length = getline(&line, &line_capacity, stdin);
+        if (line_length < 0) {
+            if (errno == EINTR && repl_cancel_requested) {
+                /* Ctrl-C at the prompt drops the partial line */
+                clearerr(stdin);
+                putchar('\n');
+                continue;
+            }
+            break;
+        }
+
+        trim_whitespace(line);
+        if (line[0] == '\0') continue;
+        if (strcmp(line, REPL_QUIT_COMMAND) == 0) break;
+
+        answer_question(client, config, run_template, session, &turn_arena, line);
+    }
+    if (show_prompt) putchar('\n');
+
+    client->cancel_flag = NULL;
+    sigaction(SIGINT, &previous_action, NULL);
+    SAFE_FREE(line);
+    arena_free(&turn_arena);
+    return ferror(stdin) ? -1 : 0;
+}
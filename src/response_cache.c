@@ -0,0 +1,258 @@
+/**
+ * @file response_cache.c
+ * @brief Response cache module implementation
+ * @note Each entry is one file named after a 64-bit hash of the endpoint and
+ *       request body; a second, independent hash stored in the entry header
+ *       rejects collisions
+ * @author Rouge Lin
+ * @date 2025-04-11
+ */
+
+#include "response_cache.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CACHE_ENTRY_MAGIC "ADSCACHE1"
+
+/*------------------------ Keys and paths ------------------------*/
+
+/**
+ * @struct cache_key_t
+ * @brief Identity of a cache entry
+ * @var name_hash FNV-1a hash naming the entry file
+ * @var check_hash Independent hash verified on lookup
+ */
+typedef struct {
+    unsigned long long name_hash;  /**< FNV-1a hash naming the entry file */
+    unsigned long long check_hash; /**< Independent hash verified on lookup */
+} cache_key_t;
+
+static void
+hash_bytes (cache_key_t *key, const char *text, size_t length)
+{
+    for (size_t i = 0; i < length; ++i) {
+        unsigned char byte = (unsigned char)text[i];
+        key->name_hash = (key->name_hash ^ byte) * 0x100000001b3ULL;
+        key->check_hash = key->check_hash * 31 + byte + (key->check_hash >> 29);
+    }
+}
+
+static cache_key_t
+compute_cache_key (const api_config_t *config, const char *request_json)
+{
+    cache_key_t key = { .name_hash = 0xcbf29ce484222325ULL, .check_hash = 5381 };
+    /* The same body sent to another endpoint may get another answer */
+    hash_bytes(&key, config->base_url, strlen(config->base_url));
+    hash_bytes(&key, "\n", 1);
+    hash_bytes(&key, request_json, strlen(request_json));
+    return key;
+}
+
+int
+resolve_cache_directory (char *path, size_t path_size, const char *subdirectory)
+{
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home_dir = getenv("HOME");
+    int length;
+    if (cache_home && cache_home[0] == '/') {
+        length = snprintf(path, path_size, "%s/ads", cache_home);
+    } else if (home_dir) {
+        length = snprintf(path, path_size, "%s/.cache/ads", home_dir);
+    } else {
+        return -1;
+    }
+    if (length >= 0 && (size_t)length < path_size && subdirectory) {
+        length += snprintf(path + length, path_size - (size_t)length, "/%s", subdirectory);
+    }
+    return length < 0 || (size_t)length >= path_size ? -1 : 0;
+}
+
+static int
+resolve_entry_path (char *path, size_t path_size, const cache_key_t *key)
+{
+    char directory[PATH_MAX];
+    if (resolve_cache_directory(directory, sizeof(directory), NULL) != 0) return -1;
+
+    int length = snprintf(path, path_size, "%s/%016llx", directory, key->name_hash);
+    return length < 0 || (size_t)length >= path_size ? -1 : 0;
+}
+
+/*------------------------ Lookup ------------------------*/
+
+char *
+response_cache_lookup (const api_config_t *config, const char *request_json)
+{
+    cache_key_t key = compute_cache_key(config, request_json);
+    char entry_path[PATH_MAX];
+    if (resolve_entry_path(entry_path, sizeof(entry_path), &key) != 0) return NULL;
+
+    int fd = open(entry_path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat entry_stat;
+    if (fstat(fd, &entry_stat) != 0 || !S_ISREG(entry_stat.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+    if (time(NULL) - entry_stat.st_mtime > config->cache_ttl) {
+        close(fd);
+        unlink(entry_path);
+        return NULL;
+    }
+
+    char *entry = malloc((size_t)entry_stat.st_size + 1);
+    if (!entry) {
+        close(fd);
+        return NULL;
+    }
+    size_t entry_length = 0;
+    while (entry_length < (size_t)entry_stat.st_size) {
+        ssize_t bytes_read = read(fd, entry + entry_length, (size_t)entry_stat.st_size - entry_length);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) break;
+        entry_length += (size_t)bytes_read;
+    }
+    entry[entry_length] = '\0';
+
+    /* Header: magic, check hash and answer length on one line */
+    unsigned long long check_hash;
+    size_t reply_length;
+    int header_length = 0;
+    char *reply = NULL;
+    if (sscanf(entry, CACHE_ENTRY_MAGIC " %llx %zu\n%n", &check_hash, &reply_length, &header_length) == 2 &&
+        header_length > 0 && check_hash == key.check_hash &&
+        (size_t)header_length + reply_length == entry_length) {
+        memmove(entry, entry + header_length, reply_length);
+        entry[reply_length] = '\0';
+        reply = entry;
+
+        /* Refresh the access time only; the modification time is the entry's age */
+        struct timespec times[2] = { { .tv_nsec = UTIME_NOW }, { .tv_nsec = UTIME_OMIT } };
+        futimens(fd, times);
+    } else {
+        free(entry);
+    }
+    close(fd);
+    return reply;
+}
+
+/*------------------------ Store and eviction ------------------------*/
+
+/**
+ * @struct cache_entry_info_t
+ * @brief Entry considered for eviction
+ * @var name File name inside the cache directory
+ * @var access_time Last time the entry was stored or hit
+ * @var size Size of the entry file
+ */
+typedef struct {
+    char name[32];      /**< File name inside the cache directory */
+    time_t access_time; /**< Last time the entry was stored or hit */
+    off_t size;         /**< Size of the entry file */
+} cache_entry_info_t;
+
+static int
+compare_access_time (const void *left, const void *right)
+{
+    const cache_entry_info_t *a = left, *b = right;
+    return (a->access_time > b->access_time) - (a->access_time < b->access_time);
+}
+
+static void
+evict_cache_entries (const char *directory, long max_bytes)
+{
+    DIR *cache_dir = opendir(directory);
+    if (!cache_dir) return;
+
+    cache_entry_info_t *entries = NULL;
+    size_t entry_count = 0, entry_capacity = 0;
+    long long total_size = 0;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(cache_dir)) != NULL) {
+        /* Dot files are temporaries of concurrent stores */
+        if (dir_entry->d_name[0] == '.' || strlen(dir_entry->d_name) >= sizeof(entries->name)) continue;
+
+        struct stat entry_stat;
+        if (fstatat(dirfd(cache_dir), dir_entry->d_name, &entry_stat, 0) != 0 ||
+            !S_ISREG(entry_stat.st_mode)) {
+            continue;
+        }
+        if (entry_count == entry_capacity) {
+            size_t new_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            cache_entry_info_t *new_entries = realloc(entries, new_capacity * sizeof(*entries));
+            if (!new_entries) break;
+            entries = new_entries;
+            entry_capacity = new_capacity;
+        }
+        cache_entry_info_t *info = &entries[entry_count++];
+        strcpy(info->name, dir_entry->d_name);
+        info->access_time = entry_stat.st_atime;
+        info->size = entry_stat.st_size;
+        total_size += entry_stat.st_size;
+    }
+
+    if (total_size > max_bytes) {
+        qsort(entries, entry_count, sizeof(*entries), compare_access_time);
+        for (size_t i = 0; i < entry_count && total_size > max_bytes; ++i) {
+            if (unlinkat(dirfd(cache_dir), entries[i].name, 0) == 0) {
+                total_size -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+    closedir(cache_dir);
+}
+
+int
+response_cache_store (const api_config_t *config, const char *request_json,
+                      const char *reply)
+{
+    cache_key_t key = compute_cache_key(config, request_json);
+    char directory[PATH_MAX];
+    char entry_path[PATH_MAX];
+    char temporary_path[PATH_MAX];
+    if (resolve_cache_directory(directory, sizeof(directory), NULL) != 0 ||
+        resolve_entry_path(entry_path, sizeof(entry_path), &key) != 0) {
+        return -1;
+    }
+    int length = snprintf(temporary_path, sizeof(temporary_path), "%s/.%016llx.%ld",
+                          directory, key.name_hash, (long)getpid());
+    if (length < 0 || (size_t)length >= sizeof(temporary_path)) return -1;
+
+    /* The parent of the cache directory (~/.cache) may not exist yet either */
+    if (make_directories(directory) != 0) return -1;
+
+    /* Answers may quote private input, so the entry is readable by its owner only */
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    FILE *entry_file = fdopen(fd, "w");
+    if (!entry_file) {
+        close(fd);
+        unlink(temporary_path);
+        return -1;
+    }
+
+    size_t reply_length = strlen(reply);
+    fprintf(entry_file, CACHE_ENTRY_MAGIC " %016llx %zu\n", key.check_hash, reply_length);
+    fwrite(reply, 1, reply_length, entry_file);
+    int write_failed = ferror(entry_file);
+    if (fclose(entry_file) != 0) write_failed = 1;
+    if (write_failed || rename(temporary_path, entry_path) != 0) {
+        unlink(temporary_path);
+        return -1;
+    }
+
+    if (config->cache_max_bytes > 0) {
+        evict_cache_entries(directory, config->cache_max_bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * @file scheduler.c
+ * @brief Request scheduler implementation
+ * @author Rouge Lin
+ * @date 2025-04-14
+ */
+
+#include "scheduler.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*------------------------ Retry policy ------------------------*/
+
+int
+retry_is_transient (CURLcode transfer_result, long status_code)
+{
+    switch (transfer_result) {
+    case CURLE_OK:
+        return status_code == 408 || status_code == 429 ||
+               (status_code >= 500 && status_code <= 599);
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SEND_ERROR:
+    case CURLE_GOT_NOTHING:
+        return 1;
+    default:
+        /* A timeout or a broken stream may come after the model did the work */
+        return 0;
+    }
+}
+
+long
+retry_delay_ms (const api_config_t *config, int attempt, long retry_after_seconds)
+{
+    if (attempt >= config->max_retries) return -1;
+
+    long ceiling = config->retry_base_ms;
+    for (int i = 0; i < attempt && ceiling < config->retry_max_ms; ++i) ceiling *= 2;
+    if (ceiling > config->retry_max_ms) ceiling = config->retry_max_ms;
+
+    /* Equal jitter: half the window is fixed, the other half random */
+    long delay = ceiling / 2 + (ceiling > 1 ? rand() % (ceiling / 2 + 1) : 0);
+    if (retry_after_seconds > 0) {
+        if (retry_after_seconds * 1000 > config->retry_max_ms) return -1;
+        delay += retry_after_seconds * 1000;
+        if (delay > config->retry_max_ms) delay = config->retry_max_ms;
+    }
+    return delay;
+}
+
+void
+retry_announce (const char *label, CURLcode transfer_result, long status_code,
+                int attempt, long max_retries, long delay_ms)
+{
+    if (label) fprintf(stderr, "[%s] ", label);
+    if (transfer_result == CURLE_OK) {
+        fprintf(stderr, "HTTP %ld", status_code);
+    } else {
+        fprintf(stderr, "%s", curl_easy_strerror(transfer_result));
+    }
+    fprintf(stderr, "; retry %d of %ld in %.1f s\n", attempt, max_retries, delay_ms / 1000.0);
+}
+
+void
+retry_sleep_ms (long delay_ms)
+{
+    struct timespec remaining = {
+        .tv_sec = delay_ms / 1000,
+        .tv_nsec = (delay_ms % 1000) * 1000000L
+    };
+    while (nanosleep(&remaining, &remaining) != 0 && errno == EINTR) {
+    }
+}
+
+/*------------------------ Rate limiter ------------------------*/
+
+void
+rate_limiter_init (rate_limiter_t *limiter, const api_config_t *config, double now_ms)
+{
+    limiter->request_capacity = (double)config->rate_limit_rpm;
+    limiter->request_rate = limiter->request_capacity / 60000.0;
+    limiter->request_level = limiter->request_capacity;
+    limiter->token_capacity = (double)config->rate_limit_tpm;
+    limiter->token_rate = limiter->token_capacity / 60000.0;
+    limiter->token_level = limiter->token_capacity;
+    limiter->refilled_ms = now_ms;
+    limiter->paused_until_ms = 0;
+}
+
+static void
+refill_buckets (rate_limiter_t *limiter, double now_ms)
+{
+    double elapsed_ms = now_ms - limiter->refilled_ms;
+    if (elapsed_ms <= 0) return;
+
+    limiter->request_level += elapsed_ms * limiter->request_rate;
+    if (limiter->request_level > limiter->request_capacity) {
+        limiter->request_level = limiter->request_capacity;
+    }
+    limiter->token_level += elapsed_ms * limiter->token_rate;
+    if (limiter->token_level > limiter->token_capacity) {
+        limiter->token_level = limiter->token_capacity;
+    }
+    limiter->refilled_ms = now_ms;
+}
+
+/* Milliseconds until a bucket holds `needed`, rounded up */
+static long
+bucket_wait_ms (double level, double needed, double rate)
+{
+    if (rate <= 0 || level >= needed) return 0;
+    return (long)((needed - level) / rate) + 1;
+}
+
+long
+rate_limiter_acquire (rate_limiter_t *limiter, double now_ms, long estimated_tokens)
+{
+    if (now_ms < limiter->paused_until_ms) {
+        return (long)(limiter->paused_until_ms - now_ms) + 1;
+    }
+    refill_buckets(limiter, now_ms);
+
+    /* A request larger than a whole minute's quota waits for a full bucket */
+    double tokens = (double)estimated_tokens;
+    if (tokens > limiter->token_capacity) tokens = limiter->token_capacity;
+
+    long request_wait = bucket_wait_ms(limiter->request_level, 1.0, limiter->request_rate);
+    long token_wait = bucket_wait_ms(limiter->token_level, tokens, limiter->token_rate);
+    long wait = request_wait > token_wait ? request_wait : token_wait;
+    if (wait > 0) return wait;
+
+    if (limiter->request_rate > 0) limiter->request_level -= 1.0;
+    if (limiter->token_rate > 0) limiter->token_level -= tokens;
+    return 0;
+}
+
+void
+rate_limiter_settle (rate_limiter_t *limiter, long estimated_tokens, long used_tokens)
+{
+    if (limiter->token_rate <= 0) return;
+
+    double estimated = (double)estimated_tokens;
+    if (estimated > limiter->token_capacity) estimated = limiter->token_capacity;
+    limiter->token_level += estimated - (double)used_tokens;
+    if (limiter->token_level > limiter->token_capacity) {
+        limiter->token_level = limiter->token_capacity;
+    }
+}
+
+void
+rate_limiter_pause (rate_limiter_t *limiter, double until_ms)
+{
+    if (until_ms > limiter->paused_until_ms) limiter->paused_until_ms = until_ms;
+}
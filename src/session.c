@@ -0,0 +1,289 @@
+/**
+ * @file session.c
+ * @brief Conversation session module implementation
+ * @author Rouge Lin
+ * @date 2025-04-10
+ */
+
+#define _GNU_SOURCE
+#include "session.h"
+#include "json_writer.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define USER_RECORD_START "\n{\"role\":\"user\""
+
+/*------------------------ Log location ------------------------*/
+
+static int
+valid_session_name (const char *name)
+{
+    if (name[0] == '\0' || name[0] == '.') return 0;
+    for (const char *cursor = name; *cursor; ++cursor) {
+        if (!strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-", *cursor)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+resolve_session_path (char *path, size_t path_size, const char *name)
+{
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home_dir = getenv("HOME");
+    int length;
+    if (data_home && data_home[0] == '/') {
+        length = snprintf(path, path_size, "%s/ads/sessions", data_home);
+    } else if (home_dir) {
+        length = snprintf(path, path_size, "%s/.local/share/ads/sessions", home_dir);
+    } else {
+        fprintf(stderr, "Cannot locate the session directory: HOME is not set\n");
+        return -1;
+    }
+    if (length < 0 || (size_t)length >= path_size) return -1;
+
+    if (make_directories(path) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    length = snprintf(path + length, path_size - (size_t)length, "/%s.log", name);
+    return length < 0 || strlen(path) + 1 >= path_size ? -1 : 0;
+}
+
+/*------------------------ Opening and truncation ------------------------*/
+
+/**
+ * @brief Rewrite the log so it holds only the retained history
+ * @param session Pointer to the session
+ * @return void
+ * @note Written to a temporary file and renamed, so a crash keeps either form
+ */
+static void
+rewrite_session_log (const session_t *session)
+{
+    char temporary_path[PATH_MAX + 8];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.tmp", session->path);
+
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror(temporary_path);
+        return;
+    }
+
+    const char *cursor = session->history;
+    size_t remaining = session->history_length;
+    while (remaining > 0) {
+        ssize_t written = write(fd, cursor, remaining);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror(temporary_path);
+            close(fd);
+            unlink(temporary_path);
+            return;
+        }
+        cursor += written;
+        remaining -= (size_t)written;
+    }
+
+    if (close(fd) != 0 || rename(temporary_path, session->path) != 0) {
+        perror(session->path);
+        unlink(temporary_path);
+    }
+}
+
+int
+session_open (session_t *session, const char *name, long max_bytes)
+{
+    memset(session, 0, sizeof(*session));
+    session->history = "";
+
+    if (!valid_session_name(name)) {
+        fprintf(stderr, "Invalid session name '%s'\n", name);
+        return -1;
+    }
+    if (resolve_session_path(session->path, sizeof(session->path), name) != 0) {
+        fprintf(stderr, "Session path too long\n");
+        return -1;
+    }
+
+    int fd = open(session->path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return 0;
+        perror(session->path);
+        return -1;
+    }
+
+    struct stat log_stat;
+    if (fstat(fd, &log_stat) != 0) {
+        perror(session->path);
+        close(fd);
+        return -1;
+    }
+    if (log_stat.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *mapping = mmap(NULL, (size_t)log_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror(session->path);
+        return -1;
+    }
+    session->mapping = mapping;
+    session->mapping_length = (size_t)log_stat.st_size;
+
+    /* A torn final record (interrupted append) is ignored */
+    size_t kept_length = session->mapping_length;
+    while (kept_length > 0 && !(kept_length >= 2 && session->mapping[kept_length - 1] == '\n' &&
+                                session->mapping[kept_length - 2] == ',')) {
+        const char *newline = memrchr(session->mapping, '\n', kept_length - 1);
+        kept_length = newline ? (size_t)(newline - session->mapping) + 1 : 0;
+    }
+    const char *history_end = session->mapping + kept_length;
+    session->history = session->mapping;
+    session->history_length = kept_length;
+
+    if (max_bytes > 0 && session->history_length > (size_t)max_bytes) {
+        /* Keep the newest turns that fit, starting at a user message */
+        const char *search_start = history_end - max_bytes - 1;
+        const char *cut = memmem(search_start, (size_t)(history_end - search_start),
+                                 USER_RECORD_START, sizeof(USER_RECORD_START) - 1);
+        session->history = cut ? cut + 1 : history_end;
+        session->history_length = (size_t)(history_end - session->history);
+        rewrite_session_log(session);
+    } else if (kept_length != session->mapping_length) {
+        rewrite_session_log(session);
+    }
+    return 0;
+}
+
+void
+session_close (session_t *session)
+{
+    if (session->mapping) munmap(session->mapping, session->mapping_length);
+    SAFE_FREE(session->pending_user);
+    SAFE_FREE(session->retained);
+    memset(session, 0, sizeof(*session));
+}
+
+/*------------------------ Recording turns ------------------------*/
+
+int
+session_retain_history (session_t *session, long max_bytes)
+{
+    size_t capacity = session->history_length + 4096;
+    char *retained = malloc(capacity);
+    if (!retained) return -1;
+
+    memcpy(retained, session->history, session->history_length);
+    retained[session->history_length] = '\0';
+    session->retained = retained;
+    session->retained_capacity = capacity;
+    session->history = retained;
+    session->max_bytes = max_bytes;
+    return 0;
+}
+
+/* Append records to the retained history, dropping the oldest turns beyond the budget */
+static int
+retain_records (session_t *session, const char *records, size_t records_length)
+{
+    size_t needed = session->history_length + records_length + 1;
+    if (needed > session->retained_capacity) {
+        size_t new_capacity = session->retained_capacity * 2;
+        if (new_capacity < needed) new_capacity = needed;
+        char *new_retained = realloc(session->retained, new_capacity);
+        if (!new_retained) return -1;
+        session->retained = new_retained;
+        session->retained_capacity = new_capacity;
+    }
+    char *history = session->retained;
+    memcpy(history + session->history_length, records, records_length);
+    size_t length = session->history_length + records_length;
+    history[length] = '\0';
+
+    if (session->max_bytes > 0 && length > (size_t)session->max_bytes) {
+        /* Same cut as session_open: the newest turns that fit, starting at a user message */
+        const char *history_end = history + length;
+        const char *search_start = history_end - session->max_bytes - 1;
+        const char *cut = memmem(search_start, (size_t)(history_end - search_start),
+                                 USER_RECORD_START, sizeof(USER_RECORD_START) - 1);
+        size_t dropped = cut ? (size_t)(cut + 1 - history) : length;
+        memmove(history, history + dropped, length - dropped + 1);
+        length -= dropped;
+    }
+    session->history = history;
+    session->history_length = length;
+    return 0;
+}
+
+int
+session_stage_user (session_t *session, const chat_request_params_t *params)
+{
+    json_writer_t writer;
+    if (json_writer_init(&writer, user_message_json_size(params) + 2) != 0) return -1;
+
+    write_user_message_json(&writer, params);
+    json_writer_raw(&writer, ",\n", 2);
+
+    SAFE_FREE(session->pending_user);
+    session->pending_user = json_writer_finish(&writer);
+    return session->pending_user ? 0 : -1;
+}
+
+int
+session_record_reply (session_t *session, const char *reply)
+{
+    if (!session->pending_user) return -1;
+
+    size_t user_length = strlen(session->pending_user);
+    size_t reply_length = strlen(reply);
+    json_writer_t writer;
+    if (json_writer_init(&writer, user_length + json_escaped_length(reply, reply_length) + 48) != 0) {
+        return -1;
+    }
+    json_writer_raw(&writer, session->pending_user, user_length);
+    json_writer_raw(&writer, "{", 1);
+    json_writer_key(&writer, "role");
+    json_writer_string(&writer, "assistant", 9);
+    json_writer_raw(&writer, ",", 1);
+    json_writer_key(&writer, "content");
+    json_writer_string(&writer, reply, reply_length);
+    json_writer_raw(&writer, "},\n", 3);
+    char *records = json_writer_finish(&writer);
+    if (!records) return -1;
+
+    size_t records_length = strlen(records);
+    int result = 0;
+    if (session->path[0]) {
+        result = -1;
+        int fd = open(session->path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (fd >= 0) {
+            ssize_t written;
+            do {
+                written = write(fd, records, records_length);
+            } while (written < 0 && errno == EINTR);
+            result = written == (ssize_t)records_length ? 0 : -1;
+            if (close(fd) != 0) result = -1;
+        }
+        if (result != 0) perror(session->path);
+    }
+    if (session->retained && retain_records(session, records, records_length) != 0) {
+        perror("Failed to keep the conversation in memory");
+        result = -1;
+    }
+
+    SAFE_FREE(records);
+    SAFE_FREE(session->pending_user);
+    return result;
+}
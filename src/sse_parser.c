@@ -0,0 +1,314 @@
+/**
+ * @file sse_parser.c
+ * @brief Server-sent events parser implementation
+ * @author Rouge Lin
+ * @date 2025-04-07
+ */
+
+#include "sse_parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*------------------------ Event framing ------------------------*/
+
+void
+sse_parser_init (sse_parser_t *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+}
+
+void
+sse_parser_free (sse_parser_t *parser)
+{
+    free(parser->owned_data);
+    memset(parser, 0, sizeof(*parser));
+}
+
+static void
+reset_event (sse_parser_t *parser)
+{
+    parser->data = NULL;
+    parser->data_length = 0;
+    parser->has_data = 0;
+    parser->event_ready = 0;
+    parser->event_type[0] = '\0';
+}
+
+static int
+reserve_owned (sse_parser_t *parser, size_t required)
+{
+    if (required <= parser->owned_capacity) return 0;
+
+    size_t new_capacity = parser->owned_capacity ? parser->owned_capacity : 1024;
+    while (new_capacity < required) new_capacity *= 2;
+    char *new_data = realloc(parser->owned_data, new_capacity);
+    if (!new_data) return -1;
+
+    if (parser->data == parser->owned_data) parser->data = new_data;
+    parser->owned_data = new_data;
+    parser->owned_capacity = new_capacity;
+    return 0;
+}
+
+int
+sse_parser_detach (sse_parser_t *parser)
+{
+    if (!parser->has_data || parser->event_ready || parser->data == parser->owned_data) return 0;
+    if (reserve_owned(parser, parser->data_length) != 0) return -1;
+
+    memcpy(parser->owned_data, parser->data, parser->data_length);
+    parser->data = parser->owned_data;
+    return 0;
+}
+
+static int
+append_data (sse_parser_t *parser, char *value, size_t length)
+{
+    if (!parser->has_data) {
+        /* Common case: one data line per event, parsed where it lies */
+        parser->data = value;
+        parser->data_length = length;
+        parser->has_data = 1;
+        return 0;
+    }
+
+    if (sse_parser_detach(parser) != 0 ||
+        reserve_owned(parser, parser->data_length + 1 + length) != 0) {
+        return -1;
+    }
+    parser->owned_data[parser->data_length++] = '\n';
+    memcpy(parser->owned_data + parser->data_length, value, length);
+    parser->data_length += length;
+    return 0;
+}
+
+int
+sse_parser_feed_line (sse_parser_t *parser, char *line, size_t length)
+{
+    if (parser->event_ready) reset_event(parser);
+
+    if (length == 0) {
+        /* A blank line dispatches the event; events without data are dropped */
+        if (!parser->has_data) {
+            reset_event(parser);
+            return 0;
+        }
+        parser->event_ready = 1;
+        return 1;
+    }
+
+    if (line[0] == ':') return 0;
+
+    char *colon = memchr(line, ':', length);
+    size_t name_length = colon ? (size_t)(colon - line) : length;
+    char *value = colon ? colon + 1 : line + length;
+    size_t value_length = length - (size_t)(value - line);
+    if (value_length > 0 && value[0] == ' ') {
+        value++;
+        value_length--;
+    }
+
+    if (name_length == 4 && memcmp(line, "data", 4) == 0) {
+        return append_data(parser, value, value_length) == 0 ? 0 : -1;
+    }
+    if (name_length == 5 && memcmp(line, "event", 5) == 0) {
+        size_t copy_length = value_length < sizeof(parser->event_type) - 1
+                           ? value_length : sizeof(parser->event_type) - 1;
+        memcpy(parser->event_type, value, copy_length);
+        parser->event_type[copy_length] = '\0';
+    }
+    return 0;
+}
+
+int
+sse_parser_finish (sse_parser_t *parser)
+{
+    if (parser->event_ready || !parser->has_data) return 0;
+    parser->event_ready = 1;
+    return 1;
+}
+
+/*------------------------ Chat chunk extraction ------------------------*/
+
+static int
+scan_decoded_string (json_scanner_t *scanner, json_span_t *value)
+{
+    if (json_scan_peek(scanner) != JSON_SCAN_STRING) {
+        value->start = NULL;
+        value->length = 0;
+        return json_scan_skip(scanner);
+    }
+    if (json_scan_string(scanner, value) != 0) return -1;
+
+    /* The caller owns the text, so the escapes are decoded where they sit */
+    size_t decoded_length = json_unescape((char *)value->start, value->start, value->length);
+    if (decoded_length == (size_t)-1) return -1;
+    value->length = decoded_length;
+    return 0;
+}
+
+/* Keep a value as it is, for a caller that scans it itself */
+static int
+scan_raw_value (json_scanner_t *scanner, json_span_t *value)
+{
+    json_scan_peek(scanner);
+    value->start = scanner->cursor;
+    if (json_scan_skip(scanner) != 0) return -1;
+    value->length = (size_t)(scanner->cursor - value->start);
+    return 0;
+}
+
+static int
+scan_delta (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status;
+        if (json_span_equals(&key, "content")) {
+            status = scan_decoded_string(scanner, &chunk->content);
+        } else if (json_span_equals(&key, "reasoning_content")) {
+            status = scan_decoded_string(scanner, &chunk->reasoning_content);
+        } else if (json_span_equals(&key, "tool_calls")) {
+            status = scan_raw_value(scanner, &chunk->tool_calls);
+        } else {
+            status = json_scan_skip(scanner);
+        }
+        if (status != 0) return -1;
+    }
+    return member;
+}
+
+static int
+scan_choice (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status;
+        if (json_span_equals(&key, "delta") || json_span_equals(&key, "message")) {
+            status = scan_delta(scanner, chunk);
+        } else if (json_span_equals(&key, "finish_reason")) {
+            status = scan_decoded_string(scanner, &chunk->finish_reason);
+        } else {
+            status = json_scan_skip(scanner);
+        }
+        if (status != 0) return -1;
+    }
+    return member;
+}
+
+static int
+scan_choices (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_ARRAY) != 0) return json_scan_skip(scanner);
+
+    int element, index = 0;
+    while ((element = json_scan_next_element(scanner)) == 1) {
+        int status = index++ == 0 ? scan_choice(scanner, chunk) : json_scan_skip(scanner);
+        if (status != 0) return -1;
+    }
+    return element;
+}
+
+/* OpenAI-style usage.prompt_tokens_details.cached_tokens */
+static int
+scan_prompt_details (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status = (json_span_equals(&key, "cached_tokens") &&
+                      json_scan_peek(scanner) == JSON_SCAN_NUMBER)
+                   ? json_scan_integer(scanner, &chunk->cached_tokens) : json_scan_skip(scanner);
+        if (status != 0) return -1;
+    }
+    return member;
+}
+
+static int
+scan_usage (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        long *target = NULL;
+        if (json_span_equals(&key, "prompt_tokens")) {
+            target = &chunk->prompt_tokens;
+        } else if (json_span_equals(&key, "completion_tokens")) {
+            target = &chunk->completion_tokens;
+        } else if (json_span_equals(&key, "total_tokens")) {
+            target = &chunk->total_tokens;
+        } else if (json_span_equals(&key, "prompt_cache_hit_tokens")) {
+            /* DeepSeek reports context cache hits under its own name */
+            target = &chunk->cached_tokens;
+        } else if (json_span_equals(&key, "prompt_cache_miss_tokens")) {
+            target = &chunk->cache_miss_tokens;
+        } else if (json_span_equals(&key, "prompt_tokens_details")) {
+            if (scan_prompt_details(scanner, chunk) != 0) return -1;
+            continue;
+        }
+
+        int status = (target && json_scan_peek(scanner) == JSON_SCAN_NUMBER)
+                   ? json_scan_integer(scanner, target) : json_scan_skip(scanner);
+        if (status != 0) return -1;
+    }
+    if (member == 0) chunk->has_usage = 1;
+    return member;
+}
+
+/* {"error":{"message":...}}, or a bare string from some proxies */
+static int
+scan_error (json_scanner_t *scanner, chat_chunk_t *chunk)
+{
+    chunk->has_error = 1;
+    if (json_scan_peek(scanner) == JSON_SCAN_STRING) {
+        return scan_decoded_string(scanner, &chunk->error_message);
+    }
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status = json_span_equals(&key, "message")
+                   ? scan_decoded_string(scanner, &chunk->error_message) : json_scan_skip(scanner);
+        if (status != 0) return -1;
+    }
+    return member;
+}
+
+int
+parse_chat_chunk (char *data, size_t length, chat_chunk_t *chunk)
+{
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->cache_miss_tokens = -1;
+
+    json_scanner_t scanner;
+    json_scan_init(&scanner, data, length);
+    if (json_scan_enter(&scanner, JSON_SCAN_OBJECT) != 0) return -1;
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(&scanner, &key)) == 1) {
+        int status;
+        if (json_span_equals(&key, "choices")) {
+            status = scan_choices(&scanner, chunk);
+        } else if (json_span_equals(&key, "usage")) {
+            status = scan_usage(&scanner, chunk);
+        } else if (json_span_equals(&key, "error")) {
+            status = scan_error(&scanner, chunk);
+        } else {
+            status = json_scan_skip(&scanner);
+        }
+        if (status != 0) return -1;
+    }
+    return member == 0 ? 0 : -1;
+}
@@ -0,0 +1,76 @@
+/**
+ * @file stats.c
+ * @brief Timing statistics helper implementation
+ * @author Rouge Lin
+ * @date 2025-04-12
+ */
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*------------------------ Time ------------------------*/
+
+double
+monotonic_ms (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000.0 + (double)now.tv_nsec / 1e6;
+}
+
+/*------------------------ Sample sets ------------------------*/
+
+void
+sample_set_init (sample_set_t *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+int
+sample_set_add (sample_set_t *set, double value)
+{
+    if (set->count == set->capacity) {
+        size_t new_capacity = set->capacity ? set->capacity * 2 : 256;
+        double *new_values = realloc(set->values, new_capacity * sizeof(*new_values));
+        if (!new_values) return -1;
+        set->values = new_values;
+        set->capacity = new_capacity;
+    }
+    set->values[set->count++] = value;
+    set->sorted = 0;
+    return 0;
+}
+
+static int
+compare_doubles (const void *left, const void *right)
+{
+    double a = *(const double *)left, b = *(const double *)right;
+    return (a > b) - (a < b);
+}
+
+double
+sample_set_percentile (sample_set_t *set, double percentile)
+{
+    if (set->count == 0) return 0.0;
+    if (!set->sorted) {
+        qsort(set->values, set->count, sizeof(*set->values), compare_doubles);
+        set->sorted = 1;
+    }
+
+    /* Nearest rank: the smallest sample with at least `percentile` percent at or below it */
+    double exact_rank = percentile / 100.0 * (double)set->count;
+    size_t rank = (size_t)exact_rank;
+    if ((double)rank < exact_rank) rank++;
+    if (rank == 0) rank = 1;
+    if (rank > set->count) rank = set->count;
+    return set->values[rank - 1];
+}
+
+void
+sample_set_free (sample_set_t *set)
+{
+    free(set->values);
+    memset(set, 0, sizeof(*set));
+}
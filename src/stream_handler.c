@@ -7,104 +7,410 @@
  */
 
 #include "stream_handler.h"
+#include "scheduler.h"
+#include "balancer.h"
+#include "utils.h"
+#include "trace.h"
+#include "tools.h"
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <curl/curl.h>
-#include <cjson/cJSON.h>
 
 /*------------------------ Streaming module implementation ------------------------*/
 
+/**
+ * @brief Make room for incoming bytes at the end of the buffer
+ * @param ctx Pointer to the streaming context
+ * @param incoming Number of bytes about to be appended
+ * @return 0 on success, -1 if the buffer cannot grow
+ * @note The consumed prefix is reclaimed only when the buffer is full, so the
+ *       partial tail is moved at most once per buffer's worth of data
+ */
+static int
+reserve_stream_buffer (stream_context_t *ctx, size_t incoming)
+{
+    if (ctx->buffer_len + incoming < ctx->buffer_capacity) return 0;
+
+    /* Bytes already fed to the parser are about to move */
+    if (sse_parser_detach(&ctx->parser) != 0) return -1;
+
+    size_t pending = ctx->buffer_len - ctx->buffer_start;
+    if (ctx->buffer_start > 0) {
+        memmove(ctx->buffer, ctx->buffer + ctx->buffer_start, pending);
+        ctx->buffer_start = 0;
+        ctx->buffer_len = pending;
+        if (pending + incoming < ctx->buffer_capacity) return 0;
+    }
+
+    size_t required = pending + incoming + 1;
+    if (required > STREAM_BUFFER_MAX_SIZE) return -1;
+
+    size_t new_capacity = ctx->buffer_capacity ? ctx->buffer_capacity : STREAM_BUFFER_INITIAL_SIZE;
+    while (new_capacity < required) new_capacity *= 2;
+    char *new_buffer = realloc(ctx->buffer, new_capacity);
+    if (!new_buffer) return -1;
+
+    ctx->buffer = new_buffer;
+    ctx->buffer_capacity = new_capacity;
+    return 0;
+}
+
 size_t
 stream_data_callback (char *ptr, size_t size, size_t nmemb, void *userdata)
 {
     size_t data_size = size * nmemb;
     stream_context_t *ctx = (stream_context_t *)userdata;
 
-    if (ctx->buffer_len + data_size >= sizeof(ctx->buffer)) {
+    if (reserve_stream_buffer(ctx, data_size) != 0) {
         fprintf(stderr, "Stream buffer overflow\n");
         return 0;
     }
 
     memcpy(ctx->buffer + ctx->buffer_len, ptr, data_size);
     ctx->buffer_len += data_size;
-    ctx->buffer[ctx->buffer_len] = '\0';
 
+    /* An error response is a JSON document, not an event stream: keep it for the report */
+    if (ctx->transfer && ctx->status_code == 0) ctx->status_code = ctx->transfer->status_code;
+    if (ctx->transfer && ctx->status_code != 200) return data_size;
+
+    TRACE_BEGIN(parse_span);
     process_stream_data(ctx);
+    TRACE_END(parse_span, "parse stream");
+    /* Every delta of this network read leaves in at most one write; events
+       leave at once even into a pipe, since their consumer parses them as they come */
+    if (ctx->events) {
+        output_sink_flush(&ctx->sink);
+    } else {
+        output_sink_poll(&ctx->sink);
+    }
     return data_size;
 }
 
-void
-process_stream_data (stream_context_t *ctx)
+/**
+ * @brief Progress callback used to honor the terminal flush deadline
+ * @param clientp Pointer to the streaming context
+ * @return 0 to continue the transfer
+ * @note libcurl calls it while waiting for data, so text held back for a
+ *       partial line still appears once its deadline passes
+ */
+static int
+stream_progress_callback (void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                          curl_off_t ultotal, curl_off_t ulnow)
 {
-    char *line_start = ctx->buffer;
-    char *line_end;
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    stream_context_t *ctx = (stream_context_t *)clientp;
+    output_sink_poll(&ctx->sink);
+    return ctx->client && http_client_cancelled(ctx->client);
+}
 
-    while ((line_end = strchr(line_start, '\n')) != NULL) {
-        *line_end = '\0';
+/**
+ * @brief Print token usage and timing of a finished stream
+ * @param ctx Pointer to the streaming context
+ * @return void
+ * @note Inter-token latency is measured between content deltas, which the
+ *       API sends one token (or a few) at a time
+ */
+static void
+print_stream_statistics (stream_context_t *ctx)
+{
+    if (ctx->has_usage) {
+        printf("\n\nToken usage:\n  Input: %ld\n  Cached: %ld\n  Uncached: %ld\n  Output: %ld\n  Total: %ld",
+               ctx->prompt_tokens, ctx->cached_tokens, ctx->prompt_tokens - ctx->cached_tokens,
+               ctx->completion_tokens, ctx->total_tokens);
+        if (ctx->prompt_tokens > 0) {
+            printf("\n  Cache hit rate: %.1f%%", ctx->cached_tokens * 100.0 / ctx->prompt_tokens);
+        }
+    } else {
+        fprintf(stderr, "\nToken usage unavailable: the server sent no usage chunk\n");
+    }
+    if (ctx->first_token_ms == 0) return;
+
+    double generation_ms = ctx->last_token_ms - ctx->first_token_ms;
+    printf("\n\nTiming:\n  Time to first token: %.1f ms", ctx->first_token_ms - ctx->request_start_ms);
+    printf("\n  Inter-token latency: p50 %.1f ms, p90 %.1f ms, p99 %.1f ms",
+           sample_set_percentile(&ctx->token_gaps, 50),
+           sample_set_percentile(&ctx->token_gaps, 90),
+           sample_set_percentile(&ctx->token_gaps, 99));
+    if (ctx->has_usage && generation_ms > 0) {
+        printf("\n  Throughput: %.1f tokens/s", ctx->completion_tokens * 1000.0 / generation_ms);
+    }
+    printf("\n  Time to last token: %.1f ms", ctx->last_token_ms - ctx->request_start_ms);
+}
 
-        if (strncmp(line_start, "data: ", 6) == 0) {
-            line_start += 6;
+/**
+ * @brief Keep a copy of streamed content for the caller
+ * @param ctx Pointer to the streaming context
+ * @param text Content fragment
+ * @param length Length of the fragment
+ * @return void
+ */
+static void
+capture_reply_text (stream_context_t *ctx, const char *text, size_t length)
+{
+    if (ctx->reply_length + length + 1 > ctx->reply_capacity) {
+        size_t new_capacity = ctx->reply_capacity ? ctx->reply_capacity : 4096;
+        while (new_capacity < ctx->reply_length + length + 1) new_capacity *= 2;
+        char *new_reply = realloc(ctx->reply, new_capacity);
+        if (!new_reply) {
+            /* The answer is still printed; only the copy is lost */
+            ctx->capture_reply = 0;
+            SAFE_FREE(ctx->reply);
+            return;
         }
+        ctx->reply = new_reply;
+        ctx->reply_capacity = new_capacity;
+    }
+    memcpy(ctx->reply + ctx->reply_length, text, length);
+    ctx->reply_length += length;
+    ctx->reply[ctx->reply_length] = '\0';
+}
+
+/**
+ * @brief Act on one complete SSE event
+ * @param ctx Pointer to the streaming context
+ * @return void
+ */
+static void
+handle_stream_event (stream_context_t *ctx)
+{
+    sse_parser_t *parser = &ctx->parser;
+
+    if (strcmp(parser->event_type, "error") == 0) {
+        if (ctx->events) event_stream_error(ctx->events, 0, parser->data, parser->data_length);
+        output_sink_flush(&ctx->sink);
+        fprintf(stderr, "Stream error: %.*s\n", (int)parser->data_length, parser->data);
+        return;
+    }
+    if (parser->data_length == 6 && memcmp(parser->data, "[DONE]", 6) == 0) {
+        ctx->done = 1;
+        return;
+    }
+
+    chat_chunk_t chunk;
+    if (parse_chat_chunk(parser->data, parser->data_length, &chunk) != 0) return;
+
+    if (chunk.content.length > 0 || chunk.reasoning_content.length > 0) {
+        double now_ms = monotonic_ms();
+        if (ctx->first_token_ms == 0) {
+            ctx->first_token_ms = now_ms;
+        } else {
+            sample_set_add(&ctx->token_gaps, now_ms - ctx->last_token_ms);
+        }
+        ctx->last_token_ms = now_ms;
+    }
 
-        cJSON *root = cJSON_Parse(line_start);
-        if (root) {
-            cJSON *choices = cJSON_GetObjectItem(root, "choices");
-            if (cJSON_IsArray(choices) && cJSON_GetArraySize(choices) > 0) {
-                cJSON *choice = cJSON_GetArrayItem(choices, 0);
-                cJSON *delta = cJSON_GetObjectItem(choice, "delta");
-                if (delta) {
-                    cJSON *content = cJSON_GetObjectItem(delta, "content");
-                    if (cJSON_IsString(content)) {
-                        printf("%s", content->valuestring);
-                        fflush(stdout);
-                    }
-                }
-            }
-            cJSON_Delete(root);
+    if (ctx->events && chunk.reasoning_content.length > 0) {
+        event_stream_text(ctx->events, "reasoning", chunk.reasoning_content.start,
+                          chunk.reasoning_content.length);
+    }
+    if (chunk.content.length > 0) {
+        if (ctx->events) {
+            event_stream_text(ctx->events, "delta", chunk.content.start, chunk.content.length);
+        } else if (!ctx->muted) {
+            output_sink_write(&ctx->sink, chunk.content.start, chunk.content.length);
+        }
+        if (ctx->capture_reply) {
+            capture_reply_text(ctx, chunk.content.start, chunk.content.length);
+        }
+    }
+    if (chunk.tool_calls.length > 0 && ctx->tool_calls && !ctx->tool_calls->failed &&
+        tool_calls_feed(ctx->tool_calls, (char *)chunk.tool_calls.start, chunk.tool_calls.length) != 0) {
+        fprintf(stderr, "Malformed tool call in stream\n");
+    }
+    if (chunk.finish_reason.length > 0) {
+        size_t copy_length = chunk.finish_reason.length < sizeof(ctx->finish_reason) - 1
+                           ? chunk.finish_reason.length : sizeof(ctx->finish_reason) - 1;
+        memcpy(ctx->finish_reason, chunk.finish_reason.start, copy_length);
+        ctx->finish_reason[copy_length] = '\0';
+        if (ctx->events) {
+            event_stream_finish(ctx->events, chunk.finish_reason.start, chunk.finish_reason.length);
         }
+    }
+    if (chunk.has_usage) {
+        ctx->has_usage = 1;
+        ctx->prompt_tokens = chunk.prompt_tokens;
+        ctx->completion_tokens = chunk.completion_tokens;
+        ctx->total_tokens = chunk.total_tokens;
+        ctx->cached_tokens = chunk.cached_tokens;
+        if (ctx->events) {
+            event_stream_usage(ctx->events, ctx->prompt_tokens, ctx->completion_tokens,
+                               ctx->total_tokens, ctx->cached_tokens);
+        }
+    }
+}
+
+static void
+feed_stream_line (stream_context_t *ctx, char *line, size_t length)
+{
+    if (length > 0 && line[length - 1] == '\r') length--;
 
+    int status = sse_parser_feed_line(&ctx->parser, line, length);
+    if (status > 0) {
+        handle_stream_event(ctx);
+    } else if (status < 0) {
+        fprintf(stderr, "Stream event too large\n");
+    }
+}
+
+void
+process_stream_data (stream_context_t *ctx)
+{
+    char *line_start = ctx->buffer + ctx->buffer_start;
+    char *buffer_end = ctx->buffer + ctx->buffer_len;
+    char *line_end;
+
+    while ((line_end = memchr(line_start, '\n', (size_t)(buffer_end - line_start))) != NULL) {
+        feed_stream_line(ctx, line_start, (size_t)(line_end - line_start));
         line_start = line_end + 1;
     }
 
-    size_t remaining = ctx->buffer_len - (line_start - ctx->buffer);
-    memmove(ctx->buffer, line_start, remaining);
-    ctx->buffer_len = remaining;
-    ctx->buffer[remaining] = '\0';
+    ctx->buffer_start = (size_t)(line_start - ctx->buffer);
 }
 
-int
-execute_streaming_request (const api_config_t *config, const char *request_json,
-                           int show_tokens)
+void
+finish_stream_data (stream_context_t *ctx)
 {
-    CURL *curl = curl_easy_init();
-    if (!curl) return -1;
+    if (ctx->buffer_len > ctx->buffer_start) {
+        feed_stream_line(ctx, ctx->buffer + ctx->buffer_start, ctx->buffer_len - ctx->buffer_start);
+        ctx->buffer_start = ctx->buffer_len;
+    }
+    if (sse_parser_finish(&ctx->parser)) {
+        handle_stream_event(ctx);
+    }
+}
+
+/* Point the transfer at an endpoint; returns the header list built for an upload (caller frees) */
+static struct curl_slist *
+target_endpoint (CURL *curl, const api_endpoint_t *endpoint,
+                 const chat_run_options_t *options, const request_body_t *body)
+{
+    struct curl_slist *upload_headers = NULL;
+    if (options->upload) upload_headers = build_request_headers(endpoint->api_key, 0, 1);
 
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", config->api_key);
+    curl_easy_setopt(curl, CURLOPT_URL, endpoint->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER,
+                     options->upload ? upload_headers : endpoint->headers[body->compressed]);
+    return upload_headers;
+}
 
+int
+execute_streaming_request (http_client_t *client, const api_config_t *config,
+                           const char *request_json, const chat_run_options_t *options,
+                           char **reply_text)
+{
+    CURL *curl = http_client_acquire(client);
     struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, auth_header);
 
-    stream_context_t ctx = { .buffer_len = 0, .show_tokens = show_tokens };
+    request_body_t body = { .data = "", .length = 0 };
+    if (!options->upload) request_body_init(&body, config, request_json);
 
-    curl_easy_setopt(curl, CURLOPT_URL, config->base_url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_json);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, stream_data_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ctx);
+    http_transfer_t transfer = {
+        .write_function = stream_data_callback,
+        .hedge_headers = config->hedge_headers[body.compressed]
+    };
+    stream_context_t ctx = {
+        .buffer = NULL,
+        .show_tokens = options->show_tokens,
+        .capture_reply = reply_text != NULL,
+        .transfer = &transfer,
+        .client = client,
+        .tool_calls = options->tool_calls
+    };
+    transfer.write_data = &ctx;
+    sse_parser_init(&ctx.parser);
+    output_sink_init(&ctx.sink, STDOUT_FILENO, config->output_flush_ms);
+    event_stream_t events;
+    if (options->format == OUTPUT_FORMAT_NDJSON) {
+        event_stream_init(&events, &ctx.sink);
+        ctx.events = &events;
+    }
+    /* Rendering on its own thread keeps a slow terminal from stalling network reads */
+    if (options->async_output) output_sink_start_writer(&ctx.sink);
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "Request failed: %s\n", curl_easy_strerror(res));
+    setup_http_body(curl, &body);
+    setup_http_transport(curl);
+    setup_http_timeouts(curl, config);
+    if (options->upload) setup_http_upload(curl, options->upload);
+    if (ctx.sink.interactive && config->output_flush_ms > 0) {
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, stream_progress_callback);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &ctx);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
     }
 
-    /* Token usage unavailable in streaming mode */
-    if (ctx.show_tokens) {
-        fprintf(stderr, "\nToken usage unavailable in streaming mode\n");
+    CURLcode res;
+    for (int attempt = 0; ; ++attempt) {
+        ctx.request_start_ms = monotonic_ms();
+        size_t endpoint_index = balancer_acquire(config->balancer, ctx.request_start_ms);
+        curl_slist_free_all(headers);
+        headers = target_endpoint(curl, &config->endpoints[endpoint_index], options, &body);
+
+        res = http_client_perform(curl, config, options->upload == NULL, &transfer);
+        output_sink_flush(&ctx.sink);
+        if (res == CURLE_OK && ctx.status_code == 0) ctx.status_code = transfer.status_code;
+        double now_ms = monotonic_ms();
+        balancer_end(config->balancer, endpoint_index, res, ctx.status_code,
+                     transfer.first_byte_ms, now_ms);
+
+        /* Transient failures happen before any text is shown, so a retry starts clean */
+        if (options->upload || !retry_is_transient(res, ctx.status_code)) break;
+        long delay_ms = retry_delay_ms(config, attempt, transfer.retry_after);
+        if (delay_ms < 0) break;
+        if (balancer_has_alternative(config->balancer, endpoint_index, now_ms)) delay_ms = 0;
+        retry_announce(NULL, res, ctx.status_code, attempt + 1, config->max_retries, delay_ms);
+        if (delay_ms > 0) retry_sleep_ms(delay_ms);
+        ctx.buffer_start = ctx.buffer_len = 0;
+        ctx.status_code = 0;
+    }
+
+    int failed = res != CURLE_OK;
+    if (failed) {
+        fprintf(stderr, "Request %s\n", res == CURLE_ABORTED_BY_CALLBACK ? "cancelled"
+                                          : curl_easy_strerror(res));
+    } else if (ctx.status_code != 200) {
+        if (ctx.buffer) ctx.buffer[ctx.buffer_len] = '\0';
+        fprintf(stderr, "HTTP error %ld: %s\n", ctx.status_code,
+                ctx.buffer_len > 0 ? ctx.buffer : "No response content");
+        ctx.buffer_start = ctx.buffer_len;
+        failed = 1;
+    }
+
+    finish_stream_data(&ctx);
+
+    if (ctx.events) {
+        if (res != CURLE_OK) {
+            const char *message = res == CURLE_ABORTED_BY_CALLBACK ? "Request cancelled"
+                                                                   : curl_easy_strerror(res);
+            event_stream_error(ctx.events, 0, message, strlen(message));
+        } else if (ctx.status_code != 200) {
+            event_stream_error(ctx.events, ctx.status_code, ctx.buffer ? ctx.buffer : "", ctx.buffer_len);
+        } else {
+            /* Timing is always reported: the events are what -t would print */
+            event_stream_timing(ctx.events, ctx.request_start_ms, ctx.first_token_ms,
+                                ctx.last_token_ms, &ctx.token_gaps, monotonic_ms());
+            event_stream_done(ctx.events, 0);
+        }
+        event_stream_free(ctx.events);
+    }
+    output_sink_close(&ctx.sink);
+
+    if (ctx.show_tokens && ctx.status_code == 200 && !ctx.events) {
+        print_stream_statistics(&ctx);
+    }
+
+    if (reply_text) {
+        *reply_text = NULL;
+        if (!failed && ctx.capture_reply) {
+            *reply_text = ctx.reply ? ctx.reply : strdup("");
+            ctx.reply = NULL;
+        }
     }
 
+    sse_parser_free(&ctx.parser);
+    sample_set_free(&ctx.token_gaps);
+    SAFE_FREE(ctx.buffer);
+    SAFE_FREE(ctx.reply);
     curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    return res == CURLE_OK ? 0 : -1;
+    request_body_free(&body);
+    return failed ? -1 : 0;
 }
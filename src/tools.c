@@ -0,0 +1,550 @@
+/**
+ * @file tools.c
+ * @brief Tool calling module implementation
+ * @author Rouge Lin
+ * @date 2025-04-21
+ */
+
+#define _GNU_SOURCE
+#include "tools.h"
+#include "stream_handler.h"
+#include "json_scan.h"
+#include "input_file.h"
+#include "stats.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cjson/cJSON.h>
+
+/*------------------------ Tool definitions ------------------------*/
+
+/* Take the command out of a definition, leaving what the API accepts */
+static int
+load_tool (cJSON *definition, tool_t *tool)
+{
+    cJSON *command = cJSON_DetachItemFromObject(definition, "command");
+    cJSON *function = cJSON_GetObjectItem(definition, "function");
+    cJSON *name = cJSON_GetObjectItem(function, "name");
+    int valid = cJSON_IsString(command) && cJSON_IsString(name) && name->valuestring[0] != '\0';
+    if (valid) {
+        tool->name = strdup(name->valuestring);
+        tool->command = strdup(command->valuestring);
+        if (!cJSON_GetObjectItem(definition, "type")) {
+            cJSON_AddStringToObject(definition, "type", "function");
+        }
+    }
+    cJSON_Delete(command);
+    return valid ? 0 : -1;
+}
+
+int
+tool_set_load (tool_set_t *set, const char *path)
+{
+    memset(set, 0, sizeof(*set));
+    char *text = read_file(path, NULL);
+    if (!text) return -1;
+
+    cJSON *root_array = cJSON_Parse(text);
+    SAFE_FREE(text);
+    if (!cJSON_IsArray(root_array) || cJSON_GetArraySize(root_array) == 0) {
+        fprintf(stderr, "%s: Expected a non-empty JSON array of tool definitions\n", path);
+        cJSON_Delete(root_array);
+        return -1;
+    }
+
+    size_t tool_count = (size_t)cJSON_GetArraySize(root_array);
+    set->tools = calloc(tool_count, sizeof(tool_t));
+    if (!set->tools) {
+        perror("Memory allocation failed");
+        cJSON_Delete(root_array);
+        return -1;
+    }
+
+    int failed = 0;
+    cJSON *definition;
+    cJSON_ArrayForEach(definition, root_array) {
+        tool_t *tool = &set->tools[set->tool_count++];
+        if (load_tool(definition, tool) != 0) {
+            fprintf(stderr, "%s: Tool %zu needs a function.name and a command\n",
+                    path, set->tool_count);
+            failed = 1;
+            break;
+        }
+        if (!tool->name || !tool->command) {
+            perror("Memory allocation failed");
+            failed = 1;
+            break;
+        }
+    }
+
+    if (!failed) {
+        set->definitions = cJSON_PrintUnformatted(root_array);
+        if (!set->definitions) perror("Memory allocation failed");
+    }
+    cJSON_Delete(root_array);
+    if (!set->definitions) {
+        tool_set_free(set);
+        return -1;
+    }
+    return 0;
+}
+
+void
+tool_set_free (tool_set_t *set)
+{
+    for (size_t i = 0; i < set->tool_count; ++i) {
+        SAFE_FREE(set->tools[i].name);
+        SAFE_FREE(set->tools[i].command);
+    }
+    SAFE_FREE(set->tools);
+    SAFE_FREE(set->definitions);
+    set->tool_count = 0;
+}
+
+static const tool_t *
+find_tool (const tool_set_t *set, const char *name)
+{
+    for (size_t i = 0; name && i < set->tool_count; ++i) {
+        if (strcmp(set->tools[i].name, name) == 0) return &set->tools[i];
+    }
+    return NULL;
+}
+
+/*------------------------ Streamed calls ------------------------*/
+
+/* Decode a string where it sits; null and other values leave the span empty */
+static int
+scan_text (json_scanner_t *scanner, json_span_t *value)
+{
+    value->start = NULL;
+    value->length = 0;
+    if (json_scan_peek(scanner) != JSON_SCAN_STRING) return json_scan_skip(scanner);
+    if (json_scan_string(scanner, value) != 0) return -1;
+
+    size_t decoded_length = json_unescape((char *)value->start, value->start, value->length);
+    if (decoded_length == (size_t)-1) return -1;
+    value->length = decoded_length;
+    return 0;
+}
+
+static int
+scan_function_delta (json_scanner_t *scanner, json_span_t *name, json_span_t *arguments)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return json_scan_skip(scanner);
+
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status;
+        if (json_span_equals(&key, "name")) {
+            status = scan_text(scanner, name);
+        } else if (json_span_equals(&key, "arguments")) {
+            status = scan_text(scanner, arguments);
+        } else {
+            status = json_scan_skip(scanner);
+        }
+        if (status != 0) return -1;
+    }
+    return member;
+}
+
+static int
+append_arguments (tool_call_t *call, const char *fragment, size_t length)
+{
+    if (call->arguments_length + length + 1 > call->arguments_capacity) {
+        size_t new_capacity = call->arguments_capacity ? call->arguments_capacity : 256;
+        while (new_capacity < call->arguments_length + length + 1) new_capacity *= 2;
+        char *new_arguments = realloc(call->arguments, new_capacity);
+        if (!new_arguments) return -1;
+        call->arguments = new_arguments;
+        call->arguments_capacity = new_capacity;
+    }
+    memcpy(call->arguments + call->arguments_length, fragment, length);
+    call->arguments_length += length;
+    call->arguments[call->arguments_length] = '\0';
+    return 0;
+}
+
+/* One element of delta.tool_calls; its members may come in any order */
+static int
+feed_call_delta (json_scanner_t *scanner, tool_call_list_t *list, long position)
+{
+    if (json_scan_enter(scanner, JSON_SCAN_OBJECT) != 0) return -1;
+
+    long index = position;
+    json_span_t id = { NULL, 0 }, name = { NULL, 0 }, arguments = { NULL, 0 };
+    json_span_t key;
+    int member;
+    while ((member = json_scan_next_member(scanner, &key)) == 1) {
+        int status;
+        if (json_span_equals(&key, "index") && json_scan_peek(scanner) == JSON_SCAN_NUMBER) {
+            status = json_scan_integer(scanner, &index);
+        } else if (json_span_equals(&key, "id")) {
+            status = scan_text(scanner, &id);
+        } else if (json_span_equals(&key, "function")) {
+            status = scan_function_delta(scanner, &name, &arguments);
+        } else {
+            status = json_scan_skip(scanner);
+        }
+        if (status != 0) return -1;
+    }
+    if (member != 0 || index < 0 || index >= TOOL_MAX_CALLS) return -1;
+
+    tool_call_t *call = &list->calls[index];
+    if ((size_t)index >= list->count) list->count = (size_t)index + 1;
+    /* The identifier and name come with the first fragment of a call */
+    if (id.length > 0 && !call->id && !(call->id = strndup(id.start, id.length))) return -1;
+    if (name.length > 0 && !call->name && !(call->name = strndup(name.start, name.length))) return -1;
+    if (arguments.length > 0) return append_arguments(call, arguments.start, arguments.length);
+    return 0;
+}
+
+int
+tool_calls_feed (tool_call_list_t *list, char *deltas, size_t length)
+{
+    json_scanner_t scanner;
+    json_scan_init(&scanner, deltas, length);
+
+    int element = -1;
+    if (json_scan_enter(&scanner, JSON_SCAN_ARRAY) == 0) {
+        long position = 0;
+        while ((element = json_scan_next_element(&scanner)) == 1) {
+            if (feed_call_delta(&scanner, list, position++) != 0) {
+                element = -1;
+                break;
+            }
+        }
+    }
+    if (element != 0) list->failed = 1;
+    return element == 0 ? 0 : -1;
+}
+
+void
+tool_calls_free (tool_call_list_t *list)
+{
+    for (size_t i = 0; i < list->count; ++i) {
+        SAFE_FREE(list->calls[i].id);
+        SAFE_FREE(list->calls[i].name);
+        SAFE_FREE(list->calls[i].arguments);
+        SAFE_FREE(list->calls[i].output);
+        memset(&list->calls[i], 0, sizeof(tool_call_t));
+    }
+    list->count = 0;
+    list->failed = 0;
+}
+
+/*------------------------ Execution ------------------------*/
+
+/**
+ * @struct tool_pool_t
+ * @brief Work shared by the tool worker threads
+ * @var list Calls to run
+ * @var set Tools the calls refer to
+ * @var next_call Index of the next call no worker has taken yet
+ */
+typedef struct {
+    tool_call_list_t *list; /**< Calls to run */
+    const tool_set_t *set;  /**< Tools the calls refer to */
+    size_t next_call;       /**< Index of the next call no worker has taken yet */
+} tool_pool_t;
+
+static void
+set_call_output (tool_call_t *call, const char *text)
+{
+    call->output = strdup(text);
+    call->output_length = call->output ? strlen(text) : 0;
+}
+
+/* Keep at most TOOL_OUTPUT_MAX bytes of output; the rest is read and dropped */
+static int
+read_call_output (tool_call_t *call, int fd, size_t *capacity)
+{
+    char discard[4096];
+    if (call->output_length == TOOL_OUTPUT_MAX) {
+        ssize_t bytes = read(fd, discard, sizeof(discard));
+        return bytes > 0 || (bytes < 0 && errno == EINTR) ? 1 : 0;
+    }
+    if (call->output_length + 4096 + 1 > *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16 * 1024;
+        if (new_capacity > TOOL_OUTPUT_MAX + 1) new_capacity = TOOL_OUTPUT_MAX + 1;
+        char *new_output = realloc(call->output, new_capacity);
+        if (!new_output) return 0;
+        call->output = new_output;
+        *capacity = new_capacity;
+    }
+    size_t room = *capacity - 1 - call->output_length;
+    ssize_t bytes = read(fd, call->output + call->output_length, room);
+    if (bytes < 0) return errno == EINTR ? 1 : 0;
+    call->output_length += (size_t)bytes;
+    return bytes > 0;
+}
+
+/* Run the command with the arguments on stdin, feeding it while its output is read */
+static void
+run_tool_call (tool_call_t *call, const tool_set_t *set)
+{
+    call->exit_status = -1;
+    const tool_t *tool = find_tool(set, call->name);
+    if (!tool) {
+        set_call_output(call, call->name ? "Error: unknown tool" : "Error: malformed tool call");
+        return;
+    }
+
+    /* Close-on-exec keeps a command started by another worker from holding these pipes open */
+    int input_pipe[2], output_pipe[2];
+    if (pipe2(input_pipe, O_CLOEXEC) != 0) {
+        set_call_output(call, "Error: could not run the tool");
+        return;
+    }
+    if (pipe2(output_pipe, O_CLOEXEC) != 0) {
+        close(input_pipe[0]);
+        close(input_pipe[1]);
+        set_call_output(call, "Error: could not run the tool");
+        return;
+    }
+
+    double started_ms = monotonic_ms();
+    pid_t child = fork();
+    if (child == 0) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        pthread_sigmask(SIG_SETMASK, &signals, NULL);
+        dup2(input_pipe[0], STDIN_FILENO);
+        dup2(output_pipe[1], STDOUT_FILENO);
+        execl("/bin/sh", "sh", "-c", tool->command, (char *)NULL);
+        _exit(127);
+    }
+    close(input_pipe[0]);
+    close(output_pipe[1]);
+    if (child < 0) {
+        close(input_pipe[1]);
+        close(output_pipe[0]);
+        set_call_output(call, "Error: could not run the tool");
+        return;
+    }
+
+    const char *input = call->arguments_length > 0 ? call->arguments : "{}";
+    size_t input_length = call->arguments_length > 0 ? call->arguments_length : 2;
+    size_t input_sent = 0, output_capacity = 0;
+    fcntl(input_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct pollfd descriptors[2] = {
+        { .fd = output_pipe[0], .events = POLLIN },
+        { .fd = input_pipe[1], .events = POLLOUT }
+    };
+    while (descriptors[0].fd >= 0) {
+        if (poll(descriptors, descriptors[1].fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (descriptors[1].fd >= 0 && descriptors[1].revents) {
+            ssize_t written = (descriptors[1].revents & POLLOUT)
+                            ? write(input_pipe[1], input + input_sent, input_length - input_sent) : -1;
+            if (written > 0) input_sent += (size_t)written;
+            /* A command that exits without reading its input simply gets no more of it */
+            if (input_sent == input_length || (written < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(input_pipe[1]);
+                descriptors[1].fd = -1;
+            }
+        }
+        if (descriptors[0].revents && !read_call_output(call, output_pipe[0], &output_capacity)) {
+            close(output_pipe[0]);
+            descriptors[0].fd = -1;
+        }
+    }
+    if (descriptors[0].fd >= 0) close(output_pipe[0]);
+    if (descriptors[1].fd >= 0) close(input_pipe[1]);
+
+    int status;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR) {}
+    if (WIFEXITED(status)) call->exit_status = WEXITSTATUS(status);
+    call->elapsed_ms = monotonic_ms() - started_ms;
+    if (!call->output) set_call_output(call, "");
+    else call->output[call->output_length] = '\0';
+
+    /* The model is told when a command failed, not just what it printed */
+    if (call->output && call->exit_status != 0) {
+        char note[48];
+        int note_length = snprintf(note, sizeof(note), "\n[exit status %d]", call->exit_status);
+        char *new_output = realloc(call->output, call->output_length + (size_t)note_length + 1);
+        if (new_output) {
+            memcpy(new_output + call->output_length, note, (size_t)note_length + 1);
+            call->output = new_output;
+            call->output_length += (size_t)note_length;
+        }
+    }
+}
+
+static void *
+run_tool_worker (void *argument)
+{
+    tool_pool_t *pool = argument;
+
+    /* A command that closes its input early must not kill the process */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    size_t index;
+    while ((index = __atomic_fetch_add(&pool->next_call, 1, __ATOMIC_RELAXED)) < pool->list->count) {
+        run_tool_call(&pool->list->calls[index], pool->set);
+    }
+    return NULL;
+}
+
+void
+tool_calls_execute (tool_call_list_t *list, const tool_set_t *set)
+{
+    tool_pool_t pool = { .list = list, .set = set };
+    pthread_t workers[TOOL_MAX_WORKERS];
+    size_t worker_count = list->count < TOOL_MAX_WORKERS ? list->count : TOOL_MAX_WORKERS;
+
+    size_t started = 0;
+    while (started < worker_count &&
+           pthread_create(&workers[started], NULL, run_tool_worker, &pool) == 0) {
+        started++;
+    }
+    /* Without any worker thread the calls still run, one after another */
+    if (started == 0) run_tool_worker(&pool);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    for (size_t i = 0; i < list->count; ++i) {
+        const tool_call_t *call = &list->calls[i];
+        fprintf(stderr, "[tool %s: exit %d, %zu bytes, %.1f ms]\n", call->name ? call->name : "?",
+                call->exit_status, call->output_length, call->elapsed_ms);
+    }
+}
+
+/*------------------------ Follow-up messages ------------------------*/
+
+static void
+write_text (json_writer_t *writer, const char *text)
+{
+    json_writer_string(writer, text ? text : "", text ? strlen(text) : 0);
+}
+
+void
+tool_calls_write_messages (json_writer_t *writer, const tool_call_list_t *list,
+                           const char *content)
+{
+    json_writer_raw(writer, ",{", 2);
+    json_writer_key(writer, "role");
+    json_writer_string(writer, "assistant", 9);
+    json_writer_raw(writer, ",", 1);
+    json_writer_key(writer, "content");
+    if (content && content[0] != '\0') {
+        write_text(writer, content);
+    } else {
+        json_writer_raw(writer, "null", 4);
+    }
+    json_writer_raw(writer, ",", 1);
+    json_writer_key(writer, "tool_calls");
+    json_writer_raw(writer, "[", 1);
+    for (size_t i = 0; i < list->count; ++i) {
+        const tool_call_t *call = &list->calls[i];
+        if (i > 0) json_writer_raw(writer, ",", 1);
+        json_writer_raw(writer, "{", 1);
+        json_writer_key(writer, "id");
+        write_text(writer, call->id);
+        json_writer_raw(writer, ",", 1);
+        json_writer_key(writer, "type");
+        json_writer_string(writer, "function", 8);
+        json_writer_raw(writer, ",", 1);
+        json_writer_key(writer, "function");
+        json_writer_raw(writer, "{", 1);
+        json_writer_key(writer, "name");
+        write_text(writer, call->name);
+        json_writer_raw(writer, ",", 1);
+        json_writer_key(writer, "arguments");
+        json_writer_string(writer, call->arguments ? call->arguments : "", call->arguments_length);
+        json_writer_raw(writer, "}}", 2);
+    }
+    json_writer_raw(writer, "]}", 2);
+
+    for (size_t i = 0; i < list->count; ++i) {
+        const tool_call_t *call = &list->calls[i];
+        json_writer_raw(writer, ",{", 2);
+        json_writer_key(writer, "role");
+        json_writer_string(writer, "tool", 4);
+        json_writer_raw(writer, ",", 1);
+        json_writer_key(writer, "tool_call_id");
+        write_text(writer, call->id);
+        json_writer_raw(writer, ",", 1);
+        json_writer_key(writer, "content");
+        json_writer_string(writer, call->output ? call->output : "", call->output_length);
+        json_writer_raw(writer, "}", 1);
+    }
+}
+
+/*------------------------ Conversation loop ------------------------*/
+
+int
+run_tool_conversation (http_client_t *client, const api_config_t *config,
+                       const chat_request_params_t *params, const tool_set_t *set,
+                       const chat_run_options_t *options)
+{
+    json_writer_t followup;
+    if (json_writer_init(&followup, 4096) != 0) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    chat_request_params_t request_params = *params;
+    request_params.tools = set->definitions;
+    chat_run_options_t run_options = *options;
+    run_options.use_cache = 0;
+    run_options.reply_text = NULL;
+
+    /* Each round's calls live only until their results are serialized */
+    tool_call_list_t *calls = calloc(1, sizeof(tool_call_list_t));
+    int result = -1;
+    for (int round = 0; calls && round < TOOL_MAX_ROUNDS; ++round) {
+        request_params.followup = followup.data;
+        request_params.followup_length = followup.length;
+        char *request_json = followup.failed ? NULL
+                           : construct_request_json(config, &request_params, 1, NULL);
+        if (!request_json) {
+            fprintf(stderr, "Failed to construct request JSON\n");
+            break;
+        }
+
+        char *reply_text = NULL;
+        run_options.tool_calls = calls;
+        fflush(stdout);
+        int status = execute_streaming_request(client, config, request_json, &run_options, &reply_text);
+        SAFE_FREE(request_json);
+        if (status == 0 && (calls->count == 0 || (reply_text && reply_text[0] != '\0'))) {
+            printf("\n");
+        }
+
+        if (status != 0 || calls->failed || calls->count == 0) {
+            result = status == 0 && !calls->failed ? 0 : -1;
+            SAFE_FREE(reply_text);
+            break;
+        }
+
+        tool_calls_execute(calls, set);
+        tool_calls_write_messages(&followup, calls, reply_text);
+        tool_calls_free(calls);
+        SAFE_FREE(reply_text);
+        if (round == TOOL_MAX_ROUNDS - 1) {
+            fprintf(stderr, "No answer after %d rounds of tool calls\n", TOOL_MAX_ROUNDS);
+        }
+    }
+
+    if (calls) tool_calls_free(calls);
+    SAFE_FREE(calls);
+    free(json_writer_finish(&followup));
+    return result;
+}
@@ -0,0 +1,238 @@
+/**
+ * @file trace.c
+ * @brief Tracing module implementation
+ * @note Always compiled; only the TRACE_* hooks depend on ADS_ENABLE_TRACING
+ * @author Rouge Lin
+ * @date 2025-04-20
+ */
+
+#include "trace.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * @def TRACE_MAX_NAMES
+ * @brief Most distinct span names the summary lists
+ */
+#define TRACE_MAX_NAMES 32
+
+/**
+ * @struct trace_span_t
+ * @brief One recorded span
+ * @var name Span name
+ * @var start_ms When the span opened
+ * @var duration_ms How long the span lasted
+ * @var thread Small number of the thread that recorded the span
+ */
+typedef struct {
+    const char *name;   /**< Span name */
+    double start_ms;    /**< When the span opened */
+    double duration_ms; /**< How long the span lasted */
+    int thread;         /**< Small number of the thread that recorded the span */
+} trace_span_t;
+
+/**
+ * @struct trace_summary_t
+ * @brief Spans of one name, added up
+ * @var name Span name
+ * @var count Number of spans
+ * @var total_ms Time spent in them
+ * @var max_ms Longest of them
+ */
+typedef struct {
+    const char *name; /**< Span name */
+    size_t count;     /**< Number of spans */
+    double total_ms;  /**< Time spent in them */
+    double max_ms;    /**< Longest of them */
+} trace_summary_t;
+
+static int trace_recording;
+static trace_format_t trace_format;
+static const char *trace_path;
+static double trace_epoch_ms;
+static int trace_thread_count;
+static size_t trace_span_count;
+static trace_span_t trace_spans[TRACE_MAX_SPANS];
+static __thread int trace_thread;
+
+/*------------------------ Recording ------------------------*/
+
+void
+trace_start (trace_format_t format, const char *path)
+{
+    trace_format = format;
+    trace_path = path;
+    trace_epoch_ms = monotonic_ms();
+    trace_recording = 1;
+    atexit(trace_report);
+}
+
+int
+parse_trace_format (const char *name, trace_format_t *format)
+{
+    if (strcmp(name, "text") == 0) {
+        *format = TRACE_FORMAT_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = TRACE_FORMAT_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+double
+trace_clock (void)
+{
+    return trace_recording ? monotonic_ms() : 0;
+}
+
+static void
+add_span (const char *name, double start_ms, double duration_ms)
+{
+    size_t index = __atomic_fetch_add(&trace_span_count, 1, __ATOMIC_RELAXED);
+    if (index >= TRACE_MAX_SPANS) return;
+
+    if (trace_thread == 0) {
+        trace_thread = __atomic_add_fetch(&trace_thread_count, 1, __ATOMIC_RELAXED);
+    }
+    trace_spans[index] = (trace_span_t){
+        .name = name,
+        .start_ms = start_ms,
+        .duration_ms = duration_ms,
+        .thread = trace_thread
+    };
+}
+
+void
+trace_record (const char *name, double start_ms)
+{
+    /* A span opened before recording started carries no timestamp */
+    if (!trace_recording || start_ms == 0) return;
+    add_span(name, start_ms, monotonic_ms() - start_ms);
+}
+
+/* Record the interval between two cumulative libcurl timings, if the phase happened */
+static void
+add_phase (const char *name, double transfer_start_ms, curl_off_t from_us, curl_off_t to_us)
+{
+    if (to_us <= from_us) return;
+    add_span(name, transfer_start_ms + from_us / 1000.0, (to_us - from_us) / 1000.0);
+}
+
+void
+trace_record_transfer (CURL *curl_handle)
+{
+    if (!trace_recording) return;
+
+    curl_off_t namelookup_us = 0, connect_us = 0, appconnect_us = 0;
+    curl_off_t pretransfer_us = 0, starttransfer_us = 0, total_us = 0;
+    curl_easy_getinfo(curl_handle, CURLINFO_NAMELOOKUP_TIME_T, &namelookup_us);
+    curl_easy_getinfo(curl_handle, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(curl_handle, CURLINFO_APPCONNECT_TIME_T, &appconnect_us);
+    curl_easy_getinfo(curl_handle, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us);
+    curl_easy_getinfo(curl_handle, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer_us);
+    curl_easy_getinfo(curl_handle, CURLINFO_TOTAL_TIME_T, &total_us);
+
+    /* The timings count from the start of the transfer, which ended just now */
+    double start_ms = monotonic_ms() - total_us / 1000.0;
+    curl_off_t connected_us = appconnect_us > connect_us ? appconnect_us : connect_us;
+    add_phase("http", start_ms, 0, total_us);
+    add_phase("dns", start_ms, 0, namelookup_us);
+    add_phase("connect", start_ms, namelookup_us, connect_us);
+    if (appconnect_us > 0) add_phase("tls", start_ms, connect_us, appconnect_us);
+    add_phase("send", start_ms, connected_us, pretransfer_us);
+    add_phase("wait", start_ms, pretransfer_us, starttransfer_us);
+    add_phase("receive", start_ms, starttransfer_us, total_us);
+}
+
+/*------------------------ Reporting ------------------------*/
+
+/* Add the spans up per name, in the order each name first appeared */
+static size_t
+summarize_spans (size_t span_count, trace_summary_t *summaries)
+{
+    size_t summary_count = 0;
+    for (size_t i = 0; i < span_count; ++i) {
+        const trace_span_t *span = &trace_spans[i];
+        size_t s = 0;
+        while (s < summary_count && strcmp(summaries[s].name, span->name) != 0) s++;
+        if (s == summary_count) {
+            if (summary_count == TRACE_MAX_NAMES) continue;
+            summaries[summary_count++] = (trace_summary_t){ .name = span->name };
+        }
+        summaries[s].count++;
+        summaries[s].total_ms += span->duration_ms;
+        if (span->duration_ms > summaries[s].max_ms) summaries[s].max_ms = span->duration_ms;
+    }
+    return summary_count;
+}
+
+static void
+print_text_summary (const trace_summary_t *summaries, size_t summary_count, size_t dropped)
+{
+    fprintf(stderr, "\n%-16s %8s %12s %12s %12s\n", "span", "count", "total ms", "mean ms", "max ms");
+    for (size_t s = 0; s < summary_count; ++s) {
+        fprintf(stderr, "%-16s %8zu %12.3f %12.3f %12.3f\n", summaries[s].name, summaries[s].count,
+                summaries[s].total_ms, summaries[s].total_ms / summaries[s].count, summaries[s].max_ms);
+    }
+    fprintf(stderr, "wall %.3f ms", monotonic_ms() - trace_epoch_ms);
+    if (dropped > 0) fprintf(stderr, ", %zu spans dropped", dropped);
+    fprintf(stderr, " (nested spans overlap)\n");
+}
+
+static void
+print_json_summary (const trace_summary_t *summaries, size_t summary_count, size_t dropped)
+{
+    fprintf(stderr, "{\"wall_ms\":%.3f,\"dropped\":%zu,\"spans\":[",
+            monotonic_ms() - trace_epoch_ms, dropped);
+    for (size_t s = 0; s < summary_count; ++s) {
+        fprintf(stderr, "%s{\"name\":\"%s\",\"count\":%zu,\"total_ms\":%.3f,\"max_ms\":%.3f}",
+                s > 0 ? "," : "", summaries[s].name, summaries[s].count,
+                summaries[s].total_ms, summaries[s].max_ms);
+    }
+    fprintf(stderr, "]}\n");
+}
+
+/* Chrome trace-event format: complete ("X") events in microseconds, viewable in Perfetto */
+static void
+write_trace_file (size_t span_count)
+{
+    FILE *trace_file = fopen(trace_path, "w");
+    if (!trace_file) {
+        perror("Failed to open trace file");
+        return;
+    }
+
+    long process_id = (long)getpid();
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (size_t i = 0; i < span_count; ++i) {
+        const trace_span_t *span = &trace_spans[i];
+        fprintf(trace_file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,\"dur\":%.1f,\"pid\":%ld,\"tid\":%d}",
+                i > 0 ? "," : "", span->name, (span->start_ms - trace_epoch_ms) * 1000.0,
+                span->duration_ms * 1000.0, process_id, span->thread);
+    }
+    fprintf(trace_file, "\n]}\n");
+    if (fclose(trace_file) != 0) perror("Failed to write trace file");
+}
+
+void
+trace_report (void)
+{
+    if (!trace_recording) return;
+    trace_recording = 0;
+
+    size_t recorded = __atomic_load_n(&trace_span_count, __ATOMIC_RELAXED);
+    size_t span_count = recorded < TRACE_MAX_SPANS ? recorded : TRACE_MAX_SPANS;
+
+    trace_summary_t summaries[TRACE_MAX_NAMES];
+    size_t summary_count = summarize_spans(span_count, summaries);
+    if (trace_format == TRACE_FORMAT_TEXT) {
+        print_text_summary(summaries, summary_count, recorded - span_count);
+    } else if (trace_format == TRACE_FORMAT_JSON) {
+        print_json_summary(summaries, summary_count, recorded - span_count);
+    }
+    if (trace_path) write_trace_file(span_count);
+}
@@ -7,6 +7,10 @@
  */
 
 #include "utils.h"
+#include "output_sink.h"
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 /*------------------------ Utility functions implementation ------------------------*/
 
@@ -15,11 +19,14 @@ stream_output (const char *text_buffer)
 {
     if (!text_buffer) return;
 
-    for (size_t i = 0; text_buffer[i]; ++i) {
-        putchar(text_buffer[i]);
-        fflush(stdout);
-    }
-    putchar('\n');
+    /* Text already queued in stdio must come first */
+    fflush(stdout);
+
+    output_sink_t sink;
+    output_sink_init(&sink, STDOUT_FILENO, 0);
+    output_sink_write(&sink, text_buffer, strlen(text_buffer));
+    output_sink_write(&sink, "\n", 1);
+    output_sink_close(&sink);
 }
 
 void
@@ -35,3 +42,15 @@ trim_whitespace (char *string_buffer)
     while (end_ptr >= string_buffer && isspace((unsigned char)*end_ptr)) end_ptr--;
     *(end_ptr + 1) = '\0';
 }
+
+int
+make_directories (char *path)
+{
+    for (char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) *slash = '\0';
+        int status = mkdir(path, 0700);
+        if (slash) *slash = '/';
+        if (status != 0 && errno != EEXIST) return -1;
+        if (!slash) return 0;
+    }
+}